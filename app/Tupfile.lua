@@ -6,5 +6,5 @@ FuseApp = Define.Executable{
 	Name = 'sonch',
 	Sources = Item 'fusemain.cxx',
 	Objects = CoreObject,
-	LinkFlags = '-lfuse -lboost_system -lboost_filesystem -lsqlite3'
+	LinkFlags = '-lfuse -lboost_system -lboost_filesystem -lsqlite3 -lz'
 }
@@ -0,0 +1,86 @@
+#ifndef compress_h
+#define compress_h
+
+#include "error.h"
+
+#include <cerrno>
+#include <vector>
+#include <zlib.h>
+
+// Blocks are deflated one at a time, so any block inflates without the rest of its file.  Only blocks that shrink by
+// an eighth or more are kept compressed; the rest aren't worth inflating on every read.
+
+// Keeps a deflate stream around between blocks, since setting one up costs more than compressing a small block.
+// Not thread safe.
+struct BlockCompressor
+{
+	BlockCompressor(void)
+	{
+		Stream.zalloc = Z_NULL;
+		Stream.zfree = Z_NULL;
+		Stream.opaque = Z_NULL;
+		if (deflateInit(&Stream, Z_BEST_SPEED) != Z_OK)
+			throw SystemError() << "Could not set up block compression: " << (Stream.msg ? Stream.msg : "unknown error");
+	}
+	~BlockCompressor(void) { deflateEnd(&Stream); }
+	BlockCompressor(BlockCompressor const &) = delete;
+	BlockCompressor &operator =(BlockCompressor const &) = delete;
+
+	// The compressed size, or 0 if the block doesn't shrink enough.  Out is resized to fit.
+	size_t Compress(char const *Data, size_t Length, std::vector<char> &Out)
+	{
+		size_t const Limit = Length - Length / 8;
+		if (Limit == 0) return 0;
+		Out.resize(Limit);
+		deflateReset(&Stream);
+		Stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(Data));
+		Stream.avail_in = static_cast<uInt>(Length);
+		Stream.next_out = reinterpret_cast<Bytef *>(Out.data());
+		Stream.avail_out = static_cast<uInt>(Limit);
+		// Running out of room before the end means it didn't shrink enough
+		if (deflate(&Stream, Z_FINISH) != Z_STREAM_END) return 0;
+		return Limit - Stream.avail_out;
+	}
+
+	private:
+		z_stream Stream;
+};
+
+// Inflates a whole block into Out.  The inflated size, or -EIO if the block is corrupt or bigger than Capacity.
+inline ssize_t DecompressBlock(char const *Data, size_t Length, char *Out, size_t Capacity)
+{
+	uLongf Size = static_cast<uLongf>(Capacity);
+	if (uncompress(reinterpret_cast<Bytef *>(Out), &Size, reinterpret_cast<Bytef const *>(Data), static_cast<uLong>(Length)) != Z_OK)
+		return -EIO;
+	return static_cast<ssize_t>(Size);
+}
+
+// Stops trying to compress after a run of blocks that wouldn't shrink, trying one again every so often in case
+// the data changes.  Reset for each file stored.
+struct CompressionBypass
+{
+	static constexpr unsigned int Patience = 4;
+	static constexpr unsigned int Interval = 16;
+
+	bool ShouldTry(void)
+	{
+		if (Failures < Patience) return true;
+		if (++Skipped < Interval) return false;
+		Skipped = 0;
+		return true;
+	}
+
+	void Record(bool Shrank)
+	{
+		if (Shrank) Failures = 0;
+		else ++Failures;
+	}
+
+	void Reset(void) { Failures = Skipped = 0; }
+
+	private:
+		unsigned int Failures = 0;
+		unsigned int Skipped = 0;
+};
+
+#endif
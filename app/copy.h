@@ -0,0 +1,96 @@
+#ifndef copy_h
+#define copy_h
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <vector>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+
+// Copies between file descriptors without passing the data through user space where the host allows it.  A
+// reflink clone is tried first, then copy_file_range, then a buffered copy.  A kernel path that reports itself
+// unsupported is skipped from then on; ones that just refuse a particular range (unaligned clones, copies across
+// filesystems on older kernels) are retried next time.
+
+namespace CopyDetail
+{
+	inline std::atomic<bool> &CanClone(void) { static std::atomic<bool> Out(true); return Out; }
+	inline std::atomic<bool> &CanCopyRange(void) { static std::atomic<bool> Out(true); return Out; }
+
+	inline bool IsUnsupported(int Error) { return (Error == ENOSYS) || (Error == EOPNOTSUPP) || (Error == ENOTTY); }
+	inline bool IsRefused(int Error) { return IsUnsupported(Error) || (Error == EXDEV) || (Error == EINVAL); }
+
+	inline ssize_t CopyBuffered(int From, off_t FromOffset, int To, off_t ToOffset, size_t Length)
+	{
+		std::vector<char> Buffer(std::min<size_t>(Length, 1024 * 1024));
+		size_t Done = 0;
+		while (Done < Length)
+		{
+			ssize_t const Got = pread(From, Buffer.data(), std::min(Buffer.size(), Length - Done), FromOffset + static_cast<off_t>(Done));
+			if (Got < 0)
+			{
+				if (errno == EINTR) continue;
+				return -errno;
+			}
+			if (Got == 0) break;
+			size_t Put = 0;
+			while (Put < static_cast<size_t>(Got))
+			{
+				ssize_t const Wrote = pwrite(To, Buffer.data() + Put, static_cast<size_t>(Got) - Put, ToOffset + static_cast<off_t>(Done + Put));
+				if (Wrote < 0)
+				{
+					if (errno == EINTR) continue;
+					return -errno;
+				}
+				Put += static_cast<size_t>(Wrote);
+			}
+			Done += Put;
+		}
+		return static_cast<ssize_t>(Done);
+	}
+}
+
+// Bytes copied, short only at the end of the source, or -errno
+inline ssize_t CopyRange(int From, off_t FromOffset, int To, off_t ToOffset, size_t Length)
+{
+	using namespace CopyDetail;
+	if (Length == 0) return 0;
+#ifdef FICLONERANGE
+	if (CanClone())
+	{
+		// Fails unless the range is block aligned and within the source, so a success copied everything
+		file_clone_range Range{From, static_cast<__u64>(FromOffset), static_cast<__u64>(Length), static_cast<__u64>(ToOffset)};
+		if (ioctl(To, FICLONERANGE, &Range) == 0) return static_cast<ssize_t>(Length);
+		if (IsUnsupported(errno)) CanClone() = false;
+	}
+#endif
+	size_t Done = 0;
+#ifdef __NR_copy_file_range
+	if (CanCopyRange())
+	{
+		while (Done < Length)
+		{
+			loff_t In = FromOffset + static_cast<off_t>(Done), Out = ToOffset + static_cast<off_t>(Done);
+			long const Copied = syscall(__NR_copy_file_range, From, &In, To, &Out, Length - Done, 0u);
+			if (Copied < 0)
+			{
+				if (errno == EINTR) continue;
+				if (!IsRefused(errno)) return -errno;
+				if (IsUnsupported(errno)) CanCopyRange() = false;
+				break;
+			}
+			if (Copied == 0) return static_cast<ssize_t>(Done);
+			Done += static_cast<size_t>(Copied);
+		}
+	}
+#endif
+	if (Done == Length) return static_cast<ssize_t>(Done);
+	ssize_t const Rest = CopyBuffered(From, FromOffset + static_cast<off_t>(Done), To, ToOffset + static_cast<off_t>(Done), Length - Done);
+	if (Rest < 0) return Rest;
+	return static_cast<ssize_t>(Done) + Rest;
+}
+
+#endif
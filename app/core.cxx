@@ -1,7 +1,14 @@
 #include "core.h"
+#include "notify.h"
+#include "copy.h"
 
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <random>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <linux/falloc.h>
 
 #define SplitDir "splits"
 #define HostInstanceIndex static_cast<Counter::Type>(0)
@@ -14,6 +21,14 @@ DefineProtocolMessage(StaticDataV1All, StaticDataV1, void(std::string InstanceNa
 enum class DatabaseVersion : unsigned int
 {
 	V1 = 0,
+	V2,
+	V3,
+	V4,
+	V5,
+	V6,
+	V7,
+	V8,
+	V9,
 	End,
 	Latest = End - 1
 };
@@ -24,9 +39,13 @@ CoreDatabaseStructure::CoreDatabaseStructure(bfs::path const &DatabasePath, bool
 	{
 		Execute("CREATE TABLE \"Stats\" "
 		"("
-			"\"Version\" INTEGER"
+			"\"Version\" INTEGER, "
+			"\"Layout\" INTEGER, "
+			"\"TargetLayout\" INTEGER, "
+			"\"Deduplicate\" BOOLEAN, "
+			"\"Compress\" BOOLEAN"
 		")");
-		Execute("INSERT INTO \"Stats\" VALUES (?)", (unsigned int)DatabaseVersion::Latest);
+		Execute("INSERT INTO \"Stats\" VALUES (?, ?, ?, 0, 0)", (unsigned int)DatabaseVersion::Latest, FileLayout(), FileLayout());
 
 		Execute("CREATE TABLE \"Instances\" "
 		"("
@@ -65,6 +84,9 @@ CoreDatabaseStructure::CoreDatabaseStructure(bfs::path const &DatabasePath, bool
 			"\"Modified\" DATETIME , "
 			"\"Permissions\" BLOB , "
 			"\"IsSplit\" BOOLEAN , "
+			"\"Versions\" BLOB , "
+			"\"ContentInstance\" INTEGER , "
+			"\"ContentIndex\" INTEGER , "
 			"PRIMARY KEY (\"IDInstance\", \"IDIndex\")"
 		")");
 		Execute("CREATE INDEX \"ParentIndex\" ON \"Files\" "
@@ -80,11 +102,143 @@ CoreDatabaseStructure::CoreDatabaseStructure(bfs::path const &DatabasePath, bool
 			"\"IDIndex\" INTEGER , "
 			"\"ParentInstance\" INTEGER , "
 			"\"ParentIndex\" INTEGER , "
+			"\"Created\" DATETIME , "
 			"PRIMARY KEY (\"IDInstance\", \"IDIndex\")"
 		")");
+		CreateCompactionIndices();
+		CreateSplitIndex();
+		CreateBlockTables();
+		CreateRetiredTable();
 	}
+	else
+	{
+		auto MaybeVersion = Get<unsigned int()>("SELECT \"Version\" FROM \"Stats\"");
+		if (!MaybeVersion)
+			throw SystemError() << "Could not read database version, database may be corrupt.";
+		DatabaseVersion Version = (DatabaseVersion)*MaybeVersion;
+		switch (Version)
+		{
+			default: throw SystemError() << "Unrecognized database version " << (unsigned int)Version;
+			case DatabaseVersion::V1:
+			{
+				// Only the host instance has made changes so far, so each node's vector is its current change
+				Execute("ALTER TABLE \"Files\" ADD COLUMN \"Versions\" BLOB");
+				std::vector<std::tuple<NodeID, NodeID>> Changed;
+				Prepare<std::tuple<NodeID, Counter, UUID>(void)>("SELECT \"IDInstance\", \"IDIndex\", \"ChangeInstance\", \"ChangeIndex\" FROM \"Files\" WHERE \"ChangeIndex\" != 0").Execute(
+					[&Changed](NodeID &&ID, Counter &&ChangeInstance, UUID &&ChangeIndex) { Changed.emplace_back(ID, NodeID(ChangeInstance, ChangeIndex)); });
+				auto SetVersions = Prepare<void(VersionVector, NodeID)>("UPDATE \"Files\" SET \"Versions\" = ? WHERE \"IDInstance\" = ? AND \"IDIndex\" = ?");
+				for (auto const &File : Changed)
+				{
+					VersionVector Versions;
+					Versions.Advance(std::get<1>(File));
+					SetVersions(Versions, std::get<0>(File));
+				}
+			}
+			case DatabaseVersion::V2:
+				// Existing history is treated as old enough to compact
+				Execute("ALTER TABLE \"Ancestry\" ADD COLUMN \"Created\" DATETIME DEFAULT 0");
+				CreateCompactionIndices();
+			case DatabaseVersion::V3:
+				CreateSplitIndex();
+			case DatabaseVersion::V4:
+				// Existing backing files are named after the change that last touched them
+				Execute("ALTER TABLE \"Files\" ADD COLUMN \"ContentInstance\" INTEGER DEFAULT 0");
+				Execute("ALTER TABLE \"Files\" ADD COLUMN \"ContentIndex\" INTEGER DEFAULT 0");
+				Execute("UPDATE \"Files\" SET \"ContentInstance\" = \"ChangeInstance\", \"ContentIndex\" = \"ChangeIndex\"");
+			case DatabaseVersion::V5:
+				// Existing shares stay flat until asked to migrate
+				Execute("ALTER TABLE \"Stats\" ADD COLUMN \"Layout\" INTEGER DEFAULT 0");
+				Execute("ALTER TABLE \"Stats\" ADD COLUMN \"TargetLayout\" INTEGER DEFAULT 0");
+			case DatabaseVersion::V6:
+				Execute("ALTER TABLE \"Stats\" ADD COLUMN \"Deduplicate\" BOOLEAN DEFAULT 0");
+				CreateBlockTables();
+			case DatabaseVersion::V7:
+				CreateRetiredTable();
+			case DatabaseVersion::V8:
+				Execute("ALTER TABLE \"Stats\" ADD COLUMN \"Compress\" BOOLEAN DEFAULT 0");
+			case DatabaseVersion::Latest: break;
+		}
+		Execute("UPDATE \"Stats\" SET \"Version\" = ?", (unsigned int)DatabaseVersion::Latest);
+	}
+}
+
+void CoreDatabaseStructure::CreateCompactionIndices(void)
+{
+	Execute("CREATE INDEX \"AncestryParentIndex\" ON \"Ancestry\" "
+	"("
+		"\"ParentInstance\" ASC, "
+		"\"ParentIndex\" ASC"
+	")");
+	Execute("CREATE INDEX \"ChangeIndex\" ON \"Files\" "
+	"("
+		"\"ChangeInstance\" ASC, "
+		"\"ChangeIndex\" ASC"
+	")");
+}
+
+void CoreDatabaseStructure::CreateSplitIndex(void)
+{
+	// Split rows are rare, so they get their own small index rather than widening ParentIndex
+	Execute("CREATE INDEX \"SplitIndex\" ON \"Files\" "
+	"("
+		"\"ParentInstance\" ASC, "
+		"\"ParentIndex\" ASC, "
+		"\"ChangeInstance\" ASC, "
+		"\"Name\" ASC"
+	") WHERE \"IsSplit\" = 1");
+}
+
+void CoreDatabaseStructure::CreateBlockTables(void)
+{
+	Execute("CREATE TABLE \"Blocks\" "
+	"("
+		"\"HashHigh\" INTEGER , "
+		"\"HashLow\" INTEGER , "
+		"\"Length\" INTEGER , "
+		"\"References\" INTEGER , "
+		"PRIMARY KEY (\"HashHigh\", \"HashLow\")"
+	")");
+	Execute("CREATE INDEX \"UnreferencedIndex\" ON \"Blocks\" "
+	"("
+		"\"References\" ASC"
+	") WHERE \"References\" = 0");
+
+	Execute("CREATE TABLE \"Chunks\" "
+	"("
+		"\"IDInstance\" INTEGER , "
+		"\"IDIndex\" INTEGER , "
+		"\"ContentInstance\" INTEGER , "
+		"\"ContentIndex\" INTEGER , "
+		"\"Offset\" INTEGER , "
+		"\"HashHigh\" INTEGER , "
+		"\"HashLow\" INTEGER , "
+		"\"Length\" INTEGER , "
+		"PRIMARY KEY (\"IDInstance\", \"IDIndex\", \"ContentInstance\", \"ContentIndex\", \"Offset\")"
+	")");
+}
+
+void CoreDatabaseStructure::CreateRetiredTable(void)
+{
+	// Extent map versions replaced by a change, kept until compaction drops the change
+	Execute("CREATE TABLE \"Retired\" "
+	"("
+		"\"IDInstance\" INTEGER , "
+		"\"IDIndex\" INTEGER , "
+		"\"ContentInstance\" INTEGER , "
+		"\"ContentIndex\" INTEGER , "
+		"\"ChangeInstance\" INTEGER , "
+		"\"ChangeIndex\" INTEGER , "
+		"PRIMARY KEY (\"IDInstance\", \"IDIndex\", \"ContentInstance\", \"ContentIndex\")"
+	")");
+	Execute("CREATE INDEX \"RetiredChangeIndex\" ON \"Retired\" "
+	"("
+		"\"ChangeInstance\" ASC, "
+		"\"ChangeIndex\" ASC"
+	")");
 }
 
+#define FileColumns "\"IDInstance\", \"IDIndex\", \"ChangeInstance\", \"ChangeIndex\", \"ParentInstance\", \"ParentIndex\", \"Name\", \"IsFile\", \"Modified\", \"Permissions\", \"IsSplit\""
+
 CoreDatabase::CoreDatabase(bfs::path const &DatabasePath, bool Create, std::string const &InstanceName, UUID const &InstanceID) :
 	CoreDatabaseStructure(DatabasePath, Create, InstanceName, InstanceID),
 	Begin(Prepare<void(void)>("BEGIN")),
@@ -93,19 +247,22 @@ CoreDatabase::CoreDatabase(bfs::path const &DatabasePath, bool Create, std::stri
 	IncrementFileIndex(Prepare<void(void)>("UPDATE \"Counters\" SET \"File\" = \"File\" + 1")),
 	GetChangeIndex(Prepare<UUID(void)>("SELECT \"Change\" FROM \"Counters\"")),
 	IncrementChangeIndex(Prepare<void(void)>("UPDATE \"Counters\" SET \"Change\" = \"Change\" + 1")),
-	GetInstanceIndex(Prepare<Counter(std::string Filename)>("SELECT \"Index\" FROM \"Instances\" WHERE \"Filename\" = ?")),
+	GetInstanceIndex(Prepare<Counter(StringView Filename)>("SELECT \"Index\" FROM \"Instances\" WHERE \"Filename\" = ?")),
+	GetInstanceFilename(Prepare<std::string(Counter Index)>("SELECT \"Filename\" FROM \"Instances\" WHERE \"Index\" = ?")),
 	GetFileByID(Prepare<ShareFileTuple(NodeID ID)>
-		("SELECT * FROM \"Files\" WHERE \"IDInstance\" = ? AND \"IDIndex\" = ? AND \"IsSplit\" = 0 LIMIT 1")),
-	GetFile(Prepare<ShareFileTuple(NodeID Parent, std::string Name)>
-		("SELECT * FROM \"Files\" WHERE \"ParentInstance\" = ? AND \"ParentIndex\" = ? AND \"IsSplit\" = 0 AND \"Name\" = ? LIMIT 1")),
-	GetSplitFile(Prepare<ShareFileTuple(NodeID Parent, Counter SplitInstance, std::string Name)>
-		("SELECT * FROM \"Files\" WHERE \"ParentInstance\" = ? AND \"ParentIndex\" = ? AND \"IsSplit\" = 1 AND \"ChangeInstance\" = ? AND \"Name\" = ? LIMIT 1")),
+		("SELECT " FileColumns " FROM \"Files\" WHERE \"IDInstance\" = ? AND \"IDIndex\" = ? AND \"IsSplit\" = 0 LIMIT 1")),
+	GetFile(Prepare<ShareFileTuple(NodeID Parent, StringView Name)>
+		("SELECT " FileColumns " FROM \"Files\" WHERE \"ParentInstance\" = ? AND \"ParentIndex\" = ? AND \"IsSplit\" = 0 AND \"Name\" = ? LIMIT 1")),
+	GetSplitFile(Prepare<ShareFileTuple(NodeID Parent, Counter SplitInstance, StringView Name)>
+		("SELECT " FileColumns " FROM \"Files\" WHERE \"ParentInstance\" = ? AND \"ParentIndex\" = ? AND \"IsSplit\" = 1 AND \"ChangeInstance\" = ? AND \"Name\" = ? LIMIT 1")),
 	GetFiles(Prepare<ShareFileTuple(NodeID Parent, unsigned int Offset, unsigned int Limit)>
-		("SELECT * FROM \"Files\" WHERE \"ParentInstance\" = ? AND \"ParentIndex\" = ? AND \"IsSplit\" = 0 LIMIT ?, ?")),
+		("SELECT " FileColumns " FROM \"Files\" WHERE \"ParentInstance\" = ? AND \"ParentIndex\" = ? AND \"IsSplit\" = 0 LIMIT ?, ?")),
 	GetSplitFiles(Prepare<ShareFileTuple(NodeID Parent, Counter SplitInstance, unsigned int Offset, unsigned int Limit)>
-		("SELECT * FROM \"Files\" WHERE \"ParentInstance\" = ? AND \"ParentIndex\" = ? AND \"IsSplit\" = 0 AND \"ChangeInstance\" = ? LIMIT ?, ?")),
+		("SELECT " FileColumns " FROM \"Files\" WHERE \"ParentInstance\" = ? AND \"ParentIndex\" = ? AND \"IsSplit\" = 1 AND \"ChangeInstance\" = ? ORDER BY \"Name\" LIMIT ?, ?")),
+	CountSplitFiles(Prepare<unsigned int(NodeID Parent, Counter SplitInstance)>
+		("SELECT COUNT(*) FROM \"Files\" WHERE \"ParentInstance\" = ? AND \"ParentIndex\" = ? AND \"IsSplit\" = 1 AND \"ChangeInstance\" = ?")),
 	CreateFile(Prepare<void(NodeID ID, NodeID Parent, std::string Name, bool IsFile, Timestamp ModifiedTime, SharePermissions Permissions)>
-		("INSERT OR IGNORE INTO \"Files\" VALUES (?, ?, 0, 0, ?, ?, ?, ?, ?, ?, 0)")),
+		("INSERT OR IGNORE INTO \"Files\" VALUES (?, ?, 0, 0, ?, ?, ?, ?, ?, ?, 0, X'', 0, 0)")),
 	DeleteFile(Prepare<void(NodeID ID, NodeID Change)>
 		("DELETE FROM \"Files\" WHERE \"IDInstance\" = ? AND \"IDIndex\" = ? AND \"ChangeInstance\" = ? AND \"ChangeIndex\" = ?")),
 	SetPermissions(Prepare<void(NodeID NewChange, SharePermissions NewPermissions, NodeID ID, NodeID Change)>
@@ -114,24 +271,97 @@ CoreDatabase::CoreDatabase(bfs::path const &DatabasePath, bool Create, std::stri
 		("UPDATE \"Files\" SET \"ChangeInstance\" = ?, \"ChangeIndex\" = ?, \"Modified\" = ? WHERE \"IDInstance\" = ? AND \"IDIndex\" = ? AND \"ChangeInstance\" = ? AND \"ChangeIndex\" = ?")),
 	MoveFile(Prepare<void(NodeID NewChange, NodeID NewParent, std::string NewName, NodeID ID, NodeID Change)>
 		("UPDATE \"Files\" SET \"ChangeInstance\" = ?, \"ChangeIndex\" = ?, \"ParentInstance\" = ?, \"ParentIndex\" = ?, \"Name\" = ? WHERE \"IDInstance\" = ? AND \"IDIndex\" = ? AND \"ChangeInstance\" = ? AND \"ChangeIndex\" = ?")),
-	CreateChange(Prepare<void(NodeID NewChange, NodeID OldChange)>
-		("INSERT OR IGNORE INTO \"Ancestry\" VALUES (?, ?, ?, ?)")),
+	CreateChange(Prepare<void(NodeID NewChange, NodeID OldChange, Timestamp Created)>
+		("INSERT OR IGNORE INTO \"Ancestry\" VALUES (?, ?, ?, ?, ?)")),
 	GetChange(Prepare<NodeID(NodeID Change)>
-		("SELECT \"ParentInstance\", \"ParentIndex\" FROM \"Ancestry\" WHERE \"IDInstance\" = ? AND \"IDIndex\" = ?"))
+		("SELECT \"ParentInstance\", \"ParentIndex\" FROM \"Ancestry\" WHERE \"IDInstance\" = ? AND \"IDIndex\" = ?")),
+	GetVersions(Prepare<VersionVector(NodeID ID)>
+		("SELECT \"Versions\" FROM \"Files\" WHERE \"IDInstance\" = ? AND \"IDIndex\" = ?")),
+	SetVersions(Prepare<void(VersionVector Versions, NodeID ID)>
+		("UPDATE \"Files\" SET \"Versions\" = ? WHERE \"IDInstance\" = ? AND \"IDIndex\" = ?")),
+	GetOldChanges(Prepare<std::tuple<int64_t, NodeID>(int64_t After, Timestamp Before, unsigned int Limit)>
+		("SELECT \"rowid\", \"IDInstance\", \"IDIndex\" FROM \"Ancestry\" WHERE \"rowid\" > ? AND \"Created\" < ? ORDER BY \"rowid\" LIMIT ?")),
+	IsCurrentChange(Prepare<int(NodeID Change)>
+		("SELECT 1 FROM \"Files\" WHERE \"ChangeInstance\" = ? AND \"ChangeIndex\" = ? LIMIT 1")),
+	ReparentChanges(Prepare<void(NodeID NewParent, NodeID OldParent)>
+		("UPDATE \"Ancestry\" SET \"ParentInstance\" = ?, \"ParentIndex\" = ? WHERE \"ParentInstance\" = ? AND \"ParentIndex\" = ?")),
+	DeleteChange(Prepare<void(NodeID Change)>
+		("DELETE FROM \"Ancestry\" WHERE \"IDInstance\" = ? AND \"IDIndex\" = ?")),
+	GetSplitParents(Prepare<std::tuple<NodeID, Counter>(void)>
+		("SELECT DISTINCT \"ParentInstance\", \"ParentIndex\", \"ChangeInstance\" FROM \"Files\" WHERE \"IsSplit\" = 1")),
+	GetParent(Prepare<NodeID(NodeID ID)>
+		("SELECT \"ParentInstance\", \"ParentIndex\" FROM \"Files\" WHERE \"IDInstance\" = ? AND \"IDIndex\" = ?")),
+	GetContent(Prepare<NodeID(NodeID ID)>
+		("SELECT \"ContentInstance\", \"ContentIndex\" FROM \"Files\" WHERE \"IDInstance\" = ? AND \"IDIndex\" = ?")),
+	SetContent(Prepare<void(NodeID NewContent, NodeID ID)>
+		("UPDATE \"Files\" SET \"ContentInstance\" = ?, \"ContentIndex\" = ? WHERE \"IDInstance\" = ? AND \"IDIndex\" = ?")),
+	GetLayout(Prepare<FileLayout(void)>("SELECT \"Layout\" FROM \"Stats\"")),
+	GetTargetLayout(Prepare<FileLayout(void)>("SELECT \"TargetLayout\" FROM \"Stats\"")),
+	SetLayout(Prepare<void(FileLayout Layout, FileLayout Target)>("UPDATE \"Stats\" SET \"Layout\" = ?, \"TargetLayout\" = ?")),
+	GetBackedFiles(Prepare<std::tuple<int64_t, NodeID, NodeID>(int64_t After, unsigned int Limit)>
+		("SELECT \"rowid\", \"IDInstance\", \"IDIndex\", \"ContentInstance\", \"ContentIndex\" FROM \"Files\" WHERE \"rowid\" > ? AND \"IsFile\" = 1 ORDER BY \"rowid\" LIMIT ?")),
+	Abort(Prepare<void(void)>("ROLLBACK")),
+	GetDeduplicate(Prepare<bool(void)>("SELECT \"Deduplicate\" FROM \"Stats\"")),
+	SetDeduplicate(Prepare<void(bool Deduplicate)>("UPDATE \"Stats\" SET \"Deduplicate\" = ?")),
+	GetCompress(Prepare<bool(void)>("SELECT \"Compress\" FROM \"Stats\"")),
+	SetCompress(Prepare<void(bool Compress)>("UPDATE \"Stats\" SET \"Compress\" = ?")),
+	GetBlockReferences(Prepare<uint64_t(ContentHash Hash)>
+		("SELECT \"References\" FROM \"Blocks\" WHERE \"HashHigh\" = ? AND \"HashLow\" = ?")),
+	CreateBlock(Prepare<void(ContentHash Hash, uint64_t Length)>
+		("INSERT INTO \"Blocks\" VALUES (?, ?, ?, 1)")),
+	ReferenceBlock(Prepare<void(ContentHash Hash)>
+		("UPDATE \"Blocks\" SET \"References\" = \"References\" + 1 WHERE \"HashHigh\" = ? AND \"HashLow\" = ?")),
+	DereferenceBlock(Prepare<void(ContentHash Hash)>
+		("UPDATE \"Blocks\" SET \"References\" = \"References\" - 1 WHERE \"HashHigh\" = ? AND \"HashLow\" = ?")),
+	GetUnreferencedBlocks(Prepare<ContentHash(unsigned int Limit)>
+		("SELECT \"HashHigh\", \"HashLow\" FROM \"Blocks\" WHERE \"References\" = 0 LIMIT ?")),
+	DeleteBlock(Prepare<void(ContentHash Hash)>
+		("DELETE FROM \"Blocks\" WHERE \"HashHigh\" = ? AND \"HashLow\" = ? AND \"References\" = 0")),
+	GetChunks(Prepare<ContentHash(NodeID ID, NodeID Content)>
+		("SELECT \"HashHigh\", \"HashLow\" FROM \"Chunks\" WHERE \"IDInstance\" = ? AND \"IDIndex\" = ? AND \"ContentInstance\" = ? AND \"ContentIndex\" = ? ORDER BY \"Offset\"")),
+	GetChunkedSize(Prepare<uint64_t(NodeID ID, NodeID Content)>
+		("SELECT \"Offset\" + \"Length\" FROM \"Chunks\" WHERE \"IDInstance\" = ? AND \"IDIndex\" = ? AND \"ContentInstance\" = ? AND \"ContentIndex\" = ? ORDER BY \"Offset\" DESC LIMIT 1")),
+	AddChunk(Prepare<void(NodeID ID, NodeID Content, uint64_t Offset, ContentHash Hash, uint64_t Length)>
+		("INSERT INTO \"Chunks\" VALUES (?, ?, ?, ?, ?, ?, ?, ?)")),
+	DeleteChunks(Prepare<void(NodeID ID, NodeID Content)>
+		("DELETE FROM \"Chunks\" WHERE \"IDInstance\" = ? AND \"IDIndex\" = ? AND \"ContentInstance\" = ? AND \"ContentIndex\" = ?")),
+	GetLogicalBytes(Prepare<uint64_t(void)>("SELECT SUM(\"Length\") FROM \"Chunks\"")),
+	GetStoredBytes(Prepare<uint64_t(void)>("SELECT SUM(\"Length\") FROM \"Blocks\"")),
+	GetBlockCount(Prepare<uint64_t(void)>("SELECT COUNT(*) FROM \"Blocks\"")),
+	CommitContent(Prepare<void(NodeID NewChange, NodeID NewContent, NodeID ID)>
+		("UPDATE \"Files\" SET \"ChangeInstance\" = ?, \"ChangeIndex\" = ?, \"ContentInstance\" = ?, \"ContentIndex\" = ? WHERE \"IDInstance\" = ? AND \"IDIndex\" = ?")),
+	RetireContent(Prepare<void(NodeID ID, NodeID Content, NodeID Change)>
+		("INSERT OR IGNORE INTO \"Retired\" VALUES (?, ?, ?, ?, ?, ?)")),
+	GetRetiredContent(Prepare<std::tuple<NodeID, Counter, UUID>(NodeID Change)>
+		("SELECT \"IDInstance\", \"IDIndex\", \"ContentInstance\", \"ContentIndex\" FROM \"Retired\" WHERE \"ChangeInstance\" = ? AND \"ChangeIndex\" = ?")),
+	DeleteRetiredContent(Prepare<void(NodeID Change)>
+		("DELETE FROM \"Retired\" WHERE \"ChangeInstance\" = ? AND \"ChangeIndex\" = ?"))
 {
 	if (Create)
 		CreateFile(NodeID(), NodeID(), "", false, static_cast<Timestamp::Type>(std::time(nullptr)), SharePermissions{1, 1});
 }
 
-static std::string GetInternalFilename(NodeID const &ID, NodeID const &Change)
-	{ return String() << *ID.Instance << "-" << *ID.Index << "-" << *Change.Instance << "-" << *Change.Index; }
 
-void ValidatePath(bfs::path const &Path) { Assert(*Path.begin() == "/"); }
+static std::vector<std::string> CoreOperationNames(void)
+{
+	return {"GetRealPath", "StatBacking", "Get", "CreateDirectory", "CreateFile", "Open", "Release", "Commit", "Copy",
+		"OpenDirectory", "GetDirectory", "SetPermissions", "SetTimestamp", "Delete", "Move", "GetVersions", "CompactHistory",
+		"SetFileLayout", "MigrateLayout", "CollectBlocks", "IngestReleased"};
+}
 
 ShareCoreInner::ShareCoreInner(bfs::path const &Root, std::string const &InstanceName) :
-	Root(Root), FilePath(Root / "." App / "files"),
+	Root(Root), FilePath(Root / "." App / "files"), FilesDescriptor(-1),
+	BlockPath(Root / "." App / "blocks"), BlocksDescriptor(-1), Deduplicate(false), Compress(false), IO(new IOEngine()), Cache(256),
+	IngestAttempts(0),
+	Latency(CoreOperationNames()),
 	InstanceName(InstanceName),
-	SplitFile(NodeID(), NodeID(), NodeID(), SplitDir, false, static_cast<Timestamp::Type>(0), SharePermissions{1, 1}, false)
+	SplitFile(NodeID(), NodeID(), NodeID(), SplitDir, false, static_cast<Timestamp::Type>(0), SharePermissions{1, 1}, false),
+	Notifier(new ChangeNotifier),
+	MigrationCursor(0),
+	CompactionCursor(0),
+	Compacted(0),
+	StopBackground(false),
+	IngestQueued(false)
 {
 	auto const ValidateFilename = [](std::string const &Filename)
 	{
@@ -190,6 +420,7 @@ ShareCoreInner::ShareCoreInner(bfs::path const &Root, std::string const &Instanc
 			Log.reset(new FileLog(Root / "log.txt"));
 			bfs::create_directory(Root / "." App);
 			bfs::create_directory(FilePath);
+			bfs::create_directory(BlockPath);
 			bfs::create_directory(TransactionPath);
 
 			{
@@ -232,22 +463,24 @@ ShareCoreInner::ShareCoreInner(bfs::path const &Root, std::string const &Instanc
 
 			InstanceFilename = GetInstanceFilename(InstanceName, InstanceID);
 
+			// Upgrades older database versions
 			Database.reset(new CoreDatabase(DatabasePath, false, InstanceName, InstanceID));
-			auto MaybeVersion = Database->Get<unsigned int()>("SELECT \"Version\" FROM \"Stats\"");
-			if (!MaybeVersion)
-				throw SystemError() << "Could not read database version, database may be corrupt.";
-			DatabaseVersion Version = (DatabaseVersion)*MaybeVersion;
-			switch (Version)
-			{
-				default: throw SystemError() << "Unrecognized database version " << (unsigned int)Version;
-				/*case Last - 2...: Do upgrade to Last - 1 && log;
-				case Last - 2...: Do upgrade to Last && log;*/
-				case DatabaseVersion::Latest: break;
-			}
-			Database->Execute("UPDATE \"Stats\" SET \"Version\" = ?", (unsigned int)DatabaseVersion::Latest);
+			LoadSplits();
+			Layout = *Database->GetLayout();
+			TargetLayout = *Database->GetTargetLayout();
+			Deduplicate = *Database->GetDeduplicate();
+			Compress = *Database->GetCompress();
+			if (!bfs::exists(BlockPath)) bfs::create_directory(BlockPath);
 		}
 		else { throw UserError() << Root << " is a non-directory.  The root path must not exist or must have been previously created by " << App << "."; }
 
+		FilesDescriptor = open(FilePath.string().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (FilesDescriptor < 0)
+			throw SystemError() << "Could not open backing file directory " << FilePath << ": " << strerror(errno);
+		BlocksDescriptor = open(BlockPath.string().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (BlocksDescriptor < 0)
+			throw SystemError() << "Could not open block directory " << BlockPath << ": " << strerror(errno);
+
 		Transaction.Create = [this](
 			UUID const &FileIndex,
 			NodeID const &Parent, std::string const &Name, bool const &IsFile,
@@ -256,13 +489,8 @@ ShareCoreInner::ShareCoreInner(bfs::path const &Root, std::string const &Instanc
 			Timestamp const Time = static_cast<Timestamp::Type>(std::time(nullptr));
 			Database->CreateFile({HostInstanceIndex, FileIndex}, Parent, Name, IsFile, Time, Permissions);
 			if (IsFile)
-			{
-				auto const InternalFilename = FilePath / GetInternalFilename(
-					NodeID{HostInstanceIndex, FileIndex},
-					NodeID{HostInstanceIndex, NullIndex});
-				bfs::ofstream Out(InternalFilename, std::ofstream::out | std::ofstream::binary);
-				if (!Out) throw ActionError{ActionError::Unknown};
-			}
+				CreateBacking({HostInstanceIndex, FileIndex}, {HostInstanceIndex, NullIndex});
+			Notifier->Publish({ChangeCreate, {HostInstanceIndex, FileIndex}, Parent, Name, IsFile, Permissions, Time});
 		};
 
 		Transaction.SetPermissions = [this](
@@ -273,10 +501,9 @@ ShareCoreInner::ShareCoreInner(bfs::path const &Root, std::string const &Instanc
 				{HostInstanceIndex, NewChangeIndex},
 				SharePermissions{CanWrite, CanExecute},
 				File.ID(), File.Change());
-			Database->CreateChange({HostInstanceIndex, NewChangeIndex}, File.Change());
-			if (File.IsFile())
-				bfs::rename(FilePath / GetInternalFilename(File.ID(), File.Change()),
-					FilePath / GetInternalFilename(File.ID(), {HostInstanceIndex, NewChangeIndex}));
+			Database->CreateChange({HostInstanceIndex, NewChangeIndex}, File.Change(), static_cast<Timestamp::Type>(std::time(nullptr)));
+			AdvanceVersions(File.ID(), {HostInstanceIndex, NewChangeIndex});
+			Notifier->Publish({ChangePermissions, File.ID(), File.Parent(), File.Name(), File.IsFile(), SharePermissions{CanWrite, CanExecute}, File.ModifiedTime()});
 		};
 
 		Transaction.SetTimestamp = [this](
@@ -287,17 +514,19 @@ ShareCoreInner::ShareCoreInner(bfs::path const &Root, std::string const &Instanc
 				{HostInstanceIndex, NewChangeIndex},
 				NewTimestamp,
 				File.ID(), File.Change());
-			Database->CreateChange({HostInstanceIndex, NewChangeIndex}, File.Change());
-			if (File.IsFile())
-				bfs::rename(FilePath / GetInternalFilename(File.ID(), File.Change()),
-					FilePath / GetInternalFilename(File.ID(), {HostInstanceIndex, NewChangeIndex}));
+			Database->CreateChange({HostInstanceIndex, NewChangeIndex}, File.Change(), static_cast<Timestamp::Type>(std::time(nullptr)));
+			AdvanceVersions(File.ID(), {HostInstanceIndex, NewChangeIndex});
+			Notifier->Publish({ChangeTimestamp, File.ID(), File.Parent(), File.Name(), File.IsFile(), File.Permissions(), NewTimestamp});
 		};
 
 		Transaction.Delete = [this](ShareFile const &File)
 		{
+			auto Content = File.IsFile() ? Database->GetContent(File.ID()) : Optional<NodeID>();
 			Database->DeleteFile(File.ID(), File.Change());
-			if (File.IsFile())
-				bfs::remove(FilePath / GetInternalFilename(File.ID(), File.Change()));
+			if (Content)
+				RemoveBacking(File.ID(), *Content);
+			if (File.IsSplit()) LoadSplits();
+			Notifier->Publish({ChangeDelete, File.ID(), File.Parent(), File.Name(), File.IsFile(), File.Permissions(), File.ModifiedTime()});
 		};
 
 		Transaction.Move = [this](
@@ -308,10 +537,10 @@ ShareCoreInner::ShareCoreInner(bfs::path const &Root, std::string const &Instanc
 			Database->MoveFile(
 				{HostInstanceIndex, NewChangeIndex}, Parent, Name,
 				File.ID(), File.Change());
-			Database->CreateChange({HostInstanceIndex, NewChangeIndex}, File.Change());
-			if (File.IsFile())
-				bfs::rename(FilePath / GetInternalFilename(File.ID(), File.Change()),
-					FilePath / GetInternalFilename(File.ID(), {HostInstanceIndex, NewChangeIndex}));
+			Database->CreateChange({HostInstanceIndex, NewChangeIndex}, File.Change(), static_cast<Timestamp::Type>(std::time(nullptr)));
+			AdvanceVersions(File.ID(), {HostInstanceIndex, NewChangeIndex});
+			if (SplitDirectories.count(std::make_pair(*File.ID().Instance, *File.ID().Index))) LoadSplits();
+			Notifier->Publish({ChangeMove, File.ID(), Parent, Name, File.IsFile(), File.Permissions(), File.ModifiedTime()});
 		};
 
 		Transact.reset(new CoreTransactor(TransactionPath,
@@ -320,135 +549,359 @@ ShareCoreInner::ShareCoreInner(bfs::path const &Root, std::string const &Instanc
 			Transaction.SetTimestamp,
 			Transaction.Delete,
 			Transaction.Move));
+
+		try { Notifier->Listen(Root / "." App / "notify"); }
+		catch (SystemError const &Error) { Log->Warn() << Error << "  Change notifications are only available in-process."; }
 	}
 	catch (bfs::filesystem_error &Error)
 		{ throw SystemError() << Error.what(); }
 }
 
+ShareCoreInner::~ShareCoreInner(void)
+{
+	{
+		std::lock_guard<std::mutex> Guard(BackgroundMutex);
+		StopBackground = true;
+	}
+	BackgroundWake.notify_all();
+	if (Compactor.joinable()) Compactor.join();
+	if (Migrator.joinable()) Migrator.join();
+	if (Ingester.joinable()) Ingester.join();
+	OpenContents.clear();
+	if (FilesDescriptor >= 0) close(FilesDescriptor);
+	if (BlocksDescriptor >= 0) close(BlocksDescriptor);
+}
+
 bfs::path ShareCoreInner::GetRoot(void) const { return Root; }
 
 bfs::path ShareCoreInner::GetRealPath(ShareFile const &File) const
 {
+	LatencyTimer Timer(Latency, CoreOperation::GetRealPath);
 	Assert(File.IsFile());
-	return FilePath / GetInternalFilename(File.ID(), File.Change());
+	auto Content = Database->GetContent(File.ID());
+	Assert(Content);
+	BackingPath Out;
+	LocateBacking(Out, File.ID(), *Content);
+	return FilePath / Out.c_str();
 }
 
-GetResult ShareCoreInner::Get(bfs::path const &Path)
+static void StatExtents(uint64_t Size, struct stat *Out)
 {
-	ValidatePath(Path);
-#ifndef NDEBUG
-	Assert(Mutex.try_lock());
-	Mutex.unlock();
-#endif
-	std::lock_guard<std::mutex> Guard(Mutex);
+	memset(Out, 0, sizeof(*Out));
+	Out->st_size = static_cast<off_t>(Size);
+	Out->st_blksize = BlockSize;
+	Out->st_blocks = static_cast<blkcnt_t>((Size + 511) / 512);
+}
+
+static int FlushPending(OpenContent &Content);
+static void TrimPreallocation(OpenContent &Content);
+
+int ShareCoreInner::StatBacking(ShareFile const &File, struct stat *Out) const
+{
+	LatencyTimer Timer(Latency, CoreOperation::StatBacking);
+	Assert(File.IsFile());
+	auto Open = OpenContents.find(std::make_pair(*File.ID().Instance, *File.ID().Index));
+	if (Open != OpenContents.end())
+	{
+		int const Flushed = FlushPending(*Open->second);
+		if (Flushed < 0) return Flushed;
+	}
+	if ((Open != OpenContents.end()) && (Open->second->Descriptor < 0))
+	{
+		// Staged writes aren't in the database yet
+		std::lock_guard<std::mutex> Guard(Open->second->ExtentMutex);
+		if (Open->second->Descriptor < 0)
+		{
+			StatExtents(Open->second->Size, Out);
+			return 0;
+		}
+	}
+	auto Content = Database->GetContent(File.ID());
+	if (!Content) return -ENOENT;
+	BackingPath Path;
+	LocateBacking(Path, File.ID(), *Content);
+	if (fstatat(FilesDescriptor, Path.c_str(), Out, AT_SYMLINK_NOFOLLOW) == 0) return 0;
+	if (errno != ENOENT) return -errno;
+	auto Size = Database->GetChunkedSize(File.ID(), *Content);
+	if (!Size) return -ENOENT;
+	StatExtents(*Size, Out);
+	return 0;
+}
+
+GetResult ShareCoreInner::Get(SharePath const &Path)
+{
+	LatencyTimer Timer(Latency, CoreOperation::Get);
 	return GetInternal(Path);
 }
 
-ActionError ShareCoreInner::CreateDirectory(bfs::path const &Path, bool CanWrite, bool CanExecute)
+ActionError ShareCoreInner::CreateDirectory(SharePath const &Path, bool CanWrite, bool CanExecute)
+{
+	LatencyTimer Timer(Latency, CoreOperation::CreateDirectory);
+	return CreateNode(Path, false, CanWrite, CanExecute);
+}
+
+ActionError ShareCoreInner::CreateFile(SharePath const &Path, bool CanWrite, bool CanExecute)
 {
-	ValidatePath(Path);
-	std::lock_guard<std::mutex> Guard(Mutex);
-	auto Parent = GetInternal(Path.parent_path());
+	LatencyTimer Timer(Latency, CoreOperation::CreateFile);
+	return CreateNode(Path, true, CanWrite, CanExecute);
+}
+
+ActionError ShareCoreInner::CreateNode(SharePath const &Path, bool IsFile, bool CanWrite, bool CanExecute)
+{
+	if (Path.IsRoot()) return ActionError::Exists;
+	auto Parent = GetInternal(Path.Parent());
 	if (IsSplitPath(Path)) return ActionError::Illegal;
 	if (!Parent) return ActionError::Missing;
 	if (Parent->IsFile()) return ActionError::Invalid;
-	if (Database->GetFile(Parent->ID(), Path.filename().string()))
+	if (Database->GetFile(Parent->ID(), Path.Filename()))
 		return ActionError::Exists;
 	Database->Begin();
 	UUID FileIndex = *Database->GetFileIndex();
 	Database->IncrementFileIndex();
 	Database->End();
-	(*Transact)(CTV1Create(), FileIndex, Parent->ID(), Path.filename().string(), false, SharePermissions{CanWrite, CanExecute});
-	Log->Debug() << "Created file " << HostInstanceIndex << " " << *FileIndex << " / 0 0";
+	(*Transact)(CTV2Create(), FileIndex, Parent->ID(), std::string(Path.Filename()), IsFile, SharePermissions{CanWrite, CanExecute});
+	Logged(*Log, Debug) << "Created file " << HostInstanceIndex << " " << *FileIndex << " / 0 0";
+	return ActionError::OK;
+}
+
+ActionResult<std::unique_ptr<OpenFile>> ShareCoreInner::Open(SharePath const &Path, bool Writable, bool Truncate)
+{
+	LatencyTimer Timer(Latency, CoreOperation::Open);
+	auto File = GetInternal(Path);
+	if (!File) return File.Code;
+	if (!File->IsFile()) return ActionError::Invalid;
+	// Truncating is a write, so it's checked before anything changes
+	if (Writable && Truncate && !File->CanWrite()) return ActionError::Restricted;
+	auto const Key = std::make_pair(*File->ID().Instance, *File->ID().Index);
+	auto Found = OpenContents.find(Key);
+	if (Found == OpenContents.end())
+	{
+		auto ContentID = Database->GetContent(File->ID());
+		if (!ContentID) return ActionError::Missing;
+		std::shared_ptr<OpenContent> Content(new OpenContent(File->ID(), *ContentID, BlocksDescriptor, *IO, Cache));
+		LoadContent(*Content);
+		Found = OpenContents.emplace(Key, std::move(Content)).first;
+	}
+	++Found->second->Handles;
+	std::unique_ptr<OpenFile> Out(new OpenFile(*File, Found->second, Writable));
+	if (Writable && Truncate)
+	{
+		int const Result = Out->Truncate(0);
+		if (Result < 0)
+		{
+			Release(std::move(Out));
+			throw SystemError() << "Could not truncate " << *File->ID().Instance << " " << *File->ID().Index << ": " << strerror(-Result);
+		}
+	}
+	return Out.release();
+}
+
+void ShareCoreInner::Release(std::unique_ptr<OpenFile> File)
+{
+	LatencyTimer Timer(Latency, CoreOperation::Release);
+	auto const Content = File->Content;
+	File.reset();
+	Assert(Content->Handles > 0);
+	int const Flushed = Content->Deleted ? 0 : FlushPending(*Content);
+	if (Flushed < 0)
+		Log->Warn() << "Could not write held back data to " << *Content->ID.Instance << " " << *Content->ID.Index << ": " << strerror(-Flushed);
+	if (--Content->Handles > 0) return;
+	OpenContents.erase(std::make_pair(*Content->ID.Instance, *Content->ID.Index));
+	TrimPreallocation(*Content);
+	if (Content->Deleted)
+	{
+		Database->Begin();
+		DereferenceChunks(Content->ID, Content->Content);
+		Database->End();
+	}
+	else if (Content->Descriptor < 0)
+		CommitExtents(*Content);
+	else
+	{
+		if (Content->Dirty)
+		{
+			// The plain file now has the only current copy, any older chunks are stale
+			Database->Begin();
+			DereferenceChunks(Content->ID, Content->Content);
+			Database->End();
+		}
+		// Also queued again if it was found open while waiting
+		if ((Content->Dirty || Ingesting.count(std::make_pair(*Content->ID.Instance, *Content->ID.Index))) && (Deduplicate || Compress))
+			QueueIngestion(*Content);
+	}
+}
+
+void ShareCoreInner::Commit(OpenFile &File)
+{
+	LatencyTimer Timer(Latency, CoreOperation::Commit);
+	int const Flushed = FlushPending(*File.Content);
+	if (Flushed < 0)
+		throw SystemError() << "Could not write held back data to " << *File.File.ID().Instance << " " << *File.File.ID().Index << ": " << strerror(-Flushed);
+	if (File.Content->Descriptor < 0) CommitExtents(*File.Content);
+}
+
+ActionError ShareCoreInner::Copy(SharePath const &From, SharePath const &To)
+{
+	LatencyTimer Timer(Latency, CoreOperation::Copy);
+	auto Source = Open(From, false, false);
+	if (!Source) return Source.Code;
+	int const Flushed = (*Source)->Flush();
+	if (Flushed < 0)
+	{
+		Release(std::move(*Source));
+		throw SystemError() << "Could not write held back data before copying: " << strerror(-Flushed);
+	}
+	ActionError const Created = CreateNode(To, true, (*Source)->File.CanWrite(), (*Source)->File.CanExecute());
+	if ((Created != ActionError::OK) || ShareExtents(*(*Source)->Content, To))
+	{
+		Release(std::move(*Source));
+		return Created;
+	}
+	auto Target = Open(To, true, false);
+	Assert(Target);
+	NodeID const TargetID = (*Target)->File.ID();
+	struct stat Status;
+	ssize_t Result = (*Source)->Stat(&Status);
+	for (off_t Offset = 0; (Result >= 0) && (Offset < Status.st_size); Offset += Result)
+	{
+		Result = (*Source)->CopyTo(**Target, Offset, Offset, static_cast<size_t>(Status.st_size - Offset));
+		if (Result == 0) break;
+	}
+	Release(std::move(*Target));
+	Release(std::move(*Source));
+	if (Result < 0)
+		throw SystemError() << "Could not copy file data to " << *TargetID.Instance << " " << *TargetID.Index << ": " << strerror(static_cast<int>(-Result));
 	return ActionError::OK;
 }
 
-ActionResult<std::unique_ptr<ShareFile>> ShareCoreInner::OpenDirectory(bfs::path const &Path)
+ActionResult<std::unique_ptr<ShareFile>> ShareCoreInner::OpenDirectory(SharePath const &Path)
 {
-	ValidatePath(Path);
-	std::lock_guard<std::mutex> Guard(Mutex);
+	LatencyTimer Timer(Latency, CoreOperation::OpenDirectory);
 	auto Out = GetInternal(Path);
 	if (!Out) return Out.Code;
-	if (!Out->IsFile()) return ActionError::Invalid;
+	if (Out->IsFile()) return ActionError::Invalid;
+	if (IsSplitPath(Path) && !Out->IsSplit() && Out->ID().Index != NullIndex)
+	{
+		// An unsplit directory seen through the split view lists that instance's splits
+		auto Instance = Database->GetInstanceIndex(Path[1]);
+		if (!Instance) return ActionError::Missing;
+		ShareFileTuple View(*Out);
+		std::get<1>(View) = NodeID(*Instance, NullIndex);
+		std::get<7>(View) = true;
+		return new ShareFile(View);
+	}
 	return new ShareFile(*Out);
 }
 
 std::vector<ShareFile> ShareCoreInner::GetDirectory(ShareFile const &File, unsigned int From, unsigned int Count)
 {
-	std::lock_guard<std::mutex> Guard(Mutex);
+	LatencyTimer Timer(Latency, CoreOperation::GetDirectory);
 	std::vector<ShareFile> Out;
-	if (File.IsSplit()) Database->GetSplitFiles.Execute(File.ID(), File.Change().Instance, From, Count,
-		[&Out](
-			NodeID &&ID, NodeID &&Change, NodeID &&Parent,
-			std::string &&Name, bool &&IsFile, Timestamp &&Modified,
-			SharePermissions &&Permissions, bool &&IsSplit)
-			{ Out.push_back(ShareFile{ID, Change, Parent, Name, IsFile, Modified, Permissions, IsSplit}); });
-	else Database->GetFiles.Execute(File.ID(), From, Count,
-		[&Out](
-			NodeID &&ID, NodeID &&Change, NodeID &&Parent,
-			std::string &&Name, bool &&IsFile, Timestamp &&Modified,
-			SharePermissions &&Permissions, bool &&IsSplit)
-			{ Out.push_back(ShareFile{ID, Change, Parent, Name, IsFile, Modified, Permissions, IsSplit}); });
-	Assert(Out.size() <= Count);
+	auto const Collect = [&Out](
+		NodeID &&ID, NodeID &&Change, NodeID &&Parent,
+		std::string &&Name, bool &&IsFile, Timestamp &&Modified,
+		SharePermissions &&Permissions, bool &&IsSplit)
+		{ Out.push_back(ShareFile{ID, Change, Parent, Name, IsFile, Modified, Permissions, IsSplit}); };
+	if ((File.ID().Index == NullIndex) && (File.Name() == SplitDir))
+	{
+		// Instances with splits anywhere in the share
+		auto Root = SplitDirectories.find(std::make_pair(HostInstanceIndex, NullIndex));
+		if (Root == SplitDirectories.end()) return Out;
+		for (Counter::Type Instance = 0; Instance < Root->second.Instances.size(); ++Instance)
+		{
+			if (!Root->second.Instances[Instance]) continue;
+			auto Filename = Database->GetInstanceFilename(Instance);
+			if (Filename) Out.push_back(SplitInstanceFile(Instance, *Filename));
+		}
+	}
+	else if (File.IsSplit())
+	{
+		// Split rows from the instance, then the unsplit directories that lead to deeper splits
+		Database->GetSplitFiles.Execute(File.ID(), File.Change().Instance, From, Count, Collect);
+		Assert(Out.size() <= Count);
+		if (Out.size() == Count) return Out;
+		// The page ran past the split rows; a page entirely past them needs their count to place the directories
+		unsigned int const Rows = (Out.empty() && (From > 0)) ? *Database->CountSplitFiles(File.ID(), File.Change().Instance) : From + static_cast<unsigned int>(Out.size());
+		unsigned int Skip = (From > Rows) ? From - Rows : 0;
+		for (auto const &Directory : SplitDirectories)
+		{
+			if (Out.size() >= Count) break;
+			if ((Directory.second.Parent.Instance != File.ID().Instance) || (Directory.second.Parent.Index != File.ID().Index)) continue;
+			if ((Directory.first.first == HostInstanceIndex) && (Directory.first.second == NullIndex)) continue;
+			if (!HasSplits(File.Change().Instance, {Directory.first.first, Directory.first.second})) continue;
+			auto Got = Database->GetFileByID({Directory.first.first, Directory.first.second});
+			if (!Got) continue;
+			if (Skip > 0) { --Skip; continue; }
+			Out.push_back(ShareFile(*Got));
+		}
+		return Out;
+	}
+	else
+	{
+		Database->GetFiles.Execute(File.ID(), From, Count, Collect);
+		Assert(Out.size() <= Count);
+		return Out;
+	}
+	if (From >= Out.size()) return {};
+	Out.erase(Out.begin(), Out.begin() + From);
+	if (Out.size() > Count) Out.resize(Count);
 	return Out;
 }
 
-ActionError ShareCoreInner::SetPermissions(bfs::path const &Path, bool CanWrite, bool CanExecute)
+ActionError ShareCoreInner::SetPermissions(SharePath const &Path, bool CanWrite, bool CanExecute)
 {
-	ValidatePath(Path);
-	std::lock_guard<std::mutex> Guard(Mutex);
+	LatencyTimer Timer(Latency, CoreOperation::SetPermissions);
 	auto File = GetInternal(Path);
 	if (!File) return File.Code;
 	Database->Begin();
 	UUID ChangeIndex = *Database->GetChangeIndex();
 	Database->IncrementChangeIndex();
 	Database->End();
-	(*Transact)(CTV1SetPermissions(),
+	(*Transact)(CTV2SetPermissions(),
 		*File, ChangeIndex,
 		CanWrite, CanExecute);
-	Log->Debug() << "Changed file " << *File->ID().Instance << " " << *File->ID().Index << " / " <<
+	Logged(*Log, Debug) << "Changed file " << *File->ID().Instance << " " << *File->ID().Index << " / " <<
 		*File->Change().Instance << " " << *File->Change().Index << " -> " << HostInstanceIndex << " " << *ChangeIndex;
 	return ActionError::OK;
 }
 
-ActionError ShareCoreInner::SetTimestamp(bfs::path const &Path, Timestamp const &NewTimestamp)
+ActionError ShareCoreInner::SetTimestamp(SharePath const &Path, Timestamp const &NewTimestamp)
 {
-	ValidatePath(Path);
-	std::lock_guard<std::mutex> Guard(Mutex);
+	LatencyTimer Timer(Latency, CoreOperation::SetTimestamp);
 	auto File = GetInternal(Path);
 	if (!File) return File.Code;
 	Database->Begin();
 	UUID ChangeIndex = *Database->GetChangeIndex();
 	Database->IncrementChangeIndex();
 	Database->End();
-	(*Transact)(CTV1SetTimestamp(),
+	(*Transact)(CTV2SetTimestamp(),
 		*File, ChangeIndex,
 		NewTimestamp);
-	Log->Debug() << "Changed file " << *File->ID().Instance << " " << *File->ID().Index << " / " <<
+	Logged(*Log, Debug) << "Changed file " << *File->ID().Instance << " " << *File->ID().Index << " / " <<
 		*File->Change().Instance << " " << *File->Change().Index << " -> " << HostInstanceIndex << " " << *ChangeIndex;
 	return ActionError::OK;
 }
 
-ActionError ShareCoreInner::Delete(bfs::path const &Path)
+ActionError ShareCoreInner::Delete(SharePath const &Path)
 {
-	ValidatePath(Path);
-	if (IsRootPath(Path)) return ActionError::Illegal;
-	std::lock_guard<std::mutex> Guard(Mutex);
+	LatencyTimer Timer(Latency, CoreOperation::Delete);
+	if (Path.IsRoot()) return ActionError::Illegal;
 	auto File = GetInternal(Path);
 	if (!File) return File.Code;
-	if (IsSplitPath(Path) && !File->IsSplit()) return ActionError::Illegal;
-	(*Transact)(CTV1Delete(), *File);
-	Log->Debug() << "Deleted file head " << *File->ID().Instance << " " << *File->ID().Index;
+	if (IsSplitPath(Path) && (!File->IsSplit() || (File->ID().Index == NullIndex))) return ActionError::Illegal;
+	(*Transact)(CTV2Delete(), *File);
+	Logged(*Log, Debug) << "Deleted file head " << *File->ID().Instance << " " << *File->ID().Index;
 	return ActionError::OK;
 }
 
-ActionError ShareCoreInner::Move(bfs::path const &From, bfs::path const &To)
+ActionError ShareCoreInner::Move(SharePath const &From, SharePath const &To)
 {
-	if (IsRootPath(From)) return ActionError::Illegal;
+	LatencyTimer Timer(Latency, CoreOperation::Move);
+	if (From.IsRoot()) return ActionError::Illegal;
 	if (IsSplitPath(From)) return ActionError::Illegal; // TODO make this okay for non-pseudo, but a copy and delete rather than a reparent
 	if (IsSplitPath(To)) return ActionError::Illegal;
 	bool DeleteAfter = false;
-	{ std::lock_guard<std::mutex> Guard(Mutex);
+	{
 		Database->Begin();
 		UUID ChangeIndex = *Database->GetChangeIndex();
 		Database->IncrementChangeIndex();
@@ -457,29 +910,33 @@ ActionError ShareCoreInner::Move(bfs::path const &From, bfs::path const &To)
 		auto FromFile = GetInternal(From);
 		if (!FromFile) return FromFile.Code;
 
-		std::string ToName = To.filename().string();
+		std::string ToName(To.Filename());
 		auto ToFile = GetInternal(To);
 		if (ToFile.Code == ActionError::Missing)
-			ToFile = GetInternal(To.parent_path().string());
+			ToFile = GetInternal(To.Parent());
 		else if (ToFile && !ToFile->IsFile())
-			ToName = From.filename().string();
+			ToName = std::string(From.Filename());
 
 		if (!ToFile) return ToFile.Code;
 		if (!ToFile->CanWrite()) return ActionError::Restricted;
 
 		if (ToFile->IsFile())
 		{
-			(*Transact)(CTV1Move(), *FromFile, ChangeIndex, ToFile->Parent(), ToName);
+			(*Transact)(CTV2Move(), *FromFile, ChangeIndex, ToFile->Parent(), ToName);
 			DeleteAfter = true;
 		}
-		else (*Transact)(CTV1Move(), *FromFile, ChangeIndex, ToFile->ID(), ToName);
-		Log->Debug() << "Changed file " << *FromFile->ID().Instance << " " << *FromFile->ID().Index << " / " <<
+		else (*Transact)(CTV2Move(), *FromFile, ChangeIndex, ToFile->ID(), ToName);
+		Logged(*Log, Debug) << "Changed file " << *FromFile->ID().Instance << " " << *FromFile->ID().Index << " / " <<
 			*FromFile->Change().Instance << " " << *FromFile->Change().Index << " -> " << HostInstanceIndex << " " << *ChangeIndex;
 	}
 	if (DeleteAfter) Delete(To);
 	return ActionError::OK;
 }
 
+size_t ShareCoreInner::Subscribe(SubscriberCallback const &Callback) { return Notifier->Subscribe(Callback); }
+
+void ShareCoreInner::Unsubscribe(size_t Subscription) { Notifier->Unsubscribe(Subscription); }
+
 /*GetResult ShareCoreInner::Get(NodeID const &ID)
 {
 	// Get primary instance of file by file id
@@ -488,74 +945,1438 @@ ActionError ShareCoreInner::Move(bfs::path const &From, bfs::path const &To)
 	return {*Got};
 }*/
 
-GetResult ShareCoreInner::GetInternal(bfs::path const &Path)
+GetResult ShareCoreInner::GetInternal(SharePath const &Path)
 {
-	ValidatePath(Path);
-	Assert(!Mutex.try_lock());
-	auto ParentFile = Database->GetFile({HostInstanceIndex, NullIndex}, "");
+	auto ParentFile = Database->GetFile({HostInstanceIndex, NullIndex}, StringView());
 	Assert(ParentFile);
-	bfs::path::iterator PathIterator = ++Path.begin();
-	if (IsRootPath(Path)) return {ShareFile(*ParentFile)};
+	if (Path.IsRoot()) return {ShareFile(*ParentFile)};
+	size_t Component = 0;
 
 	Counter SplitInstance = HostInstanceIndex;
 	bool const IsSplit = IsSplitPath(Path);
 	if (IsSplit)
 	{
-		if (++PathIterator == Path.end()) return SplitFile;
-		auto GotInstance = Database->GetInstanceIndex(PathIterator->string());
+		if (++Component == Path.Size()) return SplitFile;
+		auto GotInstance = Database->GetInstanceIndex(Path[Component]);
 		if (!GotInstance) return ActionError::Missing;
 		SplitInstance = *GotInstance;
-		return ActionError::Missing;
-		if (true /*!HasSplits(SplitInstance, ParentFile)*/) return ActionError::Missing;
-		if (++PathIterator == Path.end()) return SplitInstanceFile(SplitInstance);
+		if (!HasSplits(SplitInstance, ShareFile(*ParentFile).ID())) return ActionError::Missing;
+		if (++Component == Path.Size()) return SplitInstanceFile(SplitInstance, std::string(Path[Component - 1]));
 	}
 
+	// In the split view, a split row shadows the unsplit file and unsplit directories only show if they lead to splits
+	auto const Lookup = [&](NodeID const &Parent, StringView const &Name) -> Optional<ShareFileTuple>
 	{
-		bfs::path::iterator NextPathIterator = PathIterator; ++NextPathIterator;
-		for (; NextPathIterator != Path.end(); PathIterator = NextPathIterator, NextPathIterator++)
-		{
-			auto OriginalParentFile = ParentFile;
-			if (IsSplit)
-				ParentFile = Database->GetSplitFile(ShareFile(*OriginalParentFile).ID(), SplitInstance, PathIterator->string());
-			if (!IsSplit || !ParentFile)
-				ParentFile = Database->GetFile(ShareFile(*OriginalParentFile).ID(), PathIterator->string());
-			if (!ParentFile)
-				return ActionError::Missing;
-			if (ShareFile(*ParentFile).IsFile())
-				return ActionError::Invalid;
-		}
+		if (!IsSplit) return Database->GetFile(Parent, Name);
+		if (!HasSplits(SplitInstance, Parent)) return {};
+		auto Split = Database->GetSplitFile(Parent, SplitInstance, Name);
+		if (Split) return Split;
+		auto Unsplit = Database->GetFile(Parent, Name);
+		if (!Unsplit || ShareFile(*Unsplit).IsFile() || !HasSplits(SplitInstance, ShareFile(*Unsplit).ID())) return {};
+		return Unsplit;
+	};
+
+	for (; Component + 1 < Path.Size(); ++Component)
+	{
+		ParentFile = Lookup(std::get<0>(*ParentFile), Path[Component]);
+		if (!ParentFile)
+			return ActionError::Missing;
+		if (std::get<4>(*ParentFile))
+			return ActionError::Invalid;
 	}
 
-	auto Out = (!IsSplit) ?
-		Database->GetFile(ShareFile(*ParentFile).ID(), PathIterator->string()) :
-		Database->GetSplitFile(ShareFile(*ParentFile).ID(), SplitInstance, PathIterator->string());
+	auto Out = Lookup(std::get<0>(*ParentFile), Path[Component]);
 	if (!Out) return ActionError::Missing;
 	return ShareFile(*Out);
 }
 
+ActionResult<VersionVector> ShareCoreInner::GetVersions(SharePath const &Path)
+{
+	LatencyTimer Timer(Latency, CoreOperation::GetVersions);
+	auto File = GetInternal(Path);
+	if (!File) return File.Code;
+	auto Versions = Database->GetVersions(File->ID());
+	if (!Versions) return ActionError::Missing;
+	return *Versions;
+}
+
+void ShareCoreInner::AdvanceVersions(NodeID const &ID, NodeID const &Change)
+{
+	auto Versions = Database->GetVersions(ID);
+	if (!Versions) return;
+	Versions->Advance(Change);
+	Database->SetVersions(*Versions, ID);
+}
+
+CompactionProgress ShareCoreInner::CompactHistory(Timestamp const &Before, unsigned int BatchSize)
+{
+	LatencyTimer Timer(Latency, CoreOperation::CompactHistory);
+	CompactionProgress Out{0, 0};
+	std::vector<std::tuple<int64_t, NodeID>> Changes;
+	Database->Begin();
+	Database->GetOldChanges.Execute(CompactionCursor, Before, BatchSize,
+		[&Changes](int64_t &&Row, NodeID &&Change) { Changes.emplace_back(Row, Change); });
+	for (auto const &Change : Changes)
+	{
+		CompactionCursor = std::get<0>(Change);
+		NodeID const &ID = std::get<1>(Change);
+		// File data versions this change replaced leave the history with it
+		std::vector<std::pair<NodeID, NodeID>> Retired;
+		Database->GetRetiredContent.Execute(ID, [&Retired](NodeID &&File, Counter &&Instance, UUID &&Index)
+			{ Retired.emplace_back(File, NodeID(Instance, Index)); });
+		for (auto const &Version : Retired) DereferenceChunks(Version.first, Version.second);
+		if (!Retired.empty()) Database->DeleteRetiredContent(ID);
+		// Current changes anchor what split detection compares against
+		if (Database->IsCurrentChange(ID)) continue;
+		// Read the parent now, earlier rows in this batch may have been collapsed into it
+		auto Parent = Database->GetChange(ID);
+		if (!Parent) continue;
+		Database->ReparentChanges(*Parent, ID);
+		Database->DeleteChange(ID);
+		++Out.Reclaimed;
+	}
+	Database->End();
+	Out.Scanned = Changes.size();
+	if (Out.Scanned < BatchSize) CompactionCursor = 0;
+	Compacted += Out.Reclaimed;
+	return Out;
+}
+
+void ShareCoreInner::StartCompaction(CompactionSettings const &Settings)
+{
+	Assert(!Compactor.joinable());
+	Compactor = std::thread([this, Settings]()
+	{
+		size_t PassReclaimed = 0;
+		size_t PassCollected = 0;
+		while (true)
+		{
+			bool PassDone = false;
+			try
+			{
+				std::lock_guard<std::mutex> Guard(Mutex);
+				Timestamp const Before = static_cast<Timestamp::Type>(std::time(nullptr) - Settings.RetentionSeconds);
+				auto const Progress = CompactHistory(Before, Settings.BatchSize);
+				PassReclaimed += Progress.Reclaimed;
+				// Unreferenced blocks are collected alongside
+				size_t const Collected = CollectBlocks(Settings.BatchSize);
+				PassCollected += Collected;
+				PassDone = (Progress.Scanned < Settings.BatchSize) && (Collected < Settings.BatchSize);
+				if (PassDone && (PassReclaimed > 0))
+				{
+					Log->Note() << "Compacted " << PassReclaimed << " history rows (" << Compacted << " total).";
+					PassReclaimed = 0;
+				}
+				if (PassDone && (PassCollected > 0))
+				{
+					Log->Note() << "Removed " << PassCollected << " unreferenced blocks.";
+					PassCollected = 0;
+				}
+			}
+			catch (SystemError const &Error)
+			{
+				std::lock_guard<std::mutex> Guard(Mutex);
+				Log->Error() << "History compaction stopped: " << Error;
+				return;
+			}
+			std::unique_lock<std::mutex> Lock(BackgroundMutex);
+			if (PassDone ?
+				BackgroundWake.wait_for(Lock, std::chrono::seconds(Settings.PassIntervalSeconds), [this]() { return StopBackground; }) :
+				BackgroundWake.wait_for(Lock, std::chrono::milliseconds(Settings.BatchPauseMilliseconds), [this]() { return StopBackground; }))
+				return;
+		}
+	});
+}
+
+uint64_t ShareCoreInner::GetCompactedCount(void) const { return Compacted; }
+
+FileLayout ShareCoreInner::GetFileLayout(void) const { return Layout; }
+
+bool ShareCoreInner::IsMigratingLayout(void) const { return Layout != TargetLayout; }
+
+ActionError ShareCoreInner::SetFileLayout(FileLayout const &Target)
+{
+	LatencyTimer Timer(Latency, CoreOperation::SetFileLayout);
+	if (!Target.IsValid()) return ActionError::Invalid;
+	if (IsMigratingLayout() && (Target != TargetLayout)) return ActionError::Illegal;
+	TargetLayout = Target;
+	MigrationCursor = 0;
+	Database->SetLayout(Layout, TargetLayout);
+	return ActionError::OK;
+}
+
+size_t ShareCoreInner::MigrateLayout(unsigned int BatchSize)
+{
+	LatencyTimer Timer(Latency, CoreOperation::MigrateLayout);
+	if (!IsMigratingLayout()) return 0;
+	std::vector<std::tuple<int64_t, NodeID, NodeID>> Batch;
+	Database->GetBackedFiles.Execute(MigrationCursor, BatchSize,
+		[&Batch](int64_t &&Row, NodeID &&ID, NodeID &&Content) { Batch.emplace_back(Row, ID, Content); });
+	size_t Moved = 0;
+	for (auto const &File : Batch)
+	{
+		MigrationCursor = std::get<0>(File);
+		if (MoveBacking(Layout, std::get<1>(File), std::get<2>(File))) ++Moved;
+	}
+	if (Batch.size() < BatchSize)
+	{
+		// Files created mid-migration already went to the target layout
+		Log->Note() << "Finished moving backing files to " << TargetLayout.Levels << "x" << TargetLayout.Width << " layout.";
+		Layout = TargetLayout;
+		MigrationCursor = 0;
+		Database->SetLayout(Layout, TargetLayout);
+	}
+	return Moved;
+}
+
+bool ShareCoreInner::UseRingIO(unsigned int Depth)
+{
+	Assert(OpenContents.empty());
+	try { IO.reset(new IOEngine(Depth)); }
+	catch (SystemError const &Error)
+	{
+		Log->Warn() << Error;
+		return false;
+	}
+	return true;
+}
+
+bool ShareCoreInner::IsDeduplicating(void) const { return Deduplicate; }
+
+void ShareCoreInner::SetDeduplication(bool Enabled)
+{
+	Deduplicate = Enabled;
+	Database->SetDeduplicate(Enabled);
+}
+
+bool ShareCoreInner::IsCompressing(void) const { return Compress; }
+
+void ShareCoreInner::SetCompression(bool Enabled)
+{
+	Compress = Enabled;
+	Database->SetCompress(Enabled);
+}
+
+void ShareCoreInner::SetLogLevel(LogLevel Level) { Log->SetLevel(Level); }
+
+LatencyStats &ShareCoreInner::GetLatency(void) { return Latency; }
+
+void ShareCoreInner::StartLayoutMigration(MigrationSettings const &Settings)
+{
+	Assert(!Migrator.joinable());
+	Migrator = std::thread([this, Settings]()
+	{
+		while (true)
+		{
+			try
+			{
+				std::lock_guard<std::mutex> Guard(Mutex);
+				MigrateLayout(Settings.BatchSize);
+				if (!IsMigratingLayout()) return;
+			}
+			catch (SystemError const &Error)
+			{
+				std::lock_guard<std::mutex> Guard(Mutex);
+				Log->Error() << "Backing file migration stopped: " << Error;
+				return;
+			}
+			std::unique_lock<std::mutex> Lock(BackgroundMutex);
+			if (BackgroundWake.wait_for(Lock, std::chrono::milliseconds(Settings.BatchPauseMilliseconds), [this]() { return StopBackground; }))
+				return;
+		}
+	});
+}
+
 NodeID ShareCoreInner::GetPrecedingChange(NodeID const &Change)
 {
 	if (!Change) return NodeID();
-	std::lock_guard<std::mutex> Guard(Mutex);
 	auto Out = Database->GetChange(Change);
 	Assert(Out);
 	return *Out;
 }
 
-bool ShareCoreInner::IsRootPath(bfs::path const &Path) const
+bool ShareCoreInner::IsSplitPath(SharePath const &Path) const
+{
+	return !Path.IsRoot() && (Path[0] == SplitDir);
+}
+
+ShareFile ShareCoreInner::SplitInstanceFile(Counter Index, std::string const &Filename) const
+{
+	// Lists as the instance's splits in the root directory
+	return ShareFile(NodeID(), NodeID(Index, NullIndex), NodeID(), Filename, false, Timestamp::Type(0), SharePermissions{1, 1}, true);
+}
+
+bool ShareCoreInner::HasSplits(Counter const &Instance, NodeID const &Directory) const
+{
+	if (SplitDirectories.empty()) return false;
+	auto Found = SplitDirectories.find(std::make_pair(*Directory.Instance, *Directory.Index));
+	if (Found == SplitDirectories.end()) return false;
+	return (*Instance < Found->second.Instances.size()) && Found->second.Instances[*Instance];
+}
+
+void ShareCoreInner::LoadSplits(void)
+{
+	SplitDirectories.clear();
+	std::vector<std::tuple<NodeID, Counter>> Splits;
+	Database->GetSplitParents.Execute([&Splits](NodeID &&Parent, Counter &&Instance) { Splits.emplace_back(Parent, Instance); });
+	for (auto const &Split : Splits)
+	{
+		// Mark the directory holding the split and each of its ancestors
+		NodeID Directory = std::get<0>(Split);
+		Counter::Type const Instance = *std::get<1>(Split);
+		while (true)
+		{
+			auto Key = std::make_pair(*Directory.Instance, *Directory.Index);
+			auto Found = SplitDirectories.find(Key);
+			bool const Known = Found != SplitDirectories.end();
+			if (!Known)
+			{
+				auto Parent = Database->GetParent(Directory);
+				if (!Parent) break;
+				Found = SplitDirectories.emplace(Key, SplitDirectory{*Parent, {}}).first;
+			}
+			auto &Instances = Found->second.Instances;
+			if (Instances.size() <= Instance) Instances.resize(Instance + 1, false);
+			if (Known && Instances[Instance]) break;
+			Instances[Instance] = true;
+			if ((Directory.Instance == HostInstanceIndex) && (Directory.Index == NullIndex)) break;
+			Directory = Found->second.Parent;
+		}
+	}
+}
+
+// Backing files are named by node and content version, so metadata-only changes leave them alone.  Formatted by
+// hand into a stack buffer since this is on every file lookup.
+static constexpr size_t BackingFilenameCapacity = 4 * 20 + 3 + 1;
+
+static char *FormatDecimal(char *Out, uint64_t Value)
+{
+	char Digits[20];
+	size_t Count = 0;
+	do { Digits[Count++] = static_cast<char>('0' + Value % 10); Value /= 10; } while (Value > 0);
+	while (Count > 0) *Out++ = Digits[--Count];
+	return Out;
+}
+
+static size_t FormatBackingFilename(char (&Out)[BackingFilenameCapacity], NodeID const &ID, NodeID const &Content)
+{
+	char *Next = Out;
+	Next = FormatDecimal(Next, *ID.Instance); *Next++ = '-';
+	Next = FormatDecimal(Next, *ID.Index); *Next++ = '-';
+	Next = FormatDecimal(Next, *Content.Instance); *Next++ = '-';
+	Next = FormatDecimal(Next, *Content.Index);
+	*Next = 0;
+	return static_cast<size_t>(Next - Out);
+}
+
+void ShareCoreInner::LocateBacking(BackingPath &Out, NodeID const &ID, NodeID const &Content) const
+{
+	char Filename[BackingFilenameCapacity];
+	auto const Length = FormatBackingFilename(Filename, ID, Content);
+	TargetLayout.Format(Out, Filename, Length);
+	if (IsMigratingLayout() && (faccessat(FilesDescriptor, Out.c_str(), F_OK, 0) != 0))
+		Layout.Format(Out, Filename, Length);
+}
+
+// Creates the hashed directories leading to Path, relative to the files directory
+static void CreateBackingDirectories(int FilesDescriptor, BackingPath const &Path)
+{
+	char Directory[BackingPath::Capacity];
+	memcpy(Directory, Path.Data, Path.DirectoryLength);
+	for (size_t Index = 0; Index < Path.DirectoryLength; ++Index)
+	{
+		if (Directory[Index] != '/') continue;
+		Directory[Index] = 0;
+		if ((mkdirat(FilesDescriptor, Directory, 0700) != 0) && (errno != EEXIST))
+			throw SystemError() << "Could not create backing directory " << Directory << ": " << strerror(errno);
+		Directory[Index] = '/';
+	}
+}
+
+// Creates or empties the file at Path for reading and writing
+static int CreateBackingFile(int FilesDescriptor, BackingPath const &Path)
+{
+	int File = openat(FilesDescriptor, Path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if ((File < 0) && (errno == ENOENT) && (Path.DirectoryLength > 0))
+	{
+		CreateBackingDirectories(FilesDescriptor, Path);
+		File = openat(FilesDescriptor, Path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	}
+	if (File < 0) throw SystemError() << "Could not create backing file " << Path.c_str() << ": " << strerror(errno);
+	return File;
+}
+
+void ShareCoreInner::CreateBacking(NodeID const &ID, NodeID const &Content)
+{
+	BackingPath Path;
+	char Filename[BackingFilenameCapacity];
+	TargetLayout.Format(Path, Filename, FormatBackingFilename(Filename, ID, Content));
+	close(CreateBackingFile(FilesDescriptor, Path));
+}
+
+void ShareCoreInner::UnlinkBacking(NodeID const &ID, NodeID const &Content)
+{
+	BackingPath Path;
+	LocateBacking(Path, ID, Content);
+	if ((unlinkat(FilesDescriptor, Path.c_str(), 0) != 0) && (errno != ENOENT))
+		throw SystemError() << "Could not remove backing file " << Path.c_str() << ": " << strerror(errno);
+}
+
+void ShareCoreInner::RemoveBacking(NodeID const &ID, NodeID const &Content)
+{
+	// Open handles keep reading the unlinked file or the blocks until the last one closes
+	UnlinkBacking(ID, Content);
+	Ingesting.erase(std::make_pair(*ID.Instance, *ID.Index));
+	auto Open = OpenContents.find(std::make_pair(*ID.Instance, *ID.Index));
+	if (Open != OpenContents.end())
+	{
+		Open->second->Deleted = true;
+		return;
+	}
+	Database->Begin();
+	DereferenceChunks(ID, Content);
+	Database->End();
+}
+
+bool ShareCoreInner::MoveBacking(FileLayout const &From, NodeID const &ID, NodeID const &Content)
+{
+	BackingPath FromPath, ToPath;
+	char Filename[BackingFilenameCapacity];
+	auto const Length = FormatBackingFilename(Filename, ID, Content);
+	From.Format(FromPath, Filename, Length);
+	TargetLayout.Format(ToPath, Filename, Length);
+	int Result = renameat(FilesDescriptor, FromPath.c_str(), FilesDescriptor, ToPath.c_str());
+	if ((Result != 0) && (errno == ENOENT))
+	{
+		// Either the file already moved or the target directories don't exist yet
+		if (faccessat(FilesDescriptor, FromPath.c_str(), F_OK, 0) != 0) return false;
+		CreateBackingDirectories(FilesDescriptor, ToPath);
+		Result = renameat(FilesDescriptor, FromPath.c_str(), FilesDescriptor, ToPath.c_str());
+	}
+	if (Result != 0)
+		throw SystemError() << "Could not move backing file " << FromPath.c_str() << ": " << strerror(errno);
+	return true;
+}
+
+// Blocks are named by the hex of their hash and spread over hashed directories like backing files, but never
+// migrate between layouts.  Compressed blocks have a .z suffix.
+static void FormatBlockPath(BackingPath &Out, ContentHash const &Hash, bool Compressed)
+{
+	char Name[34] = {0};
+	for (unsigned int Digit = 0; Digit < 16; ++Digit)
+	{
+		Name[Digit] = "0123456789abcdef"[(Hash.High >> (60 - Digit * 4)) & 0xF];
+		Name[16 + Digit] = "0123456789abcdef"[(Hash.Low >> (60 - Digit * 4)) & 0xF];
+	}
+	if (Compressed) memcpy(Name + 32, ".z", 2);
+	FileLayout(2, 2).Format(Out, Name, Compressed ? 34 : 32);
+}
+
+// Bytes read, short only at the end of the file, or -errno
+static ssize_t ReadFully(int File, char *Out, size_t Length, off_t Offset)
+{
+	size_t Done = 0;
+	while (Done < Length)
+	{
+		ssize_t const Got = pread(File, Out + Done, Length - Done, Offset + static_cast<off_t>(Done));
+		if (Got < 0)
+		{
+			if (errno == EINTR) continue;
+			return -errno;
+		}
+		if (Got == 0) break;
+		Done += static_cast<size_t>(Got);
+	}
+	return static_cast<ssize_t>(Done);
+}
+
+static ssize_t WriteFully(int File, char const *Data, size_t Length, off_t Offset)
 {
-	bfs::path::iterator PathIterator = ++Path.begin();
-	return (PathIterator == Path.end());
+	size_t Done = 0;
+	while (Done < Length)
+	{
+		ssize_t const Put = pwrite(File, Data + Done, Length - Done, Offset + static_cast<off_t>(Done));
+		if (Put < 0)
+		{
+			if (errno == EINTR) continue;
+			return -errno;
+		}
+		Done += static_cast<size_t>(Put);
+	}
+	return static_cast<ssize_t>(Done);
 }
 
-bool ShareCoreInner::IsSplitPath(bfs::path const &Path) const
+// Whichever form was found last is tried first, since a share's blocks are mostly one or the other
+static int OpenBlock(int BlocksDescriptor, ContentHash const &Hash, bool &Compressed)
 {
-	bfs::path::iterator PathIterator = ++Path.begin();
-	if (PathIterator == Path.end()) return false;
-	return *PathIterator == SplitDir;
+	static std::atomic<bool> LastCompressed(false);
+	bool const First = LastCompressed;
+	for (bool const Form : {First, !First})
+	{
+		BackingPath Path;
+		FormatBlockPath(Path, Hash, Form);
+		int const Block = openat(BlocksDescriptor, Path.c_str(), O_RDONLY | O_CLOEXEC);
+		if ((Block >= 0) || (errno != ENOENT))
+		{
+			Compressed = Form;
+			if (Block >= 0) LastCompressed = Form;
+			return Block;
+		}
+	}
+	return -1;
 }
 
-ShareFile ShareCoreInner::SplitInstanceFile(Counter Index) const
+// Inflates a whole compressed block into Out, which holds BlockSize bytes
+static ssize_t InflateBlock(int Block, char *Out)
 {
-	return std::forward_as_tuple(NodeID(), NodeID(), NodeID(), String() << *Index, false, Timestamp::Type(0), SharePermissions{1, 1}, false);
+	std::vector<char> Stored(BlockSize);
+	ssize_t const Got = ReadFully(Block, Stored.data(), Stored.size(), 0);
+	if (Got < 0) return Got;
+	return DecompressBlock(Stored.data(), static_cast<size_t>(Got), Out, BlockSize);
 }
+
+static ssize_t ReadBlock(int BlocksDescriptor, ContentHash const &Hash, char *Out, size_t Length, off_t Offset)
+{
+	bool Compressed;
+	int const Block = OpenBlock(BlocksDescriptor, Hash, Compressed);
+	if (Block < 0) return -errno;
+	ssize_t Result;
+	if (!Compressed) Result = ReadFully(Block, Out, Length, Offset);
+	else
+	{
+		std::vector<char> Inflated(BlockSize);
+		Result = InflateBlock(Block, Inflated.data());
+		if (Result >= 0)
+		{
+			Result = std::max<ssize_t>(0, std::min<ssize_t>(static_cast<ssize_t>(Length), Result - Offset));
+			memcpy(Out, Inflated.data() + Offset, static_cast<size_t>(Result));
+		}
+	}
+	close(Block);
+	return Result;
+}
+
+static int UnlinkBlock(int BlocksDescriptor, ContentHash const &Hash)
+{
+	BackingPath Path;
+	FormatBlockPath(Path, Hash, false);
+	if (unlinkat(BlocksDescriptor, Path.c_str(), 0) == 0) return 0;
+	if (errno != ENOENT) return -errno;
+	FormatBlockPath(Path, Hash, true);
+	return (unlinkat(BlocksDescriptor, Path.c_str(), 0) == 0) ? 0 : -errno;
+}
+
+// Extent-mapped data as it currently stands, staged or committed, zero filled past what's stored.  The caller holds
+// the extent mutex.
+static ssize_t ReadExtent(OpenContent &Content, size_t Extent, char *Out, size_t Length, size_t Within)
+{
+	ssize_t Got = 0;
+	if ((Extent < Content.Staged.size()) && Content.Staged[Extent])
+		Got = ReadFully(Content.StagingDescriptor, Out, Length, static_cast<off_t>(Extent * BlockSize + Within));
+	else if (Extent < Content.Extents.size())
+		Got = ReadBlock(Content.BlocksDescriptor, Content.Extents[Extent], Out, Length, static_cast<off_t>(Within));
+	if (Got < 0) return Got;
+	memset(Out + Got, 0, Length - static_cast<size_t>(Got));
+	return static_cast<ssize_t>(Length);
+}
+
+// Copies an extent's current data into To at the extent's offset, leaving holes unwritten.  Bytes copied or -errno.
+static ssize_t CopyExtent(OpenContent &Content, size_t Extent, int To, size_t Length)
+{
+	auto const Offset = static_cast<off_t>(Extent * BlockSize);
+	if ((Extent < Content.Staged.size()) && Content.Staged[Extent])
+		return CopyRange(Content.StagingDescriptor, Offset, To, Offset, Length);
+	if (Extent >= Content.Extents.size()) return 0;
+	bool Compressed;
+	int const Block = OpenBlock(Content.BlocksDescriptor, Content.Extents[Extent], Compressed);
+	if (Block < 0) return -errno;
+	ssize_t Result;
+	if (!Compressed) Result = CopyRange(Block, 0, To, Offset, Length);
+	else
+	{
+		std::vector<char> Inflated(BlockSize);
+		Result = InflateBlock(Block, Inflated.data());
+		if (Result >= 0) Result = WriteFully(To, Inflated.data(), std::min(Length, static_cast<size_t>(Result)), Offset);
+	}
+	close(Block);
+	return Result;
+}
+
+static ssize_t ReadExtents(OpenContent &Content, char *Out, size_t Length, uint64_t Start)
+{
+	if (Start >= Content.Size) return 0;
+	Length = static_cast<size_t>(std::min<uint64_t>(Length, Content.Size - Start));
+	size_t Done = 0;
+	while (Done < Length)
+	{
+		uint64_t const Position = Start + Done;
+		size_t const Within = static_cast<size_t>(Position % BlockSize);
+		size_t const Want = std::min(Length - Done, BlockSize - Within);
+		ssize_t const Got = ReadExtent(Content, static_cast<size_t>(Position / BlockSize), Out + Done, Want, Within);
+		if (Got < 0) return Got;
+		Done += Want;
+	}
+	return static_cast<ssize_t>(Done);
+}
+
+// Copies the extents overlapping [Start, End) into the staging file, except ones already there or about to be
+// completely overwritten.  Parts of the staging file not holding a staged extent are always zeros.
+static int StageExtents(OpenContent &Content, uint64_t Start, uint64_t End)
+{
+	if (Content.StagingDescriptor < 0)
+	{
+		// Named per file since files stage concurrently, and unlinked straight away so a crash leaves nothing behind
+		char Filename[BackingFilenameCapacity];
+		FormatBackingFilename(Filename, Content.ID, NodeID());
+		int const Staging = openat(Content.BlocksDescriptor, Filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		if (Staging < 0) return -errno;
+		unlinkat(Content.BlocksDescriptor, Filename, 0);
+		Content.StagingDescriptor = Staging;
+	}
+	auto const Last = static_cast<size_t>((End + BlockSize - 1) / BlockSize);
+	if (Content.Staged.size() < Last) Content.Staged.resize(Last, false);
+	std::vector<char> Buffer;
+	for (auto Extent = static_cast<size_t>(Start / BlockSize); Extent < Last; ++Extent)
+	{
+		if (Content.Staged[Extent]) continue;
+		uint64_t const ExtentStart = Extent * BlockSize;
+		bool const Covered = (Start <= ExtentStart) && (End >= ExtentStart + BlockSize);
+		if (!Covered && (Extent < Content.Extents.size()))
+		{
+			auto const Length = static_cast<size_t>(std::min<uint64_t>(BlockSize, Content.Size - ExtentStart));
+			Buffer.resize(Length);
+			ssize_t Result = ReadExtent(Content, Extent, Buffer.data(), Length, 0);
+			if (Result >= 0) Result = WriteFully(Content.StagingDescriptor, Buffer.data(), Length, static_cast<off_t>(ExtentStart));
+			if (Result < 0) return static_cast<int>(Result);
+		}
+		Content.Staged[Extent] = true;
+	}
+	return 0;
+}
+
+static int TruncateExtents(OpenContent &Content, uint64_t Size)
+{
+	if (Size < Content.Size)
+	{
+		// The extent holding the new end is staged so the cut bytes don't reappear if the file grows again
+		if (Size % BlockSize != 0)
+		{
+			int const Result = StageExtents(Content, Size, Size + 1);
+			if (Result < 0) return Result;
+		}
+		auto const Count = static_cast<size_t>((Size + BlockSize - 1) / BlockSize);
+		if (Content.Extents.size() > Count) Content.Extents.resize(Count);
+		if (Content.Staged.size() > Count) Content.Staged.resize(Count);
+		if ((Content.StagingDescriptor >= 0) && (ftruncate(Content.StagingDescriptor, static_cast<off_t>(Size)) != 0)) return -errno;
+	}
+	Content.Size = Size;
+	return 0;
+}
+
+static std::atomic<bool> CanPreallocate(true);
+
+static void PreallocateAhead(OpenContent &Content, int Descriptor, uint64_t Offset, uint64_t End)
+{
+	bool const Sequential = Content.WriteEnd.exchange(End) == Offset;
+	if (!Sequential || (End < MinPreallocation) || (End <= Content.Preallocated) || !CanPreallocate) return;
+	uint64_t const Step = std::min<uint64_t>(std::max<uint64_t>(End / 4, MinPreallocation), MaxPreallocation);
+	if (fallocate(Descriptor, FALLOC_FL_KEEP_SIZE, static_cast<off_t>(End), static_cast<off_t>(Step)) == 0)
+		Content.Preallocated = End + Step;
+	else if (CopyDetail::IsUnsupported(errno)) CanPreallocate = false;
+}
+
+static void TrimPreallocation(OpenContent &Content)
+{
+	if ((Content.Descriptor < 0) || (Content.Preallocated == 0)) return;
+	struct stat Status;
+	if ((fstat(Content.Descriptor, &Status) == 0) && (static_cast<uint64_t>(Status.st_size) < Content.Preallocated))
+		fallocate(Content.Descriptor, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, Status.st_size, static_cast<off_t>(Content.Preallocated - static_cast<uint64_t>(Status.st_size)));
+	Content.Preallocated = 0;
+}
+
+static int WriteZeros(int Descriptor, uint64_t Start, uint64_t End)
+{
+	std::vector<char> const Zeros(static_cast<size_t>(std::min<uint64_t>(End - Start, BlockSize)), 0);
+	for (uint64_t Offset = Start; Offset < End; Offset += Zeros.size())
+	{
+		ssize_t const Result = WriteFully(Descriptor, Zeros.data(), static_cast<size_t>(std::min<uint64_t>(Zeros.size(), End - Offset)), static_cast<off_t>(Offset));
+		if (Result < 0) return static_cast<int>(Result);
+	}
+	return 0;
+}
+
+// Extent-mapped data has no space of its own to reserve, so allocating only moves the end.  Punched or zeroed
+// ranges are staged and punched out of the staging file, reading back as zeros; a run of zero blocks is stored once.
+static int AllocateExtents(OpenContent &Content, int Mode, uint64_t Start, uint64_t End)
+{
+	if ((Mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) != 0) return -EOPNOTSUPP;
+	// As the kernel checks them
+	if ((Mode & FALLOC_FL_PUNCH_HOLE) && (Mode & FALLOC_FL_ZERO_RANGE)) return -EINVAL;
+	if ((Mode & FALLOC_FL_PUNCH_HOLE) && !(Mode & FALLOC_FL_KEEP_SIZE)) return -EOPNOTSUPP;
+	if (Mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+	{
+		uint64_t const Stop = (Mode & FALLOC_FL_KEEP_SIZE) ? std::min(End, Content.Size) : End;
+		if (Stop > Start)
+		{
+			int Result = StageExtents(Content, Start, Stop);
+			if (Result < 0) return Result;
+			Content.Dirty = true;
+			if (fallocate(Content.StagingDescriptor, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<off_t>(Start), static_cast<off_t>(Stop - Start)) != 0)
+			{
+				if (!CopyDetail::IsUnsupported(errno)) return -errno;
+				Result = WriteZeros(Content.StagingDescriptor, Start, Stop);
+				if (Result < 0) return Result;
+			}
+		}
+	}
+	if (!(Mode & FALLOC_FL_KEEP_SIZE) && (End > Content.Size))
+	{
+		Content.Dirty = true;
+		return TruncateExtents(Content, End);
+	}
+	return 0;
+}
+
+// Batched reads of plain files go through the ring as several operations at once, if it's in use
+static ssize_t ReadBacking(OpenContent &Content, char *Out, size_t Length, uint64_t Offset, bool Batched = false)
+{
+	auto const ReadPlain = [&](int Descriptor)
+	{
+		return Batched ?
+			Content.IO.ReadBatched(Descriptor, Content.Slot, Out, Length, static_cast<off_t>(Offset)) :
+			Content.IO.Read(Descriptor, Content.Slot, Out, Length, static_cast<off_t>(Offset));
+	};
+	int const Descriptor = Content.Descriptor;
+	if (Descriptor >= 0) return ReadPlain(Descriptor);
+	std::lock_guard<std::mutex> Guard(Content.ExtentMutex);
+	// Committing may have just made the file plain
+	if (Content.Descriptor >= 0) return ReadPlain(Content.Descriptor);
+	return ReadExtents(Content, Out, Length, Offset);
+}
+
+static ssize_t WriteBacking(OpenContent &Content, char const *Data, size_t Length, uint64_t Offset)
+{
+	ssize_t Written;
+	int const Descriptor = Content.Descriptor;
+	if (Descriptor >= 0)
+	{
+		Content.Dirty = true;
+		PreallocateAhead(Content, Descriptor, Offset, Offset + Length);
+		Written = Content.IO.Write(Descriptor, Content.Slot, Data, Length, static_cast<off_t>(Offset));
+	}
+	else
+	{
+		std::lock_guard<std::mutex> Guard(Content.ExtentMutex);
+		if (Content.Descriptor >= 0)
+		{
+			Content.Dirty = true;
+			Written = Content.IO.Write(Content.Descriptor, Content.Slot, Data, Length, static_cast<off_t>(Offset));
+		}
+		else
+		{
+			if (Length == 0) return 0;
+			int const Result = StageExtents(Content, Offset, Offset + Length);
+			if (Result < 0) return Result;
+			Content.Dirty = true;
+			Written = WriteFully(Content.StagingDescriptor, Data, Length, static_cast<off_t>(Offset));
+			if (Written > 0) Content.Size = std::max<uint64_t>(Content.Size, Offset + static_cast<uint64_t>(Written));
+		}
+	}
+	Content.Cache.Invalidate(&Content, Content.CacheGeneration, Offset, Offset + Length);
+	return Written;
+}
+
+// Caller holds PendingMutex.  Held back data is dropped even if writing it fails, the error is reported once.
+static int FlushPendingLocked(OpenContent &Content)
+{
+	if (Content.Pending.empty()) return 0;
+	ssize_t const Written = WriteBacking(Content, Content.Pending.data(), Content.Pending.size(), Content.PendingOffset);
+	Content.Cache.CountFlushedWrite();
+	Content.Pending.clear();
+	Content.HasPending = false;
+	return (Written < 0) ? static_cast<int>(Written) : 0;
+}
+
+static int FlushPending(OpenContent &Content)
+{
+	if (!Content.HasPending) return 0;
+	std::lock_guard<std::mutex> Guard(Content.PendingMutex);
+	return FlushPendingLocked(Content);
+}
+
+ssize_t OpenFile::Read(char *Out, size_t Length, off_t Offset)
+{
+	int const Flushed = FlushPending(*Content);
+	if (Flushed < 0) return Flushed;
+	auto const Start = static_cast<uint64_t>(Offset);
+	FileCache &Cache = Content->Cache;
+	bool const Sequential = NextRead.exchange(Start + Length) == Start;
+	size_t Window = Sequential ? std::max(MinReadahead, std::min(Readahead * 2, MaxReadahead)) : 0;
+	Readahead = Window;
+	if (Cache.GetCapacity() == 0) return ReadBacking(*Content, Out, Length, Start);
+
+	bool End;
+	size_t const Cached = Cache.Read(Content.get(), Out, Length, Start, End);
+	Cache.CountRead(End || (Cached == Length));
+	if (End || (Cached == Length)) return static_cast<ssize_t>(Cached);
+	uint64_t const From = Start + Cached;
+	if (Window == 0)
+	{
+		ssize_t const Got = ReadBacking(*Content, Out + Cached, Length - Cached, From);
+		if (Got < 0) return (Cached > 0) ? static_cast<ssize_t>(Cached) : Got;
+		return static_cast<ssize_t>(Cached) + Got;
+	}
+
+	// Reads the rest of the request and the window after it as whole pages, keeping the window to half the pool
+	Window = std::min(Window, Cache.GetCapacity() / 2 * FileCache::PageSize);
+	uint64_t const PrefetchStart = From / FileCache::PageSize * FileCache::PageSize;
+	uint64_t const PrefetchEnd = (Start + Length + Window + FileCache::PageSize - 1) / FileCache::PageSize * FileCache::PageSize;
+	std::vector<char> Buffer(static_cast<size_t>(PrefetchEnd - PrefetchStart));
+	uint64_t const Generation = Content->CacheGeneration;
+	ssize_t const Got = ReadBacking(*Content, Buffer.data(), Buffer.size(), PrefetchStart, true);
+	if (Got < 0) return (Cached > 0) ? static_cast<ssize_t>(Cached) : Got;
+	Cache.Insert(Content.get(), Content->CacheGeneration, Generation, PrefetchStart, Buffer.data(), static_cast<size_t>(Got), static_cast<size_t>(Got) < Buffer.size());
+	Cache.CountPrefetch(static_cast<size_t>(Got));
+	auto const Skip = static_cast<size_t>(From - PrefetchStart);
+	size_t const Count = (static_cast<size_t>(Got) > Skip) ? std::min(Length - Cached, static_cast<size_t>(Got) - Skip) : 0;
+	memcpy(Out + Cached, Buffer.data() + Skip, Count);
+	return static_cast<ssize_t>(Cached + Count);
+}
+
+ssize_t OpenFile::Write(char const *Data, size_t Length, off_t Offset)
+{
+	Assert(Writable);
+	auto const Start = static_cast<uint64_t>(Offset);
+	if ((Length > 0) && (Length < SmallWrite))
+	{
+		std::lock_guard<std::mutex> Guard(Content->PendingMutex);
+		auto &Pending = Content->Pending;
+		if (Pending.empty() || (Start != Content->PendingOffset + Pending.size()) || (Pending.size() + Length > WriteBufferSize))
+		{
+			int const Result = FlushPendingLocked(*Content);
+			if (Result < 0) return Result;
+			Pending.reserve(WriteBufferSize);
+			Content->PendingOffset = Start;
+		}
+		Pending.insert(Pending.end(), Data, Data + Length);
+		Content->HasPending = true;
+		Content->Cache.Invalidate(Content.get(), Content->CacheGeneration, Start, Start + Length);
+		Content->Cache.CountBufferedWrite();
+		return static_cast<ssize_t>(Length);
+	}
+	int const Result = FlushPending(*Content);
+	if (Result < 0) return Result;
+	return WriteBacking(*Content, Data, Length, Start);
+}
+
+int OpenFile::Truncate(off_t Size)
+{
+	Assert(Writable);
+	int Result = FlushPending(*Content);
+	if (Result < 0) return Result;
+	// Truncating releases any space reserved past the end
+	Content->Preallocated = 0;
+	int const Descriptor = Content->Descriptor;
+	if (Descriptor >= 0)
+	{
+		Content->Dirty = true;
+		Result = (ftruncate(Descriptor, Size) == 0) ? 0 : -errno;
+	}
+	else
+	{
+		std::lock_guard<std::mutex> Guard(Content->ExtentMutex);
+		Content->Dirty = true;
+		if (Content->Descriptor >= 0) Result = (ftruncate(Content->Descriptor, Size) == 0) ? 0 : -errno;
+		else Result = TruncateExtents(*Content, static_cast<uint64_t>(Size));
+	}
+	// Growing or shrinking moves the end of the file, so every page goes
+	Content->Cache.Invalidate(Content.get(), Content->CacheGeneration, 0, UINT64_MAX);
+	return Result;
+}
+
+int OpenFile::Flush(void) { return FlushPending(*Content); }
+
+int OpenFile::Allocate(int Mode, off_t Offset, off_t Length)
+{
+	Assert(Writable);
+	if ((Offset < 0) || (Length <= 0)) return -EINVAL;
+	int Result = FlushPending(*Content);
+	if (Result < 0) return Result;
+	int const Descriptor = Content->Descriptor;
+	if (Descriptor >= 0)
+	{
+		Content->Dirty = true;
+		Result = (fallocate(Descriptor, Mode, Offset, Length) == 0) ? 0 : -errno;
+	}
+	else
+	{
+		std::lock_guard<std::mutex> Guard(Content->ExtentMutex);
+		if (Content->Descriptor >= 0)
+		{
+			Content->Dirty = true;
+			Result = (fallocate(Content->Descriptor, Mode, Offset, Length) == 0) ? 0 : -errno;
+		}
+		else Result = AllocateExtents(*Content, Mode, static_cast<uint64_t>(Offset), static_cast<uint64_t>(Offset + Length));
+	}
+	// Collapsing or inserting ranges shifts everything after them
+	Content->Cache.Invalidate(Content.get(), Content->CacheGeneration, static_cast<uint64_t>(Offset), UINT64_MAX);
+	return Result;
+}
+
+off_t OpenFile::Seek(off_t Offset, int Whence)
+{
+	Assert((Whence == SEEK_DATA) || (Whence == SEEK_HOLE));
+	if (Offset < 0) return -ENXIO;
+	int const Flushed = FlushPending(*Content);
+	if (Flushed < 0) return Flushed;
+	// Only pread and pwrite use the descriptor, so moving its position is harmless
+	int const Descriptor = Content->Descriptor;
+	if (Descriptor >= 0)
+	{
+		off_t const Found = lseek(Descriptor, Offset, Whence);
+		return (Found < 0) ? -errno : Found;
+	}
+	std::lock_guard<std::mutex> Guard(Content->ExtentMutex);
+	if (Content->Descriptor >= 0)
+	{
+		off_t const Found = lseek(Content->Descriptor, Offset, Whence);
+		return (Found < 0) ? -errno : Found;
+	}
+	// Every extent holds data
+	if (static_cast<uint64_t>(Offset) >= Content->Size) return -ENXIO;
+	return (Whence == SEEK_DATA) ? Offset : static_cast<off_t>(Content->Size);
+}
+
+int OpenFile::Sync(bool DataOnly)
+{
+	int const Flushed = FlushPending(*Content);
+	if (Flushed < 0) return Flushed;
+	// Staged extents only become durable when committed
+	int const Descriptor = Content->Descriptor;
+	if (Descriptor < 0) return 0;
+	if ((DataOnly ? fdatasync(Descriptor) : fsync(Descriptor)) != 0) return -errno;
+	return 0;
+}
+
+int OpenFile::Stat(struct stat *Out) const
+{
+	int const Flushed = FlushPending(*Content);
+	if (Flushed < 0) return Flushed;
+	int const Descriptor = Content->Descriptor;
+	if (Descriptor >= 0) return (fstat(Descriptor, Out) == 0) ? 0 : -errno;
+	std::lock_guard<std::mutex> Guard(Content->ExtentMutex);
+	if (Content->Descriptor >= 0) return (fstat(Content->Descriptor, Out) == 0) ? 0 : -errno;
+	StatExtents(Content->Size, Out);
+	return 0;
+}
+
+ssize_t OpenFile::CopyTo(OpenFile &To, off_t FromOffset, off_t ToOffset, size_t Length)
+{
+	Assert(To.Writable);
+	int Flushed = FlushPending(*Content);
+	if (Flushed >= 0) Flushed = FlushPending(*To.Content);
+	if (Flushed < 0) return Flushed;
+	int const From = Content->Descriptor, Target = To.Content->Descriptor;
+	if ((From >= 0) && (Target >= 0))
+	{
+		To.Content->Dirty = true;
+		ssize_t const Copied = CopyRange(From, FromOffset, Target, ToOffset, Length);
+		To.Content->Cache.Invalidate(To.Content.get(), To.Content->CacheGeneration, static_cast<uint64_t>(ToOffset), static_cast<uint64_t>(ToOffset) + Length);
+		return Copied;
+	}
+	// Extent-mapped data is stitched together, so it goes through a buffer
+	std::vector<char> Buffer(std::min<size_t>(Length, 1024 * 1024));
+	size_t Done = 0;
+	while (Done < Length)
+	{
+		ssize_t const Got = Read(Buffer.data(), std::min(Buffer.size(), Length - Done), FromOffset + static_cast<off_t>(Done));
+		if (Got < 0) return Got;
+		if (Got == 0) break;
+		ssize_t const Put = To.Write(Buffer.data(), static_cast<size_t>(Got), ToOffset + static_cast<off_t>(Done));
+		if (Put < 0) return Put;
+		Done += static_cast<size_t>(Got);
+	}
+	return static_cast<ssize_t>(Done);
+}
+
+bool OpenFile::HasStagedExtents(void) const { return (Content->Descriptor < 0) && (Content->Dirty || Content->HasPending); }
+
+void ShareCoreInner::LoadContent(OpenContent &Content)
+{
+	// A plain file wins over chunks, it's only left beside them by a crash while open for writing
+	BackingPath Path;
+	LocateBacking(Path, Content.ID, Content.Content);
+	int const Descriptor = openat(FilesDescriptor, Path.c_str(), O_RDWR | O_CLOEXEC);
+	if (Descriptor >= 0)
+	{
+		Content.Slot = IO->Register(Descriptor);
+		Content.Descriptor = Descriptor;
+		return;
+	}
+	if (errno != ENOENT)
+		throw SystemError() << "Could not open backing file " << Path.c_str() << ": " << strerror(errno);
+	Database->GetChunks.Execute(Content.ID, Content.Content, [&Content](ContentHash &&Hash) { Content.Extents.push_back(Hash); });
+	if (Content.Extents.empty())
+		throw SystemError() << "File " << *Content.ID.Instance << " " << *Content.ID.Index << " has no backing data.";
+	Content.Size = Content.CommittedSize = *Database->GetChunkedSize(Content.ID, Content.Content);
+}
+
+// Stores staged extents as a new version of the extent map under a new change.  Unchanged extents reference the
+// previous version's blocks, and the previous version is retired to the change so it's released with it.  An empty
+// file, or a hash collision, makes the new version a plain file instead.
+void ShareCoreInner::CommitExtents(OpenContent &Content)
+{
+	std::lock_guard<std::mutex> Guard(Content.ExtentMutex);
+	if ((Content.Descriptor >= 0) || !Content.Dirty || Content.Deleted) return;
+	auto File = Database->GetFileByID(Content.ID);
+	if (!File) return;
+	NodeID const PreviousChange = std::get<1>(*File);
+
+	Database->Begin();
+	UUID ChangeIndex = *Database->GetChangeIndex();
+	Database->IncrementChangeIndex();
+	Database->End();
+	NodeID const NewContent(HostInstanceIndex, ChangeIndex);
+
+	std::vector<ContentHash> Extents, Created;
+	std::vector<char> Buffer(BlockSize), Scratch(BlockSize);
+	bool Stored = Content.Size > 0;
+	Bypass.Reset();
+	Database->Begin();
+	try
+	{
+		for (uint64_t Offset = 0; Stored && (Offset < Content.Size); Offset += BlockSize)
+		{
+			auto const Extent = static_cast<size_t>(Offset / BlockSize);
+			auto const Length = static_cast<size_t>(std::min<uint64_t>(BlockSize, Content.Size - Offset));
+			bool const Staged = (Extent < Content.Staged.size()) && Content.Staged[Extent];
+			ContentHash Hash;
+			if (!Staged && (Extent < Content.Extents.size()) && (std::min<uint64_t>(BlockSize, Content.CommittedSize - Offset) == Length))
+			{
+				Hash = Content.Extents[Extent];
+				Database->ReferenceBlock(Hash);
+			}
+			else
+			{
+				ssize_t const Got = ReadExtent(Content, Extent, Buffer.data(), Length, 0);
+				if (Got < 0)
+					throw SystemError() << "Could not read staged data for " << *Content.ID.Instance << " " << *Content.ID.Index << ": " << strerror(static_cast<int>(-Got));
+				Hash = HashContent(Buffer.data(), Length);
+				if (!StoreBlock(Hash, Buffer.data(), Length, Scratch, Created))
+				{
+					Log->Warn() << "Block hash collision storing file " << *Content.ID.Instance << " " << *Content.ID.Index << ", leaving it as a plain file.";
+					Stored = false;
+					break;
+				}
+			}
+			Database->AddChunk(Content.ID, NewContent, Offset, Hash, Length);
+			Extents.push_back(Hash);
+		}
+	}
+	catch (...)
+	{
+		DiscardBlocks(Created);
+		throw;
+	}
+
+	int Plain = -1;
+	if (!Stored)
+	{
+		DiscardBlocks(Created);
+		BackingPath Path;
+		char Filename[BackingFilenameCapacity];
+		TargetLayout.Format(Path, Filename, FormatBackingFilename(Filename, Content.ID, NewContent));
+		Plain = CreateBackingFile(FilesDescriptor, Path);
+		ssize_t Result = (ftruncate(Plain, static_cast<off_t>(Content.Size)) == 0) ? 0 : -errno;
+		for (uint64_t Offset = 0; (Result >= 0) && (Offset < Content.Size); Offset += BlockSize)
+		{
+			auto const Length = static_cast<size_t>(std::min<uint64_t>(BlockSize, Content.Size - Offset));
+			Result = CopyExtent(Content, static_cast<size_t>(Offset / BlockSize), Plain, Length);
+		}
+		if (Result < 0)
+		{
+			close(Plain);
+			unlinkat(FilesDescriptor, Path.c_str(), 0);
+			throw SystemError() << "Could not write backing file " << Path.c_str() << ": " << strerror(static_cast<int>(-Result));
+		}
+		Database->Begin();
+	}
+	Database->CommitContent(NewContent, NewContent, Content.ID);
+	Database->CreateChange(NewContent, PreviousChange, static_cast<Timestamp::Type>(std::time(nullptr)));
+	AdvanceVersions(Content.ID, NewContent);
+	Database->RetireContent(Content.ID, Content.Content, NewContent);
+	Database->End();
+	Logged(*Log, Debug) << "Committed file " << *Content.ID.Instance << " " << *Content.ID.Index << " / " <<
+		*PreviousChange.Instance << " " << *PreviousChange.Index << " -> " << HostInstanceIndex << " " << *ChangeIndex;
+
+	Content.Content = NewContent;
+	Content.Extents = std::move(Extents);
+	Content.Staged.clear();
+	Content.CommittedSize = Content.Size;
+	if (Content.StagingDescriptor >= 0) close(Content.StagingDescriptor);
+	Content.StagingDescriptor = -1;
+	Content.Dirty = false;
+	if (Plain >= 0)
+	{
+		Content.Slot = IO->Register(Plain);
+		Content.Descriptor = Plain;
+	}
+}
+
+// Makes a newly created file reference the same blocks as a file in the block store, if the source has nothing
+// staged
+bool ShareCoreInner::ShareExtents(OpenContent &Source, SharePath const &To)
+{
+	std::lock_guard<std::mutex> Guard(Source.ExtentMutex);
+	if ((Source.Descriptor >= 0) || Source.Dirty) return false;
+	auto Target = GetInternal(To);
+	Assert(Target);
+	auto Content = Database->GetContent(Target->ID());
+	Assert(Content);
+	Database->Begin();
+	for (size_t Extent = 0; Extent < Source.Extents.size(); ++Extent)
+	{
+		uint64_t const Offset = Extent * BlockSize;
+		Database->ReferenceBlock(Source.Extents[Extent]);
+		Database->AddChunk(Target->ID(), *Content, Offset, Source.Extents[Extent], std::min<uint64_t>(BlockSize, Source.Size - Offset));
+	}
+	Database->End();
+	UnlinkBacking(Target->ID(), *Content);
+	return true;
+}
+
+// Writes a block file, compressed if that's worth it when there's a Compressor.  Incoming is the temporary name it's
+// written under before being renamed in, so a block is never seen partially written; no other writer may be using
+// it at the same time.  The size stored on disk.
+static size_t WriteBlockFile(int BlocksDescriptor, char const *Incoming, ContentHash const &Hash, char const *Data, size_t Length,
+	BlockCompressor *Compressor, CompressionBypass &Bypass, std::vector<char> &Compressed)
+{
+	size_t Size = 0;
+	if (Compressor && Bypass.ShouldTry())
+	{
+		Size = Compressor->Compress(Data, Length, Compressed);
+		Bypass.Record(Size > 0);
+	}
+	bool const IsCompressed = Size > 0;
+	if (IsCompressed) Data = Compressed.data();
+	else Size = Length;
+
+	int const File = openat(BlocksDescriptor, Incoming, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (File < 0) throw SystemError() << "Could not create block: " << strerror(errno);
+	ssize_t const Result = WriteFully(File, Data, Size, 0);
+	close(File);
+	if (Result < 0) throw SystemError() << "Could not write block: " << strerror(static_cast<int>(-Result));
+	BackingPath Path;
+	FormatBlockPath(Path, Hash, IsCompressed);
+	int Moved = renameat(BlocksDescriptor, Incoming, BlocksDescriptor, Path.c_str());
+	if ((Moved != 0) && (errno == ENOENT))
+	{
+		CreateBackingDirectories(BlocksDescriptor, Path);
+		Moved = renameat(BlocksDescriptor, Incoming, BlocksDescriptor, Path.c_str());
+	}
+	if (Moved != 0) throw SystemError() << "Could not store block " << Path.c_str() << ": " << strerror(errno);
+	return Size;
+}
+
+static bool BlockExists(int BlocksDescriptor, ContentHash const &Hash)
+{
+	bool Compressed;
+	int const Block = OpenBlock(BlocksDescriptor, Hash, Compressed);
+	if (Block < 0) return false;
+	close(Block);
+	return true;
+}
+
+// A chunk of a file being ingested and the block file holding it
+struct IngestedBlock
+{
+	ContentHash Hash;
+	size_t Length;
+	size_t Stored; // On disk
+	bool Created; // By this ingestion rather than found already there
+};
+
+// Reads, hashes and writes the Size bytes of File to the block store without touching the database, so it runs
+// without the core lock.  Blocks already in the store are compared byte for byte rather than written again.  False
+// on a hash collision.  Blocks has every block stored so far, whether it returns or throws.
+static bool StoreIngestedBlocks(int BlocksDescriptor, int File, uint64_t Size, bool Compressing, std::vector<IngestedBlock> &Blocks)
+{
+	// Other ingestions may be writing at the same time
+	static std::atomic<uint64_t> Writers(0);
+	std::string const Incoming = String() << "incoming." << ++Writers;
+	std::unique_ptr<BlockCompressor> Compressor(Compressing ? new BlockCompressor : nullptr);
+	CompressionBypass Bypass;
+	std::vector<char> Buffer(BlockSize), Scratch(BlockSize), Compressed;
+	for (uint64_t Offset = 0; Offset < Size; Offset += BlockSize)
+	{
+		auto const Length = static_cast<size_t>(std::min<uint64_t>(BlockSize, Size - Offset));
+		ssize_t const Got = ReadFully(File, Buffer.data(), Length, static_cast<off_t>(Offset));
+		if ((Got < 0) || (static_cast<size_t>(Got) != Length)) throw SystemError() << "Could not read backing file to store it as blocks.";
+		IngestedBlock Block{HashContent(Buffer.data(), Length), Length, 0, false};
+		bool IsCompressed;
+		int const Existing = OpenBlock(BlocksDescriptor, Block.Hash, IsCompressed);
+		if (Existing >= 0)
+		{
+			struct stat Status;
+			ssize_t const Stored = (fstat(Existing, &Status) != 0) ? -errno :
+				IsCompressed ? InflateBlock(Existing, Scratch.data()) : ReadFully(Existing, Scratch.data(), BlockSize, 0);
+			close(Existing);
+			if ((Stored < 0) || (static_cast<size_t>(Stored) != Length) || (memcmp(Scratch.data(), Buffer.data(), Length) != 0)) return false;
+			Block.Stored = static_cast<size_t>(Status.st_size);
+		}
+		else if (errno != ENOENT) throw SystemError() << "Could not open block: " << strerror(errno);
+		else
+		{
+			Block.Stored = WriteBlockFile(BlocksDescriptor, Incoming.c_str(), Block.Hash, Buffer.data(), Length, Compressor.get(), Bypass, Compressed);
+			Block.Created = true;
+		}
+		Blocks.push_back(Block);
+	}
+	return true;
+}
+
+// Caller holds the core lock
+void ShareCoreInner::QueueIngestion(OpenContent &Content)
+{
+	auto const Key = std::make_pair(*Content.ID.Instance, *Content.ID.Index);
+	uint64_t const Attempt = ++IngestAttempts;
+	Ingesting[Key] = Attempt;
+	IngestQueue.push_back(IngestJob{Key, Attempt, Content.ID, Content.Content});
+	{
+		std::lock_guard<std::mutex> Guard(BackgroundMutex);
+		IngestQueued = true;
+	}
+	BackgroundWake.notify_all();
+}
+
+// Caller holds the core lock.  Takes the next queued file that's still waiting and not open, and opens its backing
+// file.  False once the queue is empty.
+bool ShareCoreInner::TakeIngestion(IngestJob &Job, int &File)
+{
+	while (!IngestQueue.empty())
+	{
+		Job = IngestQueue.front();
+		IngestQueue.pop_front();
+		auto const Found = Ingesting.find(Job.Key);
+		if ((Found == Ingesting.end()) || (Found->second != Job.Attempt) || (OpenContents.count(Job.Key) > 0)) continue;
+		BackingPath Path;
+		LocateBacking(Path, Job.ID, Job.Content);
+		File = openat(FilesDescriptor, Path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (File < 0)
+		{
+			Ingesting.erase(Found);
+			throw SystemError() << "Could not open backing file " << Path.c_str() << " to store it as blocks: " << strerror(errno);
+		}
+		return true;
+	}
+	return false;
+}
+
+// Caller holds the core lock.  False if the attempt was abandoned, or the file was opened since it was taken and
+// waits for its release instead.  Otherwise the file is no longer waiting.
+bool ShareCoreInner::EndIngestion(IngestJob const &Job)
+{
+	auto const Found = Ingesting.find(Job.Key);
+	if ((Found == Ingesting.end()) || (Found->second != Job.Attempt) || (OpenContents.count(Job.Key) > 0)) return false;
+	Ingesting.erase(Found);
+	return true;
+}
+
+// Blocks an ingestion wrote are left unreferenced for collection rather than removed, since another ingestion may
+// have found them in the meantime
+void ShareCoreInner::DiscardIngested(std::vector<IngestedBlock> const &Blocks)
+{
+	Database->Begin();
+	for (auto const &Block : Blocks)
+		if (Block.Created && !Database->GetBlockReferences(Block.Hash))
+		{
+			Database->CreateBlock(Block.Hash, Block.Stored);
+			Database->DereferenceBlock(Block.Hash);
+		}
+	Database->End();
+}
+
+// Stores a taken file as blocks, closing File.  The caller holds the core lock; with Unlock, which must own it, it's
+// dropped while blocks are read, hashed and written.  The chunks then replace the plain file only if nothing opened,
+// wrote or removed the file in between.
+void ShareCoreInner::Ingest(IngestJob const &Job, int File, std::unique_lock<std::mutex> *Unlock)
+{
+	Cleanup Close([File]() { close(File); });
+	struct stat Status;
+	if (fstat(File, &Status) != 0)
+	{
+		EndIngestion(Job);
+		throw SystemError() << "Could not stat backing file for " << *Job.ID.Instance << " " << *Job.ID.Index << ": " << strerror(errno);
+	}
+	auto const Size = static_cast<uint64_t>(Status.st_size);
+	if (Size == 0)
+	{
+		EndIngestion(Job);
+		return;
+	}
+
+	std::vector<IngestedBlock> Blocks;
+	bool Stored = false;
+	bool const Compressing = Compress;
+	try
+	{
+		if (Unlock) Unlock->unlock();
+		Cleanup Relock([Unlock]() { if (Unlock) Unlock->lock(); });
+		Stored = StoreIngestedBlocks(BlocksDescriptor, File, Size, Compressing, Blocks);
+	}
+	catch (...)
+	{
+		EndIngestion(Job);
+		DiscardIngested(Blocks);
+		throw;
+	}
+
+	if (!EndIngestion(Job))
+	{
+		DiscardIngested(Blocks);
+		return;
+	}
+	if (!Stored)
+	{
+		// On a collision the file just stays plain
+		Log->Warn() << "Block hash collision storing file " << *Job.ID.Instance << " " << *Job.ID.Index << ", leaving it as a plain file.";
+		DiscardIngested(Blocks);
+		return;
+	}
+	Database->Begin();
+	try
+	{
+		for (size_t Index = 0; Index < Blocks.size(); ++Index)
+		{
+			auto const &Block = Blocks[Index];
+			if (Database->GetBlockReferences(Block.Hash)) Database->ReferenceBlock(Block.Hash);
+			else if (BlockExists(BlocksDescriptor, Block.Hash)) Database->CreateBlock(Block.Hash, Block.Stored);
+			else
+			{
+				// Collected while the lock was dropped, since it had no references then
+				Database->Abort();
+				DiscardIngested(Blocks);
+				return;
+			}
+			Database->AddChunk(Job.ID, Job.Content, Index * BlockSize, Block.Hash, Block.Length);
+		}
+	}
+	catch (...)
+	{
+		Database->Abort();
+		DiscardIngested(Blocks);
+		throw;
+	}
+	Database->End();
+	UnlinkBacking(Job.ID, Job.Content);
+}
+
+size_t ShareCoreInner::IngestReleased(unsigned int BatchSize)
+{
+	LatencyTimer Timer(Latency, CoreOperation::IngestReleased);
+	size_t Count = 0;
+	IngestJob Job;
+	int File;
+	while ((Count < BatchSize) && TakeIngestion(Job, File))
+	{
+		Ingest(Job, File, nullptr);
+		++Count;
+	}
+	return Count;
+}
+
+void ShareCoreInner::StartIngestion(void)
+{
+	Assert(!Ingester.joinable());
+	Ingester = std::thread([this]()
+	{
+		auto const Stopping = [this]()
+		{
+			std::lock_guard<std::mutex> Guard(BackgroundMutex);
+			return StopBackground;
+		};
+		while (true)
+		{
+			try
+			{
+				std::unique_lock<std::mutex> Lock(Mutex);
+				IngestJob Job;
+				int File;
+				while (!Stopping() && TakeIngestion(Job, File)) Ingest(Job, File, &Lock);
+			}
+			catch (SystemError const &Error)
+			{
+				std::lock_guard<std::mutex> Guard(Mutex);
+				Log->Error() << "Could not store a released file as blocks, it stays plain: " << Error;
+			}
+			std::unique_lock<std::mutex> Lock(BackgroundMutex);
+			BackgroundWake.wait(Lock, [this]() { return StopBackground || IngestQueued; });
+			if (StopBackground) return;
+			IngestQueued = false;
+		}
+	});
+}
+
+void ShareCoreInner::DereferenceChunks(NodeID const &ID, NodeID const &Content)
+{
+	std::vector<ContentHash> Chunks;
+	Database->GetChunks.Execute(ID, Content, [&Chunks](ContentHash &&Hash) { Chunks.push_back(Hash); });
+	if (Chunks.empty()) return;
+	Database->DeleteChunks(ID, Content);
+	for (auto const &Hash : Chunks) Database->DereferenceBlock(Hash);
+}
+
+// References the block if it's already stored, otherwise writes it and adds it to Created.  Matching hashes are
+// compared byte for byte; false means a collision, and nothing was stored.
+bool ShareCoreInner::StoreBlock(ContentHash const &Hash, char const *Data, size_t Length, std::vector<char> &Scratch, std::vector<ContentHash> &Created)
+{
+	if (Database->GetBlockReferences(Hash))
+	{
+		ssize_t const Stored = ReadBlock(BlocksDescriptor, Hash, Scratch.data(), BlockSize, 0);
+		if ((Stored < 0) || (static_cast<size_t>(Stored) != Length) || (memcmp(Scratch.data(), Data, Length) != 0)) return false;
+		Database->ReferenceBlock(Hash);
+		return true;
+	}
+	size_t const Stored = WriteBlock(Hash, Data, Length);
+	Created.push_back(Hash);
+	Database->CreateBlock(Hash, Stored);
+	return true;
+}
+
+// Rolls back the open transaction along with the block files it created
+void ShareCoreInner::DiscardBlocks(std::vector<ContentHash> const &Created)
+{
+	Database->Abort();
+	for (auto const &Hash : Created) UnlinkBlock(BlocksDescriptor, Hash);
+}
+
+// The size stored on disk.  Storing holds the core lock, so one temporary name is enough.
+size_t ShareCoreInner::WriteBlock(ContentHash const &Hash, char const *Data, size_t Length)
+	{ return WriteBlockFile(BlocksDescriptor, "incoming", Hash, Data, Length, Compress ? &Compressor : nullptr, Bypass, CompressedBlock); }
+
+size_t ShareCoreInner::CollectBlocks(unsigned int BatchSize)
+{
+	LatencyTimer Timer(Latency, CoreOperation::CollectBlocks);
+	std::vector<ContentHash> Garbage;
+	Database->Begin();
+	Database->GetUnreferencedBlocks.Execute(BatchSize, [&Garbage](ContentHash &&Hash) { Garbage.push_back(Hash); });
+	for (auto const &Hash : Garbage) Database->DeleteBlock(Hash);
+	Database->End();
+	// Rows go first so a crash in between leaves an orphaned block file rather than a row without data
+	for (auto const &Hash : Garbage)
+	{
+		int const Result = UnlinkBlock(BlocksDescriptor, Hash);
+		if ((Result < 0) && (Result != -ENOENT))
+		{
+			BackingPath Path;
+			FormatBlockPath(Path, Hash, false);
+			throw SystemError() << "Could not remove block " << Path.c_str() << ": " << strerror(-Result);
+		}
+	}
+	return Garbage.size();
+}
+
+BlockStoreStats ShareCoreInner::GetBlockStats(void)
+	{ return {*Database->GetLogicalBytes(), *Database->GetStoredBytes(), *Database->GetBlockCount()}; }
+
+FileCacheStats ShareCoreInner::GetFileCacheStats(void) const { return Cache.GetStats(); }
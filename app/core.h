@@ -4,6 +4,17 @@
 #include "database.h"
 #include "transaction.h"
 #include "moat.h"
+#include "hash.h"
+#include "ioengine.h"
+#include "filecache.h"
+#include "compress.h"
+#include "latency.h"
+
+#include <algorithm>
+#include <map>
+#include <deque>
+#include <atomic>
+#include <condition_variable>
 
 // TODO
 // Test fuse different user access, group permissions
@@ -59,6 +70,67 @@ struct NodeID
 	UUID Index;
 };
 
+// Per-node record of the latest change index seen from each instance.  Changes from one instance are numbered
+// monotonically, so one version precedes another iff none of its entries are greater.
+enum class VersionOrder
+{
+	Equal,
+	Before,
+	After,
+	Concurrent
+};
+
+struct VersionVector
+{
+	typedef std::pair<Counter::Type, UUID::Type> Entry;
+
+	UUID Get(Counter const &Instance) const
+	{
+		auto Found = Find(*Instance);
+		if ((Found == Entries.end()) || (Found->first != *Instance)) return UUID::Type(0);
+		return Found->second;
+	}
+
+	void Advance(NodeID const &Change)
+	{
+		auto Found = Find(*Change.Instance);
+		if ((Found == Entries.end()) || (Found->first != *Change.Instance))
+			Entries.insert(Found, Entry(*Change.Instance, *Change.Index));
+		else if (Found->second < *Change.Index) Found->second = *Change.Index;
+	}
+
+	VersionOrder Compare(VersionVector const &Other) const
+	{
+		bool Less = false, Greater = false;
+		auto Left = Entries.begin(), Right = Other.Entries.begin();
+		while ((Left != Entries.end()) || (Right != Other.Entries.end()))
+		{
+			if ((Right == Other.Entries.end()) || ((Left != Entries.end()) && (Left->first < Right->first)))
+				{ if (Left->second != 0) Greater = true; ++Left; }
+			else if ((Left == Entries.end()) || (Right->first < Left->first))
+				{ if (Right->second != 0) Less = true; ++Right; }
+			else
+			{
+				if (Left->second < Right->second) Less = true;
+				else if (Left->second > Right->second) Greater = true;
+				++Left; ++Right;
+			}
+			if (Less && Greater) return VersionOrder::Concurrent;
+		}
+		if (Less) return VersionOrder::Before;
+		if (Greater) return VersionOrder::After;
+		return VersionOrder::Equal;
+	}
+
+	std::vector<Entry> Entries;
+
+	private:
+		std::vector<Entry>::iterator Find(Counter::Type Instance)
+			{ return std::lower_bound(Entries.begin(), Entries.end(), Entry(Instance, 0)); }
+		std::vector<Entry>::const_iterator Find(Counter::Type Instance) const
+			{ return std::lower_bound(Entries.begin(), Entries.end(), Entry(Instance, 0)); }
+};
+
 #include "shared.h"
 struct SharePermissions
 {
@@ -70,6 +142,7 @@ typedef std::tuple<NodeID, NodeID, NodeID, std::string, bool, Timestamp, SharePe
 struct ShareFile : ShareFileTuple
 {
 	using ShareFileTuple::ShareFileTuple;
+	ShareFile(ShareFileTuple const &Other) : ShareFileTuple(Other) {}
 
 	inline NodeID const &ID(void) const { return std::get<0>(*this); }
 	inline NodeID const &Change(void) const { return std::get<1>(*this); }
@@ -86,65 +159,254 @@ struct ShareFile : ShareFileTuple
 
 typedef ActionResult<ShareFile> GetResult;
 
-inline size_t ProtocolGetSize(ShareFile const &Argument) { return sizeof(Argument); }
-inline void ProtocolWrite(uint8_t *&Out, ShareFile const &Argument)
+// A share path as FUSE passes it ("/a/b"), split into components once.  The components point into the source
+// string, which must outlive the SharePath.
+struct SharePath
+{
+	SharePath(char const *Path) { Parse(Path, strlen(Path)); }
+	SharePath(std::string const &Path) { Parse(Path.data(), Path.size()); }
+	SharePath(bfs::path const &Path) { Parse(Path.native().data(), Path.native().size()); }
+
+	size_t Size(void) const { return Count; }
+	bool IsRoot(void) const { return Count == 0; }
+	StringView operator [](size_t Index) const
+	{
+		Assert(Index < Count);
+		return (Index < InlineDepth) ? Inline[Index] : Overflow[Index - InlineDepth];
+	}
+	StringView Filename(void) const { return IsRoot() ? StringView() : (*this)[Count - 1]; }
+	SharePath Parent(void) const
+	{
+		SharePath Out(*this);
+		if (Out.Count > 0) --Out.Count;
+		return Out;
+	}
+
+	private:
+		void Parse(char const *Path, size_t Length)
+		{
+			Assert(Length > 0);
+			Assert(Path[0] == '/');
+			Count = 0;
+			size_t Start = 1;
+			for (size_t Index = 1; Index <= Length; ++Index)
+			{
+				if ((Index < Length) && (Path[Index] != '/')) continue;
+				if (Index > Start)
+				{
+					StringView const Component(Path + Start, Index - Start);
+					if (Count < InlineDepth) Inline[Count] = Component;
+					else Overflow.push_back(Component);
+					++Count;
+				}
+				Start = Index + 1;
+			}
+		}
+
+		// Deeper paths spill to the heap
+		static constexpr size_t InlineDepth = 32;
+		StringView Inline[InlineDepth];
+		std::vector<StringView> Overflow;
+		size_t Count;
+};
+
+// NodeIDs are written as their two integers, in full or, in compact fields, as varints
+inline size_t ProtocolGetSize(NodeID const &Argument) { return sizeof(Argument.Instance) + sizeof(Argument.Index); }
+inline void ProtocolWrite(uint8_t *&Out, NodeID const &Argument)
+{
+	ProtocolWrite(Out, Argument.Instance);
+	ProtocolWrite(Out, Argument.Index);
+}
+template <typename LogType> bool ProtocolRead(LogType &Log, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, Protocol::BufferType const &Buffer, size_t &Offset, NodeID &Data)
+{
+	return ProtocolRead(Log, VersionID, MessageID, Buffer, Offset, Data.Instance) &&
+		ProtocolRead(Log, VersionID, MessageID, Buffer, Offset, Data.Index);
+}
+template <typename LogType> bool ProtocolView(LogType &Log, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, Protocol::ViewBody const &Body, size_t &Offset, NodeID &Data)
+{
+	return ProtocolView(Log, VersionID, MessageID, Body, Offset, Data.Instance) &&
+		ProtocolView(Log, VersionID, MessageID, Body, Offset, Data.Index);
+}
+
+inline size_t ProtocolGetSize(Protocol::Compact<NodeID> const &Argument)
+	{ return Protocol::VarintSize(*Argument.Instance) + Protocol::VarintSize(*Argument.Index); }
+inline void ProtocolWrite(uint8_t *&Out, Protocol::Compact<NodeID> const &Argument)
 {
-	memcpy(Out, &Argument, sizeof(Argument));
-	Out += sizeof(Argument);
+	Protocol::WriteVarint(Out, *Argument.Instance);
+	Protocol::WriteVarint(Out, *Argument.Index);
 }
-template <typename LogType> bool ProtocolRead(LogType &Log, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, Protocol::BufferType const &Buffer, Protocol::SizeType &Offset, ShareFile &Data)
+template <typename LogType> bool ProtocolReadCompactNode(LogType &Log, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, uint8_t const *Buffer, size_t Size, size_t &Offset, NodeID &Data)
 {
-	if (Buffer.size() < StrictCast(Offset, size_t) + sizeof(Data))
+	return ProtocolReadVarint(Log, VersionID, MessageID, Buffer, Size, Offset, *Data.Instance) &&
+		ProtocolReadVarint(Log, VersionID, MessageID, Buffer, Size, Offset, *Data.Index);
+}
+template <typename LogType> bool ProtocolRead(LogType &Log, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, Protocol::BufferType const &Buffer, size_t &Offset, Protocol::Compact<NodeID> &Data)
+	{ return ProtocolReadCompactNode(Log, VersionID, MessageID, Buffer.data(), Buffer.size(), Offset, Data); }
+template <typename LogType> bool ProtocolView(LogType &Log, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, Protocol::ViewBody const &Body, size_t &Offset, Protocol::Compact<NodeID> &Data)
+	{ return ProtocolReadCompactNode(Log, VersionID, MessageID, Body.Bytes.Data, Body.Bytes.Count, Offset, Data); }
+
+// Permissions are one byte of flags
+enum : uint8_t { PermissionWrite = 1 << 0, PermissionExecute = 1 << 1 };
+inline uint8_t PermissionFlags(SharePermissions const &Permissions)
+	{ return (Permissions.CanWrite ? PermissionWrite : 0) | (Permissions.CanExecute ? PermissionExecute : 0); }
+
+inline size_t ProtocolGetSize(SharePermissions const &) { return 1; }
+inline void ProtocolWrite(uint8_t *&Out, SharePermissions const &Argument) { *Out++ = PermissionFlags(Argument); }
+template <typename LogType> bool ProtocolReadPermissions(LogType &Log, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, uint8_t const *Buffer, size_t Size, size_t &Offset, SharePermissions &Data)
+{
+	if ((Offset >= Size) || (Buffer[Offset] & ~(PermissionWrite | PermissionExecute)))
 	{
-		Log.Debug() << "ShareFilend of file reached prematurely reading message body ShareFile size " << sizeof(Data) << ", message length doesn't match contents (version " << *VersionID << ", type " << *MessageID << ")";
+		Log.Debug() << "Missing or invalid permissions in message body (version " << *VersionID << ", type " << *MessageID << ")";
 		assert(false);
 		return false;
 	}
-
-	Data = *reinterpret_cast<ShareFile const *>(&Buffer[*Offset]);
-	Offset += (Protocol::SizeType::Type)sizeof(Data);
+	Data.CanWrite = (Buffer[Offset] & PermissionWrite) ? 1 : 0;
+	Data.CanExecute = (Buffer[Offset] & PermissionExecute) ? 1 : 0;
+	++Offset;
 	return true;
 }
+template <typename LogType> bool ProtocolRead(LogType &Log, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, Protocol::BufferType const &Buffer, size_t &Offset, SharePermissions &Data)
+	{ return ProtocolReadPermissions(Log, VersionID, MessageID, Buffer.data(), Buffer.size(), Offset, Data); }
+template <typename LogType> bool ProtocolView(LogType &Log, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, Protocol::ViewBody const &Body, size_t &Offset, SharePermissions &Data)
+	{ return ProtocolReadPermissions(Log, VersionID, MessageID, Body.Bytes.Data, Body.Bytes.Count, Offset, Data); }
 
-inline size_t ProtocolGetSize(NodeID const &Argument) { return sizeof(Argument); }
-inline void ProtocolWrite(uint8_t *&Out, NodeID const &Argument)
+// A ShareFile is written field by field, compactly: its ID as varints, its change and parent as zigzagged varint
+// differences from its ID (changes follow soon after the node they change, and parents are usually made just
+// before their children), its flags in a byte, its name with a varint length, and its modified time as a varint.
+enum : uint8_t { ShareFileIsFile = 1 << 0, ShareFileCanWrite = 1 << 1, ShareFileCanExecute = 1 << 2, ShareFileIsSplit = 1 << 3 };
+
+inline NodeID NodeDifference(NodeID const &Node, NodeID const &Base)
+{
+	return {
+		static_cast<Counter::Type>(Protocol::ZigZag(static_cast<int64_t>(*Node.Instance - *Base.Instance))),
+		static_cast<UUID::Type>(Protocol::ZigZag(static_cast<int64_t>(*Node.Index - *Base.Index)))};
+}
+inline NodeID NodeFromDifference(NodeID const &Difference, NodeID const &Base)
+{
+	return {
+		static_cast<Counter::Type>(*Base.Instance + static_cast<uint64_t>(Protocol::UnZigZag(*Difference.Instance))),
+		static_cast<UUID::Type>(*Base.Index + static_cast<uint64_t>(Protocol::UnZigZag(*Difference.Index)))};
+}
+
+inline size_t ProtocolGetSize(ShareFile const &Argument)
 {
-	memcpy(Out, &Argument, sizeof(Argument));
-	Out += sizeof(Argument);
+	return ProtocolGetSize(Protocol::Compact<NodeID>(Argument.ID())) +
+		ProtocolGetSize(Protocol::Compact<NodeID>(NodeDifference(Argument.Change(), Argument.ID()))) +
+		ProtocolGetSize(Protocol::Compact<NodeID>(NodeDifference(Argument.Parent(), Argument.ID()))) +
+		1 +
+		Protocol::VarintSize(Argument.Name().size()) + Argument.Name().size() +
+		Protocol::VarintSize(*Argument.ModifiedTime());
 }
-template <typename LogType> bool ProtocolRead(LogType &Log, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, Protocol::BufferType const &Buffer, Protocol::SizeType &Offset, NodeID &Data)
+inline void ProtocolWrite(uint8_t *&Out, ShareFile const &Argument)
+{
+	ProtocolWrite(Out, Protocol::Compact<NodeID>(Argument.ID()));
+	ProtocolWrite(Out, Protocol::Compact<NodeID>(NodeDifference(Argument.Change(), Argument.ID())));
+	ProtocolWrite(Out, Protocol::Compact<NodeID>(NodeDifference(Argument.Parent(), Argument.ID())));
+	*Out++ =
+		(Argument.IsFile() ? ShareFileIsFile : 0) |
+		(Argument.CanWrite() ? ShareFileCanWrite : 0) |
+		(Argument.CanExecute() ? ShareFileCanExecute : 0) |
+		(Argument.IsSplit() ? ShareFileIsSplit : 0);
+	Protocol::WriteVarint(Out, Argument.Name().size());
+	memcpy(Out, Argument.Name().data(), Argument.Name().size());
+	Out += Argument.Name().size();
+	Protocol::WriteVarint(Out, *Argument.ModifiedTime());
+}
+template <typename LogType> bool ProtocolReadShareFile(LogType &Log, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, uint8_t const *Buffer, size_t Size, size_t &Offset, ShareFile &Data)
 {
-	if (Buffer.size() < StrictCast(Offset, size_t) + sizeof(Data))
+	NodeID ID, Change, Parent;
+	if (!ProtocolReadCompactNode(Log, VersionID, MessageID, Buffer, Size, Offset, ID)) return false;
+	if (!ProtocolReadCompactNode(Log, VersionID, MessageID, Buffer, Size, Offset, Change)) return false;
+	if (!ProtocolReadCompactNode(Log, VersionID, MessageID, Buffer, Size, Offset, Parent)) return false;
+	if ((Offset >= Size) || (Buffer[Offset] & ~(ShareFileIsFile | ShareFileCanWrite | ShareFileCanExecute | ShareFileIsSplit)))
 	{
-		Log.Debug() << "NodeIDnd of file reached prematurely reading message body NodeID size " << sizeof(Data) << ", message length doesn't match contents (version " << *VersionID << ", type " << *MessageID << ")";
+		Log.Debug() << "Missing or invalid ShareFile flags in message body (version " << *VersionID << ", type " << *MessageID << ")";
 		assert(false);
 		return false;
 	}
-
-	Data = *reinterpret_cast<NodeID const *>(&Buffer[*Offset]);
-	Offset += (Protocol::SizeType::Type)sizeof(Data);
+	uint8_t const Flags = Buffer[Offset++];
+	uint64_t NameLength;
+	if (!ProtocolReadVarint(Log, VersionID, MessageID, Buffer, Size, Offset, NameLength)) return false;
+	if (NameLength > Size - Offset)
+	{
+		Log.Debug() << "End of file reached prematurely reading message body ShareFile name size " << NameLength << ", message length doesn't match contents (version " << *VersionID << ", type " << *MessageID << ")";
+		assert(false);
+		return false;
+	}
+	std::string Name(reinterpret_cast<char const *>(Buffer + Offset), static_cast<size_t>(NameLength));
+	Offset += static_cast<size_t>(NameLength);
+	Timestamp ModifiedTime;
+	if (!ProtocolReadVarint(Log, VersionID, MessageID, Buffer, Size, Offset, *ModifiedTime)) return false;
+	SharePermissions Permissions;
+	Permissions.CanWrite = (Flags & ShareFileCanWrite) ? 1 : 0;
+	Permissions.CanExecute = (Flags & ShareFileCanExecute) ? 1 : 0;
+	static_cast<ShareFileTuple &>(Data) = ShareFileTuple(ID, NodeFromDifference(Change, ID), NodeFromDifference(Parent, ID), std::move(Name), (Flags & ShareFileIsFile) != 0, ModifiedTime, Permissions, (Flags & ShareFileIsSplit) != 0);
 	return true;
 }
+template <typename LogType> bool ProtocolRead(LogType &Log, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, Protocol::BufferType const &Buffer, size_t &Offset, ShareFile &Data)
+	{ return ProtocolReadShareFile(Log, VersionID, MessageID, Buffer.data(), Buffer.size(), Offset, Data); }
+template <typename LogType> bool ProtocolView(LogType &Log, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, Protocol::ViewBody const &Body, size_t &Offset, ShareFile &Data)
+	{ return ProtocolReadShareFile(Log, VersionID, MessageID, Body.Bytes.Data, Body.Bytes.Count, Offset, Data); }
 
-inline size_t ProtocolGetSize(SharePermissions const &Argument) { return sizeof(Argument); }
-inline void ProtocolWrite(uint8_t *&Out, SharePermissions const &Argument)
+namespace Protocol
 {
-	memcpy(Out, &Argument, sizeof(Argument));
-	Out += sizeof(Argument);
+template <> struct FieldFixedSize<SharePermissions> : std::integral_constant<size_t, 1> {};
+template <> struct FieldFixedSize<ShareFile> : std::integral_constant<size_t, 0> {};
 }
-template <typename LogType> bool ProtocolRead(LogType &Log, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, Protocol::BufferType const &Buffer, Protocol::SizeType &Offset, SharePermissions &Data)
+
+// A backing file's location relative to the files directory, built on the stack
+struct BackingPath
 {
-	if (Buffer.size() < StrictCast(Offset, size_t) + sizeof(Data))
+	static constexpr size_t Capacity = 128;
+	char Data[Capacity];
+	size_t Length;
+	size_t DirectoryLength;
+
+	char const *c_str(void) const { return Data; }
+};
+
+// Backing files are spread over nested directories named by hex digits of a hash of the backing filename, so no
+// single host directory grows to millions of entries.  Zero levels is the original flat layout.
+struct FileLayout
+{
+	unsigned int Levels;
+	unsigned int Width;
+
+	FileLayout(unsigned int Levels = 2, unsigned int Width = 2) : Levels(Levels), Width(Width) {}
+
+	bool IsValid(void) const { return (Levels * Width <= 16) && ((Levels == 0) == (Width == 0)); }
+	bool operator ==(FileLayout const &Other) const { return (Levels == Other.Levels) && (Width == Other.Width); }
+	bool operator !=(FileLayout const &Other) const { return !(*this == Other); }
+
+	void Format(BackingPath &Out, char const *Filename, size_t Length) const
 	{
-		Log.Debug() << "SharePermissionsnd of file reached prematurely reading message body SharePermissions size " << sizeof(Data) << ", message length doesn't match contents (version " << *VersionID << ", type " << *MessageID << ")";
-		assert(false);
-		return false;
+		uint64_t Hash = 14695981039346656037ull;
+		for (size_t Index = 0; Index < Length; ++Index)
+		{
+			Hash ^= static_cast<uint8_t>(Filename[Index]);
+			Hash *= 1099511628211ull;
+		}
+		Out.DirectoryLength = Levels * (Width + 1);
+		Assert(Out.DirectoryLength + Length < BackingPath::Capacity);
+		char *Next = Out.Data;
+		for (unsigned int Level = 0; Level < Levels; ++Level)
+		{
+			for (unsigned int Digit = 0; Digit < Width; ++Digit, Hash >>= 4)
+				*Next++ = "0123456789abcdef"[Hash & 0xF];
+			*Next++ = '/';
+		}
+		memcpy(Next, Filename, Length);
+		Next[Length] = 0;
+		Out.Length = Out.DirectoryLength + Length;
 	}
 
-	Data = *reinterpret_cast<SharePermissions const *>(&Buffer[*Offset]);
-	Offset += (Protocol::SizeType::Type)sizeof(Data);
-	return true;
-}
+	bfs::path Locate(bfs::path const &Base, std::string const &Filename) const
+	{
+		BackingPath Out;
+		Format(Out, Filename.c_str(), Filename.size());
+		return Base / Out.c_str();
+	}
+};
 
 struct CoreDatabaseOperations
 {
@@ -181,10 +443,70 @@ struct CoreDatabaseOperations
 		return *static_cast<SharePermissions const *>(sqlite3_column_blob(Context, Index++));
 	}
 
+	void Bind(sqlite3 *BaseContext, sqlite3_stmt *Context, char const *Template, int &Index, VersionVector const &Value)
+	{
+		if (sqlite3_bind_blob(Context, Index, Value.Entries.data(), static_cast<int>(Value.Entries.size() * sizeof(VersionVector::Entry)), SQLITE_TRANSIENT) != SQLITE_OK)
+			throw SystemError() << "Could not bind argument " << Index << " to \"" << Template << "\": " << sqlite3_errmsg(BaseContext);
+		++Index;
+	}
+
+	VersionVector Unbind(sqlite3_stmt *Context, int &Index, ::Type<VersionVector>)
+	{
+		VersionVector Out;
+		auto const Bytes = static_cast<size_t>(sqlite3_column_bytes(Context, Index));
+		assert(Bytes % sizeof(VersionVector::Entry) == 0);
+		auto const Data = static_cast<VersionVector::Entry const *>(sqlite3_column_blob(Context, Index++));
+		if (Data) Out.Entries.assign(Data, Data + Bytes / sizeof(VersionVector::Entry));
+		return Out;
+	}
+
+	void Bind(sqlite3 *BaseContext, sqlite3_stmt *Context, char const *Template, int &Index, StringView const &Value)
+	{
+		if (sqlite3_bind_text(Context, Index, Value.Data, static_cast<int>(Value.Length), nullptr) != SQLITE_OK)
+			throw SystemError() << "Could not bind argument " << Index << " to \"" << Template << "\": " << sqlite3_errmsg(BaseContext);
+		++Index;
+	}
+
+	void Bind(sqlite3 *BaseContext, sqlite3_stmt *Context, char const *Template, int &Index, FileLayout const &Value)
+	{
+		if (sqlite3_bind_int(Context, Index, static_cast<int>((Value.Levels << 8) | Value.Width)) != SQLITE_OK)
+			throw SystemError() << "Could not bind argument " << Index << " to \"" << Template << "\": " << sqlite3_errmsg(BaseContext);
+		++Index;
+	}
+
+	FileLayout Unbind(sqlite3_stmt *Context, int &Index, ::Type<FileLayout>)
+	{
+		auto const Packed = static_cast<unsigned int>(sqlite3_column_int(Context, Index++));
+		return FileLayout(Packed >> 8, Packed & 0xFF);
+	}
+
+	void Bind(sqlite3 *BaseContext, sqlite3_stmt *Context, char const *Template, int &Index, ContentHash const &Value)
+	{
+		if (sqlite3_bind_int64(Context, Index, *reinterpret_cast<int64_t const *>(&Value.High)) != SQLITE_OK)
+			throw SystemError() << "Could not bind argument " << Index << " to \"" << Template << "\": " << sqlite3_errmsg(BaseContext);
+		if (sqlite3_bind_int64(Context, Index + 1, *reinterpret_cast<int64_t const *>(&Value.Low)) != SQLITE_OK)
+			throw SystemError() << "Could not bind argument " << Index << " to \"" << Template << "\": " << sqlite3_errmsg(BaseContext);
+		Index += 2;
+	}
+
+	ContentHash Unbind(sqlite3_stmt *Context, int &Index, ::Type<ContentHash>)
+	{
+		int64_t const High = sqlite3_column_int64(Context, Index);
+		int64_t const Low = sqlite3_column_int64(Context, Index + 1);
+		Index += 2;
+		return {*reinterpret_cast<uint64_t const *>(&High), *reinterpret_cast<uint64_t const *>(&Low)};
+	}
+
 };
 struct CoreDatabaseStructure : SQLDatabase<CoreDatabaseOperations>
 {
 	CoreDatabaseStructure(bfs::path const &DatabasePath, bool Create, std::string const &InstanceName, UUID const &InstanceID);
+
+	private:
+		void CreateCompactionIndices(void);
+		void CreateSplitIndex(void);
+		void CreateBlockTables(void);
+		void CreateRetiredTable(void);
 };
 struct CoreDatabase : CoreDatabaseStructure
 {
@@ -198,22 +520,62 @@ struct CoreDatabase : CoreDatabaseStructure
 	Statement<void(void)> IncrementFileIndex;
 	Statement<UUID(void)> GetChangeIndex;
 	Statement<void(void)> IncrementChangeIndex;
-	Statement<Counter(std::string Filename)> GetInstanceIndex;
+	Statement<Counter(StringView Filename)> GetInstanceIndex;
+	Statement<std::string(Counter Index)> GetInstanceFilename;
 	Statement<ShareFileTuple(NodeID ID)> GetFileByID;
-	Statement<ShareFileTuple(NodeID Parent, std::string Name)> GetFile;
-	Statement<ShareFileTuple(NodeID Parent, Counter SplitInstance, std::string Name)> GetSplitFile;
+	Statement<ShareFileTuple(NodeID Parent, StringView Name)> GetFile;
+	Statement<ShareFileTuple(NodeID Parent, Counter SplitInstance, StringView Name)> GetSplitFile;
 	Statement<ShareFileTuple(NodeID Parent, unsigned int Offset, unsigned int Limit)> GetFiles;
 	Statement<ShareFileTuple(NodeID Parent, Counter SplitInstance, unsigned int Offset, unsigned int Limit)> GetSplitFiles;
+	Statement<unsigned int(NodeID Parent, Counter SplitInstance)> CountSplitFiles;
 	Statement<void(NodeID ID, NodeID Parent, std::string Name, bool IsFile, Timestamp ModifiedTime, SharePermissions Permissions)> CreateFile;
 	Statement<void(NodeID ID, NodeID Change)> DeleteFile;
 	Statement<void(NodeID NewChange, SharePermissions NewPermissions, NodeID ID, NodeID Change)> SetPermissions;
 	Statement<void(NodeID NewChange, Timestamp NewModifiedTime, NodeID ID, NodeID Change)> SetTimestamp;
 	Statement<void(NodeID NewChange, NodeID NewParent, std::string NewName, NodeID ID, NodeID Change)> MoveFile;
-	Statement<void(NodeID NewChange, NodeID OldChange)> CreateChange;
+	Statement<void(NodeID NewChange, NodeID OldChange, Timestamp Created)> CreateChange;
 	Statement<NodeID(NodeID Change)> GetChange;
+	Statement<VersionVector(NodeID ID)> GetVersions;
+	Statement<void(VersionVector Versions, NodeID ID)> SetVersions;
+	Statement<std::tuple<int64_t, NodeID>(int64_t After, Timestamp Before, unsigned int Limit)> GetOldChanges;
+	Statement<int(NodeID Change)> IsCurrentChange;
+	Statement<void(NodeID NewParent, NodeID OldParent)> ReparentChanges;
+	Statement<void(NodeID Change)> DeleteChange;
+	Statement<std::tuple<NodeID, Counter>(void)> GetSplitParents;
+	Statement<NodeID(NodeID ID)> GetParent;
+	Statement<NodeID(NodeID ID)> GetContent;
+	Statement<void(NodeID NewContent, NodeID ID)> SetContent;
+	Statement<FileLayout(void)> GetLayout;
+	Statement<FileLayout(void)> GetTargetLayout;
+	Statement<void(FileLayout Layout, FileLayout Target)> SetLayout;
+	Statement<std::tuple<int64_t, NodeID, NodeID>(int64_t After, unsigned int Limit)> GetBackedFiles;
+	Statement<void(void)> Abort;
+	Statement<bool(void)> GetDeduplicate;
+	Statement<void(bool Deduplicate)> SetDeduplicate;
+	Statement<bool(void)> GetCompress;
+	Statement<void(bool Compress)> SetCompress;
+	Statement<uint64_t(ContentHash Hash)> GetBlockReferences;
+	Statement<void(ContentHash Hash, uint64_t Length)> CreateBlock;
+	Statement<void(ContentHash Hash)> ReferenceBlock;
+	Statement<void(ContentHash Hash)> DereferenceBlock;
+	Statement<ContentHash(unsigned int Limit)> GetUnreferencedBlocks;
+	Statement<void(ContentHash Hash)> DeleteBlock;
+	Statement<ContentHash(NodeID ID, NodeID Content)> GetChunks;
+	Statement<uint64_t(NodeID ID, NodeID Content)> GetChunkedSize;
+	Statement<void(NodeID ID, NodeID Content, uint64_t Offset, ContentHash Hash, uint64_t Length)> AddChunk;
+	Statement<void(NodeID ID, NodeID Content)> DeleteChunks;
+	Statement<uint64_t(void)> GetLogicalBytes;
+	Statement<uint64_t(void)> GetStoredBytes;
+	Statement<uint64_t(void)> GetBlockCount;
+	Statement<void(NodeID NewChange, NodeID NewContent, NodeID ID)> CommitContent;
+	Statement<void(NodeID ID, NodeID Content, NodeID Change)> RetireContent;
+	Statement<std::tuple<NodeID, Counter, UUID>(NodeID Change)> GetRetiredContent;
+	Statement<void(NodeID Change)> DeleteRetiredContent;
 };
 
 DefineProtocol(CoreTransactorProtocol)
+// Version 1 wrote each ShareFile as it lay in memory, name pointer and all, so its journals can't be replayed.  It
+// stays defined to hold its version ID.
 DefineProtocolVersion(CoreTransactorVersion1, CoreTransactorProtocol)
 DefineProtocolMessage(CTV1Create, CoreTransactorVersion1,
 	void(
@@ -235,39 +597,325 @@ DefineProtocolMessage(CTV1Move, CoreTransactorVersion1,
 		ShareFile File, UUID NewChangeIndex,
 		NodeID ParentID,
 		std::string Name))
+// Version 2 packs IDs and timestamps compactly, and has long lengths
+DefineProtocolLongVersion(CoreTransactorVersion2, CoreTransactorProtocol)
+DefineProtocolMessage(CTV2Create, CoreTransactorVersion2,
+	void(
+		Protocol::Compact<UUID> ID,
+		Protocol::Compact<NodeID> Parent, std::string Name, bool IsFile,
+		SharePermissions Permissions))
+DefineProtocolMessage(CTV2SetPermissions, CoreTransactorVersion2,
+	void(
+		ShareFile File, Protocol::Compact<UUID> NewChangeIndex,
+		bool CanWrite, bool CanExecute))
+DefineProtocolMessage(CTV2SetTimestamp, CoreTransactorVersion2,
+	void(
+		ShareFile File, Protocol::Compact<UUID> NewChangeIndex,
+		Protocol::Compact<Timestamp> NewTimestamp))
+DefineProtocolMessage(CTV2Delete, CoreTransactorVersion2,
+	void(ShareFile File))
+DefineProtocolMessage(CTV2Move, CoreTransactorVersion2,
+	void(
+		ShareFile File, Protocol::Compact<UUID> NewChangeIndex,
+		Protocol::Compact<NodeID> ParentID,
+		std::string Name))
+
+struct ChangeNotifier;
+struct ChangeEvent;
+
+// History older than the retention window is collapsed so that only each node's current change and its link
+// to the oldest retained ancestor remain.  Work is done in small batches, releasing the core between them.
+struct CompactionSettings
+{
+	unsigned int RetentionSeconds = 30 * 24 * 60 * 60;
+	unsigned int BatchSize = 256;
+	unsigned int BatchPauseMilliseconds = 50;
+	unsigned int PassIntervalSeconds = 60 * 60;
+};
+
+struct CompactionProgress
+{
+	size_t Scanned;
+	size_t Reclaimed;
+};
+
+struct MigrationSettings
+{
+	unsigned int BatchSize = 1024;
+	unsigned int BatchPauseMilliseconds = 10;
+};
+
+// With deduplication on, file data is cut into fixed size chunks when the last writer closes the file, and each
+// distinct chunk is stored once in the block store, named by its hash and reference counted.  The chunks of a file
+// in the block store double as its extent map, so later writes only store the extents they touch.
+static constexpr size_t BlockSize = 64 * 1024;
+
+struct BlockStoreStats
+{
+	uint64_t LogicalBytes; // File data held as chunks
+	uint64_t StoredBytes; // Distinct blocks as stored on disk, compressed or not, including ones awaiting collection
+	uint64_t Blocks;
+};
+
+// Writes smaller than SmallWrite that continue the previous one are held back and written together, up to
+// WriteBufferSize at a time.  Sequential readers read ahead from MinReadahead, doubling each read up to MaxReadahead.
+static constexpr size_t SmallWrite = 16 * 1024;
+static constexpr size_t WriteBufferSize = 256 * 1024;
+static constexpr size_t MinReadahead = 128 * 1024;
+static constexpr size_t MaxReadahead = 1024 * 1024;
+
+// Plain files written sequentially past MinPreallocation get space reserved ahead of the writer, a quarter of the
+// file's size at a time up to MaxPreallocation, so they aren't fragmented.  Unused space goes back on release.
+static constexpr uint64_t MinPreallocation = 1024 * 1024;
+static constexpr uint64_t MaxPreallocation = 64 * 1024 * 1024;
+
+// File data shared by every handle open on one file.  The data is a plain backing file or an extent map of
+// blocks.  Writes to an extent-mapped file copy only the extents they touch into a staging file, and committing
+// stores those as a new version of the map, sharing the untouched extents' blocks with the previous version.
+struct OpenContent
+{
+	OpenContent(NodeID const &ID, NodeID const &Content, int BlocksDescriptor, IOEngine &IO, FileCache &Cache) :
+		ID(ID), IO(IO), Slot(-1), Descriptor(-1), BlocksDescriptor(BlocksDescriptor), Dirty(false),
+		Cache(Cache), CacheGeneration(0), PendingOffset(0), HasPending(false), WriteEnd(0), Preallocated(0),
+		Content(Content), Handles(0), Deleted(false),
+		Size(0), CommittedSize(0), StagingDescriptor(-1) {}
+	~OpenContent(void)
+	{
+		Cache.Drop(this);
+		if (Descriptor >= 0)
+		{
+			IO.Unregister(Slot);
+			close(Descriptor);
+		}
+		if (StagingDescriptor >= 0) close(StagingDescriptor);
+	}
+
+	NodeID const ID;
+	IOEngine &IO;
+	int Slot; // Descriptor's registration with IO, set before Descriptor
+	std::atomic<int> Descriptor; // Plain backing file or -1
+	int const BlocksDescriptor;
+	std::atomic<bool> Dirty;
+
+	FileCache &Cache;
+	std::atomic<uint64_t> CacheGeneration; // Bumped by the cache whenever it invalidates this data's pages
+
+	// Small writes held back to be coalesced, flushed before anything else looks at the data
+	std::mutex PendingMutex;
+	std::vector<char> Pending;
+	uint64_t PendingOffset;
+	std::atomic<bool> HasPending;
+
+	// Plain files only
+	std::atomic<uint64_t> WriteEnd; // Where the last write stopped
+	std::atomic<uint64_t> Preallocated; // End of the space reserved past the data
+
+	// Guarded by the core
+	NodeID Content;
+	unsigned int Handles;
+	bool Deleted;
+
+	// Guarded by ExtentMutex, unused for plain files
+	std::mutex ExtentMutex;
+	std::vector<ContentHash> Extents; // As committed, one per BlockSize bytes
+	std::vector<bool> Staged; // Extents whose current data is in the staging file
+	uint64_t Size;
+	uint64_t CommittedSize;
+	int StagingDescriptor; // Unlinked; staged extents sit at their offsets in the file
+};
+
+// Reads and writes go to the backing data without taking the core lock.  Results are byte counts or -errno, like
+// FUSE callbacks.
+struct OpenFile
+{
+	OpenFile(ShareFile const &File, std::shared_ptr<OpenContent> const &Content, bool Writable) :
+		File(File), Writable(Writable), Content(Content), NextRead(0), Readahead(0) {}
+
+	ssize_t Read(char *Out, size_t Length, off_t Offset);
+	ssize_t Write(char const *Data, size_t Length, off_t Offset);
+	int Truncate(off_t Size);
+	int Flush(void); // Writes out held back small writes
+	int Allocate(int Mode, off_t Offset, off_t Length); // fallocate modes; punched extent-mapped ranges stage zeros
+	off_t Seek(off_t Offset, int Whence); // SEEK_DATA or SEEK_HOLE
+	int Sync(bool DataOnly);
+	int Stat(struct stat *Out) const;
+	ssize_t CopyTo(OpenFile &To, off_t FromOffset, off_t ToOffset, size_t Length); // Offloaded to the host where possible
+	bool HasStagedExtents(void) const; // Needs a commit through the core to become durable
+
+	ShareFile const File;
+	bool const Writable;
+
+	private:
+		friend struct ShareCoreInner;
+		std::shared_ptr<OpenContent> const Content;
+
+		// Sequential stream detection.  Concurrent reads on one handle can race on these, which only costs a
+		// misjudged readahead.
+		std::atomic<uint64_t> NextRead;
+		std::atomic<size_t> Readahead;
+};
+
+// Operations timed in the core's latency stats, in the order they're reported
+enum class CoreOperation
+{
+	GetRealPath,
+	StatBacking,
+	Get,
+	CreateDirectory,
+	CreateFile,
+	Open,
+	Release,
+	Commit,
+	Copy,
+	OpenDirectory,
+	GetDirectory,
+	SetPermissions,
+	SetTimestamp,
+	Delete,
+	Move,
+	GetVersions,
+	CompactHistory,
+	SetFileLayout,
+	MigrateLayout,
+	CollectBlocks,
+	IngestReleased
+};
+
+struct IngestedBlock;
 
 struct ShareCoreInner
 {
 	ShareCoreInner(bfs::path const &Root, std::string const &InstanceName = std::string());
+	~ShareCoreInner(void);
 
 	bfs::path GetRoot(void) const;
 
 	bfs::path GetRealPath(ShareFile const &File) const;
+	int StatBacking(ShareFile const &File, struct stat *Out) const; // 0 or -errno, like FUSE callbacks
 
-	GetResult Get(bfs::path const &Path);
+	GetResult Get(SharePath const &Path);
 
-	ActionError CreateDirectory(bfs::path const &Path, bool CanWrite, bool CanExecute);
-	//ActionResult<Optional<OpenFileContext>> CreateFile(bfs::path const &Path, bool CanWrite, bool CanExecute, bool Open);
-	ActionResult<std::unique_ptr<ShareFile>> OpenDirectory(bfs::path const &Path);
+	ActionError CreateDirectory(SharePath const &Path, bool CanWrite, bool CanExecute);
+	ActionError CreateFile(SharePath const &Path, bool CanWrite, bool CanExecute);
+	ActionResult<std::unique_ptr<OpenFile>> Open(SharePath const &Path, bool Writable, bool Truncate);
+	void Release(std::unique_ptr<OpenFile> File);
+	void Commit(OpenFile &File);
+	ActionError Copy(SharePath const &From, SharePath const &To); // Files in the block store share blocks with the copy
+	ActionResult<std::unique_ptr<ShareFile>> OpenDirectory(SharePath const &Path);
 	std::vector<ShareFile> GetDirectory(ShareFile const &File, unsigned int From, unsigned int Count);
-	ActionError SetPermissions(bfs::path const &Path, bool CanWrite, bool CanExecute);
-	ActionError SetTimestamp(bfs::path const &Path, Timestamp const &NewTimestamp);
-	ActionError Delete(bfs::path const &Path);
-	ActionError Move(bfs::path const &From, bfs::path const &To);
+	ActionError SetPermissions(SharePath const &Path, bool CanWrite, bool CanExecute);
+	ActionError SetTimestamp(SharePath const &Path, Timestamp const &NewTimestamp);
+	ActionError Delete(SharePath const &Path);
+	ActionError Move(SharePath const &From, SharePath const &To);
+
+	ActionResult<VersionVector> GetVersions(SharePath const &Path);
+
+	CompactionProgress CompactHistory(Timestamp const &Before, unsigned int BatchSize);
+	void StartCompaction(CompactionSettings const &Settings);
+	uint64_t GetCompactedCount(void) const;
+
+	// Changing the layout moves backing files over in batches while the share stays usable
+	FileLayout GetFileLayout(void) const;
+	bool IsMigratingLayout(void) const;
+	ActionError SetFileLayout(FileLayout const &Target);
+	size_t MigrateLayout(unsigned int BatchSize);
+	void StartLayoutMigration(MigrationSettings const &Settings);
+
+	// Sends readahead of plain backing files to io_uring, as batches of reads submitted together.  False if the
+	// kernel doesn't allow it, in which case I/O stays synchronous.  Only while no files are open.
+	bool UseRingIO(unsigned int Depth);
+
+	// Applies to file data written after it's turned on; files already in the block store stay there either way
+	bool IsDeduplicating(void) const;
+	void SetDeduplication(bool Enabled);
+	size_t CollectBlocks(unsigned int BatchSize);
+	BlockStoreStats GetBlockStats(void);
+
+	// Files written while deduplicating or compressing are queued on release to go to the block store, and stay
+	// plain until then.  Either stores up to BatchSize of them holding the core lock throughout, or starts a thread
+	// that stores them as they come with the lock dropped while blocks are read and written.  Files still queued
+	// when the core closes stay plain.
+	size_t IngestReleased(unsigned int BatchSize);
+	void StartIngestion(void);
+
+	// Blocks stored after it's turned on are compressed where that saves space, and with it on files go to the
+	// block store on release even without deduplication.  Applies to the whole share.
+	bool IsCompressing(void) const;
+	void SetCompression(bool Enabled);
+
+	FileCacheStats GetFileCacheStats(void) const;
+
+	// Lines below the level aren't written to the share's log; not remembered by the share
+	void SetLogLevel(LogLevel Level);
+
+	// Time spent in each operation, not counting waiting for the core lock.  Operations the core calls itself while
+	// handling another are counted too.  Safe to read and reset without the core lock.
+	LatencyStats &GetLatency(void);
+
+	typedef std::function<bool(std::vector<ChangeEvent> const &Events, bool Overflowed)> SubscriberCallback;
+	size_t Subscribe(SubscriberCallback const &Callback);
+	void Unsubscribe(size_t Subscription); // A batch being delivered may finish after, so callbacks may use the core
 
 	private:
 		//GetResult Get(NodeID const &ID);
-		GetResult GetInternal(bfs::path const &Path);
+		GetResult GetInternal(SharePath const &Path);
+		ActionError CreateNode(SharePath const &Path, bool IsFile, bool CanWrite, bool CanExecute);
 		NodeID GetPrecedingChange(NodeID const &Change);
+		void AdvanceVersions(NodeID const &ID, NodeID const &Change);
 
-		bool IsRootPath(bfs::path const &Path) const;
-		bool IsSplitPath(bfs::path const &Path) const;
-		ShareFile SplitInstanceFile(Counter Index) const;
+		bool IsSplitPath(SharePath const &Path) const;
+		ShareFile SplitInstanceFile(Counter Index, std::string const &Filename) const;
+		bool HasSplits(Counter const &Instance, NodeID const &Directory) const;
+		void LoadSplits(void);
+
+		void LocateBacking(BackingPath &Out, NodeID const &ID, NodeID const &Content) const;
+		void CreateBacking(NodeID const &ID, NodeID const &Content);
+		void RemoveBacking(NodeID const &ID, NodeID const &Content);
+		bool MoveBacking(FileLayout const &From, NodeID const &ID, NodeID const &Content);
+		void UnlinkBacking(NodeID const &ID, NodeID const &Content);
+
+		struct IngestJob
+		{
+			std::pair<Counter::Type, UUID::Type> Key;
+			uint64_t Attempt;
+			NodeID ID;
+			NodeID Content;
+		};
+
+		void LoadContent(OpenContent &Content);
+		void QueueIngestion(OpenContent &Content);
+		bool TakeIngestion(IngestJob &Job, int &File);
+		void Ingest(IngestJob const &Job, int File, std::unique_lock<std::mutex> *Unlock);
+		bool EndIngestion(IngestJob const &Job);
+		void DiscardIngested(std::vector<IngestedBlock> const &Blocks);
+		void CommitExtents(OpenContent &Content);
+		bool ShareExtents(OpenContent &Source, SharePath const &To);
+		void DereferenceChunks(NodeID const &ID, NodeID const &Content);
+		bool StoreBlock(ContentHash const &Hash, char const *Data, size_t Length, std::vector<char> &Scratch, std::vector<ContentHash> &Created);
+		void DiscardBlocks(std::vector<ContentHash> const &Created);
+		size_t WriteBlock(ContentHash const &Hash, char const *Data, size_t Length);
 
 		bfs::path const Root;
 		bfs::path const FilePath;
+		int FilesDescriptor;
+		bfs::path const BlockPath;
+		int BlocksDescriptor;
+		bool Deduplicate;
+		bool Compress;
+		BlockCompressor Compressor; // For blocks stored under the core lock; ingestion has its own
+		CompressionBypass Bypass;
+		std::vector<char> CompressedBlock;
+		std::unique_ptr<IOEngine> IO;
+		FileCache Cache;
+		std::map<std::pair<Counter::Type, UUID::Type>, std::shared_ptr<OpenContent>> OpenContents;
+		// Released files waiting to be stored as blocks, by attempt.  Releasing the file again starts a new attempt
+		// and removing it abandons it; one found open is left for its release to queue again.
+		std::map<std::pair<Counter::Type, UUID::Type>, uint64_t> Ingesting;
+		uint64_t IngestAttempts;
+		std::deque<IngestJob> IngestQueue;
 
 		std::unique_ptr<FileLog> Log;
+		mutable LatencyStats Latency; // Const operations are timed too
 
 		std::string InstanceName;
 		UUID InstanceID;
@@ -278,16 +926,40 @@ struct ShareCoreInner
 
 		ShareFile SplitFile;
 
+		// Directories that hold splits or lead to them, with a bit per instance.  Empty when there are no splits.
+		struct SplitDirectory
+		{
+			NodeID Parent;
+			std::vector<bool> Instances;
+		};
+		std::map<std::pair<Counter::Type, UUID::Type>, SplitDirectory> SplitDirectories;
+
+		std::unique_ptr<ChangeNotifier> Notifier;
+
 		std::unique_ptr<CoreDatabase> Database;
 
-		typedef Transactor<CTV1Create, CTV1SetPermissions, CTV1SetTimestamp, CTV1Delete, CTV1Move> CoreTransactor;
+		FileLayout Layout;
+		FileLayout TargetLayout;
+		int64_t MigrationCursor;
+
+		int64_t CompactionCursor;
+		std::atomic<uint64_t> Compacted;
+		std::mutex BackgroundMutex;
+		std::condition_variable BackgroundWake;
+		bool StopBackground;
+		bool IngestQueued; // Guarded by BackgroundMutex, wakes the ingestion thread
+		std::thread Compactor;
+		std::thread Migrator;
+		std::thread Ingester;
+
+		typedef Transactor<CTV2Create, CTV2SetPermissions, CTV2SetTimestamp, CTV2Delete, CTV2Move> CoreTransactor;
 		struct
 		{
-			CTV1Create::Function Create;
-			CTV1SetPermissions::Function SetPermissions;
-			CTV1SetTimestamp::Function SetTimestamp;
-			CTV1Delete::Function Delete;
-			CTV1Move::Function Move;
+			CTV2Create::Function Create;
+			CTV2SetPermissions::Function SetPermissions;
+			CTV2SetTimestamp::Function SetTimestamp;
+			CTV2Delete::Function Delete;
+			CTV2Move::Function Move;
 		} Transaction;
 		std::unique_ptr<CoreTransactor> Transact;
 };
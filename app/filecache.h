@@ -0,0 +1,167 @@
+#ifndef filecache_h
+#define filecache_h
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+
+// Counts since the core started.  A read is a hit when prefetched pages covered all of it.
+struct FileCacheStats
+{
+	uint64_t ReadHits;
+	uint64_t ReadMisses;
+	uint64_t PrefetchedBytes; // Read from backing data into the pool
+	uint64_t BufferedWrites; // Small writes held back to be coalesced
+	uint64_t FlushedWrites; // Backing writes the held back ones became
+};
+
+// A bounded pool of fixed size pages of file data read ahead for sequential readers, evicting the least recently
+// used page first.  Pages are keyed by their owner (the open file data) and index, and a short page holds the end
+// of the file.  Invalidating bumps the owner's generation; pages read from backing data before the bump are refused
+// when inserted, so a prefetch racing a write can't leave stale data in the pool.
+struct FileCache
+{
+	static constexpr size_t PageSize = 64 * 1024;
+
+	FileCache(size_t Capacity) : Capacity(Capacity), ReadHits(0), ReadMisses(0), PrefetchedBytes(0), BufferedWrites(0), FlushedWrites(0) {}
+
+	size_t GetCapacity(void) const { return Capacity; }
+
+	// Copies the cached prefix of the range and returns its length.  End is set if the prefix reaches the end of
+	// the file.
+	size_t Read(void const *Owner, char *Out, size_t Length, uint64_t Offset, bool &End)
+	{
+		End = false;
+		std::lock_guard<std::mutex> Guard(Mutex);
+		size_t Done = 0;
+		while (Done < Length)
+		{
+			uint64_t const At = Offset + Done;
+			auto Found = Index.find(Key(reinterpret_cast<uintptr_t>(Owner), At / PageSize));
+			if (Found == Index.end()) break;
+			Page &Entry = *Found->second;
+			Pages.splice(Pages.begin(), Pages, Found->second);
+			auto const Start = static_cast<size_t>(At % PageSize);
+			if (Start < Entry.Length)
+			{
+				size_t const Count = std::min(Length - Done, Entry.Length - Start);
+				memcpy(Out + Done, Entry.Data.get() + Start, Count);
+				Done += Count;
+				if (Start + Count < Entry.Length) continue;
+			}
+			if (Entry.Length < PageSize)
+			{
+				End = true;
+				break;
+			}
+		}
+		return Done;
+	}
+
+	// Stores data read from Offset (page aligned) unless the owner was invalidated since Snapshot was taken.  If
+	// the data reaches the end of the file, the page past it is stored short (possibly empty) to say so.
+	void Insert(void const *Owner, std::atomic<uint64_t> const &Generation, uint64_t Snapshot, uint64_t Offset, char const *Data, size_t Length, bool ReachesEnd)
+	{
+		if (Capacity == 0) return;
+		std::lock_guard<std::mutex> Guard(Mutex);
+		if (Generation != Snapshot) return;
+		size_t const Count = Length / PageSize + (((Length % PageSize != 0) || ReachesEnd) ? 1 : 0);
+		for (size_t Number = 0; Number < Count; ++Number)
+		{
+			Key const Where(reinterpret_cast<uintptr_t>(Owner), Offset / PageSize + Number);
+			auto Found = Index.find(Where);
+			std::list<Page>::iterator Entry;
+			if (Found != Index.end()) Entry = Found->second;
+			else if (Pages.size() < Capacity)
+			{
+				Pages.emplace_front();
+				Entry = Pages.begin();
+				Entry->Data.reset(new char[PageSize]);
+				Index.emplace(Where, Entry);
+			}
+			else
+			{
+				Entry = std::prev(Pages.end());
+				if (Entry->Owner != 0) Index.erase(Key(Entry->Owner, Entry->Number));
+				Index.emplace(Where, Entry);
+			}
+			Pages.splice(Pages.begin(), Pages, Entry);
+			Entry->Owner = Where.first;
+			Entry->Number = Where.second;
+			size_t const Remaining = Length - std::min(Length, Number * PageSize);
+			Entry->Length = (Remaining < PageSize) ? Remaining : PageSize;
+			memcpy(Entry->Data.get(), Data + Number * PageSize, Entry->Length);
+		}
+	}
+
+	// Forgets pages overlapping the range, End exclusive.  A range reaching past a cached end of file grows the file,
+	// so the short page saying where the end was goes too.
+	void Invalidate(void const *Owner, std::atomic<uint64_t> &Generation, uint64_t Start, uint64_t End)
+	{
+		std::lock_guard<std::mutex> Guard(Mutex);
+		++Generation;
+		if (End <= Start) return;
+		auto const OwnerKey = reinterpret_cast<uintptr_t>(Owner);
+		uint64_t First = Start / PageSize;
+		// Nothing is read ahead past the end, so if it's cached it's in the owner's last page
+		auto Last = Index.lower_bound(Key(OwnerKey + 1, 0));
+		if (Last != Index.begin())
+		{
+			--Last;
+			Page const &Entry = *Last->second;
+			if ((Last->first.first == OwnerKey) && (Entry.Length < PageSize) && (Entry.Number * PageSize + Entry.Length < End))
+				First = std::min(First, Entry.Number);
+		}
+		Erase(OwnerKey, First, (End - 1) / PageSize);
+	}
+
+	void Drop(void const *Owner)
+	{
+		std::lock_guard<std::mutex> Guard(Mutex);
+		Erase(reinterpret_cast<uintptr_t>(Owner), 0, UINT64_MAX);
+	}
+
+	void CountRead(bool Hit) { ++(Hit ? ReadHits : ReadMisses); }
+	void CountPrefetch(size_t Bytes) { PrefetchedBytes += Bytes; }
+	void CountBufferedWrite(void) { ++BufferedWrites; }
+	void CountFlushedWrite(void) { ++FlushedWrites; }
+
+	FileCacheStats GetStats(void) const { return {ReadHits, ReadMisses, PrefetchedBytes, BufferedWrites, FlushedWrites}; }
+
+	private:
+		typedef std::pair<uintptr_t, uint64_t> Key;
+		struct Page
+		{
+			uintptr_t Owner = 0; // 0 when free
+			uint64_t Number = 0;
+			size_t Length = 0;
+			std::unique_ptr<char[]> Data;
+		};
+
+		// Freed pages go to the back to be reused first
+		void Erase(uintptr_t Owner, uint64_t First, uint64_t Last)
+		{
+			auto Found = Index.lower_bound(Key(Owner, First));
+			while ((Found != Index.end()) && (Found->first.first == Owner) && (Found->first.second <= Last))
+			{
+				Found->second->Owner = 0;
+				Pages.splice(Pages.end(), Pages, Found->second);
+				Found = Index.erase(Found);
+			}
+		}
+
+		size_t const Capacity;
+		std::mutex Mutex;
+		std::list<Page> Pages; // Most recently used first
+		std::map<Key, std::list<Page>::iterator> Index;
+
+		std::atomic<uint64_t> ReadHits, ReadMisses, PrefetchedBytes, BufferedWrites, FlushedWrites;
+};
+
+#endif
@@ -4,11 +4,13 @@
 #include "core.h"
 
 #include <string>
+#include <vector>
 #include <memory>
 #include <cassert>
 #include <dirent.h>
 #include <sys/time.h>
 #include <sstream>
+#include <mutex>
 
 #define _FILE_OFFSET_BITS 64
 #define _REENTRANT
@@ -19,10 +21,105 @@ struct
 {
 	bfs::path RootPath;
 	std::string InstanceName;
+	Optional<bool> Deduplicate;
+	Optional<bool> Compress;
+	Optional<LogLevel> Level;
+	bool RingIO = false;
 } static PreinitContext;
 
 static std::unique_ptr<ShareCore> Core;
 
+// The FUSE callbacks, timed in FuseLatency
+enum class FuseOperation
+{
+	Getattr,
+	Fgetattr,
+	Access,
+	Statfs,
+	Rename,
+	Chmod,
+	Utimens,
+	Mkdir,
+	Opendir,
+	Releasedir,
+	Readdir,
+	Rmdir,
+	Create,
+	Open,
+	Truncate,
+	Ftruncate,
+	Unlink,
+	Read,
+	Write,
+	Fallocate,
+	Flush,
+	Release,
+	Fsync
+};
+
+static LatencyStats FuseLatency({"getattr", "fgetattr", "access", "statfs", "rename", "chmod", "utimens", "mkdir", "opendir",
+	"releasedir", "readdir", "rmdir", "create", "open", "truncate", "ftruncate", "unlink", "read", "write", "fallocate",
+	"flush", "release", "fsync"});
+static LatencyStats *CoreLatency = nullptr;
+
+// A hidden file at the top of the mount with the latency of each FUSE callback and core operation, and the file
+// cache's counters, since the mount started or the file was last truncated.  Reading it snapshots the stats when
+// opened; it can't be written.
+#define StatsPath "/." App "-stats"
+
+// The cache counts from when the core started, so resetting remembers where the counts were
+static std::mutex CacheBaselineMutex;
+static FileCacheStats CacheBaseline{0, 0, 0, 0, 0};
+
+static bool IsStats(char const *Path) { return strcmp(Path, StatsPath) == 0; }
+
+static std::string ReportCache(void)
+{
+	if (!Core) return std::string();
+	FileCacheStats Stats = (*Core)->GetFileCacheStats();
+	{
+		std::lock_guard<std::mutex> Guard(CacheBaselineMutex);
+		Stats.ReadHits -= CacheBaseline.ReadHits;
+		Stats.ReadMisses -= CacheBaseline.ReadMisses;
+		Stats.PrefetchedBytes -= CacheBaseline.PrefetchedBytes;
+		Stats.BufferedWrites -= CacheBaseline.BufferedWrites;
+		Stats.FlushedWrites -= CacheBaseline.FlushedWrites;
+	}
+	return String() << "# counter value\n" <<
+		"cache.ReadHits " << Stats.ReadHits << "\n" <<
+		"cache.ReadMisses " << Stats.ReadMisses << "\n" <<
+		"cache.PrefetchedBytes " << Stats.PrefetchedBytes << "\n" <<
+		"cache.BufferedWrites " << Stats.BufferedWrites << "\n" <<
+		"cache.FlushedWrites " << Stats.FlushedWrites << "\n";
+}
+
+static std::string ReportStats(void)
+{
+	return "# operation count p50 p99 p999 max (nanoseconds)\n" + FuseLatency.Report("fuse.") +
+		(CoreLatency ? CoreLatency->Report("core.") : std::string()) + ReportCache();
+}
+
+static void ResetStats(void)
+{
+	FuseLatency.Reset();
+	if (CoreLatency) CoreLatency->Reset();
+	if (Core)
+	{
+		std::lock_guard<std::mutex> Guard(CacheBaselineMutex);
+		CacheBaseline = (*Core)->GetFileCacheStats();
+	}
+}
+
+static void StatStats(struct stat *Output)
+{
+	memset(Output, 0, sizeof(*Output));
+	// The size isn't known until it's read, and reads bypass the page cache
+	Output->st_mode = S_IFREG | S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+	Output->st_nlink = 1;
+	Output->st_uid = getuid();
+	Output->st_gid = getgid();
+}
+
 void ExportAttributes(ShareFile const &File, struct stat *Output)
 {
 	Output->st_mode =
@@ -43,27 +140,46 @@ void ExportAttributes(ShareFile const &File, struct stat *Output)
 	Output->st_ctime = StrictCast(File.ModifiedTime(), time_t);
 }
 
-/*struct FileContext
-{
-	std::unique_ptr<ShareFile> Share;
-	int FileDescriptor;
-	FileContext(void) : FileDescriptor(-1) {}
-	~FileContext(void) { if (FileDescriptor >= 0) close(FileDescriptor); }
-};*/
-
 int main(int argc, char **argv)
 {
 	StandardOutLog Log("initialization");
 
-	if (argc <= 2)
+	std::vector<char const *> Arguments;
+	for (int Index = 1; Index < argc; ++Index)
+	{
+		std::string const Argument = argv[Index];
+		if (Argument == "--deduplicate") PreinitContext.Deduplicate = true;
+		else if (Argument == "--no-deduplicate") PreinitContext.Deduplicate = false;
+		else if (Argument == "--compress") PreinitContext.Compress = true;
+		else if (Argument == "--no-compress") PreinitContext.Compress = false;
+		else if (Argument == "--io-uring") PreinitContext.RingIO = true;
+		else if (Argument.compare(0, 12, "--log-level=") == 0)
+		{
+			LogLevel Level;
+			if (!ParseLogLevel(Argument.substr(12), Level))
+			{
+				Log.Error() << "Unknown log level \"" << Argument.substr(12) << "\", expected debug, note, warn or error.";
+				return 1;
+			}
+			PreinitContext.Level = Level;
+		}
+		else Arguments.push_back(argv[Index]);
+	}
+
+	if (Arguments.size() < 2)
 	{
-		Log.Note() << ("Usage: " App " LOCATION MOUNTPOINT [NAME]\n"
-			"\tMounts " App " share LOCATION at MOUNTPOINT.  If LOCATION does not exist, creates a new share with NAME.");
+		Log.Note() << ("Usage: " App " [OPTIONS] LOCATION MOUNTPOINT [NAME]\n"
+			"\tMounts " App " share LOCATION at MOUNTPOINT.  If LOCATION does not exist, creates a new share with NAME.\n"
+			"\tThe latency of each operation since mounting is in MOUNTPOINT/." App "-stats; truncating it starts the counts over.\n"
+			"\t--deduplicate, --no-deduplicate: Store newly written file data in the deduplicating block store, or not.  Remembered by the share.\n"
+			"\t--compress, --no-compress: Compress newly stored blocks of file data where that saves space, or not.  Files go to the block store with this on even without deduplication.  Remembered by the share.\n"
+			"\t--io-uring: Read ahead from backing files in batches through io_uring, falling back to plain syscalls if the kernel doesn't support it.  Other reads and writes stay plain syscalls, which are faster one at a time.\n"
+			"\t--log-level=LEVEL: Write lines at LEVEL (debug, note, warn or error) and above to the share's log.  Debug lines are only available in debug builds.");
 		return 0;
 	}
 
-	PreinitContext.RootPath = argv[1];
-	if (argc >= 3) PreinitContext.InstanceName = argv[3];
+	PreinitContext.RootPath = Arguments[0];
+	if (Arguments.size() >= 3) PreinitContext.InstanceName = Arguments[2];
 
 	fuse_operations FuseCallbacks{0};
 
@@ -90,7 +206,21 @@ int main(int argc, char **argv)
 	FuseCallbacks.init = [](fuse_conn_info *conn) -> void *
 	{
 		StandardOutLog Log("initialization");
-		try { Core.reset(new ShareCore(PreinitContext.RootPath, PreinitContext.InstanceName)); }
+		try
+		{
+			Core.reset(new ShareCore(PreinitContext.RootPath, PreinitContext.InstanceName));
+			CoreLatency = &(*Core)->GetLatency();
+			if (PreinitContext.Level) (*Core)->SetLogLevel(*PreinitContext.Level);
+			(*Core)->StartCompaction(CompactionSettings());
+			(*Core)->StartIngestion();
+			if (((*Core)->GetFileLayout().Levels == 0) && !(*Core)->IsMigratingLayout())
+				(*Core)->SetFileLayout(FileLayout());
+			(*Core)->StartLayoutMigration(MigrationSettings());
+			if (PreinitContext.Deduplicate) (*Core)->SetDeduplication(*PreinitContext.Deduplicate);
+			if (PreinitContext.Compress) (*Core)->SetCompression(*PreinitContext.Compress);
+			if (PreinitContext.RingIO && !(*Core)->UseRingIO(128))
+				Log.Warn() << "io_uring is unavailable, backing file I/O will be synchronous.";
+		}
 		catch (UserError &Message)
 		{
 			Log.Error() << Message;
@@ -107,27 +237,35 @@ int main(int argc, char **argv)
 	// Lookup/read metadata actions
 	FuseCallbacks.getattr = [](const char *path, struct stat *stbuf)
 	{
+		LatencyTimer Timer(FuseLatency, FuseOperation::Getattr);
+		if (IsStats(path)) { StatStats(stbuf); return 0; }
 		GetResult File = (*Core)->Get(path);
 		if (!File) return -ENOENT;
 		if (File->IsFile())
 		{
-			int Result = lstat((*Core)->GetRealPath(*File).string().c_str(), stbuf);
-			if (Result == -1) return -errno;
+			int Result = (*Core)->StatBacking(*File, stbuf);
+			if (Result != 0) return Result;
 		}
 		ExportAttributes(*File, stbuf);
 		return 0;
 	};
 
-	/*FuseCallbacks.fgetattr = [](const char *, struct stat *stbuf, struct fuse_file_info *fi)
+	FuseCallbacks.fgetattr = [](const char *path, struct stat *stbuf, struct fuse_file_info *fi)
 	{
-		ShareFile *File = reinterpret_cast<ShareFile *>(fi->fh);
-		int Result = fstat(File->FileDescriptor, stbuf);
-		if (Result == -1) return -errno;
-		return ExportAttributes(*File, stbuf);
-	};*/
+		LatencyTimer Timer(FuseLatency, FuseOperation::Fgetattr);
+		if (IsStats(path)) { StatStats(stbuf); return 0; }
+		GetResult File = (*Core)->Get(path);
+		if (!File) return -ENOENT;
+		int Result = reinterpret_cast<OpenFile *>(fi->fh)->Stat(stbuf);
+		if (Result != 0) return Result;
+		ExportAttributes(*File, stbuf);
+		return 0;
+	};
 
 	FuseCallbacks.access = [](const char *path, int mask)
 	{
+		LatencyTimer Timer(FuseLatency, FuseOperation::Access);
+		if (IsStats(path)) return (mask & X_OK) ? -EACCES : 0;
 		GetResult File = (*Core)->Get(path);
 		if (!File) return -ENOENT;
 		if
@@ -140,6 +278,7 @@ int main(int argc, char **argv)
 
 	FuseCallbacks.statfs = [](const char *path, struct statvfs *stbuf)
 	{
+		LatencyTimer Timer(FuseLatency, FuseOperation::Statfs);
 		int Result = statvfs((*Core)->GetRoot().string().c_str(), stbuf);
 		if (Result == -1) return -errno;
 		return 0;
@@ -148,6 +287,8 @@ int main(int argc, char **argv)
 	// Directory or file changes
 	FuseCallbacks.rename = [](const char *from, const char *to)
 	{
+		LatencyTimer Timer(FuseLatency, FuseOperation::Rename);
+		if (IsStats(from) || IsStats(to)) return -EPERM;
 		switch ((*Core)->Move(from, to))
 		{
 			case ActionError::OK: break;
@@ -161,6 +302,8 @@ int main(int argc, char **argv)
 
 	FuseCallbacks.chmod = [](const char *path, mode_t mode)
 	{
+		LatencyTimer Timer(FuseLatency, FuseOperation::Chmod);
+		if (IsStats(path)) return -EPERM;
 		switch ((*Core)->SetPermissions(path, mode & S_IWUSR, mode & S_IXUSR))
 		{
 			case ActionError::OK: break;
@@ -173,6 +316,8 @@ int main(int argc, char **argv)
 
 	FuseCallbacks.utimens = [](const char *path, const struct timespec ts[2])
 	{
+		LatencyTimer Timer(FuseLatency, FuseOperation::Utimens);
+		if (IsStats(path)) return -EPERM;
 		switch ((*Core)->SetTimestamp(path, static_cast<Timestamp::Type>(ts[1].tv_sec)))
 		{
 			case ActionError::OK: break;
@@ -192,6 +337,8 @@ int main(int argc, char **argv)
 	// Directory access
 	FuseCallbacks.mkdir = [](const char *path, mode_t mode)
 	{
+		LatencyTimer Timer(FuseLatency, FuseOperation::Mkdir);
+		if (IsStats(path)) return -EEXIST;
 		switch ((*Core)->CreateDirectory(path, mode & S_IWUSR, mode & S_IXUSR))
 		{
 			case ActionError::OK: break;
@@ -203,6 +350,8 @@ int main(int argc, char **argv)
 
 	FuseCallbacks.opendir = [](const char *path, fuse_file_info *fi)
 	{
+		LatencyTimer Timer(FuseLatency, FuseOperation::Opendir);
+		if (IsStats(path)) return -ENOTDIR;
 		ActionResult<std::unique_ptr<ShareFile>> Result = (*Core)->OpenDirectory(path);
 		switch (Result.Code)
 		{
@@ -219,12 +368,14 @@ int main(int argc, char **argv)
 
 	FuseCallbacks.releasedir = [](const char *, struct fuse_file_info *fi)
 	{
+		LatencyTimer Timer(FuseLatency, FuseOperation::Releasedir);
 		delete reinterpret_cast<ShareFile *>(fi->fh);
 		return 0;
 	};
 
 	FuseCallbacks.readdir = [](const char *, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
 	{
+		LatencyTimer Timer(FuseLatency, FuseOperation::Readdir);
 		ShareFile *File = reinterpret_cast<ShareFile *>(fi->fh);
 
 		static unsigned int BlockCount = 100;
@@ -254,8 +405,11 @@ int main(int argc, char **argv)
 
 	FuseCallbacks.rmdir = [](const char *path)
 	{
+		LatencyTimer Timer(FuseLatency, FuseOperation::Rmdir);
+		if (IsStats(path)) return -ENOTDIR;
 		switch ((*Core)->Delete(path))
 		{
+			case ActionError::OK: break;
 			case ActionError::Invalid: return -ENOTDIR;
 			case ActionError::Missing: return -ENOENT;
 			default: assert(false); return -ELOOP;
@@ -264,84 +418,176 @@ int main(int argc, char **argv)
 	};
 
 	// File access
-	/*FuseCallbacks.create = [](const char *path, mode_t mode, struct fuse_file_info *fi)
+	FuseCallbacks.create = [](const char *path, mode_t mode, struct fuse_file_info *fi)
 	{
-		int fd = open((*Core)->TranslatePath(path).c_str(), fi->flags, mode);
-		if (fd == -1) return -errno;
-		fi->fh = fd;
+		LatencyTimer Timer(FuseLatency, FuseOperation::Create);
+		if (IsStats(path)) return -EEXIST;
+		switch ((*Core)->CreateFile(path, mode & S_IWUSR, mode & S_IXUSR))
+		{
+			case ActionError::OK: break;
+			case ActionError::Exists: return -EEXIST;
+			case ActionError::Invalid: return -ENOTDIR;
+			case ActionError::Missing: return -ENOENT;
+			case ActionError::Illegal: return -EPERM;
+			default: assert(false); return -EIO;
+		}
+		// The creator may write even if the new file isn't writable
+		auto Result = (*Core)->Open(path, true, false);
+		if (!Result) return -ENOENT;
+		fi->fh = reinterpret_cast<decltype(fi->fh)>((*Result).release());
 		return 0;
 	};
 
 	FuseCallbacks.open = [](const char *path, struct fuse_file_info *fi)
 	{
-		ShareFile *(*Core)->Get(path).release();
-		fi->fh = reinterpret_cast<decltype(fi->fh)>(ShareFile);
-		int Result = open((*Core)->TranslatePath(path).c_str(), fi->flags);
-		if (Result == -1) return -errno;
-		close(Result);
+		LatencyTimer Timer(FuseLatency, FuseOperation::Open);
+		if (IsStats(path))
+		{
+			if (fi->flags & O_TRUNC) ResetStats();
+			fi->direct_io = 1;
+			fi->fh = reinterpret_cast<decltype(fi->fh)>(new std::string(ReportStats()));
+			return 0;
+		}
+		bool const Writable = (fi->flags & O_ACCMODE) != O_RDONLY;
+		auto Result = (*Core)->Open(path, Writable, fi->flags & O_TRUNC);
+		switch (Result.Code)
+		{
+			case ActionError::OK: break;
+			case ActionError::Invalid: return -EISDIR;
+			case ActionError::Missing: return -ENOENT;
+			case ActionError::Restricted: return -EACCES;
+			default: assert(false); return -EIO;
+		}
+		if (Writable && !(*Result)->File.CanWrite())
+		{
+			(*Core)->Release(std::move(*Result));
+			return -EACCES;
+		}
+		fi->fh = reinterpret_cast<decltype(fi->fh)>((*Result).release());
 		return 0;
 	};
 
-
 	FuseCallbacks.truncate = [](const char *path, off_t size)
 	{
-		int Result = truncate((*Core)->TranslatePath(path).c_str(), size);
-		if (Result == -1) return -errno;
-		return 0;
+		LatencyTimer Timer(FuseLatency, FuseOperation::Truncate);
+		if (IsStats(path))
+		{
+			if (size != 0) return -EACCES;
+			ResetStats();
+			return 0;
+		}
+		auto Result = (*Core)->Open(path, true, false);
+		switch (Result.Code)
+		{
+			case ActionError::OK: break;
+			case ActionError::Invalid: return -EISDIR;
+			case ActionError::Missing: return -ENOENT;
+			default: assert(false); return -EIO;
+		}
+		if (!(*Result)->File.CanWrite())
+		{
+			(*Core)->Release(std::move(*Result));
+			return -EACCES;
+		}
+		int Truncated = (*Result)->Truncate(size);
+		(*Core)->Release(std::move(*Result));
+		return Truncated;
 	};
 
-	FuseCallbacks.ftruncate = [](const char *, off_t size, struct fuse_file_info *fi)
+	FuseCallbacks.ftruncate = [](const char *path, off_t size, struct fuse_file_info *fi)
 	{
-		int Result = ftruncate(fi->fh, size);
-		if (Result == -1) return -errno;
-		return 0;
+		LatencyTimer Timer(FuseLatency, FuseOperation::Ftruncate);
+		if (IsStats(path))
+		{
+			if (size != 0) return -EACCES;
+			ResetStats();
+			return 0;
+		}
+		return reinterpret_cast<OpenFile *>(fi->fh)->Truncate(size);
 	};
 
 	FuseCallbacks.unlink = [](const char *path)
 	{
-		int Result = unlink((*Core)->TranslatePath(path).c_str());
-		if (Result == -1) return -errno;
+		LatencyTimer Timer(FuseLatency, FuseOperation::Unlink);
+		if (IsStats(path)) return -EPERM;
+		GetResult File = (*Core)->Get(path);
+		if (!File) return -ENOENT;
+		if (!File->IsFile()) return -EISDIR;
+		switch ((*Core)->Delete(path))
+		{
+			case ActionError::OK: break;
+			case ActionError::Missing: return -ENOENT;
+			case ActionError::Illegal: return -EPERM;
+			default: assert(false); return -EIO;
+		}
 		return 0;
 	};
 
 	FuseCallbacks.read = [](const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 	{
-		int Result = pread(fi->fh, buf, size, offset);
-		if (Result == -1) return -errno;
-		return Result;
+		LatencyTimer Timer(FuseLatency, FuseOperation::Read);
+		if (IsStats(path))
+		{
+			std::string const &Report = *reinterpret_cast<std::string *>(fi->fh);
+			if (static_cast<size_t>(offset) >= Report.size()) return 0;
+			size_t const Count = std::min(size, Report.size() - static_cast<size_t>(offset));
+			memcpy(buf, Report.data() + offset, Count);
+			return static_cast<int>(Count);
+		}
+		return static_cast<int>(reinterpret_cast<OpenFile *>(fi->fh)->Read(buf, size, offset));
 	};
 
 	FuseCallbacks.write = [](const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 	{
-		int Result = pwrite(fi->fh, buf, size, offset);
-		if (Result == -1) return -errno;
-		return Result;
+		LatencyTimer Timer(FuseLatency, FuseOperation::Write);
+		if (IsStats(path)) return -EACCES;
+		OpenFile *File = reinterpret_cast<OpenFile *>(fi->fh);
+		if (!File->Writable) return -EBADF;
+		return static_cast<int>(File->Write(buf, size, offset));
 	};
 
-	FuseCallbacks.release = [](const char *, struct fuse_file_info *fi)
+	// FUSE 2 has no lseek callback, so SEEK_DATA and SEEK_HOLE (OpenFile::Seek) can't be passed through yet
+	FuseCallbacks.fallocate = [](const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi)
 	{
-		close(fi->fh);
-		return 0;
+		LatencyTimer Timer(FuseLatency, FuseOperation::Fallocate);
+		if (IsStats(path)) return -EACCES;
+		OpenFile *File = reinterpret_cast<OpenFile *>(fi->fh);
+		if (!File->Writable) return -EBADF;
+		return File->Allocate(mode, offset, length);
 	};
 
-	FuseCallbacks.fsync = [](const char *, int isdatasync, struct fuse_file_info *fi)
+	// Every close, so errors writing held back data reach the application
+	FuseCallbacks.flush = [](const char *path, struct fuse_file_info *fi)
 	{
-		int Result;
-
-#ifndef HAVE_FDATASYNC
-		(void) isdatasync;
-		Result = fsync(fi->fh);
-#else
-		if (isdatasync) Result = fdatasync(fi->fh);
-		else Result = fsync(fi->fh);
-#endif
-		if (Result == -1) return -errno;
+		LatencyTimer Timer(FuseLatency, FuseOperation::Flush);
+		if (IsStats(path)) return 0;
+		return reinterpret_cast<OpenFile *>(fi->fh)->Flush();
+	};
+
+	FuseCallbacks.release = [](const char *path, struct fuse_file_info *fi)
+	{
+		LatencyTimer Timer(FuseLatency, FuseOperation::Release);
+		if (IsStats(path))
+		{
+			delete reinterpret_cast<std::string *>(fi->fh);
+			return 0;
+		}
+		(*Core)->Release(std::unique_ptr<OpenFile>(reinterpret_cast<OpenFile *>(fi->fh)));
 		return 0;
-	};*/
+	};
+
+	FuseCallbacks.fsync = [](const char *path, int isdatasync, struct fuse_file_info *fi)
+	{
+		LatencyTimer Timer(FuseLatency, FuseOperation::Fsync);
+		if (IsStats(path)) return 0;
+		OpenFile *File = reinterpret_cast<OpenFile *>(fi->fh);
+		if (File->HasStagedExtents()) (*Core)->Commit(*File);
+		return File->Sync(isdatasync);
+	};
 
 	fuse_args FuseArgs = FUSE_ARGS_INIT(0, NULL);
 	fuse_opt_add_arg(&FuseArgs, argv[0]);
-	fuse_opt_add_arg(&FuseArgs, argv[2]);
+	fuse_opt_add_arg(&FuseArgs, Arguments[1]);
 	fuse_opt_add_arg(&FuseArgs, "-d");
 
 	return fuse_main(FuseArgs.argc, FuseArgs.argv, &FuseCallbacks, nullptr);
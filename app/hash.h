@@ -0,0 +1,66 @@
+#ifndef hash_h
+#define hash_h
+
+#include <cstdint>
+#include <cstring>
+
+// 128-bit non-cryptographic hash for naming stored blocks.  Input is consumed in 32 byte stripes across four
+// independent multiply-rotate lanes, so the lanes pipeline (and vectorize where the target has 64-bit multiplies)
+// rather than forming one serial dependency chain.  Words are read in host byte order, so hashes are only
+// comparable between hosts of the same endianness.
+
+struct ContentHash
+{
+	uint64_t High;
+	uint64_t Low;
+
+	bool operator ==(ContentHash const &Other) const { return (High == Other.High) && (Low == Other.Low); }
+	bool operator !=(ContentHash const &Other) const { return !(*this == Other); }
+};
+
+namespace HashDetail
+{
+	static constexpr uint64_t Prime1 = 0x9E3779B185EBCA87ull;
+	static constexpr uint64_t Prime2 = 0xC2B2AE3D27D4EB4Full;
+	static constexpr uint64_t Prime3 = 0x165667B19E3779F9ull;
+	static constexpr uint64_t Prime4 = 0x85EBCA77C2B2AE63ull;
+	static constexpr uint64_t Prime5 = 0x27D4EB2F165667C5ull;
+
+	inline uint64_t Rotate(uint64_t Value, unsigned int Bits) { return (Value << Bits) | (Value >> (64 - Bits)); }
+	inline uint64_t Round(uint64_t Lane, uint64_t Input) { return Rotate(Lane + Input * Prime2, 31) * Prime1; }
+	inline uint64_t Avalanche(uint64_t Value)
+	{
+		Value ^= Value >> 33;
+		Value *= Prime2;
+		Value ^= Value >> 29;
+		Value *= Prime3;
+		Value ^= Value >> 32;
+		return Value;
+	}
+}
+
+inline ContentHash HashContent(void const *Data, size_t Length)
+{
+	using namespace HashDetail;
+	uint64_t Lanes[4] = {Prime1 + Prime2, Prime2, 0, 0 - Prime1};
+	auto Next = static_cast<uint8_t const *>(Data);
+	size_t Remaining = Length;
+	for (; Remaining >= 32; Remaining -= 32, Next += 32)
+	{
+		uint64_t Stripe[4];
+		memcpy(Stripe, Next, sizeof(Stripe));
+		for (unsigned int Lane = 0; Lane < 4; ++Lane) Lanes[Lane] = Round(Lanes[Lane], Stripe[Lane]);
+	}
+	if (Remaining > 0)
+	{
+		// The zero padding is told apart from real zeros by the length in the final mix
+		uint64_t Stripe[4] = {0, 0, 0, 0};
+		memcpy(Stripe, Next, Remaining);
+		for (unsigned int Lane = 0; Lane < 4; ++Lane) Lanes[Lane] = Round(Lanes[Lane], Stripe[Lane]);
+	}
+	uint64_t const Merged = Rotate(Lanes[0], 1) + Rotate(Lanes[1], 7) + Rotate(Lanes[2], 12) + Rotate(Lanes[3], 18) + Length;
+	uint64_t const Crossed = (Lanes[0] * Prime4) ^ Rotate(Lanes[1], 27) ^ (Lanes[2] * Prime5) ^ Rotate(Lanes[3], 41) ^ (Length * Prime3);
+	return {Avalanche(Merged), Avalanche(Crossed + Merged * Prime4)};
+}
+
+#endif
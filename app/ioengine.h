@@ -0,0 +1,401 @@
+#ifndef ioengine_h
+#define ioengine_h
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "error.h"
+
+// Reads and writes on backing files, either as plain synchronous syscalls or through one shared io_uring.  With the
+// ring, files can be registered so the kernel skips the descriptor lookup per operation, and batches of operations
+// into the engine's registered buffers go to the kernel in one submission.  A lone operation costs more through the
+// ring than as a syscall, so only batches use it.  The ring is driven with raw syscalls; whichever waiting thread
+// gets there first reaps completions for everyone.
+
+struct IOOperation
+{
+	IOOperation(bool Write, int File, char *Data, size_t Length, off_t Offset, int Slot = -1, int Buffer = -1) :
+		Write(Write), File(File), Slot(Slot), Buffer(Buffer), Data(Data), Length(Length), Offset(Offset), Result(0),
+		Remaining(nullptr) {}
+
+	bool Write;
+	int File;
+	int Slot; // Registered file or -1
+	int Buffer; // Registered buffer holding Data, or -1
+	char *Data;
+	size_t Length;
+	off_t Offset;
+	ssize_t Result; // Bytes, possibly short, or -errno
+
+	private:
+		friend struct IOEngine;
+		size_t *Remaining;
+};
+
+namespace IODetail
+{
+	inline int Setup(unsigned int Entries, io_uring_params *Parameters)
+		{ return static_cast<int>(syscall(__NR_io_uring_setup, Entries, Parameters)); }
+	inline int Enter(int Ring, unsigned int Submit, unsigned int Complete, unsigned int Flags)
+		{ return static_cast<int>(syscall(__NR_io_uring_enter, Ring, Submit, Complete, Flags, nullptr, 0)); }
+	inline int Register(int Ring, unsigned int Opcode, void const *Argument, unsigned int Count)
+		{ return static_cast<int>(syscall(__NR_io_uring_register, Ring, Opcode, Argument, Count)); }
+}
+
+struct IOEngine
+{
+	static constexpr unsigned int FileSlots = 4096;
+	static constexpr size_t BufferSize = 128 * 1024; // The largest FUSE request
+
+	// Synchronous
+	IOEngine(void) : Ring(-1), Depth(0), InFlight(0), Reaping(false) {}
+
+	// Throws if the kernel won't set up a ring; callers fall back to the synchronous engine
+	IOEngine(unsigned int Depth) : Ring(-1), Depth(Depth), InFlight(0), Reaping(false)
+	{
+		io_uring_params Parameters;
+		memset(&Parameters, 0, sizeof(Parameters));
+		Ring = IODetail::Setup(Depth, &Parameters);
+		if (Ring < 0) throw SystemError() << "Could not set up io_uring: " << strerror(errno);
+		try
+		{
+			SubmitMapSize = Parameters.sq_off.array + Parameters.sq_entries * sizeof(unsigned);
+			CompleteMapSize = Parameters.cq_off.cqes + Parameters.cq_entries * sizeof(io_uring_cqe);
+			bool const Single = Parameters.features & IORING_FEAT_SINGLE_MMAP;
+			if (Single) SubmitMapSize = CompleteMapSize = std::max(SubmitMapSize, CompleteMapSize);
+			SubmitMap = Map(SubmitMapSize, IORING_OFF_SQ_RING);
+			CompleteMap = Single ? SubmitMap : Map(CompleteMapSize, IORING_OFF_CQ_RING);
+			EntriesSize = Parameters.sq_entries * sizeof(io_uring_sqe);
+			Entries = static_cast<io_uring_sqe *>(Map(EntriesSize, IORING_OFF_SQES));
+
+			auto const Submit = static_cast<char *>(SubmitMap);
+			SubmitHead = reinterpret_cast<unsigned *>(Submit + Parameters.sq_off.head);
+			SubmitTail = reinterpret_cast<unsigned *>(Submit + Parameters.sq_off.tail);
+			SubmitMask = *reinterpret_cast<unsigned *>(Submit + Parameters.sq_off.ring_mask);
+			SubmitArray = reinterpret_cast<unsigned *>(Submit + Parameters.sq_off.array);
+			auto const Complete = static_cast<char *>(CompleteMap);
+			CompleteHead = reinterpret_cast<unsigned *>(Complete + Parameters.cq_off.head);
+			CompleteTail = reinterpret_cast<unsigned *>(Complete + Parameters.cq_off.tail);
+			CompleteMask = *reinterpret_cast<unsigned *>(Complete + Parameters.cq_off.ring_mask);
+			Completions = reinterpret_cast<io_uring_cqe *>(Complete + Parameters.cq_off.cqes);
+			this->Depth = Parameters.sq_entries;
+
+			// An empty file table, filled in as files are registered
+			std::vector<int> Empty(FileSlots, -1);
+			if (IODetail::Register(Ring, IORING_REGISTER_FILES, Empty.data(), FileSlots) == 0)
+				for (unsigned int Slot = FileSlots; Slot > 0; --Slot) FreeSlots.push_back(static_cast<int>(Slot - 1));
+
+			// A buffer per queue entry in one mapping, pinned once here rather than on every operation
+			BufferMapSize = this->Depth * BufferSize;
+			BufferMap = mmap(nullptr, BufferMapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (BufferMap == MAP_FAILED) throw SystemError() << "Could not allocate I/O buffers: " << strerror(errno);
+			std::vector<iovec> Buffers(this->Depth);
+			for (unsigned int Index = 0; Index < this->Depth; ++Index)
+				Buffers[Index] = {static_cast<char *>(BufferMap) + Index * BufferSize, BufferSize};
+			if (IODetail::Register(Ring, IORING_REGISTER_BUFFERS, Buffers.data(), this->Depth) == 0)
+				for (unsigned int Index = this->Depth; Index > 0; --Index) FreeBuffers.push_back(static_cast<int>(Index - 1));
+		}
+		catch (...)
+		{
+			Unmap();
+			throw;
+		}
+	}
+
+	~IOEngine(void) { Unmap(); }
+
+	IOEngine(IOEngine const &) = delete;
+	IOEngine &operator =(IOEngine const &) = delete;
+
+	bool IsRing(void) const { return Ring >= 0; }
+	unsigned int GetDepth(void) const { return Depth; }
+
+	// A slot to pass with operations on File, or -1 if it couldn't be registered.  Files must be unregistered
+	// before they're closed, the ring holds its own reference.
+	int Register(int File)
+	{
+		if (Ring < 0) return -1;
+		std::lock_guard<std::mutex> Guard(Mutex);
+		if (FreeSlots.empty()) return -1;
+		int const Slot = FreeSlots.back();
+		io_uring_files_update Update;
+		memset(&Update, 0, sizeof(Update));
+		Update.offset = static_cast<unsigned>(Slot);
+		Update.fds = reinterpret_cast<uintptr_t>(&File);
+		if (IODetail::Register(Ring, IORING_REGISTER_FILES_UPDATE, &Update, 1) != 1) return -1;
+		FreeSlots.pop_back();
+		return Slot;
+	}
+
+	void Unregister(int Slot)
+	{
+		if (Slot < 0) return;
+		std::lock_guard<std::mutex> Guard(Mutex);
+		int const None = -1;
+		io_uring_files_update Update;
+		memset(&Update, 0, sizeof(Update));
+		Update.offset = static_cast<unsigned>(Slot);
+		Update.fds = reinterpret_cast<uintptr_t>(&None);
+		IODetail::Register(Ring, IORING_REGISTER_FILES_UPDATE, &Update, 1);
+		FreeSlots.push_back(Slot);
+	}
+
+	// A registered buffer of BufferSize bytes to use with operations, or -1 when none are free
+	int AcquireBuffer(void)
+	{
+		std::lock_guard<std::mutex> Guard(Mutex);
+		if (FreeBuffers.empty()) return -1;
+		int const Buffer = FreeBuffers.back();
+		FreeBuffers.pop_back();
+		return Buffer;
+	}
+
+	void ReleaseBuffer(int Buffer)
+	{
+		std::lock_guard<std::mutex> Guard(Mutex);
+		FreeBuffers.push_back(Buffer);
+	}
+
+	char *GetBuffer(int Buffer) { return static_cast<char *>(BufferMap) + static_cast<size_t>(Buffer) * BufferSize; }
+
+	// Performs the operations together, returning when all are done.  Each is a single read or write, so results
+	// may be short like pread and pwrite.
+	void Run(IOOperation *Operations, size_t Count)
+	{
+		if (Ring < 0)
+		{
+			RunSynchronous(Operations, Count);
+			return;
+		}
+
+		// Operations the kernel has are never abandoned, since completing them writes through their addresses
+		size_t Remaining = Count;
+		int SubmitError = 0, WaitError = 0;
+		std::unique_lock<std::mutex> Lock(Mutex);
+		for (size_t Next = 0; (Next < Count) && (SubmitError == 0);)
+		{
+			// Larger batches than the queue go in as room frees up
+			while (InFlight == Depth) Wait(Lock, Remaining, WaitError);
+			unsigned int Queued = 0;
+			for (; (Next < Count) && (InFlight < Depth); ++Next, ++Queued, ++InFlight)
+				Queue(Operations[Next], Remaining);
+			while (Queued > 0)
+			{
+				int const Result = IODetail::Enter(Ring, Queued, 0, 0);
+				if ((Result < 0) && (errno == EINTR)) continue;
+				if (Result < 0)
+				{
+					// Submitting holds the mutex, so whatever the kernel didn't take is this batch's to take back
+					SubmitError = errno;
+					__atomic_store_n(SubmitTail, __atomic_load_n(SubmitHead, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+					InFlight -= Queued;
+					Remaining -= Queued;
+					break;
+				}
+				Queued -= static_cast<unsigned int>(Result);
+			}
+		}
+		while (Remaining > 0) Wait(Lock, Remaining, WaitError);
+		if (SubmitError != 0) throw SystemError() << "Could not submit I/O: " << strerror(SubmitError);
+		if (WaitError != 0) throw SystemError() << "Could not wait for I/O: " << strerror(WaitError);
+	}
+
+	// Bytes read, short only at the end of the file, or -errno
+	ssize_t Read(int File, int Slot, char *Out, size_t Length, off_t Offset)
+	{
+		size_t Done = 0;
+		while (Done < Length)
+		{
+			IOOperation Operation(false, File, Out + Done, Length - Done, Offset + static_cast<off_t>(Done), Slot);
+			RunSynchronous(&Operation, 1);
+			if ((Operation.Result == -EINTR) || (Operation.Result == -EAGAIN)) continue;
+			if (Operation.Result < 0) return Operation.Result;
+			if (Operation.Result == 0) break;
+			Done += static_cast<size_t>(Operation.Result);
+		}
+		return static_cast<ssize_t>(Done);
+	}
+
+	ssize_t Write(int File, int Slot, char const *Data, size_t Length, off_t Offset)
+	{
+		size_t Done = 0;
+		while (Done < Length)
+		{
+			IOOperation Operation(true, File, const_cast<char *>(Data) + Done, Length - Done, Offset + static_cast<off_t>(Done), Slot);
+			RunSynchronous(&Operation, 1);
+			if ((Operation.Result == -EINTR) || (Operation.Result == -EAGAIN)) continue;
+			if (Operation.Result < 0) return Operation.Result;
+			Done += static_cast<size_t>(Operation.Result);
+		}
+		return static_cast<ssize_t>(Done);
+	}
+
+	// Like Read, but with the ring a range longer than a buffer is read as buffer sized pieces submitted together,
+	// into registered buffers while there are free ones
+	ssize_t ReadBatched(int File, int Slot, char *Out, size_t Length, off_t Offset)
+	{
+		if ((Ring < 0) || (Length <= BufferSize)) return Read(File, Slot, Out, Length, Offset);
+		size_t const Pieces = (Length + BufferSize - 1) / BufferSize;
+		std::vector<int> Buffers;
+		{
+			std::lock_guard<std::mutex> Guard(Mutex);
+			while ((Buffers.size() < Pieces) && !FreeBuffers.empty())
+			{
+				Buffers.push_back(FreeBuffers.back());
+				FreeBuffers.pop_back();
+			}
+		}
+		Cleanup Release([this, &Buffers]()
+		{
+			std::lock_guard<std::mutex> Guard(Mutex);
+			FreeBuffers.insert(FreeBuffers.end(), Buffers.begin(), Buffers.end());
+		});
+		std::vector<IOOperation> Operations;
+		Operations.reserve(Pieces);
+		for (size_t Index = 0; Index < Pieces; ++Index)
+		{
+			size_t const Start = Index * BufferSize;
+			size_t const Size = std::min(static_cast<size_t>(BufferSize), Length - Start);
+			off_t const At = Offset + static_cast<off_t>(Start);
+			if (Index < Buffers.size()) Operations.emplace_back(false, File, GetBuffer(Buffers[Index]), Size, At, Slot, Buffers[Index]);
+			else Operations.emplace_back(false, File, Out + Start, Size, At, Slot);
+		}
+		Run(Operations.data(), Operations.size());
+
+		// Up to the first short piece; the rest, if it's not the end of the file, is read after
+		size_t Done = 0;
+		for (auto const &Operation : Operations)
+		{
+			if ((Operation.Result == -EINTR) || (Operation.Result == -EAGAIN)) break;
+			if (Operation.Result < 0) return Operation.Result;
+			auto const Got = static_cast<size_t>(Operation.Result);
+			if (Operation.Buffer >= 0) memcpy(Out + Done, Operation.Data, Got);
+			Done += Got;
+			if (Got < Operation.Length) break;
+		}
+		if (Done == Length) return static_cast<ssize_t>(Done);
+		ssize_t const Rest = Read(File, Slot, Out + Done, Length - Done, Offset + static_cast<off_t>(Done));
+		if (Rest < 0) return Rest;
+		return static_cast<ssize_t>(Done) + Rest;
+	}
+
+	private:
+		static void RunSynchronous(IOOperation *Operations, size_t Count)
+		{
+			for (size_t Index = 0; Index < Count; ++Index)
+			{
+				auto &Operation = Operations[Index];
+				do
+				{
+					Operation.Result = Operation.Write ?
+						pwrite(Operation.File, Operation.Data, Operation.Length, Operation.Offset) :
+						pread(Operation.File, Operation.Data, Operation.Length, Operation.Offset);
+				} while ((Operation.Result < 0) && (errno == EINTR));
+				if (Operation.Result < 0) Operation.Result = -errno;
+			}
+		}
+
+		void *Map(size_t Size, off_t Offset)
+		{
+			void *Out = mmap(nullptr, Size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Ring, Offset);
+			if (Out == MAP_FAILED) throw SystemError() << "Could not map io_uring: " << strerror(errno);
+			return Out;
+		}
+
+		void Unmap(void)
+		{
+			if (BufferMap) munmap(BufferMap, BufferMapSize);
+			if (Entries) munmap(Entries, EntriesSize);
+			if (CompleteMap && (CompleteMap != SubmitMap)) munmap(CompleteMap, CompleteMapSize);
+			if (SubmitMap) munmap(SubmitMap, SubmitMapSize);
+			if (Ring >= 0) close(Ring);
+			BufferMap = SubmitMap = CompleteMap = nullptr;
+			Entries = nullptr;
+			Ring = -1;
+		}
+
+		// Called with the mutex held and room in the queue
+		void Queue(IOOperation &Operation, size_t &Remaining)
+		{
+			unsigned const Tail = *SubmitTail;
+			unsigned const Index = Tail & SubmitMask;
+			io_uring_sqe &Entry = Entries[Index];
+			memset(&Entry, 0, sizeof(Entry));
+			bool const Fixed = Operation.Buffer >= 0;
+			Entry.opcode = Operation.Write ?
+				(Fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE) :
+				(Fixed ? IORING_OP_READ_FIXED : IORING_OP_READ);
+			if (Operation.Slot >= 0)
+			{
+				Entry.fd = Operation.Slot;
+				Entry.flags = IOSQE_FIXED_FILE;
+			}
+			else Entry.fd = Operation.File;
+			Entry.off = static_cast<__u64>(Operation.Offset);
+			Entry.addr = reinterpret_cast<uintptr_t>(Operation.Data);
+			Entry.len = static_cast<__u32>(Operation.Length);
+			if (Fixed) Entry.buf_index = static_cast<__u16>(Operation.Buffer);
+			Entry.user_data = reinterpret_cast<uintptr_t>(&Operation);
+			Operation.Remaining = &Remaining;
+			SubmitArray[Index] = Index;
+			__atomic_store_n(SubmitTail, Tail + 1, __ATOMIC_RELEASE);
+		}
+
+		// Reaps if no other thread is, otherwise waits for the reaper to pass completions along.  A failed wait is
+		// remembered in Error rather than thrown, so the caller can still wait out its operations.
+		void Wait(std::unique_lock<std::mutex> &Lock, size_t const &Remaining, int &Error)
+		{
+			if (Reaping)
+			{
+				Reaped.wait(Lock);
+				return;
+			}
+			Reaping = true;
+			Lock.unlock();
+			int const Result = IODetail::Enter(Ring, 0, 1, IORING_ENTER_GETEVENTS);
+			int const EnterError = errno;
+			Lock.lock();
+			Reaping = false;
+			unsigned Head = *CompleteHead;
+			unsigned const Tail = __atomic_load_n(CompleteTail, __ATOMIC_ACQUIRE);
+			for (; Head != Tail; ++Head)
+			{
+				io_uring_cqe const &Completion = Completions[Head & CompleteMask];
+				auto &Operation = *reinterpret_cast<IOOperation *>(static_cast<uintptr_t>(Completion.user_data));
+				Operation.Result = Completion.res;
+				--*Operation.Remaining;
+				--InFlight;
+			}
+			__atomic_store_n(CompleteHead, Head, __ATOMIC_RELEASE);
+			Reaped.notify_all();
+			if ((Result < 0) && (EnterError != EINTR) && (Remaining > 0) && (Error == 0)) Error = EnterError;
+		}
+
+		int Ring;
+		unsigned int Depth;
+		void *SubmitMap = nullptr, *CompleteMap = nullptr, *BufferMap = nullptr;
+		io_uring_sqe *Entries = nullptr;
+		size_t SubmitMapSize = 0, CompleteMapSize = 0, EntriesSize = 0, BufferMapSize = 0;
+		unsigned *SubmitHead, *SubmitTail, *SubmitArray, SubmitMask;
+		unsigned *CompleteHead, *CompleteTail, CompleteMask;
+		io_uring_cqe *Completions;
+
+		std::mutex Mutex;
+		std::condition_variable Reaped;
+		unsigned int InFlight;
+		bool Reaping;
+		std::vector<int> FreeSlots;
+		std::vector<int> FreeBuffers;
+};
+
+#endif
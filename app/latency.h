@@ -0,0 +1,190 @@
+#ifndef latency_h
+#define latency_h
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Since the stats were created or last reset, in nanoseconds.  Percentiles are the top of the bucket they fall in,
+// so within an eighth of the true value.
+struct LatencySummary
+{
+	uint64_t Count;
+	uint64_t P50;
+	uint64_t P99;
+	uint64_t P999;
+	uint64_t Max;
+};
+
+// Latency histograms for a fixed set of named operations.  Each thread counts into its own buckets, so recording
+// is a couple of relaxed atomic stores with no lock or shared cache line; the lock is only taken the first time a
+// thread records and when summarizing.  Buckets are log-linear: 8 per power of two, up to about half an hour.
+// Resetting remembers the counts so far rather than clearing them, so recording threads never race with it.
+struct LatencyStats
+{
+	static constexpr unsigned int SubBits = 3;
+	static constexpr unsigned int MaxExponent = 40;
+	// The last holds everything longer
+	static constexpr size_t Buckets = ((MaxExponent - SubBits + 2) << SubBits) + 1;
+
+	LatencyStats(std::vector<std::string> const &Names) :
+		Names(Names), Serial(NextSerial()++), Baseline(Names.size() * Buckets, 0) {}
+
+	size_t GetCount(void) const { return Names.size(); }
+	std::string const &GetName(size_t Operation) const { return Names[Operation]; }
+
+	void Record(size_t Operation, uint64_t Nanoseconds)
+	{
+		std::atomic<uint64_t> &Count = ThreadCounts()[Operation * Buckets + Bucket(Nanoseconds)];
+		// Only this thread writes its counts
+		Count.store(Count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+
+	LatencySummary Summarize(size_t Operation) const
+	{
+		std::vector<uint64_t> Counts(Buckets, 0);
+		{
+			std::lock_guard<std::mutex> Guard(Mutex);
+			Sum(Operation, Counts.data());
+			for (size_t Index = 0; Index < Buckets; ++Index) Counts[Index] -= Baseline[Operation * Buckets + Index];
+		}
+		LatencySummary Out{0, 0, 0, 0, 0};
+		for (auto const Count : Counts) Out.Count += Count;
+		if (Out.Count == 0) return Out;
+		Out.P50 = Percentile(Counts, Out.Count, 500);
+		Out.P99 = Percentile(Counts, Out.Count, 990);
+		Out.P999 = Percentile(Counts, Out.Count, 999);
+		Out.Max = Percentile(Counts, Out.Count, 1000);
+		return Out;
+	}
+
+	// A line per operation: the prefixed name, count, p50, p99, p999 and max in nanoseconds
+	std::string Report(std::string const &Prefix) const
+	{
+		std::ostringstream Out;
+		for (size_t Operation = 0; Operation < Names.size(); ++Operation)
+		{
+			LatencySummary const Summary = Summarize(Operation);
+			Out << Prefix << Names[Operation] << " " << Summary.Count << " " << Summary.P50 << " " << Summary.P99 << " " <<
+				Summary.P999 << " " << Summary.Max << "\n";
+		}
+		return Out.str();
+	}
+
+	void Reset(void)
+	{
+		std::lock_guard<std::mutex> Guard(Mutex);
+		for (size_t Operation = 0; Operation < Names.size(); ++Operation) Sum(Operation, &Baseline[Operation * Buckets]);
+	}
+
+	static size_t Bucket(uint64_t Nanoseconds)
+	{
+		if (Nanoseconds < (1u << SubBits)) return static_cast<size_t>(Nanoseconds);
+		unsigned int const Exponent = 63 - __builtin_clzll(Nanoseconds);
+		if (Exponent > MaxExponent) return Buckets - 1;
+		return ((Exponent - SubBits + 1) << SubBits) + ((Nanoseconds >> (Exponent - SubBits)) & ((1u << SubBits) - 1));
+	}
+
+	// The largest value that lands in the bucket
+	static uint64_t BucketTop(size_t Index)
+	{
+		if (Index < (1u << SubBits)) return Index;
+		if (Index == Buckets - 1) return ~uint64_t(0);
+		unsigned int const Exponent = static_cast<unsigned int>(Index >> SubBits) + SubBits - 1;
+		uint64_t const Mantissa = (1u << SubBits) + (Index & ((1u << SubBits) - 1));
+		return ((Mantissa + 1) << (Exponent - SubBits)) - 1;
+	}
+
+	private:
+		typedef std::unique_ptr<std::atomic<uint64_t>[]> ThreadCountsType;
+
+		std::atomic<uint64_t> *ThreadCounts(void)
+		{
+			// Each thread remembers its counts in the last few stats it used, so the lock is only taken the first
+			// time a thread records (or after using more stats than that in between)
+			struct CacheEntry { uint64_t Serial; std::atomic<uint64_t> *Counts; };
+			static thread_local CacheEntry Cache[4] = {};
+			static thread_local unsigned int Replace = 0;
+			for (auto const &Entry : Cache) if (Entry.Serial == Serial) return Entry.Counts;
+			std::atomic<uint64_t> *Counts;
+			{
+				std::lock_guard<std::mutex> Guard(Mutex);
+				auto const Thread = std::this_thread::get_id();
+				auto Found = std::find_if(Threads.begin(), Threads.end(),
+					[Thread](std::pair<std::thread::id, ThreadCountsType> const &Entry) { return Entry.first == Thread; });
+				if (Found == Threads.end())
+				{
+					size_t const Size = Names.size() * Buckets;
+					ThreadCountsType New(new std::atomic<uint64_t>[Size]);
+					for (size_t Index = 0; Index < Size; ++Index) New[Index].store(0, std::memory_order_relaxed);
+					Threads.emplace_back(Thread, std::move(New));
+					Found = Threads.end() - 1;
+				}
+				Counts = Found->second.get();
+			}
+			Cache[Replace] = CacheEntry{Serial, Counts};
+			Replace = (Replace + 1) % 4;
+			return Counts;
+		}
+
+		// Mutex held.  Counts of threads that have exited are kept, so nothing recorded is lost.
+		void Sum(size_t Operation, uint64_t *Out) const
+		{
+			for (size_t Index = 0; Index < Buckets; ++Index) Out[Index] = 0;
+			for (auto const &Thread : Threads)
+				for (size_t Index = 0; Index < Buckets; ++Index)
+					Out[Index] += Thread.second[Operation * Buckets + Index].load(std::memory_order_relaxed);
+		}
+
+		// Per mille
+		static uint64_t Percentile(std::vector<uint64_t> const &Counts, uint64_t Total, uint64_t Rank)
+		{
+			uint64_t const Target = std::max<uint64_t>(1, (Total * Rank + 999) / 1000);
+			uint64_t Seen = 0;
+			for (size_t Index = 0; Index < Counts.size(); ++Index)
+			{
+				Seen += Counts[Index];
+				if (Seen >= Target) return BucketTop(Index);
+			}
+			return BucketTop(Counts.size() - 1);
+		}
+
+		static std::atomic<uint64_t> &NextSerial(void)
+		{
+			static std::atomic<uint64_t> Next(1);
+			return Next;
+		}
+
+		std::vector<std::string> const Names;
+		uint64_t const Serial;
+		mutable std::mutex Mutex;
+		std::vector<std::pair<std::thread::id, ThreadCountsType>> Threads;
+		std::vector<uint64_t> Baseline;
+};
+
+// Records the time from construction to destruction as one operation
+struct LatencyTimer
+{
+	template <typename OperationType> LatencyTimer(LatencyStats &Stats, OperationType Operation) :
+		Stats(Stats), Operation(static_cast<size_t>(Operation)), Start(std::chrono::steady_clock::now()) {}
+	LatencyTimer(LatencyTimer const &) = delete;
+	~LatencyTimer(void)
+	{
+		Stats.Record(Operation, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - Start).count()));
+	}
+
+	private:
+		LatencyStats &Stats;
+		size_t const Operation;
+		std::chrono::steady_clock::time_point const Start;
+};
+
+#endif
@@ -5,6 +5,18 @@
 #include <iostream>
 #include <fstream>
 #include <cassert>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <vector>
+#include <type_traits>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 
@@ -12,35 +24,89 @@
 
 namespace bfs = boost::filesystem;
 
+enum LogLevel : uint8_t { LogDebug, LogNote, LogWarn, LogError };
+
+// Lines below LOG_LEVEL aren't compiled in: 0 keeps everything, 1 drops debug lines, and so on up to 3 for errors
+// only.  By default debug lines are only in debug builds.
+#ifndef LOG_LEVEL
+#ifdef NDEBUG
+#define LOG_LEVEL 1
+#else
+#define LOG_LEVEL 0
+#endif
+#endif
+constexpr LogLevel CompiledLogLevel = static_cast<LogLevel>(LOG_LEVEL);
+
+// The levels a log writes, which can be raised at runtime above those compiled in
+struct LogFilter
+{
+	LogFilter(void) : Level(CompiledLogLevel) {}
+
+	bool Enabled(LogLevel Check) const { return (Check >= CompiledLogLevel) && (Check >= Level.load(std::memory_order_relaxed)); }
+	LogLevel GetLevel(void) const { return static_cast<LogLevel>(Level.load(std::memory_order_relaxed)); }
+	void SetLevel(LogLevel Level) { this->Level.store(std::max(Level, CompiledLogLevel), std::memory_order_relaxed); }
+
+	private:
+		std::atomic<uint8_t> Level;
+};
+
+// For parsing options: debug, note, warn or error
+inline bool ParseLogLevel(std::string const &Text, LogLevel &Level)
+{
+	static char const *Names[] = {"debug", "note", "warn", "error"};
+	for (uint8_t Index = 0; Index < 4; ++Index)
+		if (Text == Names[Index]) { Level = static_cast<LogLevel>(Index); return true; }
+	return false;
+}
+
+// Writes a line only if its level is enabled.  Otherwise it costs one branch: no stream is made and the arguments
+// aren't evaluated, and below the compiled level the whole statement compiles away.
+//	Logged(*Log, Debug) << "Created file " << Describe(File);
+#define Logged(Target, Level) \
+	if (!(Target).Enabled(Log##Level)) {} else (Target).Level()
+
 struct NullLogStream
 {
+	template <typename ...Whatever> NullLogStream(Whatever const &...) {}
 	template <typename InputType> NullLogStream &operator <<(InputType const &) { return *this; }
 };
 
+// A log's stream for a level, or nothing if the level isn't compiled in
+template <LogLevel Level, typename StreamType> using LevelStream =
+	typename std::conditional<(Level >= CompiledLogLevel), StreamType, NullLogStream>::type;
+
 struct NullLog
 {
+	bool Enabled(LogLevel) const { return false; }
+	void SetLevel(LogLevel) {}
+
 	NullLogStream Debug(void) { return NullLogStream(); }
 	NullLogStream Note(void) { return NullLogStream(); }
 	NullLogStream Warn(void) { return NullLogStream(); }
 	NullLogStream Error(void) { return NullLogStream(); }
 };
 
+// Lines at levels disabled at runtime are still formatted, but not written; Logged skips them entirely
 template <bool Important> struct StandardLogStream : public std::stringstream
 {
-	StandardLogStream(std::ostream &Output, std::string const &Prefix) : Output(Output) { *this << Prefix; }
-	~StandardLogStream() { *this << '\n'; if (Important) Output << str() << std::flush; else Output << str(); }
+	StandardLogStream(std::ostream &Output, std::string const &Prefix, bool Active) : Output(Output), Active(Active) { *this << Prefix; }
+	~StandardLogStream()
+	{
+		if (!Active) return;
+		*this << '\n';
+		if (Important) Output << str() << std::flush; else Output << str();
+	}
 	std::ostream &Output;
+	bool const Active;
 };
 
-struct StandardOutLog
+struct StandardOutLog : LogFilter
 {
 	StandardOutLog(std::string const &Prefix)
 	{
-#ifndef NDEBUG
 		std::stringstream DebugPrefixStream;
 		DebugPrefixStream << "Debug (" << Prefix << "): ";
 		DebugPrefix = DebugPrefixStream.str();
-#endif
 		std::stringstream NotePrefixStream;
 		NotePrefixStream << "Note (" << Prefix << "): ";
 		NotePrefix = NotePrefixStream.str();
@@ -51,53 +117,324 @@ struct StandardOutLog
 		ErrorPrefixStream << "Error (" << Prefix << "): ";
 		ErrorPrefix = ErrorPrefixStream.str();
 	}
-#ifndef NDEBUG
-	StandardLogStream<true> Debug(void) { return {std::cout, DebugPrefix}; }
-#else
-	NullLogStream Debug(void) { return NullLogStream(); }
-#endif
-	StandardLogStream<false> Note(void) { return {std::cout, NotePrefix}; }
-	StandardLogStream<false> Warn(void) { return {std::cout, WarnPrefix}; }
-	StandardLogStream<true> Error(void) { return {std::cerr, ErrorPrefix}; }
+	LevelStream<LogDebug, StandardLogStream<true>> Debug(void) { return {std::cout, DebugPrefix, Enabled(LogDebug)}; }
+	LevelStream<LogNote, StandardLogStream<false>> Note(void) { return {std::cout, NotePrefix, Enabled(LogNote)}; }
+	LevelStream<LogWarn, StandardLogStream<false>> Warn(void) { return {std::cout, WarnPrefix, Enabled(LogWarn)}; }
+	LevelStream<LogError, StandardLogStream<true>> Error(void) { return {std::cerr, ErrorPrefix, Enabled(LogError)}; }
 
 	private:
-		std::string
-#ifndef NDEBUG
-			DebugPrefix,
-#endif
-			NotePrefix, WarnPrefix, ErrorPrefix;
+		std::string DebugPrefix, NotePrefix, WarnPrefix, ErrorPrefix;
 };
 
-struct FileLog
+// FileLog lines are recorded on the calling thread in a compact binary form, each argument tagged with its type,
+// and copied into a ring buffer belonging to that thread.  A background thread drains the rings, formats the lines
+// and writes them, so logging costs the caller a few copies and no locks.  Lines from one thread keep their order;
+// lines from different threads logged close together may be written in either order.  Arguments other than
+// numbers, characters and strings are formatted on the calling thread.
+// Records are written whole by the thread that owns the ring and read by the log's writer thread
+struct LogRing
 {
-	FileLog(bfs::path const &Path) : Stream(Path)
+	static constexpr size_t Capacity = 64 * 1024;
+	static_assert((Capacity & (Capacity - 1)) == 0, "Ring capacity must be a power of two");
+
+	LogRing(void) : Head(0), Tail(0) {}
+
+	// False if there isn't room
+	bool Push(uint8_t const *Record, size_t Length)
+	{
+		uint64_t const Start = Head.load(std::memory_order_relaxed);
+		if (Capacity - (Start - Tail.load(std::memory_order_acquire)) < Length) return false;
+		size_t const Offset = static_cast<size_t>(Start & (Capacity - 1));
+		size_t const First = std::min(Length, Capacity - Offset);
+		memcpy(Data + Offset, Record, First);
+		memcpy(Data, Record + First, Length - First);
+		Head.store(Start + Length, std::memory_order_release);
+		return true;
+	}
+
+	// Moves every pushed record to the end of Out
+	void Drain(std::vector<uint8_t> &Out)
+	{
+		uint64_t const End = Head.load(std::memory_order_acquire);
+		uint64_t const Start = Tail.load(std::memory_order_relaxed);
+		size_t const Length = static_cast<size_t>(End - Start);
+		if (Length == 0) return;
+		size_t const Offset = static_cast<size_t>(Start & (Capacity - 1));
+		size_t const First = std::min(Length, Capacity - Offset);
+		Out.insert(Out.end(), Data + Offset, Data + Offset + First);
+		Out.insert(Out.end(), Data, Data + (Length - First));
+		Tail.store(End, std::memory_order_release);
+	}
+
+	private:
+		std::atomic<uint64_t> Head; // Written by the owning thread
+		char HeadPadding[64 - sizeof(std::atomic<uint64_t>)];
+		std::atomic<uint64_t> Tail; // Written by the writer thread
+		char TailPadding[64 - sizeof(std::atomic<uint64_t>)];
+		uint8_t Data[Capacity];
+};
+
+struct FileLog;
+
+// Collects a line's arguments on the stack and hands the record to the log when the line ends.  A record is its
+// length, its level, then each argument as a tag and its value.  Lines longer than a record are cut short.  Lines at
+// levels disabled at runtime skip their arguments, but the arguments are still evaluated; Logged skips those too.
+struct AsyncLogStream
+{
+	enum : uint8_t { TagText, TagCharacter, TagSigned, TagUnsigned, TagFloat };
+	static constexpr size_t MaxRecord = 2048;
+	static constexpr size_t RecordHeaderSize = sizeof(uint16_t) + sizeof(LogLevel);
+	// Arguments leave room to mark a line that was cut short
+	static constexpr size_t Limit = MaxRecord - (1 + sizeof(uint16_t) + 3);
+
+	AsyncLogStream(FileLog &Log, LogLevel Level, bool Active) : Log(Log), Active(Active), Used(RecordHeaderSize), Truncated(false)
+		{ Record[sizeof(uint16_t)] = Level; }
+	AsyncLogStream(AsyncLogStream const &) = delete;
+	~AsyncLogStream(void);
+
+	template <typename InputType> AsyncLogStream &operator <<(InputType const &Input) { if (Active) Append(Input); return *this; }
+
+	private:
+		void Append(std::string const &Input) { AppendText(Input.data(), Input.size(), Limit); }
+		void Append(char const *Input) { AppendText(Input, strlen(Input), Limit); }
+		void Append(char Input) { AppendCharacter(Input); }
+		void Append(signed char Input) { AppendCharacter(static_cast<char>(Input)); }
+		void Append(unsigned char Input) { AppendCharacter(static_cast<char>(Input)); }
+		void Append(bool Input) { AppendValue(TagUnsigned, static_cast<uint64_t>(Input)); }
+		template <typename IntType> typename std::enable_if<std::is_integral<IntType>::value && std::is_signed<IntType>::value>::type Append(IntType Input)
+			{ AppendValue(TagSigned, static_cast<int64_t>(Input)); }
+		template <typename IntType> typename std::enable_if<std::is_integral<IntType>::value && !std::is_signed<IntType>::value>::type Append(IntType Input)
+			{ AppendValue(TagUnsigned, static_cast<uint64_t>(Input)); }
+		template <typename FloatType> typename std::enable_if<std::is_floating_point<FloatType>::value>::type Append(FloatType Input)
+			{ AppendValue(TagFloat, static_cast<double>(Input)); }
+		template <typename InputType> typename std::enable_if<!std::is_arithmetic<InputType>::value && !std::is_convertible<InputType, char const *>::value>::type
+			Append(InputType const &Input)
+		{
+			std::ostringstream Text;
+			Text << Input;
+			Append(Text.str());
+		}
+
+		void AppendText(char const *Text, size_t Length, size_t Limit)
+		{
+			size_t const Room = Limit - Used;
+			if (Room < 1 + sizeof(uint16_t) + Length)
+			{
+				Truncated = true;
+				if (Room <= 1 + sizeof(uint16_t)) return;
+				Length = Room - 1 - sizeof(uint16_t);
+			}
+			Record[Used++] = TagText;
+			uint16_t const Size = static_cast<uint16_t>(Length);
+			memcpy(Record + Used, &Size, sizeof(Size));
+			memcpy(Record + Used + sizeof(Size), Text, Length);
+			Used += sizeof(Size) + Length;
+		}
+
+		void AppendCharacter(char Input)
+		{
+			if (Limit - Used < 2) { Truncated = true; return; }
+			Record[Used++] = TagCharacter;
+			Record[Used++] = static_cast<uint8_t>(Input);
+		}
+
+		template <typename ValueType> void AppendValue(uint8_t Tag, ValueType Value)
+		{
+			if (Limit - Used < 1 + sizeof(Value)) { Truncated = true; return; }
+			Record[Used++] = Tag;
+			memcpy(Record + Used, &Value, sizeof(Value));
+			Used += sizeof(Value);
+		}
+
+		FileLog &Log;
+		bool const Active;
+		size_t Used;
+		bool Truncated;
+		uint8_t Record[MaxRecord];
+};
+
+struct FileLog : LogFilter
+{
+	FileLog(bfs::path const &Path) : Stream(Path), Serial(NextSerial()++), Stopping(false), Full(false), Passes(0), FlushTarget(0)
 	{
 		assert(Stream);
 		if (!Stream) throw SystemError() << "Could not open log file \"" << Path << "\"";
-#ifndef NDEBUG
-		DebugPrefix = "Debug: ";
-#endif
-		NotePrefix = "Note: ";
-		WarnPrefix = "Warn: ";
-		ErrorPrefix = "Error: ";
+		Writer = std::thread([this]() { Write(); });
+	}
+
+	~FileLog(void)
+	{
+		{
+			std::lock_guard<std::mutex> Guard(Mutex);
+			Stopping = true;
+		}
+		Wake.notify_one();
+		Writer.join();
+	}
+
+	LevelStream<LogDebug, AsyncLogStream> Debug(void) { return {*this, LogDebug, Enabled(LogDebug)}; }
+	LevelStream<LogNote, AsyncLogStream> Note(void) { return {*this, LogNote, Enabled(LogNote)}; }
+	LevelStream<LogWarn, AsyncLogStream> Warn(void) { return {*this, LogWarn, Enabled(LogWarn)}; }
+	LevelStream<LogError, AsyncLogStream> Error(void) { return {*this, LogError, Enabled(LogError)}; }
+
+	// Returns once every line logged before the call is written
+	void Flush(void)
+	{
+		std::unique_lock<std::mutex> Lock(Mutex);
+		// The pass under way may have drained this thread's ring already, so wait for the one after
+		uint64_t const Target = Passes + 2;
+		FlushTarget = std::max(FlushTarget, Target);
+		Wake.notify_one();
+		Written.wait(Lock, [this, Target]() { return Passes >= Target; });
 	}
-#ifndef NDEBUG
-	StandardLogStream<true> Debug(void) { return {Stream, DebugPrefix}; }
-#else
-	NullLogStream Debug(void) { return NullLogStream(); }
-#endif
-	StandardLogStream<false> Note(void) { return {Stream, NotePrefix}; }
-	StandardLogStream<false> Warn(void) { return {Stream, WarnPrefix}; }
-	StandardLogStream<true> Error(void) { return {Stream, ErrorPrefix}; }
 
 	private:
+		friend struct AsyncLogStream;
+
+		// Errors are waited for, since they're often the last word before a crash.  If the ring is full the caller
+		// waits for room rather than lose the line.
+		void Commit(uint8_t const *Record, size_t Length, LogLevel Level)
+		{
+			LogRing &Ring = ThreadRing();
+			while (!Ring.Push(Record, Length))
+			{
+				Full.store(true, std::memory_order_relaxed);
+				Wake.notify_one();
+				std::this_thread::yield();
+			}
+			if (Level == LogError) Flush();
+		}
+
+		LogRing &ThreadRing(void)
+		{
+			// Each thread remembers its ring in the last log it used, so the lock is only taken when switching logs
+			static thread_local uint64_t CachedSerial = 0;
+			static thread_local LogRing *Cached = nullptr;
+			if (CachedSerial == Serial) return *Cached;
+			std::lock_guard<std::mutex> Guard(Mutex);
+			std::unique_ptr<LogRing> &Ring = Rings[std::this_thread::get_id()];
+			if (!Ring) Ring.reset(new LogRing);
+			CachedSerial = Serial;
+			Cached = Ring.get();
+			return *Cached;
+		}
+
+		static std::atomic<uint64_t> &NextSerial(void)
+		{
+			static std::atomic<uint64_t> Next(1);
+			return Next;
+		}
+
+		void Write(void)
+		{
+			std::vector<LogRing *> Sources;
+			std::vector<uint8_t> Records;
+			std::string Text;
+			std::unique_lock<std::mutex> Lock(Mutex);
+			while (true)
+			{
+				bool const Last = Stopping;
+				Full.store(false, std::memory_order_relaxed);
+				Sources.clear();
+				for (auto &Ring : Rings) Sources.push_back(Ring.second.get());
+				Lock.unlock();
+				Text.clear();
+				for (auto Ring : Sources)
+				{
+					Records.clear();
+					Ring->Drain(Records);
+					Format(Records, Text);
+				}
+				Stream.write(Text.data(), static_cast<std::streamsize>(Text.size()));
+				Stream.flush();
+				Lock.lock();
+				++Passes;
+				Written.notify_all();
+				if (Last) break;
+				Wake.wait_for(Lock, std::chrono::milliseconds(20), [this]() { return Stopping || Full.load(std::memory_order_relaxed) || (Passes < FlushTarget); });
+			}
+		}
+
+		// Formats records onto the end of Text
+		static void Format(std::vector<uint8_t> const &Records, std::string &Text)
+		{
+			static char const *Prefixes[] = {"Debug: ", "Note: ", "Warn: ", "Error: "};
+			for (size_t Offset = 0; Offset < Records.size(); )
+			{
+				uint16_t Length;
+				memcpy(&Length, &Records[Offset], sizeof(Length));
+				size_t const End = Offset + Length;
+				Text += Prefixes[Records[Offset + sizeof(Length)]];
+				Offset += AsyncLogStream::RecordHeaderSize;
+				while (Offset < End)
+				{
+					uint8_t const Tag = Records[Offset++];
+					switch (Tag)
+					{
+						case AsyncLogStream::TagText:
+						{
+							uint16_t const Size = Read<uint16_t>(Records, Offset);
+							Text.append(reinterpret_cast<char const *>(&Records[Offset]), Size);
+							Offset += Size;
+						} break;
+						case AsyncLogStream::TagCharacter: Text += static_cast<char>(Records[Offset++]); break;
+						case AsyncLogStream::TagSigned:
+						{
+							int64_t const Value = Read<int64_t>(Records, Offset);
+							if (Value < 0) Text += '-';
+							// Negated unsigned, so the most negative value works too
+							FormatUnsigned((Value < 0) ? 0 - static_cast<uint64_t>(Value) : static_cast<uint64_t>(Value), Text);
+						} break;
+						case AsyncLogStream::TagUnsigned: FormatUnsigned(Read<uint64_t>(Records, Offset), Text); break;
+						case AsyncLogStream::TagFloat:
+						{
+							std::ostringstream Float;
+							Float << Read<double>(Records, Offset);
+							Text += Float.str();
+						} break;
+						default: assert(false); Offset = End; break;
+					}
+				}
+				Text += '\n';
+			}
+		}
+
+		static void FormatUnsigned(uint64_t Value, std::string &Text)
+		{
+			char Digits[20];
+			size_t Count = 0;
+			do { Digits[Count++] = static_cast<char>('0' + Value % 10); Value /= 10; } while (Value > 0);
+			while (Count > 0) Text += Digits[--Count];
+		}
+
+		template <typename ValueType> static ValueType Read(std::vector<uint8_t> const &Records, size_t &Offset)
+		{
+			ValueType Value;
+			memcpy(&Value, &Records[Offset], sizeof(Value));
+			Offset += sizeof(Value);
+			return Value;
+		}
+
 		bfs::ofstream Stream;
-		std::string
-#ifndef NDEBUG
-			DebugPrefix,
-#endif
-			NotePrefix, WarnPrefix, ErrorPrefix;
+		uint64_t const Serial;
+
+		std::mutex Mutex;
+		std::condition_variable Wake, Written;
+		std::map<std::thread::id, std::unique_ptr<LogRing>> Rings;
+		bool Stopping;
+		std::atomic<bool> Full; // A thread is waiting for room in its ring
+		uint64_t Passes;
+		uint64_t FlushTarget;
+		std::thread Writer;
 };
 
-#endif
+inline AsyncLogStream::~AsyncLogStream(void)
+{
+	if (!Active) return;
+	if (Truncated) AppendText("...", 3, MaxRecord);
+	uint16_t const Length = static_cast<uint16_t>(Used);
+	memcpy(Record, &Length, sizeof(Length));
+	Log.Commit(Record, Used, static_cast<LogLevel>(Record[sizeof(uint16_t)]));
+}
 
+#endif
@@ -21,7 +21,7 @@ template <typename InnerT> struct MoatT
 			BridgeT(BridgeT &&Other) : Inner(Other.Inner), Guard(std::move(Other.Guard)) {}
 			BridgeT(InnerT &Inner) : Inner(Inner), Guard(Inner.Mutex) {}
 			InnerT &Inner;
-			std::lock_guard<std::mutex> Guard;
+			std::unique_lock<std::mutex> Guard;
 	};
 	
 	template <typename FunctionT> void Cross(FunctionT const &Function)
@@ -0,0 +1,372 @@
+#ifndef notify_h
+#define notify_h
+
+#include "core.h"
+
+#include <map>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Change notifications are pushed to subscribers rather than polled.  Publishing (from the FUSE threads, via the
+// transaction callbacks) only merges the change into each subscriber's pending set under a short lock; delivery
+// happens on a per-subscriber thread.  Repeated changes to a node coalesce into a single event, and a subscriber
+// that falls too far behind has its pending set dropped and receives an overflow notice instead, after which it
+// should rescan.
+
+DefineProtocol(NotifyProtocol)
+DefineProtocolVersion(NotifyVersion1, NotifyProtocol)
+DefineProtocolMessage(NV1Create, NotifyVersion1,
+	void(NodeID ID, NodeID Parent, std::string Name, bool IsFile))
+DefineProtocolMessage(NV1Move, NotifyVersion1,
+	void(NodeID ID, NodeID Parent, std::string Name))
+DefineProtocolMessage(NV1Delete, NotifyVersion1,
+	void(NodeID ID))
+DefineProtocolMessage(NV1SetPermissions, NotifyVersion1,
+	void(NodeID ID, bool CanWrite, bool CanExecute))
+DefineProtocolMessage(NV1SetTimestamp, NotifyVersion1,
+	void(NodeID ID, Timestamp NewTimestamp))
+DefineProtocolMessage(NV1Overflow, NotifyVersion1,
+	void(void))
+// Sent by a subscriber, with the codecs it can unwrap as Protocol::CodecFlag bits.  Batches after it may come in
+// compressed frames.
+DefineProtocolMessage(NV1AcceptCodecs, NotifyVersion1,
+	void(uint8_t Codecs))
+
+enum ChangeType : unsigned int
+{
+	ChangeCreate = 1 << 0,
+	ChangeMove = 1 << 1,
+	ChangeDelete = 1 << 2,
+	ChangePermissions = 1 << 3,
+	ChangeTimestamp = 1 << 4
+};
+
+struct ChangeEvent
+{
+	unsigned int Types;
+	NodeID ID;
+	NodeID Parent;
+	std::string Name;
+	bool IsFile;
+	SharePermissions Permissions;
+	Timestamp Modified;
+
+	// Folds a later change to the same node into this one
+	void Merge(ChangeEvent const &Later)
+	{
+		if (Later.Types & ChangeDelete)
+		{
+			// A node created and deleted within one batch was never observed
+			Types = (Types & ChangeCreate) ? 0u : static_cast<unsigned int>(ChangeDelete);
+			return;
+		}
+		if (Later.Types & (ChangeCreate | ChangeMove))
+		{
+			Parent = Later.Parent;
+			Name = Later.Name;
+		}
+		if (Later.Types & ChangeCreate) IsFile = Later.IsFile;
+		if (Later.Types & ChangePermissions) Permissions = Later.Permissions;
+		if (Later.Types & ChangeTimestamp) Modified = Later.Modified;
+		Types |= Later.Types;
+		if (Types & ChangeCreate) Types &= ~static_cast<unsigned int>(ChangeMove);
+	}
+
+	// Adds the event's messages to the end of Out
+	void Encode(Protocol::BufferType &Out) const
+	{
+		if (Types & ChangeDelete) { NV1Delete::Append(Out, ID); return; }
+		if (Types & ChangeCreate) NV1Create::Append(Out, ID, Parent, Name, IsFile);
+		if (Types & ChangeMove) NV1Move::Append(Out, ID, Parent, Name);
+		if (Types & ChangePermissions) NV1SetPermissions::Append(Out, ID, Permissions.CanWrite, Permissions.CanExecute);
+		if (Types & ChangeTimestamp) NV1SetTimestamp::Append(Out, ID, Modified);
+	}
+};
+
+struct ChangeSubscription
+{
+	// Returning false ends the subscription
+	typedef std::function<bool(std::vector<ChangeEvent> const &Events, bool Overflowed)> CallbackType;
+
+	// Interrupt, if given, unblocks a callback stuck waiting on something outside, like a subscriber that stopped
+	// reading
+	ChangeSubscription(CallbackType const &Callback, size_t Limit, std::function<void(void)> const &Interrupt) :
+		Callback(Callback), Interrupt(Interrupt), Limit(Limit), Overflowed(false), Stopping(false), Dead(false),
+		Thread([this]() { Deliver(); })
+		{}
+
+	~ChangeSubscription(void)
+	{
+		Stop();
+		Thread.join();
+	}
+
+	// Ends delivery after any batch in progress without waiting for it
+	void Stop(void)
+	{
+		{
+			std::lock_guard<std::mutex> Guard(Mutex);
+			Stopping = true;
+		}
+		Wake.notify_one();
+		if (Interrupt) Interrupt();
+	}
+
+	bool IsDead(void) const { return Dead; }
+
+	void Publish(ChangeEvent const &Event)
+	{
+		{
+			std::lock_guard<std::mutex> Guard(Mutex);
+			if (Overflowed) return;
+			auto Key = std::make_pair(*Event.ID.Instance, *Event.ID.Index);
+			auto Found = Indices.find(Key);
+			if (Found != Indices.end()) Pending[Found->second].Merge(Event);
+			else if (Pending.size() >= Limit)
+			{
+				Pending.clear();
+				Indices.clear();
+				Overflowed = true;
+			}
+			else
+			{
+				Indices.emplace(Key, Pending.size());
+				Pending.push_back(Event);
+			}
+		}
+		Wake.notify_one();
+	}
+
+	private:
+		void Deliver(void)
+		{
+			std::vector<ChangeEvent> Batch;
+			while (true)
+			{
+				bool BatchOverflowed = false;
+				{
+					std::unique_lock<std::mutex> Lock(Mutex);
+					Wake.wait(Lock, [this]() { return Stopping || Overflowed || !Pending.empty(); });
+					if (Stopping) break;
+					Batch.clear();
+					for (auto &Event : Pending) if (Event.Types) Batch.push_back(std::move(Event));
+					Pending.clear();
+					Indices.clear();
+					BatchOverflowed = Overflowed;
+					Overflowed = false;
+				}
+				if (Batch.empty() && !BatchOverflowed) continue;
+				if (!Callback(Batch, BatchOverflowed)) break;
+			}
+			Dead = true;
+		}
+
+		CallbackType const Callback;
+		std::function<void(void)> const Interrupt;
+		size_t const Limit;
+
+		std::mutex Mutex;
+		std::condition_variable Wake;
+		std::vector<ChangeEvent> Pending;
+		std::map<std::pair<Counter::Type, UUID::Type>, size_t> Indices;
+		bool Overflowed;
+		bool Stopping;
+		std::atomic<bool> Dead;
+
+		std::thread Thread;
+};
+
+struct ChangeNotifier
+{
+	typedef size_t SubscriptionID;
+
+	ChangeNotifier(size_t Limit = 4096) : Limit(Limit), NextID(0), ListenSocket(-1) {}
+
+	~ChangeNotifier(void)
+	{
+		if (ListenSocket >= 0)
+		{
+			shutdown(ListenSocket, SHUT_RDWR);
+			close(ListenSocket);
+			ListenThread.join();
+			unlink(SocketPath.string().c_str());
+		}
+		std::map<SubscriptionID, std::unique_ptr<ChangeSubscription>> Stopping;
+		std::vector<std::unique_ptr<ChangeSubscription>> Stopped;
+		{
+			std::lock_guard<std::mutex> Guard(Mutex);
+			Stopping.swap(Subscriptions);
+			Stopped.swap(Retired);
+		}
+	}
+
+	SubscriptionID Subscribe(ChangeSubscription::CallbackType const &Callback, std::function<void(void)> const &Interrupt = {})
+	{
+		std::unique_ptr<ChangeSubscription> Subscription(new ChangeSubscription(Callback, Limit, Interrupt));
+		std::vector<std::unique_ptr<ChangeSubscription>> Reaped;
+		std::lock_guard<std::mutex> Guard(Mutex);
+		Reap(Reaped);
+		SubscriptionID const ID = NextID++;
+		Subscriptions.emplace(ID, std::move(Subscription));
+		return ID;
+	}
+
+	// Doesn't wait for a batch being delivered, since the caller may hold something the callback is waiting for.
+	// The callback isn't called again after it returns.
+	void Unsubscribe(SubscriptionID ID)
+	{
+		std::vector<std::unique_ptr<ChangeSubscription>> Reaped;
+		std::lock_guard<std::mutex> Guard(Mutex);
+		auto Found = Subscriptions.find(ID);
+		if (Found == Subscriptions.end()) return;
+		Found->second->Stop();
+		Retired.push_back(std::move(Found->second));
+		Subscriptions.erase(Found);
+		Reap(Reaped);
+	}
+
+	void Publish(ChangeEvent const &Event)
+	{
+		std::lock_guard<std::mutex> Guard(Mutex);
+		for (auto &Subscription : Subscriptions)
+			if (!Subscription.second->IsDead()) Subscription.second->Publish(Event);
+	}
+
+	// Accepts subscribers on a unix domain socket.  Each batch is written as a sequence of NotifyProtocol messages,
+	// wrapped in a compressed frame once the subscriber accepts a codec.
+	void Listen(bfs::path const &Path)
+	{
+		sockaddr_un Address{};
+		Address.sun_family = AF_UNIX;
+		if (Path.string().size() >= sizeof(Address.sun_path))
+			throw SystemError() << "Notification socket path " << Path << " is too long.";
+		strcpy(Address.sun_path, Path.string().c_str());
+		unlink(Address.sun_path);
+		ListenSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (ListenSocket < 0)
+			throw SystemError() << "Could not create notification socket: " << strerror(errno);
+		if ((bind(ListenSocket, reinterpret_cast<sockaddr *>(&Address), sizeof(Address)) != 0) ||
+			(listen(ListenSocket, 16) != 0))
+		{
+			int const Error = errno;
+			close(ListenSocket);
+			ListenSocket = -1;
+			throw SystemError() << "Could not listen on notification socket " << Path << ": " << strerror(Error);
+		}
+		SocketPath = Path;
+		ListenThread = std::thread([this]() { Accept(); });
+	}
+
+	private:
+		// Mutex held.  Moves out subscriptions whose delivery thread has finished, to be destroyed once it's released.
+		void Reap(std::vector<std::unique_ptr<ChangeSubscription>> &Out)
+		{
+			for (auto Other = Subscriptions.begin(); Other != Subscriptions.end();)
+			{
+				if (!Other->second->IsDead()) { ++Other; continue; }
+				Out.push_back(std::move(Other->second));
+				Other = Subscriptions.erase(Other);
+			}
+			for (auto Other = Retired.begin(); Other != Retired.end();)
+			{
+				if (!(*Other)->IsDead()) { ++Other; continue; }
+				Out.push_back(std::move(*Other));
+				Other = Retired.erase(Other);
+			}
+		}
+
+		void Accept(void)
+		{
+			while (true)
+			{
+				int const Client = accept4(ListenSocket, nullptr, nullptr, SOCK_CLOEXEC);
+				if (Client < 0)
+				{
+					if (errno == EINTR || errno == ECONNABORTED) continue;
+					break;
+				}
+				std::shared_ptr<SocketSubscriber> Subscriber(new SocketSubscriber(Client));
+				Subscribe([Subscriber](std::vector<ChangeEvent> const &Events, bool Overflowed) { return Subscriber->Send(Events, Overflowed); },
+					[Subscriber]() { Subscriber->Interrupt(); });
+			}
+		}
+
+		// A subscriber on the socket.  Subscribers that never say which codecs they accept get plain messages.
+		struct SocketSubscriber
+		{
+			SocketSubscriber(int Socket) : Socket(Socket), Listening(true),
+				Requests(Log, [this](uint8_t const &Codecs) { Framer.SetCodec(Protocol::ChooseCodec(Codecs)); })
+				{}
+			~SocketSubscriber(void) { close(Socket); }
+
+			// Fails a send blocked on a subscriber that stopped reading
+			void Interrupt(void) { shutdown(Socket, SHUT_RDWR); }
+
+			bool Send(std::vector<ChangeEvent> const &Events, bool Overflowed)
+			{
+				// Whatever the subscriber has said since the last batch, without waiting for more
+				uint8_t Incoming[256];
+				while (Listening)
+				{
+					ssize_t const Got = recv(Socket, Incoming, sizeof(Incoming), MSG_DONTWAIT);
+					if (Got > 0)
+					{
+						if (!Requests.Read(Incoming, static_cast<size_t>(Got))) return false;
+						continue;
+					}
+					if ((Got < 0) && (errno == EINTR)) continue;
+					// The subscriber may have closed its side for writing and still be reading
+					if (Got == 0) Listening = false;
+					break;
+				}
+
+				// Each batch is encoded into one buffer, reused between batches, and sent together
+				Batch.clear();
+				if (Overflowed) NV1Overflow::Append(Batch);
+				for (auto const &Event : Events) Event.Encode(Batch);
+				Out.clear();
+				Framer.Append(Out, Batch.data(), Batch.size());
+				size_t Offset = 0;
+				while (Offset < Out.size())
+				{
+					ssize_t const Sent = send(Socket, &Out[Offset], Out.size() - Offset, MSG_NOSIGNAL);
+					if (Sent < 0)
+					{
+						if (errno == EINTR) continue;
+						return false;
+					}
+					Offset += static_cast<size_t>(Sent);
+				}
+				return true;
+			}
+
+			private:
+				int const Socket;
+				bool Listening;
+				NullLog Log;
+				Protocol::StreamReader<NullLog, NV1AcceptCodecs> Requests;
+				Protocol::FrameCompressor Framer;
+				Protocol::BufferType Batch;
+				Protocol::BufferType Out;
+		};
+
+		size_t const Limit;
+
+		std::mutex Mutex;
+		SubscriptionID NextID;
+		std::map<SubscriptionID, std::unique_ptr<ChangeSubscription>> Subscriptions;
+		std::vector<std::unique_ptr<ChangeSubscription>> Retired; // Unsubscribed, delivery may not have finished
+
+		bfs::path SocketPath;
+		int ListenSocket;
+		std::thread ListenThread;
+};
+
+#endif
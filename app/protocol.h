@@ -1,8 +1,6 @@
 #ifndef protocol_h
 #define protocol_h
 
-// TODO Add conditional big endian -> little endian conversions
-
 /*
 Major versions are incompatible, and could be essentially different protocols.
  versions are compatible.
@@ -14,8 +12,11 @@ Messages are completely redefined for each new version.
 #include "constcount.h"
 #include "error.h"
 #include "cast.h"
+#include "shared.h"
+#include "compress.h"
 
 #include <vector>
+#include <algorithm>
 #include <functional>
 #include <limits>
 #include <cassert>
@@ -23,9 +24,11 @@ Messages are completely redefined for each new version.
 #include <memory>
 #include <type_traits>
 #include <typeinfo>
+#include <tuple>
 
 #define DefineProtocol(Name) typedef Protocol::Protocol<__COUNTER__> Name;
 #define DefineProtocolVersion(Name, InProtocol) typedef Protocol::Version<static_cast<Protocol::VersionIDType::Type>(GetConstCount(InProtocol)), InProtocol> Name; IncrementConstCount(InProtocol)
+#define DefineProtocolLongVersion(Name, InProtocol) typedef Protocol::Version<static_cast<Protocol::VersionIDType::Type>(GetConstCount(InProtocol) | Protocol::LongLengthsFlag), InProtocol> Name; IncrementConstCount(InProtocol)
 #define DefineProtocolMessage(Name, InVersion, Signature) typedef Protocol::Message<static_cast<Protocol::MessageIDType::Type>(GetConstCount(InVersion)), InVersion, Signature> Name; IncrementConstCount(InVersion)
 
 namespace Protocol
@@ -35,8 +38,223 @@ typedef StrictType(uint8_t) VersionIDType;
 typedef StrictType(uint8_t) MessageIDType;
 typedef StrictType(uint16_t) SizeType;
 typedef StrictType(uint16_t) ArraySizeType;
+typedef StrictType(uint64_t) LongSizeType;
 
 typedef std::vector<uint8_t> BufferType;
+
+// Integers go on the wire little endian.  Big endian hosts swap them, which is decided at compile time so little
+// endian hosts pay nothing.
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+constexpr bool SwapBytes = false;
+#elif defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+constexpr bool SwapBytes = true;
+#else
+#error "Unknown byte order"
+#endif
+
+template <typename IntType> inline typename std::enable_if<std::is_integral<IntType>::value, IntType>::type WireOrder(IntType Value)
+{
+	if (!SwapBytes) return Value;
+	uint8_t Bytes[sizeof(Value)];
+	memcpy(Bytes, &Value, sizeof(Value));
+	std::reverse(Bytes, Bytes + sizeof(Value));
+	memcpy(&Value, Bytes, sizeof(Value));
+	return Value;
+}
+template <size_t Uniqueness, typename ValueType> inline typename std::enable_if<std::is_integral<ValueType>::value, ExplicitCastable<Uniqueness, ValueType>>::type
+	WireOrder(ExplicitCastable<Uniqueness, ValueType> const &Value)
+	{ return WireOrder(*Value); }
+// Anything else says how to write itself
+template <typename FieldType> inline typename std::enable_if<!std::is_integral<FieldType>::value, FieldType const &>::type WireOrder(FieldType const &Value)
+	{ return Value; }
+
+// Message and array lengths take two bytes.  In versions defined with DefineProtocolLongVersion, longer ones are
+// escaped: the two bytes are all ones, and the length follows in eight.  Those versions have the flag below set in
+// their ID, so readers know which form a message uses before reading its length, and versions from before the
+// escape existed still read all ones as a length.
+static_assert(SizeType::Size == ArraySizeType::Size, "Message and array lengths are written the same way");
+constexpr SizeType::Type LongLength = std::numeric_limits<SizeType::Type>::max();
+constexpr size_t LongLengthSize = SizeType::Size + LongSizeType::Size;
+
+constexpr VersionIDType::Type LongLengthsFlag = 0x80;
+constexpr bool HasLongLengths(VersionIDType::Type VersionID) { return (VersionID & LongLengthsFlag) != 0; }
+// A version's place among its protocol's versions, for dispatch
+constexpr size_t VersionIndex(VersionIDType::Type VersionID) { return static_cast<size_t>(VersionID & ~LongLengthsFlag); }
+
+inline size_t LengthSize(uint64_t Length) { return (Length < LongLength) ? SizeType::Size : LongLengthSize; }
+
+inline void WriteLength(uint8_t *&Out, uint64_t Length, bool Long = false)
+{
+	SizeType::Type const Short = WireOrder((Long || (Length >= LongLength)) ? LongLength : static_cast<SizeType::Type>(Length));
+	memcpy(Out, &Short, sizeof(Short));
+	Out += sizeof(Short);
+	if (Short != LongLength) return;
+	uint64_t const Wire = WireOrder(Length);
+	memcpy(Out, &Wire, sizeof(Wire));
+	Out += sizeof(Wire);
+}
+
+// Reads a length from the Available bytes at Data, escaped only if Long.  The bytes it took, or 0 if Available
+// doesn't hold all of it.
+inline size_t ReadLength(uint8_t const *Data, size_t Available, uint64_t &Length, bool Long)
+{
+	if (Available < SizeType::Size) return 0;
+	SizeType::Type Short;
+	memcpy(&Short, Data, sizeof(Short));
+	Short = WireOrder(Short);
+	if (!Long || (Short != LongLength)) { Length = Short; return SizeType::Size; }
+	if (Available < LongLengthSize) return 0;
+	memcpy(&Length, Data + SizeType::Size, sizeof(Length));
+	Length = WireOrder(Length);
+	return LongLengthSize;
+}
+
+// Varints take seven bits a byte, low bits first, with the top bit set on every byte but the last
+constexpr size_t MaxVarintSize = 10;
+
+inline size_t VarintSize(uint64_t Value)
+{
+	size_t const Bits = 64 - static_cast<size_t>(__builtin_clzll(Value | 1));
+	return (Bits + 6) / 7;
+}
+
+inline void WriteVarint(uint8_t *&Out, uint64_t Value)
+{
+	for (; Value >= 0x80; Value >>= 7) *Out++ = static_cast<uint8_t>(Value | 0x80);
+	*Out++ = static_cast<uint8_t>(Value);
+}
+
+// Reads a varint from the Available bytes at Data.  The bytes it took, or 0 if Available ends first or it's longer
+// than any 64 bit value.
+inline size_t ReadVarint(uint8_t const *Data, size_t Available, uint64_t &Value)
+{
+	// Most IDs and lengths fit in a byte
+	if ((Available > 0) && !(Data[0] & 0x80))
+	{
+		Value = Data[0];
+		return 1;
+	}
+	Value = 0;
+	size_t const Limit = (Available < MaxVarintSize) ? Available : MaxVarintSize;
+	for (size_t Index = 0; Index < Limit; ++Index)
+	{
+		Value |= static_cast<uint64_t>(Data[Index] & 0x7F) << (7 * Index);
+		if (!(Data[Index] & 0x80)) return Index + 1;
+	}
+	return 0;
+}
+
+// Signed values are zigzagged first, so small negatives take as few bytes as small positives
+inline uint64_t ZigZag(int64_t Value) { return (static_cast<uint64_t>(Value) << 1) ^ static_cast<uint64_t>(Value >> 63); }
+inline int64_t UnZigZag(uint64_t Value) { return static_cast<int64_t>(Value >> 1) ^ -static_cast<int64_t>(Value & 1); }
+
+template <typename IntType> inline typename std::enable_if<std::is_signed<IntType>::value, uint64_t>::type ToVarint(IntType Value)
+	{ return ZigZag(Value); }
+template <typename IntType> inline typename std::enable_if<!std::is_signed<IntType>::value, uint64_t>::type ToVarint(IntType Value)
+	{ return Value; }
+
+// False if the value doesn't fit
+template <typename IntType> inline typename std::enable_if<std::is_signed<IntType>::value, bool>::type FromVarint(uint64_t Value, IntType &Out)
+{
+	int64_t const Signed = UnZigZag(Value);
+	if ((Signed < std::numeric_limits<IntType>::min()) || (Signed > std::numeric_limits<IntType>::max())) return false;
+	Out = static_cast<IntType>(Signed);
+	return true;
+}
+template <typename IntType> inline typename std::enable_if<!std::is_signed<IntType>::value, bool>::type FromVarint(uint64_t Value, IntType &Out)
+{
+	if (Value > std::numeric_limits<IntType>::max()) return false;
+	Out = static_cast<IntType>(Value);
+	return true;
+}
+
+// A field written compactly rather than at full width, for IDs, counters and timestamps that are usually far
+// smaller than their type allows.  Strict integer types are written as varints; structures provide their own
+// compact overloads.  A Compact is its wrapped type, so writers and callbacks take the wrapped type as is.
+template <typename ValueType> struct Compact : ValueType
+{
+	static_assert(std::is_class<ValueType>::value, "Wrap plain integers in a strict type to write them compactly");
+
+	Compact(void) {}
+	Compact(ValueType const &Value) : ValueType(Value) {}
+	template <typename InitType, typename std::enable_if<std::is_constructible<ValueType, InitType const &>::value>::type * = nullptr>
+		Compact(InitType const &Value) : ValueType(Value) {}
+};
+
+// Elements owned elsewhere, such as in a mapped journal or a receive buffer.  Nothing guarantees the elements are
+// aligned, so they're copied out one at a time rather than handed out by pointer.
+template <typename ElementType> struct Span
+{
+	static_assert(!std::is_class<ElementType>::value, "Spans only hold plain elements");
+
+	Span(void) : Data(nullptr), Count(0) {}
+	Span(uint8_t const *Data, size_t Count) : Data(Data), Count(Count) {}
+
+	size_t size(void) const { return Count; }
+	bool empty(void) const { return Count == 0; }
+	ElementType operator [](size_t Index) const
+	{
+		ElementType Out;
+		memcpy(&Out, Data + Index * sizeof(ElementType), sizeof(ElementType));
+		return Out;
+	}
+	std::vector<ElementType> Copy(void) const
+	{
+		std::vector<ElementType> Out(Count);
+		if (Count > 0) memcpy(&Out[0], Data, Count * sizeof(ElementType));
+		return Out;
+	}
+
+	uint8_t const *Data;
+	size_t Count;
+};
+
+// Bytes too many to hold in memory at once, such as file contents.  Sent with Message::Send, which pulls them from
+// Source a piece at a time; Source fills Out with the next Length bytes, returning false if it can't.  A blob must
+// be a message's last field, and only fixed size fields can come before it.
+struct Blob
+{
+	uint64_t Length;
+	std::function<bool(uint8_t *Out, size_t Length)> Source;
+};
+
+// What a reader hands a callback for a blob.  The ViewReader gives it whole; the StreamReader gives it in pieces as
+// they arrive, calling the callback once per piece with the message's other fields each time.
+struct BlobPiece
+{
+	BlobPiece(void) : Offset(0), Length(0) {}
+
+	bool Last(void) const { return Offset + Data.Count == Length; }
+
+	uint64_t Offset; // Where Data starts in the blob
+	uint64_t Length; // Of the whole blob
+	Span<uint8_t> Data;
+};
+
+// What the ViewReader hands a callback for each field: strings and arrays of plain elements refer into the buffer
+// being read, everything else is copied out as the Reader would.  Arrays of anything else still need a vector.
+template <typename FieldType> struct ViewOf { typedef FieldType Type; };
+template <> struct ViewOf<std::string> { typedef StringView Type; };
+template <> struct ViewOf<Blob> { typedef BlobPiece Type; };
+template <typename ElementType> struct ViewOf<std::vector<ElementType>>
+{
+	typedef typename std::conditional
+	<
+		std::is_class<ElementType>::value,
+		std::vector<typename ViewOf<ElementType>::Type>,
+		Span<ElementType>
+	>::type Type;
+};
+
+// What the ViewReader reads a message's fields from.  When a blob arrives in pieces, Bytes ends at the blob's
+// length and Piece is what's arrived of it.
+struct ViewBody
+{
+	ViewBody(Span<uint8_t> const &Bytes, BlobPiece const *Piece = nullptr) : Bytes(Bytes), Piece(Piece) {}
+
+	Span<uint8_t> Bytes;
+	BlobPiece const *Piece;
+};
 }
 
 template <typename IntType, typename std::enable_if<std::is_integral<IntType>::value>::type * = nullptr>
@@ -45,7 +263,11 @@ template <typename IntType, typename std::enable_if<std::is_integral<IntType>::v
 
 template <typename IntType, typename std::enable_if<std::is_integral<IntType>::value>::type * = nullptr>
 	inline void ProtocolWrite(uint8_t *&Out, IntType const &Argument)
-	{ *reinterpret_cast<IntType *>(Out) = Argument; Out += sizeof(Argument); }
+{
+	IntType const Wire = Protocol::WireOrder(Argument);
+	memcpy(Out, &Wire, sizeof(Wire));
+	Out += sizeof(Wire);
+}
 
 template <size_t ExplicitCastableUniqueness, typename ExplicitCastableType> size_t ProtocolGetSize(ExplicitCastable<ExplicitCastableUniqueness, ExplicitCastableType> const &Argument)
 	{ return ProtocolGetSize(*Argument); }
@@ -54,30 +276,23 @@ template <size_t ExplicitCastableUniqueness, typename ExplicitCastableType> void
 	{ ProtocolWrite(Out, *Argument); }
 
 inline size_t ProtocolGetSize(std::string const &Argument)
-{
-	assert(Argument.size() <= std::numeric_limits<Protocol::ArraySizeType::Type>::max());
-	return {Protocol::SizeType::Type(Protocol::ArraySizeType::Size + Argument.size())};
-}
+	{ return Protocol::LengthSize(Argument.size()) + Argument.size(); }
 inline void ProtocolWrite(uint8_t *&Out, std::string const &Argument)
 {
-	Protocol::ArraySizeType const StringSize = (Protocol::ArraySizeType::Type)Argument.size();
-	ProtocolWrite(Out, *StringSize);
+	Protocol::WriteLength(Out, Argument.size());
 	memcpy(Out, Argument.c_str(), Argument.size());
 	Out += Argument.size();
 }
 
 template <typename ElementType, typename std::enable_if<!std::is_class<ElementType>::value>::type* = nullptr>
 	inline size_t ProtocolGetSize(std::vector<ElementType> const &Argument)
-{
-	assert(Argument.size() <= std::numeric_limits<Protocol::ArraySizeType::Type>::max());
-	return Protocol::ArraySizeType::Size + (Protocol::ArraySizeType::Type)Argument.size() * sizeof(ElementType);
-}
+	{ return Protocol::LengthSize(Argument.size()) + Argument.size() * sizeof(ElementType); }
 
 template <typename ElementType, typename std::enable_if<!std::is_class<ElementType>::value>::type* = nullptr>
 	inline void ProtocolWrite(uint8_t *&Out, std::vector<ElementType> const &Argument)
 {
-	Protocol::ArraySizeType const ArraySize = (Protocol::ArraySizeType::Type)Argument.size();
-	ProtocolWrite(Out, *ArraySize);
+	Protocol::WriteLength(Out, Argument.size());
+	if (Argument.empty()) return;
 	memcpy(Out, &Argument[0], Argument.size() * sizeof(ElementType));
 	Out += Argument.size() * sizeof(ElementType);
 }
@@ -85,350 +300,934 @@ template <typename ElementType, typename std::enable_if<!std::is_class<ElementTy
 template <typename ElementType, typename std::enable_if<std::is_class<ElementType>::value>::type* = nullptr>
 	static inline size_t ProtocolGetSize(std::vector<ElementType> const &Argument)
 {
-	assert(Argument.size() <= std::numeric_limits<Protocol::ArraySizeType::Type>::max());
-	Protocol::ArraySizeType const ArraySize = (Protocol::ArraySizeType::Type)Argument.size();
-	size_t Out = Protocol::ArraySizeType::Size;
-	for (Protocol::ArraySizeType ElementIndex = (Protocol::ArraySizeType::Type)0; ElementIndex < ArraySize; ++ElementIndex)
-		Out += ProtocolGetSize(Argument[*ElementIndex]);
+	size_t Out = Protocol::LengthSize(Argument.size());
+	for (auto const &Element : Argument) Out += ProtocolGetSize(Element);
 	return Out;
 }
 template <typename ElementType, typename std::enable_if<std::is_class<ElementType>::value>::type* = nullptr>
 	static inline void ProtocolWrite(uint8_t *&Out, std::vector<ElementType> const &Argument)
 {
-	Protocol::ArraySizeType const ArraySize = (Protocol::ArraySizeType::Type)Argument.size();
-	ProtocolWrite(Out, *ArraySize);
-	for (Protocol::ArraySizeType ElementIndex = (Protocol::ArraySizeType::Type)0; ElementIndex < ArraySize; ++ElementIndex)
-		ProtocolWrite(Out, Argument[*ElementIndex]);
+	Protocol::WriteLength(Out, Argument.size());
+	for (auto const &Element : Argument) ProtocolWrite(Out, Element);
 }
 
-template <typename LogType, typename IntType> bool ProtocolRead(LogType &Log, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, Protocol::BufferType const &Buffer, Protocol::SizeType &Offset, IntType &Data)
+// Only the length is written here, Message::Send follows it with the bytes
+inline size_t ProtocolGetSize(Protocol::Blob const &Argument) { return Protocol::LongLengthSize + Argument.Length; }
+inline void ProtocolWrite(uint8_t *&Out, Protocol::Blob const &Argument) { Protocol::WriteLength(Out, Argument.Length, true); }
+
+template <size_t ExplicitCastableUniqueness, typename ExplicitCastableType> size_t ProtocolGetSize(Protocol::Compact<ExplicitCastable<ExplicitCastableUniqueness, ExplicitCastableType>> const &Argument)
+	{ return Protocol::VarintSize(Protocol::ToVarint(*Argument)); }
+template <size_t ExplicitCastableUniqueness, typename ExplicitCastableType> void ProtocolWrite(uint8_t *&Out, Protocol::Compact<ExplicitCastable<ExplicitCastableUniqueness, ExplicitCastableType>> const &Argument)
+	{ Protocol::WriteVarint(Out, Protocol::ToVarint(*Argument)); }
+
+// Reads a varint, for compact fields
+template <typename LogType> bool ProtocolReadVarint(LogType &Log, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, uint8_t const *Buffer, size_t Size, size_t &Offset, uint64_t &Value)
 {
-	if (Buffer.size() < StrictCast(Offset, size_t) + sizeof(IntType))
+	size_t const Taken = Protocol::ReadVarint(Buffer + Offset, Size - Offset, Value);
+	if (Taken > 0)
 	{
-		Log.Debug() << "End of file reached prematurely reading message body integer size " << sizeof(IntType) << ", message length doesn't match contents (version " << *VersionID << ", type " << *MessageID << ")";
-		assert(false);
-		return false;
+		Offset += Taken;
+		return true;
 	}
+	Log.Debug() << "End of file reached prematurely reading message body varint, message length doesn't match contents (version " << *VersionID << ", type " << *MessageID << ")";
+	assert(false);
+	return false;
+}
 
-	Data = *reinterpret_cast<IntType const *>(&Buffer[*Offset]);
-	Offset += static_cast<Protocol::SizeType::Type>(sizeof(IntType));
-	return true;
+template <typename LogType, typename ValueType> bool ProtocolReadCompact(LogType &Log, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, uint8_t const *Buffer, size_t Size, size_t &Offset, ValueType &Data)
+{
+	uint64_t Value;
+	if (!ProtocolReadVarint(Log, VersionID, MessageID, Buffer, Size, Offset, Value)) return false;
+	if (Protocol::FromVarint(Value, *Data)) return true;
+	Log.Debug() << "Message body varint " << Value << " is out of range for its field (version " << *VersionID << ", type " << *MessageID << ")";
+	assert(false);
+	return false;
 }
 
-template <typename LogType> bool ProtocolRead(LogType &Log, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, Protocol::BufferType const &Buffer, Protocol::SizeType &Offset, std::string &Data)
+// Reads an array length and checks there's room for that many elements of at least ElementSize bytes
+template <size_t ElementSize, typename LogType> bool ProtocolReadArraySize(LogType &Log, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, uint8_t const *Buffer, size_t Size, size_t &Offset, size_t &Count)
 {
-	if (Buffer.size() < StrictCast(Offset, size_t) + Protocol::ArraySizeType::Size)
+	uint64_t Length;
+	size_t const Taken = Protocol::ReadLength(Buffer + Offset, Size - Offset, Length, Protocol::HasLongLengths(*VersionID));
+	if ((Taken > 0) && (Length <= (Size - Offset - Taken) / ElementSize))
 	{
-		Log.Debug() << "End of file reached prematurely reading message body string header size " << Protocol::SizeType::Size << ", message length doesn't match contents (version " << *VersionID << ", type " << *MessageID << ")";
+		Offset += Taken;
+		Count = static_cast<size_t>(Length);
+		return true;
+	}
+	if (Taken == 0) Log.Debug() << "End of file reached prematurely reading message body array header, message length doesn't match contents (version " << *VersionID << ", type " << *MessageID << ")";
+	else Log.Debug() << "End of file reached prematurely reading message body array body size " << Length << ", message length doesn't match contents (version " << *VersionID << ", type " << *MessageID << ")";
+	assert(false);
+	return false;
+}
+
+template <typename LogType, typename IntType> bool ProtocolRead(LogType &Log, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, Protocol::BufferType const &Buffer, size_t &Offset, IntType &Data)
+{
+	if (Buffer.size() < Offset + sizeof(IntType))
+	{
+		Log.Debug() << "End of file reached prematurely reading message body integer size " << sizeof(IntType) << ", message length doesn't match contents (version " << *VersionID << ", type " << *MessageID << ")";
 		assert(false);
 		return false;
 	}
-	Protocol::ArraySizeType::Type const &Size = *reinterpret_cast<Protocol::ArraySizeType::Type const *>(&Buffer[*Offset]);
-	Offset += static_cast<Protocol::SizeType::Type>(sizeof(Size));
-	if (Buffer.size() < StrictCast(Offset, size_t) + (size_t)Size)
+
+	memcpy(static_cast<void *>(&Data), &Buffer[Offset], sizeof(IntType));
+	Data = Protocol::WireOrder(Data);
+	Offset += sizeof(IntType);
+	return true;
+}
+
+template <typename LogType, size_t ExplicitCastableUniqueness, typename ExplicitCastableType> bool ProtocolRead(LogType &Log, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, Protocol::BufferType const &Buffer, size_t &Offset, Protocol::Compact<ExplicitCastable<ExplicitCastableUniqueness, ExplicitCastableType>> &Data)
+	{ return ProtocolReadCompact(Log, VersionID, MessageID, Buffer.data(), Buffer.size(), Offset, Data); }
+
+template <typename LogType> bool ProtocolRead(LogType &Log, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, Protocol::BufferType const &Buffer, size_t &Offset, std::string &Data)
+{
+	size_t Count;
+	if (!ProtocolReadArraySize<1>(Log, VersionID, MessageID, Buffer.data(), Buffer.size(), Offset, Count)) return false;
+	Data.assign(reinterpret_cast<char const *>(Buffer.data() + Offset), Count);
+	Offset += Count;
+	return true;
+}
+
+template <typename LogType, typename ElementType, typename std::enable_if<!std::is_class<ElementType>::value>::type* = nullptr>
+	bool ProtocolRead(LogType &Log, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, Protocol::BufferType const &Buffer, size_t &Offset, std::vector<ElementType> &Data)
+{
+	size_t Count;
+	if (!ProtocolReadArraySize<sizeof(ElementType)>(Log, VersionID, MessageID, Buffer.data(), Buffer.size(), Offset, Count)) return false;
+	Data.resize(Count);
+	if (Count > 0) memcpy(&Data[0], Buffer.data() + Offset, Count * sizeof(ElementType));
+	Offset += Count * sizeof(ElementType);
+	return true;
+}
+
+template <typename LogType, typename ElementType, typename std::enable_if<std::is_class<ElementType>::value>::type* = nullptr>
+	bool ProtocolRead(LogType &Log, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, Protocol::BufferType const &Buffer, size_t &Offset, std::vector<ElementType> &Data)
+{
+	size_t Count;
+	if (!ProtocolReadArraySize<1>(Log, VersionID, MessageID, Buffer.data(), Buffer.size(), Offset, Count)) return false;
+	Data.resize(Count);
+	for (auto &Element : Data)
+		if (!ProtocolRead(Log, VersionID, MessageID, Buffer, Offset, Element)) return false;
+	return true;
+}
+
+// Reads from a buffer owned by the caller, for the ViewReader
+template <typename LogType, typename FieldType> bool ProtocolView(LogType &Log, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, Protocol::ViewBody const &Body, size_t &Offset, FieldType &Data)
+{
+	if (Body.Bytes.Count < Offset + sizeof(FieldType))
 	{
-		Log.Debug() << "End of file reached prematurely reading message body string body size " << Size << ", message length doesn't match contents (version " << *VersionID << ", type " << *MessageID << ")";
+		Log.Debug() << "End of file reached prematurely reading message body field size " << sizeof(FieldType) << ", message length doesn't match contents (version " << *VersionID << ", type " << *MessageID << ")";
 		assert(false);
 		return false;
 	}
-	Data = std::string(reinterpret_cast<char const *>(&Buffer[*Offset]), Size);
-	Offset += Size;
+	memcpy(static_cast<void *>(&Data), Body.Bytes.Data + Offset, sizeof(FieldType));
+	Data = Protocol::WireOrder(Data);
+	Offset += sizeof(FieldType);
 	return true;
 }
 
-template <typename LogType, typename ElementType, typename std::enable_if<!std::is_class<ElementType>::value>::type* = nullptr>
-	bool ProtocolRead(LogType &Log, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, Protocol::BufferType const &Buffer, Protocol::SizeType &Offset, std::vector<ElementType> &Data)
+template <typename LogType, size_t ExplicitCastableUniqueness, typename ExplicitCastableType> bool ProtocolView(LogType &Log, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, Protocol::ViewBody const &Body, size_t &Offset, Protocol::Compact<ExplicitCastable<ExplicitCastableUniqueness, ExplicitCastableType>> &Data)
+	{ return ProtocolReadCompact(Log, VersionID, MessageID, Body.Bytes.Data, Body.Bytes.Count, Offset, Data); }
+
+template <typename LogType> bool ProtocolView(LogType &Log, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, Protocol::ViewBody const &Body, size_t &Offset, StringView &Data)
+{
+	size_t Count;
+	if (!ProtocolReadArraySize<1>(Log, VersionID, MessageID, Body.Bytes.Data, Body.Bytes.Count, Offset, Count)) return false;
+	Data = StringView(reinterpret_cast<char const *>(Body.Bytes.Data + Offset), Count);
+	Offset += Count;
+	return true;
+}
+
+template <typename LogType, typename ElementType> bool ProtocolView(LogType &Log, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, Protocol::ViewBody const &Body, size_t &Offset, Protocol::Span<ElementType> &Data)
 {
-	if (Buffer.size() < StrictCast(Offset, size_t) + Protocol::ArraySizeType::Size)
+	size_t Count;
+	if (!ProtocolReadArraySize<sizeof(ElementType)>(Log, VersionID, MessageID, Body.Bytes.Data, Body.Bytes.Count, Offset, Count)) return false;
+	Data = Protocol::Span<ElementType>(Body.Bytes.Data + Offset, Count);
+	Offset += Count * sizeof(ElementType);
+	return true;
+}
+
+template <typename LogType, typename ElementType> bool ProtocolView(LogType &Log, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, Protocol::ViewBody const &Body, size_t &Offset, std::vector<ElementType> &Data)
+{
+	size_t Count;
+	if (!ProtocolReadArraySize<1>(Log, VersionID, MessageID, Body.Bytes.Data, Body.Bytes.Count, Offset, Count)) return false;
+	Data.resize(Count);
+	for (auto &Element : Data)
+		if (!ProtocolView(Log, VersionID, MessageID, Body, Offset, Element)) return false;
+	return true;
+}
+
+template <typename LogType> bool ProtocolView(LogType &Log, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, Protocol::ViewBody const &Body, size_t &Offset, Protocol::BlobPiece &Data)
+{
+	uint64_t Length;
+	size_t const Taken = Protocol::ReadLength(Body.Bytes.Data + Offset, Body.Bytes.Count - Offset, Length, Protocol::HasLongLengths(*VersionID));
+	if (Taken == 0)
 	{
-		Log.Debug() << "End of file reached prematurely reading message body array header size " << Protocol::ArraySizeType::Size << ", message length doesn't match contents (version " << *VersionID << ", type " << *MessageID << ")";
+		Log.Debug() << "End of file reached prematurely reading message body blob header, message length doesn't match contents (version " << *VersionID << ", type " << *MessageID << ")";
 		assert(false);
 		return false;
 	}
-	Protocol::ArraySizeType::Type const &Size = *reinterpret_cast<Protocol::ArraySizeType::Type const *>(&Buffer[*Offset]);
-	Offset += static_cast<Protocol::SizeType::Type>(sizeof(Size));
-	if (Buffer.size() < StrictCast(Offset, size_t) + Size * sizeof(ElementType))
+	Offset += Taken;
+	if (Body.Piece)
+	{
+		Data = *Body.Piece;
+		return true;
+	}
+	if (Length != Body.Bytes.Count - Offset)
 	{
-		Log.Debug() << "End of file reached prematurely reading message body array body size " << Size << ", message length doesn't match contents (version " << *VersionID << ", type " << *MessageID << ")";
+		Log.Debug() << "Message length doesn't match blob size " << Length << " (version " << *VersionID << ", type " << *MessageID << ")";
 		assert(false);
 		return false;
 	}
-	Data.resize(Size);
-	memcpy(&Data[0], &Buffer[*Offset], Size * sizeof(ElementType));
-	Offset += static_cast<Protocol::SizeType::Type>(Size * sizeof(ElementType));
+	Data.Offset = 0;
+	Data.Length = Length;
+	Data.Data = Protocol::Span<uint8_t>(Body.Bytes.Data + Offset, static_cast<size_t>(Length));
+	Offset += static_cast<size_t>(Length);
 	return true;
 }
 
-template <typename LogType, typename ElementType, typename std::enable_if<std::is_class<ElementType>::value>::type* = nullptr>
-	bool ProtocolRead(LogType &Log, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, Protocol::BufferType const &Buffer, Protocol::SizeType &Offset, std::vector<ElementType> &Data)
+namespace Protocol
+{
+// Infrastructure
+constexpr SizeType HeaderSize{SizeType::Type(VersionIDType::Size + MessageIDType::Size + SizeType::Size)};
+constexpr size_t LongHeaderSize = VersionIDType::Size + MessageIDType::Size + LongLengthSize;
+
+// Reads a message header from the Available bytes at Data.  The header's size, or 0 if Available doesn't hold all
+// of it.
+inline size_t ReadHeader(uint8_t const *Data, size_t Available, VersionIDType::Type &VersionID, MessageIDType::Type &MessageID, uint64_t &BodyLength)
 {
-	if (Buffer.size() < StrictCast(Offset, size_t) + Protocol::ArraySizeType::Size)
+	size_t const IDSize = VersionIDType::Size + MessageIDType::Size;
+	if (Available < *HeaderSize) return 0;
+	memcpy(&VersionID, Data, VersionIDType::Size);
+	memcpy(&MessageID, Data + VersionIDType::Size, MessageIDType::Size);
+	size_t const Taken = ReadLength(Data + IDSize, Available - IDSize, BodyLength, HasLongLengths(VersionID));
+	return Taken ? IDSize + Taken : 0;
+}
+
+// Batches of messages can be wrapped in a compressed frame, which readers unwrap and read as if the messages had
+// come by themselves.  A frame has a message header with the reserved version ID below and the codec as its
+// message ID.  Its body is the length of the messages as a varint, then the messages compressed.  Codecs are
+// agreed per connection, since a reader only unwraps the codecs it knows, or recorded per file in the frames.
+// Frames use long lengths.
+constexpr VersionIDType::Type FrameVersionID = std::numeric_limits<VersionIDType::Type>::max();
+
+enum FrameCodec : uint8_t { CodecNone = 0, CodecDeflate = 1 };
+
+// Codecs as flags, for offering several at once
+constexpr uint8_t CodecFlag(FrameCodec Codec) { return static_cast<uint8_t>(1u << Codec); }
+constexpr uint8_t SupportedCodecs = CodecFlag(CodecDeflate);
+
+// The best codec out of those the other side offers, or CodecNone if there's nothing in common
+inline FrameCodec ChooseCodec(uint8_t Offered) { return (Offered & CodecFlag(CodecDeflate)) ? CodecDeflate : CodecNone; }
+
+// Frames are inflated whole, so a corrupt or hostile length can't ask for more than this
+constexpr size_t MaxFrameSize = 16 * 1024 * 1024;
+
+// Smaller batches aren't worth the codec's overhead
+constexpr size_t MinimumFrameInput = 128;
+
+// Inflates a frame's body into Out
+template <typename LogType> bool Unframe(LogType &Log, MessageIDType::Type Codec, Span<uint8_t> const &Body, BufferType &Out)
+{
+	uint64_t Length;
+	size_t const Taken = ReadVarint(Body.Data, Body.Count, Length);
+	if ((Codec != CodecDeflate) || (Taken == 0) || (Length > MaxFrameSize))
 	{
-		Log.Debug() << "End of file reached prematurely reading message body array header size " << Protocol::ArraySizeType::Size << ", message length doesn't match contents (version " << *VersionID << ", type " << *MessageID << ")";
+		Log.Debug() << "Read compressed frame with unknown codec " << static_cast<unsigned int>(Codec) << " or invalid length";
 		assert(false);
 		return false;
 	}
-	Protocol::ArraySizeType::Type const &Size = *reinterpret_cast<Protocol::ArraySizeType::Type const *>(&Buffer[*Offset]);
-	Offset += static_cast<Protocol::SizeType::Type>(sizeof(Size));
-	if (Buffer.size() < StrictCast(Offset, size_t) + (size_t)Size)
+	Out.resize(static_cast<size_t>(Length));
+	ssize_t const Inflated = DecompressBlock(reinterpret_cast<char const *>(Body.Data + Taken), Body.Count - Taken, reinterpret_cast<char *>(Out.data()), Out.size());
+	if (Inflated != static_cast<ssize_t>(Length))
 	{
-		Log.Debug() << "End of file reached prematurely reading message body array body size " << Size << ", message length doesn't match contents (version " << *VersionID << ", type " << *MessageID << ")";
+		Log.Debug() << "Compressed frame is corrupt or doesn't match its length " << Length;
 		assert(false);
 		return false;
 	}
-	Data.resize(Size);
-	for (Protocol::ArraySizeType ElementIndex = (Protocol::ArraySizeType::Type)0; ElementIndex < Size; ++ElementIndex)
-		ProtocolRead(Log, VersionID, MessageID, Buffer, Offset, Data[*ElementIndex]);
 	return true;
 }
 
-namespace Protocol
+// Wraps batches of whole messages in frames compressed with the codec agreed with the reader.  Batches that are
+// small, too large to unwrap, or that don't shrink are passed through as they are.  Not thread safe.
+struct FrameCompressor
 {
-// Infrastructure
-constexpr SizeType HeaderSize{SizeType::Type(VersionIDType::Size + MessageIDType::Size + SizeType::Size)};
+	FrameCompressor(FrameCodec Codec = CodecNone) : Codec(Codec) {}
+
+	FrameCodec GetCodec(void) const { return Codec; }
+	void SetCodec(FrameCodec Codec) { this->Codec = Codec; }
+
+	// Adds the Length bytes of messages at Messages to the end of Out.  The size added.
+	size_t Append(BufferType &Out, uint8_t const *Messages, size_t Length)
+	{
+		size_t const Start = Out.size();
+		if ((Codec == CodecDeflate) && (Length >= MinimumFrameInput) && (Length <= MaxFrameSize))
+		{
+			// Set up on first use, since a deflate stream holds a few hundred KiB
+			if (!Compressor) Compressor.reset(new BlockCompressor);
+			size_t const Packed = Compressor->Compress(reinterpret_cast<char const *>(Messages), Length, Scratch);
+			if (Packed > 0)
+			{
+				size_t const Body = VarintSize(Length) + Packed;
+				Out.resize(Start + VersionIDType::Size + MessageIDType::Size + LengthSize(Body) + Body);
+				uint8_t *WritePointer = &Out[Start];
+				ProtocolWrite(WritePointer, VersionIDType(FrameVersionID));
+				ProtocolWrite(WritePointer, MessageIDType(static_cast<MessageIDType::Type>(Codec)));
+				WriteLength(WritePointer, Body);
+				WriteVarint(WritePointer, Length);
+				memcpy(WritePointer, Scratch.data(), Packed);
+				return Out.size() - Start;
+			}
+		}
+		Out.insert(Out.end(), Messages, Messages + Length);
+		return Length;
+	}
+
+	private:
+		FrameCodec Codec;
+		std::unique_ptr<BlockCompressor> Compressor;
+		std::vector<char> Scratch;
+};
+
+// Strings, arrays and compact fields vary in size, everything else is written at its full width unless it says
+// otherwise here
+template <typename FieldType> struct FieldFixedSize : std::integral_constant<size_t, sizeof(FieldType)> {};
+template <> struct FieldFixedSize<std::string> : std::integral_constant<size_t, 0> {};
+template <> struct FieldFixedSize<Blob> : std::integral_constant<size_t, 0> {};
+template <typename ValueType> struct FieldFixedSize<Compact<ValueType>> : std::integral_constant<size_t, 0> {};
+template <typename ElementType> struct FieldFixedSize<std::vector<ElementType>> : std::integral_constant<size_t, 0> {};
+
+template <typename ...FieldTypes> struct FixedBodySize;
+template <> struct FixedBodySize<>
+{
+	static constexpr bool Fixed = true;
+	static constexpr size_t Value = 0;
+};
+template <typename NextType, typename ...RemainingTypes> struct FixedBodySize<NextType, RemainingTypes...>
+{
+	static constexpr bool Fixed = (FieldFixedSize<NextType>::value > 0) && FixedBodySize<RemainingTypes...>::Fixed;
+	static constexpr size_t Value = FieldFixedSize<NextType>::value + FixedBodySize<RemainingTypes...>::Value;
+};
+
+// For a message that ends in a blob, the size of its body up to the blob's bytes
+template <typename ...FieldTypes> struct BlobPrefixSize
+{
+	static constexpr bool Valid = false;
+	static constexpr size_t Value = 0;
+};
+template <> struct BlobPrefixSize<Blob>
+{
+	static constexpr bool Valid = true;
+	static constexpr size_t Value = LongLengthSize;
+};
+template <typename NextType, typename ...RemainingTypes> struct BlobPrefixSize<NextType, RemainingTypes...>
+{
+	static constexpr bool Valid = (FieldFixedSize<NextType>::value > 0) && BlobPrefixSize<RemainingTypes...>::Valid;
+	static constexpr size_t Value = FieldFixedSize<NextType>::value + BlobPrefixSize<RemainingTypes...>::Value;
+};
+
+template <typename ...FieldTypes> struct HasBlob : std::false_type {};
+template <typename NextType, typename ...RemainingTypes> struct HasBlob<NextType, RemainingTypes...>
+	: std::integral_constant<bool, std::is_same<NextType, Blob>::value || HasBlob<RemainingTypes...>::value> {};
 
 template <size_t Individuality> struct Protocol {};
 
 template <VersionIDType::Type IDValue, typename InProtocol> struct Version
-	{ static constexpr VersionIDType ID{IDValue}; };
+{
+	static_assert(VersionIndex(IDValue) < VersionIndex(FrameVersionID), "The last version ID is reserved for compressed frames.");
+	static constexpr VersionIDType ID{IDValue};
+	static constexpr bool LongLengths = HasLongLengths(IDValue);
+};
 template <VersionIDType::Type IDValue, typename InProtocol> constexpr VersionIDType Version<IDValue, InProtocol>::ID;
+template <VersionIDType::Type IDValue, typename InProtocol> constexpr bool Version<IDValue, InProtocol>::LongLengths;
 
 template <MessageIDType::Type, typename, typename> struct Message;
 template <MessageIDType::Type IDValue, typename InVersion, typename ...Definition> struct Message<IDValue, InVersion, void(Definition...)>
 {
+	static_assert(!HasBlob<Definition...>::value || BlobPrefixSize<Definition...>::Valid, "A Blob must be a message's last field, after only fixed size fields.");
+	static_assert(!HasBlob<Definition...>::value || InVersion::LongLengths, "Messages with a Blob need a version with long lengths.");
+
 	typedef InVersion Version;
 	typedef void Signature(Definition...);
 	typedef std::function<void(Definition const &...)> Function;
 	static constexpr MessageIDType ID{IDValue};
 
+	// The encoded size of every instance, or 0 if it depends on the arguments
+	static constexpr size_t FixedSize = FixedBodySize<Definition...>::Fixed ? *HeaderSize + FixedBodySize<Definition...>::Value : 0;
+
+	// For a message that ends in a blob, the size of its body up to the blob's bytes, otherwise 0
+	static constexpr size_t BlobPrefix = BlobPrefixSize<Definition...>::Valid ? BlobPrefixSize<Definition...>::Value : 0;
+
+	// The encoded size, including any blob, or 0 if the version doesn't have long lengths and the arguments are too
+	// large for one message
+	static size_t Size(Definition const &...Arguments)
+	{
+		if (FixedBodySize<Definition...>::Fixed) return FixedSize;
+		size_t const Body = BodySize(Arguments...);
+		// Every string or array in a body that fits in two bytes has a length that does too
+		if (!InVersion::LongLengths) return (Body > LongLength) ? 0 : *HeaderSize + Body;
+		return VersionIDType::Size + MessageIDType::Size + LengthSize(Body) + Body;
+	}
+
 	static std::vector<uint8_t> Write(Definition const &...Arguments)
 	{
 		std::vector<uint8_t> Out;
-		auto RequiredSize = Size(Arguments...);
-		if (RequiredSize > std::numeric_limits<SizeType::Type>::max())
-			{ assert(false); return Out; }
-		Out.resize(StrictCast(HeaderSize, size_t) + RequiredSize);
-		uint8_t *WritePointer = &Out[0];
-		ProtocolWrite(WritePointer, InVersion::ID);
-		ProtocolWrite(WritePointer, ID);
-		ProtocolWrite(WritePointer, (SizeType::Type)RequiredSize);
-		Write(WritePointer, Arguments...);
+		Append(Out, Arguments...);
 		return Out;
 	}
 
+	// Adds the message to the end of Out, so a batch of messages can go out in one write.  Out's capacity is kept
+	// between batches if it's cleared rather than replaced.  The encoded size, or 0 if the message is too large.
+	static size_t Append(BufferType &Out, Definition const &...Arguments)
+	{
+		static_assert(BlobPrefix == 0, "Messages with a Blob are written with Send.");
+		size_t const Length = Size(Arguments...);
+		if (Length == 0) { assert(false); return 0; }
+		size_t const Start = Out.size();
+		Out.resize(Start + Length);
+		uint8_t *WritePointer = &Out[Start];
+		WriteHeader(WritePointer, Length);
+		WriteBody(WritePointer, Arguments...);
+		return Length;
+	}
+
+	// Writes the message to Out if it fits in Capacity.  The encoded size, or 0 if it doesn't fit.
+	static size_t Encode(uint8_t *Out, size_t Capacity, Definition const &...Arguments)
+	{
+		static_assert(BlobPrefix == 0, "Messages with a Blob are written with Send.");
+		size_t const Length = Size(Arguments...);
+		if ((Length == 0) || (Length > Capacity)) return 0;
+		WriteHeader(Out, Length);
+		WriteBody(Out, Arguments...);
+		return Length;
+	}
+
+	// Writes a message ending in a blob to Sink without holding the blob in memory: the header and other fields
+	// go first, then the blob in pieces of at most PieceSize.  Sink takes (uint8_t const *Data, size_t Length) and
+	// returns false if it can't take them.  False if the sink or the blob's source fails.
+	template <typename SinkType> static bool Send(SinkType &&Sink, Definition const &...Arguments)
+	{
+		static_assert(BlobPrefix > 0, "Only messages with a Blob are written with Send.");
+		size_t const PieceSize = 64 * 1024;
+		uint8_t Prefix[LongHeaderSize + BlobPrefix];
+		size_t const Length = Size(Arguments...);
+		uint8_t *WritePointer = Prefix;
+		WriteHeader(WritePointer, Length);
+		WriteBody(WritePointer, Arguments...);
+		if (!Sink(static_cast<uint8_t const *>(Prefix), static_cast<size_t>(WritePointer - Prefix))) return false;
+
+		Blob const &Bytes = LastArgument(Arguments...);
+		std::vector<uint8_t> Piece(static_cast<size_t>(std::min<uint64_t>(PieceSize, Bytes.Length)));
+		for (uint64_t Sent = 0; Sent < Bytes.Length; )
+		{
+			size_t const Next = static_cast<size_t>(std::min<uint64_t>(Piece.size(), Bytes.Length - Sent));
+			if (!Bytes.Source(Piece.data(), Next)) return false;
+			if (!Sink(static_cast<uint8_t const *>(Piece.data()), Next)) return false;
+			Sent += Next;
+		}
+		return true;
+	}
+
 	private:
+		static inline void WriteHeader(uint8_t *&Out, size_t Length)
+		{
+			ProtocolWrite(Out, InVersion::ID);
+			ProtocolWrite(Out, ID);
+			size_t const IDSize = VersionIDType::Size + MessageIDType::Size;
+			size_t const ShortBody = Length - IDSize - SizeType::Size;
+			if (!InVersion::LongLengths) ProtocolWrite(Out, static_cast<SizeType::Type>(ShortBody));
+			else WriteLength(Out, (ShortBody < LongLength) ? ShortBody : Length - IDSize - LongLengthSize);
+		}
+
 		template <typename NextType, typename... RemainingTypes>
-			static inline size_t Size(NextType NextArgument, RemainingTypes... RemainingArguments)
-			{ return ProtocolGetSize(NextArgument) + Size(RemainingArguments...); }
+			static inline size_t BodySize(NextType const &NextArgument, RemainingTypes const &... RemainingArguments)
+			{ return ProtocolGetSize(NextArgument) + BodySize(RemainingArguments...); }
 
-		static constexpr size_t Size(void) { return {0}; }
+		static constexpr size_t BodySize(void) { return {0}; }
 
 		template <typename NextType, typename... RemainingTypes>
-			static inline void Write(uint8_t *&Out, NextType NextArgument, RemainingTypes... RemainingArguments)
+			static inline void WriteBody(uint8_t *&Out, NextType const &NextArgument, RemainingTypes const &... RemainingArguments)
 			{
 				ProtocolWrite(Out, NextArgument);
-				Write(Out, RemainingArguments...);
+				WriteBody(Out, RemainingArguments...);
 			}
 
-		static inline void Write(uint8_t *&) {}
+		static inline void WriteBody(uint8_t *&) {}
 
+		static Blob const &LastArgument(Blob const &Argument) { return Argument; }
+		template <typename NextType, typename... RemainingTypes>
+			static Blob const &LastArgument(NextType const &, RemainingTypes const &... RemainingArguments)
+			{ return LastArgument(RemainingArguments...); }
 };
 template <MessageIDType::Type IDValue, typename InVersion, typename ...Definition> constexpr MessageIDType Message<IDValue, InVersion, void(Definition...)>::ID;
+template <MessageIDType::Type IDValue, typename InVersion, typename ...Definition> constexpr size_t Message<IDValue, InVersion, void(Definition...)>::FixedSize;
+template <MessageIDType::Type IDValue, typename InVersion, typename ...Definition> constexpr size_t Message<IDValue, InVersion, void(Definition...)>::BlobPrefix;
 
-template <VersionIDType::Type CurrentVersionID, MessageIDType::Type CurrentMessageID, typename Enabled, typename ...MessageTypes> struct ReaderTupleElement;
-template
-<
-	VersionIDType::Type CurrentVersionID,
-	MessageIDType::Type CurrentMessageID,
-	typename MessageType,
-	typename ...RemainingMessageTypes
->
-struct ReaderTupleElement
-<
-	CurrentVersionID,
-	CurrentMessageID,
-	typename std::enable_if<(CurrentVersionID == *MessageType::Message::Version::ID) && (CurrentMessageID == *MessageType::Message::ID)>::type,
-	MessageType, RemainingMessageTypes...
->
-: ReaderTupleElement
-<
-	CurrentVersionID,
-	CurrentMessageID + 1,
-	void,
-	RemainingMessageTypes...
->
+template <typename MessageType> struct MessageFields;
+template <MessageIDType::Type IDValue, typename InVersion, typename ...Definition> struct MessageFields<Message<IDValue, InVersion, void(Definition...)>>
 {
-	private:
-		template <typename ParentType = MessageType> struct MessageDerivedTypes;
-		template <MessageIDType::Type ID, typename InVersion, typename ...Definition>
-			struct MessageDerivedTypes<Message<ID, InVersion, void(Definition...)>>
-		{
-			typedef std::tuple<Definition...> Tuple;
-			typedef std::function<void(Definition const &...)> Callback;
-		};
-
-		typedef ReaderTupleElement
-		<
-			CurrentVersionID,
-			CurrentMessageID,
-			void,
-			MessageType, RemainingMessageTypes...
-		> ThisElement;
-
-		typedef ReaderTupleElement
-		<
-			CurrentVersionID,
-			CurrentMessageID + 1,
-			void,
-			RemainingMessageTypes...
-		> NextElement;
-
-		typename MessageDerivedTypes<>::Callback Callback;
-
-	protected:
-		template <typename CallbackType, typename ...RemainingCallbackTypes>
-			ReaderTupleElement(CallbackType const &Callback, RemainingCallbackTypes const &...RemainingCallbacks) :
-			NextElement(std::forward<RemainingCallbackTypes const &>(RemainingCallbacks)...), Callback(Callback)
-			{}
-
-		template <typename LogType>
-			bool Read(LogType &Log, VersionIDType const &VersionID, MessageIDType const &MessageID, BufferType const &Buffer)
+	typedef std::tuple<Definition...> Tuple;
+	typedef std::function<void(Definition const &...)> Callback;
+	typedef std::function<void(typename ViewOf<Definition>::Type const &...)> ViewCallback;
+};
+
+template <typename LogType, typename UnreadTypes, typename ReadTypes> struct ReadImplementation {};
+template <typename LogType, typename NextType, typename... RemainingTypes, typename... ReadTypes>
+	struct ReadImplementation<LogType, std::tuple<NextType, RemainingTypes...>, std::tuple<ReadTypes...>>
+{
+	template <typename CallbackType> static bool Read(CallbackType const &Callback, LogType &Log, VersionIDType const &VersionID, MessageIDType const &MessageID, BufferType const &Buffer, size_t &Offset, ReadTypes const &...ReadData)
+	{
+		NextType Data;
+		if (!ProtocolRead(Log, VersionID, MessageID, Buffer, Offset, Data)) return false;
+		return ReadImplementation<LogType, std::tuple<RemainingTypes...>, std::tuple<ReadTypes..., NextType>>::Read(Callback, Log, VersionID, MessageID, Buffer, Offset, ReadData..., Data);
+	}
+};
+template <typename LogType, typename... ReadTypes>
+	struct ReadImplementation<LogType, std::tuple<>, std::tuple<ReadTypes...>>
+{
+	template <typename CallbackType> static bool Read(CallbackType const &Callback, LogType &, VersionIDType const &, MessageIDType const &, BufferType const &, size_t &, ReadTypes const &...ReadData)
+	{
+		Callback(ReadData...);
+		return true;
+	}
+};
+
+template <typename LogType, typename UnreadTypes, typename ReadTypes> struct ViewImplementation {};
+template <typename LogType, typename NextType, typename... RemainingTypes, typename... ReadTypes>
+	struct ViewImplementation<LogType, std::tuple<NextType, RemainingTypes...>, std::tuple<ReadTypes...>>
+{
+	template <typename CallbackType> static bool Read(CallbackType const &Callback, LogType &Log, VersionIDType const &VersionID, MessageIDType const &MessageID, ViewBody const &Body, size_t &Offset, ReadTypes const &...ReadData)
+	{
+		typename ViewOf<NextType>::Type Data;
+		if (!ProtocolView(Log, VersionID, MessageID, Body, Offset, Data)) return false;
+		return ViewImplementation<LogType, std::tuple<RemainingTypes...>, std::tuple<ReadTypes..., typename ViewOf<NextType>::Type>>::Read(Callback, Log, VersionID, MessageID, Body, Offset, ReadData..., Data);
+	}
+};
+template <typename LogType, typename... ReadTypes>
+	struct ViewImplementation<LogType, std::tuple<>, std::tuple<ReadTypes...>>
+{
+	template <typename CallbackType> static bool Read(CallbackType const &Callback, LogType &, VersionIDType const &, MessageIDType const &, ViewBody const &, size_t &, ReadTypes const &...ReadData)
+	{
+		Callback(ReadData...);
+		return true;
+	}
+};
+
+template <size_t ...Values> struct IndexList {};
+template <typename First, typename Second> struct JoinIndexLists;
+template <size_t ...First, size_t ...Second> struct JoinIndexLists<IndexList<First...>, IndexList<Second...>>
+	{ typedef IndexList<First..., (sizeof...(First) + Second)...> Type; };
+template <size_t Count> struct MakeIndexList
+{
+	typedef typename JoinIndexLists
+	<
+		typename MakeIndexList<Count / 2>::Type,
+		typename MakeIndexList<Count - Count / 2>::Type
+	>::Type Type;
+};
+template <> struct MakeIndexList<0> { typedef IndexList<> Type; };
+template <> struct MakeIndexList<1> { typedef IndexList<0> Type; };
+
+template <typename MessageType, typename ...MessageTypes> struct MessageIndex;
+template <typename MessageType, typename ...RemainingTypes> struct MessageIndex<MessageType, MessageType, RemainingTypes...>
+	: std::integral_constant<size_t, 0> {};
+template <typename MessageType, typename OtherType, typename ...RemainingTypes> struct MessageIndex<MessageType, OtherType, RemainingTypes...>
+	: std::integral_constant<size_t, 1 + MessageIndex<MessageType, RemainingTypes...>::value> {};
+
+template <typename ...MessageTypes> struct MessagePosition;
+template <> struct MessagePosition<>
+{
+	static constexpr size_t Find(size_t, size_t, size_t Position) { return Position; }
+	static constexpr size_t Versions(void) { return 0; }
+	static constexpr bool Distinct(void) { return true; }
+	static constexpr bool Blobs(void) { return false; }
+};
+template <typename MessageType, typename ...RemainingTypes> struct MessagePosition<MessageType, RemainingTypes...>
+{
+	// Where the message with these IDs is in the list, or the length of the list if it isn't there
+	static constexpr size_t Find(size_t VersionID, size_t MessageID, size_t Position)
+	{
+		return ((VersionID == VersionIndex(*MessageType::Version::ID)) && (MessageID == *MessageType::ID)) ?
+			Position : MessagePosition<RemainingTypes...>::Find(VersionID, MessageID, Position + 1);
+	}
+
+	// One more than the highest version index in the list
+	static constexpr size_t Versions(void)
+	{
+		return (VersionIndex(*MessageType::Version::ID) + 1u > MessagePosition<RemainingTypes...>::Versions()) ?
+			VersionIndex(*MessageType::Version::ID) + 1u : MessagePosition<RemainingTypes...>::Versions();
+	}
+
+	// Whether every message in the list has its own IDs
+	static constexpr bool Distinct(void)
+	{
+		return (MessagePosition<RemainingTypes...>::Find(VersionIndex(*MessageType::Version::ID), *MessageType::ID, 0) == sizeof...(RemainingTypes)) &&
+			MessagePosition<RemainingTypes...>::Distinct();
+	}
+
+	// Whether any message in the list ends in a blob
+	static constexpr bool Blobs(void) { return (MessageType::BlobPrefix > 0) || MessagePosition<RemainingTypes...>::Blobs(); }
+};
+
+template <size_t Position, typename Enabled, typename ...MessageTypes> struct BlobPrefixAt : std::integral_constant<size_t, 0> {};
+template <size_t Position, typename ...MessageTypes> struct BlobPrefixAt<Position, typename std::enable_if<(Position < sizeof...(MessageTypes))>::type, MessageTypes...>
+	: std::integral_constant<size_t, std::tuple_element<Position, std::tuple<MessageTypes...>>::type::BlobPrefix> {};
+
+constexpr size_t MessageIDCount = static_cast<size_t>(std::numeric_limits<MessageIDType::Type>::max()) + 1;
+
+// Has an entry for every message ID of every version up to the highest a reader knows, pointing at the reader's
+// handler for that message or its handler for unknown messages.  Dispatch is one indexed call however many
+// messages there are.  Alongside is the size of each message's body up to its blob, for messages that end in one.
+// Versions are indexed without their long lengths flag, so handlers check the flag matches.
+template <typename ReaderType, typename Slots, typename ...MessageTypes> struct DispatchTable;
+template <typename ReaderType, size_t ...Slots, typename ...MessageTypes> struct DispatchTable<ReaderType, IndexList<Slots...>, MessageTypes...>
+{
+	typedef typename ReaderType::Handler Handler;
+	static constexpr Handler Entries[sizeof...(Slots)] =
+		{&ReaderType::template Handle<MessagePosition<MessageTypes...>::Find(Slots / MessageIDCount, Slots % MessageIDCount, 0)>...};
+	static constexpr size_t BlobPrefixes[sizeof...(Slots)] =
+		{BlobPrefixAt<MessagePosition<MessageTypes...>::Find(Slots / MessageIDCount, Slots % MessageIDCount, 0), void, MessageTypes...>::value...};
+
+	template <typename BodyType> static bool Dispatch(ReaderType &This, VersionIDType const &VersionID, MessageIDType const &MessageID, BodyType const &Body)
+	{
+		size_t const Slot = VersionIndex(*VersionID) * MessageIDCount + *MessageID;
+		if (Slot >= sizeof...(Slots))
+			return ReaderType::template Handle<sizeof...(MessageTypes)>(This, VersionID, MessageID, Body);
+		return Entries[Slot](This, VersionID, MessageID, Body);
+	}
+
+	static size_t BlobPrefix(VersionIDType const &VersionID, MessageIDType const &MessageID)
+	{
+		size_t const Slot = VersionIndex(*VersionID) * MessageIDCount + *MessageID;
+		return (Slot < sizeof...(Slots)) ? BlobPrefixes[Slot] : 0;
+	}
+};
+template <typename ReaderType, size_t ...Slots, typename ...MessageTypes>
+	constexpr typename DispatchTable<ReaderType, IndexList<Slots...>, MessageTypes...>::Handler
+	DispatchTable<ReaderType, IndexList<Slots...>, MessageTypes...>::Entries[sizeof...(Slots)];
+template <typename ReaderType, size_t ...Slots, typename ...MessageTypes>
+	constexpr size_t DispatchTable<ReaderType, IndexList<Slots...>, MessageTypes...>::BlobPrefixes[sizeof...(Slots)];
+
+template <typename ReaderType, typename ...MessageTypes> using ReaderDispatchTable =
+	DispatchTable<ReaderType, typename MakeIndexList<MessagePosition<MessageTypes...>::Versions() * MessageIDCount>::Type, MessageTypes...>;
+
+template <typename LogType, typename ...MessageTypes> struct Reader
+{
+	static_assert(MessagePosition<MessageTypes...>::Distinct(), "Messages from different protocols can't share a reader.");
+	static_assert(!MessagePosition<MessageTypes...>::Blobs(), "Messages with a Blob are read with a ViewReader or StreamReader.");
+
+	template <typename ...CallbackTypes> Reader(LogType &Log, CallbackTypes const &...Callbacks) : Log(Log), Callbacks(Callbacks...) {}
+
+	// StreamType must have ::read(char *, int) and operator! operators.
+	template <typename StreamType> bool Read(StreamType &&Stream)
+	{
+		Buffer.resize(LongHeaderSize);
+		if (!Stream.read((char *)&Buffer[0], *HeaderSize)) return true;
+		VersionIDType::Type VersionID;
+		MessageIDType::Type MessageID;
+		uint64_t DataSize;
+		if (ReadHeader(&Buffer[0], *HeaderSize, VersionID, MessageID, DataSize) == 0)
 		{
-			if ((VersionID == MessageType::Version::ID) && (MessageID == MessageType::ID))
+			// A long length's other eight bytes
+			if (!Stream.read((char *)&Buffer[*HeaderSize], LongHeaderSize - *HeaderSize))
 			{
-				SizeType Offset{(SizeType::Type)0};
-				return ReadImplementation<LogType, typename MessageDerivedTypes<>::Tuple, std::tuple<>>::Read(*this, Log, VersionID, MessageID, Buffer, Offset);
+				Log.Debug() << "End of file reached prematurely reading message header (version " << VersionID << ", type " << MessageID << ")";
+				assert(false);
+				return false;
 			}
-			return NextElement::Read(Log, VersionID, MessageID, Buffer);
+			ReadHeader(&Buffer[0], LongHeaderSize, VersionID, MessageID, DataSize);
 		}
+		Buffer.resize(static_cast<size_t>(DataSize));
+		if (!Stream.read((char *)Buffer.data(), static_cast<size_t>(DataSize)))
+		{
+			Log.Debug() << "End of file reached prematurely reading message body (version " << VersionID << ", type " << MessageID << ")";
+			assert(false);
+			return false;
+		}
+		if (VersionID == FrameVersionID) return ReadFrame(MessageID);
+		return Table::Dispatch(*this, VersionID, MessageID, Buffer);
+	}
 
-	public:
-		template <
-			typename CallMessageType,
-			typename ...ArgumentTypes,
-			typename std::enable_if<std::is_same<CallMessageType, MessageType>::value>::type* = nullptr>
-			void Call(ArgumentTypes const & ...Arguments)
-			{ Callback(std::forward<ArgumentTypes const &>(Arguments)...); }
-
-		template <
-			typename CallMessageType,
-			typename ...ArgumentTypes,
-			typename std::enable_if<!std::is_same<CallMessageType, MessageType>::value>::type* = nullptr>
-			void Call(ArgumentTypes const & ...Arguments)
-			{ NextElement::template Call<CallMessageType, ArgumentTypes...>(std::forward<ArgumentTypes const &>(Arguments)...); }
+	template <typename CallMessageType, typename ...ArgumentTypes> void Call(ArgumentTypes const & ...Arguments)
+		{ std::get<MessageIndex<CallMessageType, MessageTypes...>::value>(Callbacks)(Arguments...); }
 
 	private:
-		template <typename LogType, typename UnreadTypes, typename ReadTypes> struct ReadImplementation {};
-		template <typename LogType, typename NextType, typename... RemainingTypes, typename... ReadTypes>
-			struct ReadImplementation<LogType, std::tuple<NextType, RemainingTypes...>, std::tuple<ReadTypes...>>
+		template <typename, typename, typename...> friend struct DispatchTable;
+		typedef bool (*Handler)(Reader &This, VersionIDType const &VersionID, MessageIDType const &MessageID, BufferType const &Buffer);
+		typedef ReaderDispatchTable<Reader, MessageTypes...> Table;
+
+		template <size_t Position> static typename std::enable_if<Position == sizeof...(MessageTypes), bool>::type
+			Handle(Reader &This, VersionIDType const &VersionID, MessageIDType const &MessageID, BufferType const &)
 		{
-			static bool Read(ThisElement &This, LogType &Log, VersionIDType const &VersionID, MessageIDType const &MessageID, BufferType const &Buffer, SizeType &Offset, ReadTypes const &...ReadData)
-			{
-				NextType Data;
-				if (!ProtocolRead(Log, VersionID, MessageID, Buffer, Offset, Data)) return false;
-				return ReadImplementation<LogType, std::tuple<RemainingTypes...>, std::tuple<ReadTypes..., NextType>>::Read(This, Log, VersionID, MessageID, Buffer, Offset, std::forward<ReadTypes const &>(ReadData)..., std::move(Data));
-			}
-		};
+			This.Log.Warn() << "Read message with invalid version or message type (version " << *VersionID << ") with invalid message type: " << *MessageID;
+			assert(false);
+			return false;
+		}
+
+		template <size_t Position> static typename std::enable_if<(Position < sizeof...(MessageTypes)), bool>::type
+			Handle(Reader &This, VersionIDType const &VersionID, MessageIDType const &MessageID, BufferType const &Buffer)
+		{
+			typedef typename std::tuple_element<Position, std::tuple<MessageTypes...>>::type MessageType;
+			if (*VersionID != *MessageType::Version::ID)
+				return Handle<sizeof...(MessageTypes)>(This, VersionID, MessageID, Buffer);
+			size_t Offset = 0;
+			return ReadImplementation<LogType, typename MessageFields<MessageType>::Tuple, std::tuple<>>::Read(std::get<Position>(This.Callbacks), This.Log, VersionID, MessageID, Buffer, Offset);
+		}
 
-		template <typename LogType, typename... ReadTypes>
-			struct ReadImplementation<LogType, std::tuple<>, std::tuple<ReadTypes...>>
+		// Reads the messages in the compressed frame in Buffer, each copied into Buffer in turn
+		bool ReadFrame(MessageIDType::Type Codec)
 		{
-			static bool Read(ThisElement &This, LogType &Log, VersionIDType const &VersionID, MessageIDType const &MessageID, BufferType const &Buffer, SizeType &Offset, ReadTypes const &...ReadData)
+			if (!Unframe(Log, Codec, Span<uint8_t>(Buffer.data(), Buffer.size()), Unframed)) return false;
+			for (size_t Offset = 0; Offset < Unframed.size(); )
 			{
-				This.Callback(std::forward<ReadTypes const &>(ReadData)...);
-				return true;
+				VersionIDType::Type VersionID;
+				MessageIDType::Type MessageID;
+				uint64_t DataSize;
+				size_t const Header = ReadHeader(&Unframed[Offset], Unframed.size() - Offset, VersionID, MessageID, DataSize);
+				if ((Header == 0) || (DataSize > Unframed.size() - Offset - Header))
+				{
+					Log.Debug() << "Compressed frame ends partway through a message";
+					assert(false);
+					return false;
+				}
+				Offset += Header;
+				Buffer.assign(Unframed.begin() + static_cast<ptrdiff_t>(Offset), Unframed.begin() + static_cast<ptrdiff_t>(Offset + DataSize));
+				Offset += static_cast<size_t>(DataSize);
+				// Frames don't nest, so a frame in here is an unknown message
+				if (!Table::Dispatch(*this, VersionID, MessageID, Buffer)) return false;
 			}
-		};
-};
+			return true;
+		}
 
-template
-<
-	VersionIDType::Type CurrentVersionID,
-	MessageIDType::Type CurrentMessageID,
-	typename MessageType,
-	typename ...RemainingMessageTypes
->
-struct ReaderTupleElement
-<
-	CurrentVersionID,
-	CurrentMessageID,
-	typename std::enable_if<(CurrentVersionID + 1 == *MessageType::Message::Version::ID)>::type,
-	MessageType, RemainingMessageTypes...
->
-: ReaderTupleElement
-<
-	CurrentVersionID + 1,
-	0,
-	void,
-	MessageType, RemainingMessageTypes...
->
-{
-	typedef ReaderTupleElement
-	<
-		CurrentVersionID + 1,
-		0,
-		void,
-		MessageType, RemainingMessageTypes...
-	> NextElement;
-
-	template <typename ...RemainingCallbackTypes>
-		ReaderTupleElement(RemainingCallbackTypes const &...RemainingCallbacks) :
-		NextElement(std::forward<RemainingCallbackTypes const &>(RemainingCallbacks)...)
-		{}
+		LogType &Log;
+		std::tuple<typename MessageFields<MessageTypes>::Callback...> Callbacks;
+		std::vector<uint8_t> Buffer;
+		BufferType Unframed;
 };
 
-template
-<
-	VersionIDType::Type CurrentVersionID,
-	MessageIDType::Type CurrentMessageID
->
-struct ReaderTupleElement
-<
-	CurrentVersionID,
-	CurrentMessageID,
-	void
->
+template <typename LogType, typename ...MessageTypes> struct StreamReader;
+
+// Reads messages in place from a buffer the caller holds, such as a mapped file or a network buffer.  Callbacks get
+// views of strings and arrays that are only good until the buffer changes; they must copy anything they keep.
+// Nothing is allocated per message unless a message has arrays of strings or structures.
+template <typename LogType, typename ...MessageTypes> struct ViewReader
 {
-	typedef std::vector<uint8_t> BufferType;
+	static_assert(MessagePosition<MessageTypes...>::Distinct(), "Messages from different protocols can't share a reader.");
+
+	template <typename ...CallbackTypes> ViewReader(LogType &Log, CallbackTypes const &...Callbacks) : Log(Log), Callbacks(Callbacks...), Unframing(false) {}
 
-	template <typename LogType> bool Read(LogType &Log, VersionIDType const &VersionID, MessageIDType const &MessageID, BufferType const &Buffer)
+	// Reads the message at Start, advancing Start past it.  False if the message is cut off, corrupt, or unknown.
+	bool Read(uint8_t const *&Start, uint8_t const *End)
 	{
-		Log.Warn() << "Read message with invalid version or message type (version " << *VersionID << ") with invalid message type: " << *MessageID;
-		assert(false);
-		return false;
+		size_t const Available = static_cast<size_t>(End - Start);
+		VersionIDType::Type VersionID;
+		MessageIDType::Type MessageID;
+		uint64_t DataSize;
+		size_t const Header = ReadHeader(Start, Available, VersionID, MessageID, DataSize);
+		if (Header == 0)
+		{
+			Log.Debug() << "End of file reached prematurely reading message header";
+			assert(false);
+			return false;
+		}
+		if (DataSize > Available - Header)
+		{
+			Log.Debug() << "End of file reached prematurely reading message body (version " << VersionID << ", type " << MessageID << ")";
+			assert(false);
+			return false;
+		}
+		ViewBody const Body(Span<uint8_t>(Start + Header, static_cast<size_t>(DataSize)));
+		Start += Header + DataSize;
+		if (VersionID == FrameVersionID) return ReadFrame(MessageID, Body.Bytes);
+		return Table::Dispatch(*this, VersionID, MessageID, Body);
+	}
+
+	// Reads every message in the buffer
+	bool Read(uint8_t const *Start, size_t Length)
+	{
+		uint8_t const *const End = Start + Length;
+		while (Start < End) if (!Read(Start, End)) return false;
+		return true;
 	}
+
+	private:
+		template <typename, typename, typename...> friend struct DispatchTable;
+		template <typename, typename...> friend struct StreamReader;
+		typedef bool (*Handler)(ViewReader &This, VersionIDType const &VersionID, MessageIDType const &MessageID, ViewBody const &Body);
+		typedef ReaderDispatchTable<ViewReader, MessageTypes...> Table;
+
+		template <size_t Position> static typename std::enable_if<Position == sizeof...(MessageTypes), bool>::type
+			Handle(ViewReader &This, VersionIDType const &VersionID, MessageIDType const &MessageID, ViewBody const &)
+		{
+			This.Log.Warn() << "Read message with invalid version or message type (version " << *VersionID << ") with invalid message type: " << *MessageID;
+			assert(false);
+			return false;
+		}
+
+		template <size_t Position> static typename std::enable_if<(Position < sizeof...(MessageTypes)), bool>::type
+			Handle(ViewReader &This, VersionIDType const &VersionID, MessageIDType const &MessageID, ViewBody const &Body)
+		{
+			typedef typename std::tuple_element<Position, std::tuple<MessageTypes...>>::type MessageType;
+			if (*VersionID != *MessageType::Version::ID)
+				return Handle<sizeof...(MessageTypes)>(This, VersionID, MessageID, Body);
+			size_t Offset = 0;
+			return ViewImplementation<LogType, typename MessageFields<MessageType>::Tuple, std::tuple<>>::Read(std::get<Position>(This.Callbacks), This.Log, VersionID, MessageID, Body, Offset);
+		}
+
+		// Reads the messages in a compressed frame from a buffer the reader holds, so views into it are only good
+		// until the next frame
+		bool ReadFrame(MessageIDType::Type Codec, Span<uint8_t> const &Body)
+		{
+			if (Unframing)
+			{
+				Log.Debug() << "Read compressed frame inside another";
+				assert(false);
+				return false;
+			}
+			if (!Unframe(Log, Codec, Body, Unframed)) return false;
+			Unframing = true;
+			bool const Success = Read(Unframed.data(), Unframed.size());
+			Unframing = false;
+			return Success;
+		}
+
+		// For the StreamReader: Message holds a header and the body up to a blob, Piece what's arrived of the blob
+		bool ReadPiece(Span<uint8_t> const &Message, BlobPiece const &Piece)
+		{
+			VersionIDType::Type VersionID;
+			MessageIDType::Type MessageID;
+			uint64_t DataSize;
+			size_t const Header = ReadHeader(Message.Data, Message.Count, VersionID, MessageID, DataSize);
+			if (Header == 0)
+			{
+				Log.Debug() << "Held message piece has no complete header";
+				assert(false);
+				return false;
+			}
+			ViewBody const Body(Span<uint8_t>(Message.Data + Header, Message.Count - Header), &Piece);
+			return Table::Dispatch(*this, VersionID, MessageID, Body);
+		}
+
+		LogType &Log;
+		std::tuple<typename MessageFields<MessageTypes>::ViewCallback...> Callbacks;
+		BufferType Unframed;
+		bool Unframing;
 };
 
-template <typename LogType, typename ...MessageTypes> struct Reader : ReaderTupleElement<0, 0, void, MessageTypes...>
+// Reads messages from a transport that delivers bytes in arbitrary pieces, such as a non-blocking socket.  Whole
+// messages within a piece are read in place; only a message split across pieces is gathered into a buffer held
+// until the rest arrives.  Messages ending in a blob aren't gathered whole: once the fields before the blob are in,
+// the blob goes to the callback a piece at a time as it arrives, so only those fields are held.  As with the
+// ViewReader, views passed to callbacks are only good during the callback.
+template <typename LogType, typename ...MessageTypes> struct StreamReader
 {
-	template <typename ...CallbackTypes> Reader(LogType &Log, CallbackTypes const &...Callbacks) : HeadElement(Callbacks...), Log(Log) {}
+	template <typename ...CallbackTypes> StreamReader(LogType &Log, CallbackTypes const &...Callbacks) : Viewer(Log, Callbacks...), Failed(false) {}
 
-	// StreamType must have ::read(char *, int) and operator! operators.
-	template <typename StreamType> bool Read(StreamType &&Stream)
+	// Reads every message completed by the piece.  False if a message is corrupt or unknown, after which the
+	// reader refuses further pieces.
+	bool Read(uint8_t const *Data, size_t Length)
 	{
-		Buffer.resize(StrictCast(HeaderSize, size_t));
-		if (!Stream.read((char *)&Buffer[0], *HeaderSize)) return true;
-		VersionIDType const VersionID = *reinterpret_cast<VersionIDType *>(&Buffer[0]);
-		MessageIDType const MessageID = *reinterpret_cast<MessageIDType *>(&Buffer[VersionIDType::Size]);
-		SizeType const DataSize = *reinterpret_cast<SizeType *>(&Buffer[VersionIDType::Size + MessageIDType::Size]);
-		Buffer.resize(StrictCast(DataSize, size_t));
-		if (!Stream.read((char *)&Buffer[0], *DataSize))
+		if (Failed) return false;
+		uint8_t const *const End = Data + Length;
+		while (true)
 		{
-			Log.Debug() << "End of file reached prematurely reading message body (version " << *VersionID << ", type " << *MessageID << ")";
-			assert(false);
-			return false;
+			if (Piece.Length > 0)
+			{
+				// Passing a blob through
+				size_t const Taken = static_cast<size_t>(std::min<uint64_t>(Piece.Length - Piece.Offset, static_cast<uint64_t>(End - Data)));
+				if (Taken == 0) return true;
+				Piece.Data = Span<uint8_t>(Data, Taken);
+				if (!Viewer.ReadPiece(Span<uint8_t>(Partial.data(), Partial.size()), Piece)) return Fail();
+				Data += Taken;
+				Piece.Offset += Taken;
+				if (Piece.Offset == Piece.Length)
+				{
+					Piece = BlobPiece();
+					Partial.clear();
+				}
+				continue;
+			}
+
+			if (!Partial.empty())
+			{
+				// Finishing a message started in an earlier piece
+				VersionIDType::Type VersionID;
+				MessageIDType::Type MessageID;
+				uint64_t DataSize;
+				if (!Gather(Data, End, StrictCast(HeaderSize, size_t))) return true;
+				size_t Header = ReadHeader(Partial.data(), Partial.size(), VersionID, MessageID, DataSize);
+				if (Header == 0)
+				{
+					if (!Gather(Data, End, LongHeaderSize)) return true;
+					Header = ReadHeader(Partial.data(), Partial.size(), VersionID, MessageID, DataSize);
+				}
+				size_t const Prefix = Table::BlobPrefix(VersionID, MessageID);
+				if ((Prefix > 0) && (DataSize > Prefix))
+				{
+					if (!Gather(Data, End, Header + Prefix)) return true;
+					Piece.Length = DataSize - Prefix;
+					continue;
+				}
+				if (!Gather(Data, End, Header + DataSize)) return true;
+				uint8_t const *Start = Partial.data();
+				if (!Viewer.Read(Start, Start + Partial.size())) return Fail();
+				Partial.clear();
+				continue;
+			}
+
+			if (Data == End) return true;
+			{
+				// Whole messages in this piece
+				size_t const Available = static_cast<size_t>(End - Data);
+				VersionIDType::Type VersionID;
+				MessageIDType::Type MessageID;
+				uint64_t DataSize;
+				size_t const Header = ReadHeader(Data, Available, VersionID, MessageID, DataSize);
+				if ((Header > 0) && (DataSize <= Available - Header))
+				{
+					if (!Viewer.Read(Data, End)) return Fail();
+					continue;
+				}
+				// Starting a message that ends in a later piece, taking no more than it needs to hold
+				size_t Held = Available;
+				if (Header > 0)
+				{
+					size_t const Prefix = Table::BlobPrefix(VersionID, MessageID);
+					if ((Prefix > 0) && (DataSize > Prefix)) Held = std::min(Held, Header + Prefix);
+				}
+				Partial.assign(Data, Data + Held);
+				Data += Held;
+			}
 		}
-		return HeadElement::Read(Log, VersionID, MessageID, Buffer);
 	}
 
+	// Whether the last piece ended between messages.  A stream that closes when this is false was cut off.
+	bool Idle(void) const { return Partial.empty(); }
+
 	private:
-		typedef ReaderTupleElement<0, 0, void, MessageTypes...> HeadElement;
+		bool Fail(void)
+		{
+			Failed = true;
+			return false;
+		}
 
-		LogType &Log;
-		std::vector<uint8_t> Buffer;
+		// Moves bytes from the piece into Partial until it holds Length.  True once it does.
+		bool Gather(uint8_t const *&Data, uint8_t const *End, size_t Length)
+		{
+			if (Partial.size() >= Length) return true;
+			size_t const Taken = std::min(Length - Partial.size(), static_cast<size_t>(End - Data));
+			Partial.insert(Partial.end(), Data, Data + Taken);
+			Data += Taken;
+			return Partial.size() >= Length;
+		}
+
+		typedef typename ViewReader<LogType, MessageTypes...>::Table Table;
+
+		ViewReader<LogType, MessageTypes...> Viewer;
+		BufferType Partial;
+		BlobPiece Piece; // Of a message being passed through, Length is 0 otherwise
+		bool Failed;
 };
 
 }
 
 #endif
-
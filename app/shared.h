@@ -1,6 +1,10 @@
 #ifndef shared_h
 #define shared_h
 
+#include <cstring>
+#include <string>
+#include <sstream>
+
 struct String
 {
 	String(void) {}
@@ -11,5 +15,22 @@ struct String
 		std::stringstream Buffer;
 };
 
+// Refers to characters owned elsewhere, for parsing and lookups that shouldn't copy
+struct StringView
+{
+	StringView(void) : Data(""), Length(0) {}
+	StringView(char const *Data, size_t Length) : Data(Data), Length(Length) {}
+	StringView(char const *Data) : Data(Data), Length(strlen(Data)) {}
+	StringView(std::string const &Source) : Data(Source.data()), Length(Source.size()) {}
+
+	bool operator ==(StringView const &Other) const
+		{ return (Length == Other.Length) && (memcmp(Data, Other.Data, Length) == 0); }
+	bool operator !=(StringView const &Other) const { return !(*this == Other); }
+	explicit operator std::string(void) const { return std::string(Data, Length); }
+
+	char const *Data;
+	size_t Length;
+};
+
 #endif
 
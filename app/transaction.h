@@ -7,6 +7,10 @@
 
 #include <mutex>
 #include <thread>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 
@@ -36,18 +40,53 @@ template <typename ...MessageTypes> struct Transactor
 			}
 			bfs::remove(*Filename);
 		}
+
+		// After replay, since a corrupt journal throws and the destructor wouldn't close it
+		Descriptor = open(TransactionPath.string().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (Descriptor < 0)
+			throw SystemError() << "Could not open transaction directory " << TransactionPath << ": " << strerror(errno);
 	}
 
+	~Transactor(void) { close(Descriptor); }
+
 	template <typename MessageType, typename ...ArgumentTypes> void Act(ArgumentTypes const &... Arguments)
 	{
 		static_assert(TypeIn<MessageType, MessageTypes...>::Value, "MessageType is unregisteed.  Type must be registered with callback in constructor.");
-		bfs::path ThreadPath = TransactionPath / (std::string)(String() << std::this_thread::get_id());
-		bfs::ofstream Out(ThreadPath, std::ofstream::out | std::ofstream::binary);
-		if (!Out) throw SystemError() << "Could not create file " << ThreadPath << ".";
-		auto const &Data = MessageType::Write(Arguments...);
-		Out.write((char const *)&Data[0], static_cast<std::streamsize>(Data.size()));
+		// Each thread journals to its own file, named by a hash of its id
+		char Filename[sizeof(size_t) * 2 + 1];
+		size_t ThreadHash = std::hash<std::thread::id>()(std::this_thread::get_id());
+		for (size_t Digit = 0; Digit < sizeof(size_t) * 2; ++Digit, ThreadHash >>= 4)
+			Filename[Digit] = "0123456789abcdef"[ThreadHash & 0xF];
+		Filename[sizeof(size_t) * 2] = 0;
+
+		int const Out = openat(Descriptor, Filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		if (Out < 0) throw SystemError() << "Could not create transaction file " << Filename << ": " << strerror(errno);
+		// Most actions fit on the stack
+		uint8_t Stack[512];
+		Protocol::BufferType Heap;
+		uint8_t const *Data = Stack;
+		size_t Size = MessageType::Encode(Stack, sizeof(Stack), Arguments...);
+		if (Size == 0)
+		{
+			Size = MessageType::Append(Heap, Arguments...);
+			Data = Heap.data();
+		}
+		size_t Written = 0;
+		while (Written < Size)
+		{
+			ssize_t const Result = write(Out, Data + Written, Size - Written);
+			if (Result < 0)
+			{
+				if (errno == EINTR) continue;
+				int const Error = errno;
+				close(Out);
+				throw SystemError() << "Could not write transaction file " << Filename << ": " << strerror(Error);
+			}
+			Written += static_cast<size_t>(Result);
+		}
+		close(Out);
 		Reader.template Call<MessageType>(std::forward<ArgumentTypes const &>(Arguments)...);
-		bfs::remove(ThreadPath / (std::string)(String() << std::this_thread::get_id()));
+		unlinkat(Descriptor, Filename, 0);
 	}
 
 	template <typename MessageType, typename ...ArgumentTypes> void operator()(MessageType, ArgumentTypes const &... Arguments)
@@ -55,6 +94,7 @@ template <typename ...MessageTypes> struct Transactor
 
 	private:
 		bfs::path const TransactionPath;
+		int Descriptor;
 		StandardOutLog Log;
 		Protocol::Reader<StandardOutLog, MessageTypes...> Reader;
 };
@@ -0,0 +1,80 @@
+DoOnce 'app/Tupfile.lua'
+
+-- Benchmarks are built but not run as tests
+
+VersionsBench = Define.Executable
+{
+	Name = 'versions',
+	Sources = Item 'versions.cxx',
+	Objects = CoreObject,
+	LinkFlags = '-lboost_system -lboost_filesystem -lsqlite3 -lz'
+}
+
+LayoutBench = Define.Executable
+{
+	Name = 'layout',
+	Sources = Item 'layout.cxx',
+	Objects = CoreObject,
+	LinkFlags = '-lboost_system -lboost_filesystem -lsqlite3 -lz'
+}
+
+GetattrBench = Define.Executable
+{
+	Name = 'getattr',
+	Sources = Item 'getattr.cxx',
+	Objects = CoreObject,
+	LinkFlags = '-lboost_system -lboost_filesystem -lsqlite3 -lz -lpthread'
+}
+
+BlocksBench = Define.Executable
+{
+	Name = 'blocks',
+	Sources = Item 'blocks.cxx',
+	Objects = CoreObject,
+	LinkFlags = '-lboost_system -lboost_filesystem -lsqlite3 -lz -lpthread'
+}
+
+IOEngineBench = Define.Executable
+{
+	Name = 'ioengine',
+	Sources = Item 'ioengine.cxx',
+	LinkFlags = '-lpthread'
+}
+
+CompressBench = Define.Executable
+{
+	Name = 'compress',
+	Sources = Item 'compress.cxx',
+	Objects = CoreObject,
+	LinkFlags = '-lboost_system -lboost_filesystem -lsqlite3 -lz -lpthread'
+}
+
+ProtocolBench = Define.Executable
+{
+	Name = 'protocol',
+	Sources = Item 'protocol.cxx',
+	LinkFlags = '-lboost_system -lboost_filesystem -lz'
+}
+
+DispatchBench = Define.Executable
+{
+	Name = 'dispatch',
+	Sources = Item 'dispatch.cxx',
+	LinkFlags = '-lboost_system -lboost_filesystem -lz'
+}
+
+CompactBench = Define.Executable
+{
+	Name = 'compact',
+	Sources = Item 'compact.cxx',
+	Objects = CoreObject,
+	LinkFlags = '-lboost_system -lboost_filesystem -lsqlite3 -lz -lpthread'
+}
+
+LogBench = Define.Executable
+{
+	Name = 'log',
+	Sources = Item 'log.cxx',
+	Objects = CoreObject,
+	LinkFlags = '-lboost_system -lboost_filesystem -lsqlite3 -lz -lpthread'
+}
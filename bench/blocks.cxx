@@ -0,0 +1,89 @@
+#include "../app/core.h"
+
+#include <chrono>
+#include <iomanip>
+#include <random>
+
+// Writes and reads back a corpus of MEGABYTES (default 256) through the core, once stored plain and once
+// deduplicated, reporting throughput and space used.  Files are 1MiB, built from a pool of random blocks sized so
+// that on average each block appears DUPLICATION (default 2) times.  Reads are from a warm page cache.
+
+typedef std::chrono::steady_clock Clock;
+
+static double Seconds(Clock::duration const &Duration)
+	{ return std::chrono::duration_cast<std::chrono::nanoseconds>(Duration).count() / 1e9; }
+
+int main(int argc, char **argv)
+{
+	try
+	{
+		uint64_t const Megabytes = (argc >= 2) ? std::stoull(argv[1]) : 256;
+		double const Duplication = (argc >= 3) ? std::stod(argv[2]) : 2.0;
+		bfs::path const Base = (argc >= 4) ? bfs::path(argv[3]) : bfs::path("blocksbench");
+		size_t const FileSize = 1024 * 1024;
+		size_t const IOSize = 128 * 1024; // The largest FUSE request
+		size_t const FileCount = static_cast<size_t>(Megabytes);
+		size_t const BlocksPerFile = FileSize / BlockSize;
+		size_t const PoolSize = std::max<size_t>(1, static_cast<size_t>(FileCount * BlocksPerFile / Duplication));
+
+		std::mt19937_64 Random(1);
+		std::vector<std::string> Pool(PoolSize, std::string(BlockSize, 0));
+		for (auto &Block : Pool)
+			for (size_t Offset = 0; Offset < BlockSize; Offset += sizeof(uint64_t))
+				{ uint64_t const Value = Random(); memcpy(&Block[Offset], &Value, sizeof(Value)); }
+		std::vector<std::vector<size_t>> Files(FileCount);
+		for (auto &File : Files)
+			for (size_t Block = 0; Block < BlocksPerFile; ++Block) File.push_back(Random() % PoolSize);
+
+		std::cout << std::setw(8) << "mode" << std::setw(16) << "write (MB/s)" << std::setw(16) << "read (MB/s)" <<
+			std::setw(16) << "stored (MB)" << std::setw(10) << "ratio" << std::endl;
+		for (bool const Deduplicate : {false, true})
+		{
+			bfs::remove_all(Base);
+			ShareCore Core(Base, "bench");
+			Core->SetDeduplication(Deduplicate);
+
+			std::string Buffer(FileSize, 0);
+			Clock::duration Writing{};
+			for (size_t Index = 0; Index < FileCount; ++Index)
+			{
+				for (size_t Block = 0; Block < BlocksPerFile; ++Block)
+					memcpy(&Buffer[Block * BlockSize], Pool[Files[Index][Block]].data(), BlockSize);
+				std::string const Path = String() << "/" << Index;
+				auto const Start = Clock::now();
+				Assert(Core->CreateFile(Path, true, false), ActionError::OK);
+				auto File = Core->Open(Path, true, false);
+				for (size_t Offset = 0; Offset < FileSize; Offset += IOSize)
+					Assert((*File)->Write(&Buffer[Offset], IOSize, static_cast<off_t>(Offset)), static_cast<ssize_t>(IOSize));
+				Core->Release(std::move(*File));
+				Core->IngestReleased(1);
+				Writing += Clock::now() - Start;
+			}
+
+			Clock::duration Reading{};
+			for (size_t Index = 0; Index < FileCount; ++Index)
+			{
+				std::string const Path = String() << "/" << Index;
+				auto const Start = Clock::now();
+				auto File = Core->Open(Path, false, false);
+				for (size_t Offset = 0; Offset < FileSize; Offset += IOSize)
+					Assert((*File)->Read(&Buffer[Offset], IOSize, static_cast<off_t>(Offset)), static_cast<ssize_t>(IOSize));
+				Core->Release(std::move(*File));
+				Reading += Clock::now() - Start;
+				Assert(memcmp(&Buffer[0], Pool[Files[Index][0]].data(), BlockSize), 0);
+			}
+
+			double const Logical = static_cast<double>(FileCount * FileSize);
+			double const Stored = Deduplicate ? static_cast<double>(Core->GetBlockStats().StoredBytes) : Logical;
+			std::cout << std::setw(8) << (Deduplicate ? "dedup" : "plain") <<
+				std::setw(16) << std::fixed << std::setprecision(1) << Logical / 1e6 / Seconds(Writing) <<
+				std::setw(16) << Logical / 1e6 / Seconds(Reading) <<
+				std::setw(16) << Stored / 1e6 <<
+				std::setw(10) << std::setprecision(2) << Logical / Stored << std::endl;
+		}
+		bfs::remove_all(Base);
+	}
+	catch (SystemError const &Error) { std::cerr << Error << std::endl; return 1; }
+	catch (UserError const &Error) { std::cerr << Error << std::endl; return 1; }
+	return 0;
+}
@@ -0,0 +1,184 @@
+#include "../app/core.h"
+
+#include <chrono>
+#include <iomanip>
+
+// Builds a share of DIRECTORIES (default 100) directories of 100 files each, reads its files back from the core, and
+// journals a create, a timestamp change, a move and a delete for every file, as the core would.  The same
+// operations are written once with the compact transaction messages and once with full width equivalents, then
+// read back in place, reporting the bytes each kind of operation takes and the encoding and decoding rates.
+
+typedef std::chrono::steady_clock Clock;
+
+static double Seconds(Clock::duration const &Duration)
+	{ return std::chrono::duration_cast<std::chrono::nanoseconds>(Duration).count() / 1e9; }
+
+// The transaction messages with every ID, counter and timestamp at full width
+DefineProtocol(FullWidthProtocol)
+DefineProtocolVersion(FullWidthVersion1, FullWidthProtocol)
+DefineProtocolMessage(FWV1Create, FullWidthVersion1,
+	void(UUID ID, NodeID Parent, std::string Name, bool IsFile, SharePermissions Permissions))
+DefineProtocolMessage(FWV1SetTimestamp, FullWidthVersion1,
+	void(NodeID ID, NodeID Change, NodeID Parent, std::string Name, uint8_t Flags, Timestamp ModifiedTime, UUID NewChangeIndex, Timestamp NewTimestamp))
+DefineProtocolMessage(FWV1Delete, FullWidthVersion1,
+	void(NodeID ID, NodeID Change, NodeID Parent, std::string Name, uint8_t Flags, Timestamp ModifiedTime))
+DefineProtocolMessage(FWV1Move, FullWidthVersion1,
+	void(NodeID ID, NodeID Change, NodeID Parent, std::string Name, uint8_t Flags, Timestamp ModifiedTime, UUID NewChangeIndex, NodeID ParentID, std::string NewName))
+
+struct Operations
+{
+	std::vector<ShareFile> Files;
+	std::vector<NodeID> Targets;
+	Timestamp Now;
+	UUID FirstChange;
+};
+
+static uint8_t Flags(ShareFile const &File)
+	{ return (File.IsFile() ? 1 : 0) | (File.CanWrite() ? 2 : 0) | (File.CanExecute() ? 4 : 0) | (File.IsSplit() ? 8 : 0); }
+
+// Appends the operations of the given kind (0 create, 1 timestamp, 2 move, 3 delete) for every file
+static void EncodeCompact(Operations const &Ops, int Kind, Protocol::BufferType &Out)
+{
+	UUID Change = Ops.FirstChange;
+	for (size_t Index = 0; Index < Ops.Files.size(); ++Index)
+	{
+		ShareFile const &File = Ops.Files[Index];
+		switch (Kind)
+		{
+			case 0: CTV2Create::Append(Out, File.ID().Index, File.Parent(), File.Name(), File.IsFile(), File.Permissions()); break;
+			case 1: CTV2SetTimestamp::Append(Out, File, ++Change, Ops.Now); break;
+			case 2: CTV2Move::Append(Out, File, ++Change, Ops.Targets[Index], File.Name()); break;
+			default: CTV2Delete::Append(Out, File); break;
+		}
+	}
+}
+
+static void EncodeFullWidth(Operations const &Ops, int Kind, Protocol::BufferType &Out)
+{
+	UUID Change = Ops.FirstChange;
+	for (size_t Index = 0; Index < Ops.Files.size(); ++Index)
+	{
+		ShareFile const &File = Ops.Files[Index];
+		switch (Kind)
+		{
+			case 0: FWV1Create::Append(Out, File.ID().Index, File.Parent(), File.Name(), File.IsFile(), File.Permissions()); break;
+			case 1: FWV1SetTimestamp::Append(Out, File.ID(), File.Change(), File.Parent(), File.Name(), Flags(File), File.ModifiedTime(), ++Change, Ops.Now); break;
+			case 2: FWV1Move::Append(Out, File.ID(), File.Change(), File.Parent(), File.Name(), Flags(File), File.ModifiedTime(), ++Change, Ops.Targets[Index], File.Name()); break;
+			default: FWV1Delete::Append(Out, File.ID(), File.Change(), File.Parent(), File.Name(), Flags(File), File.ModifiedTime()); break;
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	try
+	{
+		size_t const Directories = (argc >= 2) ? std::stoull(argv[1]) : 100;
+		bfs::path const Base = (argc >= 3) ? bfs::path(argv[2]) : bfs::path("compactbench");
+		size_t const FilesPerDirectory = 100;
+		size_t const Rounds = 100;
+
+		Operations Ops;
+		bfs::remove_all(Base);
+		{
+			ShareCore Core(Base, "bench");
+			for (size_t Directory = 0; Directory < Directories; ++Directory)
+			{
+				std::string const Path = String() << "/project" << Directory;
+				Assert(Core->CreateDirectory(Path, true, true), ActionError::OK);
+				for (size_t File = 0; File < FilesPerDirectory; ++File)
+				{
+					std::string const FilePath = String() << Path << "/source_file_" << File << ".cxx";
+					Assert(Core->CreateFile(FilePath, true, false), ActionError::OK);
+					// Some files have been touched since they were made
+					if (File % 3 == 0) Assert(Core->SetTimestamp(FilePath, static_cast<Timestamp::Type>(1500000000 + File)), ActionError::OK);
+				}
+			}
+			for (size_t Directory = 0; Directory < Directories; ++Directory)
+			{
+				std::string const Path = String() << "/project" << Directory;
+				auto Handle = Core->OpenDirectory(Path);
+				Assert(Handle);
+				auto const Children = Core->GetDirectory(**Handle, 0, static_cast<unsigned int>(FilesPerDirectory));
+				std::string const TargetPath = String() << "/project" << (Directory + 1) % Directories;
+				NodeID const Target = Core->Get(TargetPath)->ID();
+				for (auto const &Child : Children)
+				{
+					Ops.Files.push_back(Child);
+					Ops.Targets.push_back(Target);
+				}
+			}
+		}
+		bfs::remove_all(Base);
+		Ops.Now = static_cast<Timestamp::Type>(std::time(nullptr));
+		Ops.FirstChange = static_cast<UUID::Type>(Ops.Files.size() * 2);
+
+		std::cout << Ops.Files.size() << " files" << std::endl;
+		std::cout << std::setw(10) << "operation" << std::setw(12) << "layout" << std::setw(14) << "bytes/op" <<
+			std::setw(16) << "encode (M/s)" << std::setw(16) << "decode (M/s)" << std::endl;
+		NullLog Log;
+		uint64_t Checksum = 0;
+		auto const Sum = [&Checksum](NodeID const &ID) { Checksum += *ID.Index; };
+		Protocol::ViewReader<NullLog, CTV2Create, CTV2SetPermissions, CTV2SetTimestamp, CTV2Delete, CTV2Move> CompactReader(Log,
+			[&](UUID const &ID, NodeID const &, StringView const &Name, bool const &, SharePermissions const &) { Checksum += *ID + Name.Length; },
+			[&](ShareFile const &File, UUID const &, bool const &, bool const &) { Sum(File.ID()); },
+			[&](ShareFile const &File, UUID const &, Timestamp const &Time) { Sum(File.ID()); Checksum += *Time; },
+			[&](ShareFile const &File) { Sum(File.ID()); },
+			[&](ShareFile const &File, UUID const &, NodeID const &Parent, StringView const &) { Sum(File.ID()); Sum(Parent); });
+		// Replaying needs a ShareFile either way, so the full width callbacks build one too
+		auto const Rebuild = [](NodeID const &ID, NodeID const &Change, NodeID const &Parent, StringView const &Name, uint8_t const &Flags, Timestamp const &ModifiedTime)
+		{
+			SharePermissions Permissions;
+			Permissions.CanWrite = (Flags & 2) ? 1 : 0;
+			Permissions.CanExecute = (Flags & 4) ? 1 : 0;
+			return ShareFile(ID, Change, Parent, std::string(Name.Data, Name.Length), (Flags & 1) != 0, ModifiedTime, Permissions, (Flags & 8) != 0);
+		};
+		Protocol::ViewReader<NullLog, FWV1Create, FWV1SetTimestamp, FWV1Delete, FWV1Move> FullWidthReader(Log,
+			[&](UUID const &ID, NodeID const &, StringView const &Name, bool const &, SharePermissions const &) { Checksum += *ID + Name.Length; },
+			[&](NodeID const &ID, NodeID const &Change, NodeID const &Parent, StringView const &Name, uint8_t const &Flags, Timestamp const &ModifiedTime, UUID const &, Timestamp const &Time)
+				{ Sum(Rebuild(ID, Change, Parent, Name, Flags, ModifiedTime).ID()); Checksum += *Time; },
+			[&](NodeID const &ID, NodeID const &Change, NodeID const &Parent, StringView const &Name, uint8_t const &Flags, Timestamp const &ModifiedTime)
+				{ Sum(Rebuild(ID, Change, Parent, Name, Flags, ModifiedTime).ID()); },
+			[&](NodeID const &ID, NodeID const &Change, NodeID const &Parent, StringView const &Name, uint8_t const &Flags, Timestamp const &ModifiedTime, UUID const &, NodeID const &NewParent, StringView const &)
+				{ Sum(Rebuild(ID, Change, Parent, Name, Flags, ModifiedTime).ID()); Sum(NewParent); });
+
+		size_t Totals[2] = {0, 0};
+		for (int Kind = 0; Kind < 4; ++Kind)
+		{
+			for (bool Compact : {false, true})
+			{
+				Protocol::BufferType Buffer;
+				auto const Encode = [&]() { Compact ? EncodeCompact(Ops, Kind, Buffer) : EncodeFullWidth(Ops, Kind, Buffer); };
+				Encode();
+				size_t const Bytes = Buffer.size();
+				Totals[Compact] += Bytes;
+
+				auto Start = Clock::now();
+				for (size_t Round = 0; Round < Rounds; ++Round)
+				{
+					Buffer.clear();
+					Encode();
+				}
+				double const Encoding = Seconds(Clock::now() - Start);
+
+				Start = Clock::now();
+				for (size_t Round = 0; Round < Rounds; ++Round)
+					Assert(Compact ? CompactReader.Read(Buffer.data(), Buffer.size()) : FullWidthReader.Read(Buffer.data(), Buffer.size()));
+				double const Decoding = Seconds(Clock::now() - Start);
+
+				double const Count = static_cast<double>(Ops.Files.size() * Rounds);
+				std::cout << std::setw(10) << (char const *[]){"create", "timestamp", "move", "delete"}[Kind] <<
+					std::setw(12) << (Compact ? "compact" : "full") <<
+					std::setw(14) << std::fixed << std::setprecision(1) << static_cast<double>(Bytes) / Ops.Files.size() <<
+					std::setw(16) << Count / Encoding / 1e6 <<
+					std::setw(16) << Count / Decoding / 1e6 << std::endl;
+			}
+		}
+		std::cout << "journal bytes: full " << Totals[0] << ", compact " << Totals[1] << " (" << std::setprecision(2) <<
+			static_cast<double>(Totals[1]) / Totals[0] << "x)" << std::endl;
+		std::cout << "(checksum " << Checksum << ")" << std::endl;
+	}
+	catch (SystemError const &Error) { std::cerr << Error << std::endl; return 1; }
+	catch (UserError const &Error) { std::cerr << Error << std::endl; return 1; }
+	return 0;
+}
@@ -0,0 +1,143 @@
+#include "../app/core.h"
+
+#include <chrono>
+#include <iomanip>
+#include <random>
+
+// Writes and reads back corpora of MEGABYTES (default 64) each through the core, once stored raw as plain files and
+// once compressed in the block store, reporting throughput, random 4KiB read rate, and space used.  The corpora are
+// log lines, prose-like text from a small vocabulary, random bytes, and alternating blocks of log lines and random
+// bytes.  Files are 1MiB.  Reads are from a warm page cache, with a fresh open per file.
+
+typedef std::chrono::steady_clock Clock;
+
+static double Seconds(Clock::duration const &Duration)
+	{ return std::chrono::duration_cast<std::chrono::nanoseconds>(Duration).count() / 1e9; }
+
+static std::string MakeCorpus(std::string const &Kind, size_t Size, std::mt19937_64 &Random)
+{
+	static char const *Words[] = {"the", "share", "file", "of", "a", "change", "and", "to", "directory", "instance",
+		"block", "is", "written", "in", "version", "node", "that", "read", "data", "backing"};
+	auto const Logs = [&Random](size_t Size)
+	{
+		std::string Out;
+		for (uint64_t Line = 0; Out.size() < Size; ++Line)
+			Out += String() << "2024-03-" << (10 + Line / 100000 % 20) << " 12:" << (Line / 60 % 60) << ":" << (Line % 60) <<
+				" [worker " << (Random() % 16) << "] request " << Line << " took " << (Random() % 5000) << "us status " <<
+				((Random() % 50 == 0) ? 500 : 200) << "\n";
+		Out.resize(Size);
+		return Out;
+	};
+	auto const Noise = [&Random](size_t Size)
+	{
+		std::string Out(Size, 0);
+		for (size_t Offset = 0; Offset + sizeof(uint64_t) <= Size; Offset += sizeof(uint64_t))
+			{ uint64_t const Value = Random(); memcpy(&Out[Offset], &Value, sizeof(Value)); }
+		return Out;
+	};
+	if (Kind == "logs") return Logs(Size);
+	if (Kind == "noise") return Noise(Size);
+	if (Kind == "text")
+	{
+		std::string Out;
+		while (Out.size() < Size)
+		{
+			Out += Words[Random() % (sizeof(Words) / sizeof(*Words))];
+			Out += (Random() % 12 == 0) ? ".\n" : " ";
+		}
+		Out.resize(Size);
+		return Out;
+	}
+	std::string const LogPart = Logs(Size), NoisePart = Noise(Size);
+	std::string Out(Size, 0);
+	for (size_t Offset = 0; Offset < Size; Offset += BlockSize)
+		memcpy(&Out[Offset], ((Offset / BlockSize % 2) ? NoisePart : LogPart).data() + Offset, std::min<size_t>(BlockSize, Size - Offset));
+	return Out;
+}
+
+int main(int argc, char **argv)
+{
+	try
+	{
+		uint64_t const Megabytes = (argc >= 2) ? std::stoull(argv[1]) : 64;
+		bfs::path const Base = (argc >= 3) ? bfs::path(argv[2]) : bfs::path("compressbench");
+		size_t const FileSize = 1024 * 1024;
+		size_t const IOSize = 128 * 1024; // The largest FUSE request
+		size_t const ReadSize = 4096;
+		size_t const RandomReads = 20000;
+		size_t const FileCount = static_cast<size_t>(Megabytes);
+
+		std::cout << std::setw(8) << "corpus" << std::setw(12) << "mode" << std::setw(14) << "write (MB/s)" <<
+			std::setw(14) << "read (MB/s)" << std::setw(16) << "4K reads (k/s)" << std::setw(14) << "stored (MB)" <<
+			std::setw(8) << "ratio" << std::endl;
+		std::mt19937_64 Random(1);
+		for (std::string const Kind : {"logs", "text", "noise", "mixed"})
+		{
+			std::string const Corpus = MakeCorpus(Kind, FileSize * FileCount, Random);
+			for (bool const Compress : {false, true})
+			{
+				bfs::remove_all(Base);
+				ShareCore Core(Base, "bench");
+				Core->SetCompression(Compress);
+
+				Clock::duration Writing{};
+				for (size_t Index = 0; Index < FileCount; ++Index)
+				{
+					std::string const Path = String() << "/" << Index;
+					auto const Start = Clock::now();
+					Assert(Core->CreateFile(Path, true, false), ActionError::OK);
+					auto File = Core->Open(Path, true, false);
+					for (size_t Offset = 0; Offset < FileSize; Offset += IOSize)
+						Assert((*File)->Write(&Corpus[Index * FileSize + Offset], IOSize, static_cast<off_t>(Offset)), static_cast<ssize_t>(IOSize));
+					Core->Release(std::move(*File));
+					Core->IngestReleased(1);
+					Writing += Clock::now() - Start;
+				}
+
+				std::string Buffer(FileSize, 0);
+				Clock::duration Reading{};
+				for (size_t Index = 0; Index < FileCount; ++Index)
+				{
+					std::string const Path = String() << "/" << Index;
+					auto const Start = Clock::now();
+					auto File = Core->Open(Path, false, false);
+					for (size_t Offset = 0; Offset < FileSize; Offset += IOSize)
+						Assert((*File)->Read(&Buffer[Offset], IOSize, static_cast<off_t>(Offset)), static_cast<ssize_t>(IOSize));
+					Core->Release(std::move(*File));
+					Reading += Clock::now() - Start;
+					Assert(memcmp(Buffer.data(), &Corpus[Index * FileSize], FileSize), 0);
+				}
+
+				// Random reads through handles held open, so each is a seek into the middle of a file
+				std::vector<std::unique_ptr<OpenFile>> Files;
+				for (size_t Index = 0; Index < FileCount; ++Index)
+				{
+					std::string const Path = String() << "/" << Index;
+					Files.push_back(std::move(*Core->Open(Path, false, false)));
+				}
+				auto const Start = Clock::now();
+				for (size_t Count = 0; Count < RandomReads; ++Count)
+				{
+					size_t const Index = Random() % FileCount;
+					auto const Offset = static_cast<off_t>(Random() % (FileSize / ReadSize) * ReadSize);
+					Assert(Files[Index]->Read(&Buffer[0], ReadSize, Offset), static_cast<ssize_t>(ReadSize));
+				}
+				double const RandomSeconds = Seconds(Clock::now() - Start);
+				for (auto &File : Files) Core->Release(std::move(File));
+
+				double const Logical = static_cast<double>(FileCount * FileSize);
+				double const Stored = Compress ? static_cast<double>(Core->GetBlockStats().StoredBytes) : Logical;
+				std::cout << std::setw(8) << Kind << std::setw(12) << (Compress ? "compressed" : "raw") <<
+					std::setw(14) << std::fixed << std::setprecision(1) << Logical / 1e6 / Seconds(Writing) <<
+					std::setw(14) << Logical / 1e6 / Seconds(Reading) <<
+					std::setw(16) << RandomReads / RandomSeconds / 1e3 <<
+					std::setw(14) << Stored / 1e6 <<
+					std::setw(8) << std::setprecision(2) << Logical / Stored << std::endl;
+			}
+		}
+		bfs::remove_all(Base);
+	}
+	catch (SystemError const &Error) { std::cerr << Error << std::endl; return 1; }
+	catch (UserError const &Error) { std::cerr << Error << std::endl; return 1; }
+	return 0;
+}
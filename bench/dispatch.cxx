@@ -0,0 +1,128 @@
+#include "../app/protocol.h"
+#include "../app/log.h"
+
+#include <chrono>
+#include <iomanip>
+#include <random>
+
+// Reads MESSAGES (default 4000000) small messages drawn from a protocol with 200 message types, with the
+// Reader and ViewReader, and with a reader that compares each message's IDs against every registered message in
+// turn as the readers did before they had a dispatch table.  Messages are uniformly mixed, all the first type, or
+// all the last type.
+
+typedef std::chrono::steady_clock Clock;
+
+DefineProtocol(DispatchProtocol)
+DefineProtocolVersion(DispatchVersion1, DispatchProtocol)
+template <size_t Index> using DispatchMessage = Protocol::Message<static_cast<Protocol::MessageIDType::Type>(Index), DispatchVersion1, void(uint64_t Value)>;
+constexpr size_t MessageTypes = 200;
+
+typedef std::function<void(uint64_t const &)> CallbackType;
+
+template <typename ...MessageTypes> struct LinearReader;
+template <> struct LinearReader<>
+{
+	static bool Read(NullLog &, CallbackType const *, Protocol::VersionIDType const &, Protocol::MessageIDType const &, Protocol::BufferType const &)
+		{ return false; }
+};
+template <typename MessageType, typename ...RemainingTypes> struct LinearReader<MessageType, RemainingTypes...>
+{
+	static bool Read(NullLog &Log, CallbackType const *Callbacks, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, Protocol::BufferType const &Buffer)
+	{
+		if ((VersionID != MessageType::Version::ID) || (MessageID != MessageType::ID))
+			return LinearReader<RemainingTypes...>::Read(Log, Callbacks + 1, VersionID, MessageID, Buffer);
+		size_t Offset = 0;
+		uint64_t Value;
+		if (!ProtocolRead(Log, VersionID, MessageID, Buffer, Offset, Value)) return false;
+		(*Callbacks)(Value);
+		return true;
+	}
+};
+
+struct BufferStream
+{
+	BufferStream(Protocol::BufferType const &Buffer) : Buffer(Buffer), Offset(0), Dead(false) {}
+	BufferStream &read(char *Out, size_t Length)
+	{
+		if (Offset + Length > Buffer.size()) { Dead = true; return *this; }
+		memcpy(Out, &Buffer[Offset], Length);
+		Offset += Length;
+		return *this;
+	}
+	bool operator !(void) const { return Dead; }
+	bool AtEnd(void) const { return Offset >= Buffer.size(); }
+
+	private:
+		Protocol::BufferType const &Buffer;
+		size_t Offset;
+		bool Dead;
+};
+
+template <size_t ...Indices> void Bench(Protocol::IndexList<Indices...>, size_t Messages)
+{
+	NullLog Log;
+	uint64_t Sum = 0;
+	CallbackType const Callback = [&Sum](uint64_t const &Value) { Sum += Value; };
+	Protocol::Reader<NullLog, DispatchMessage<Indices>...> Reader(Log, ((void)Indices, Callback)...);
+	Protocol::ViewReader<NullLog, DispatchMessage<Indices>...> Viewer(Log, ((void)Indices, Callback)...);
+	std::vector<CallbackType> const Callbacks(MessageTypes, Callback);
+	Protocol::BufferType (* const Writers[])(uint64_t const &) = {&DispatchMessage<Indices>::Write...};
+
+	std::cout << std::setw(8) << "mix" << std::setw(14) << "linear" << std::setw(14) << "reader" << std::setw(14) << "view" << "   (M msgs/s)" << std::endl;
+	std::mt19937_64 Random(1);
+	for (std::string const Mix : {"uniform", "first", "last"})
+	{
+		Protocol::BufferType Buffer;
+		for (size_t Index = 0; Index < Messages; ++Index)
+		{
+			size_t const Type = (Mix == "uniform") ? Random() % MessageTypes : (Mix == "first") ? 0 : MessageTypes - 1;
+			auto const Message = Writers[Type](Index);
+			Buffer.insert(Buffer.end(), Message.begin(), Message.end());
+		}
+
+		auto const Time = [&](std::function<void(void)> const &Body)
+		{
+			double Best = 0;
+			for (unsigned int Round = 0; Round < 5; ++Round)
+			{
+				auto const Start = Clock::now();
+				Body();
+				double const Seconds = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - Start).count() / 1e9;
+				if ((Best == 0) || (Seconds < Best)) Best = Seconds;
+			}
+			return Messages / 1e6 / Best;
+		};
+
+		double const Linear = Time([&](void)
+		{
+			Protocol::BufferType Body;
+			for (size_t Offset = 0; Offset < Buffer.size(); )
+			{
+				Protocol::VersionIDType const VersionID{Buffer[Offset]};
+				Protocol::MessageIDType const MessageID{Buffer[Offset + 1]};
+				Protocol::SizeType::Type Size;
+				memcpy(&Size, &Buffer[Offset + 2], sizeof(Size));
+				Offset += *Protocol::HeaderSize;
+				Body.assign(&Buffer[Offset], &Buffer[Offset] + Size);
+				Offset += Size;
+				Assert(LinearReader<DispatchMessage<Indices>...>::Read(Log, Callbacks.data(), VersionID, MessageID, Body));
+			}
+		});
+		double const Table = Time([&](void)
+		{
+			BufferStream Stream(Buffer);
+			while (!Stream.AtEnd()) Assert(Reader.Read(Stream));
+		});
+		double const View = Time([&](void) { Assert(Viewer.Read(&Buffer[0], Buffer.size())); });
+		std::cout << std::setw(8) << Mix << std::fixed << std::setprecision(1) <<
+			std::setw(14) << Linear << std::setw(14) << Table << std::setw(14) << View << std::endl;
+	}
+	std::cout << "(checksum " << Sum << ")" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+	size_t const Messages = (argc >= 2) ? std::stoull(argv[1]) : 4000000;
+	Bench(typename Protocol::MakeIndexList<MessageTypes>::Type(), Messages);
+	return 0;
+}
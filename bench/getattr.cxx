@@ -0,0 +1,113 @@
+#include "../app/core.h"
+
+#include <chrono>
+#include <iomanip>
+#include <sys/stat.h>
+
+// Counts heap allocations made while answering getattr the way the FUSE layer does, for directories and files at
+// a few depths.  SQLite's own allocations (cursors and result registers inside sqlite3_step) are counted
+// separately; everything the core does around the queries should not allocate.
+
+static thread_local bool Counting = false;
+static thread_local bool InSQLite = false;
+static thread_local uint64_t Allocations = 0;
+static thread_local uint64_t SQLiteAllocations = 0;
+
+extern "C"
+{
+	void *__libc_malloc(size_t Size);
+	void *__libc_calloc(size_t Count, size_t Size);
+	void *__libc_realloc(void *Pointer, size_t Size);
+
+	void *malloc(size_t Size) { if (Counting && !InSQLite) ++Allocations; return __libc_malloc(Size); }
+	void *calloc(size_t Count, size_t Size) { if (Counting && !InSQLite) ++Allocations; return __libc_calloc(Count, Size); }
+	void *realloc(void *Pointer, size_t Size) { if (Counting && !InSQLite) ++Allocations; return __libc_realloc(Pointer, Size); }
+}
+
+static sqlite3_mem_methods SQLiteDefault;
+
+static void *SQLiteMalloc(int Size)
+{
+	if (Counting) ++SQLiteAllocations;
+	InSQLite = true;
+	void *Out = SQLiteDefault.xMalloc(Size);
+	InSQLite = false;
+	return Out;
+}
+
+static void *SQLiteRealloc(void *Pointer, int Size)
+{
+	if (Counting) ++SQLiteAllocations;
+	InSQLite = true;
+	void *Out = SQLiteDefault.xRealloc(Pointer, Size);
+	InSQLite = false;
+	return Out;
+}
+
+static int GetAttributes(ShareCore &Core, char const *Path, struct stat *Out)
+{
+	GetResult File = Core->Get(Path);
+	if (!File) return -ENOENT;
+	if (File->IsFile())
+	{
+		int Result = Core->StatBacking(*File, Out);
+		if (Result != 0) return Result;
+	}
+	Out->st_mode = (File->IsFile() ? S_IFREG : S_IFDIR) | S_IRUSR | (File->CanWrite() ? S_IWUSR : 0);
+	Out->st_mtime = static_cast<time_t>(*File->ModifiedTime());
+	return 0;
+}
+
+int main(int, char **)
+{
+	sqlite3_config(SQLITE_CONFIG_GETMALLOC, &SQLiteDefault);
+	sqlite3_mem_methods Counted = SQLiteDefault;
+	Counted.xMalloc = SQLiteMalloc;
+	Counted.xRealloc = SQLiteRealloc;
+	sqlite3_config(SQLITE_CONFIG_MALLOC, &Counted);
+
+	try
+	{
+		bfs::path const Root("getattrbench");
+		bfs::remove_all(Root);
+		Cleanup Cleanup([&]() { bfs::remove_all(Root); });
+		{
+			ShareCore Core(Root, "bench");
+			Assert(Core->CreateDirectory("/a", true, true), ActionError::OK);
+			Assert(Core->CreateDirectory("/a/b", true, true), ActionError::OK);
+			Assert(Core->CreateDirectory("/a/b/c", true, true), ActionError::OK);
+			Assert(Core->CreateFile("/a/b/c/file", true, false), ActionError::OK);
+			auto File = Core->Open("/a/b/c/file", true, false);
+			Assert(File);
+			Assert((*File)->Write("data", 4, 0), 4);
+			Core->Release(std::move(*File));
+		}
+		ShareCore Core(Root);
+
+		unsigned int const Repeats = 100000;
+		std::cout << std::setw(16) << "path" << std::setw(16) << "ns/op" << std::setw(16) << "core allocs/op" << std::setw(18) << "sqlite allocs/op" << std::endl;
+		bool Clean = true;
+		for (auto const Path : {"/", "/a", "/a/b/c", "/a/b/c/file", "/a/missing"})
+		{
+			struct stat Attributes;
+			GetAttributes(Core, Path, &Attributes);
+			Allocations = 0;
+			SQLiteAllocations = 0;
+			Counting = true;
+			auto const Start = std::chrono::steady_clock::now();
+			for (unsigned int Repeat = 0; Repeat < Repeats; ++Repeat)
+				GetAttributes(Core, Path, &Attributes);
+			auto const Elapsed = std::chrono::steady_clock::now() - Start;
+			Counting = false;
+			std::cout << std::setw(16) << Path <<
+				std::setw(16) << std::chrono::duration_cast<std::chrono::nanoseconds>(Elapsed).count() / Repeats <<
+				std::setw(16) << std::fixed << std::setprecision(2) << static_cast<double>(Allocations) / Repeats <<
+				std::setw(18) << static_cast<double>(SQLiteAllocations) / Repeats << std::endl;
+			if (Allocations > 0) Clean = false;
+		}
+		if (!Clean) { std::cerr << "The core allocated during getattr." << std::endl; return 1; }
+	}
+	catch (SystemError const &Error) { std::cerr << Error << std::endl; return 1; }
+	catch (UserError const &Error) { std::cerr << Error << std::endl; return 1; }
+	return 0;
+}
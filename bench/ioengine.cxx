@@ -0,0 +1,130 @@
+#include "../app/ioengine.h"
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <fcntl.h>
+#include <sys/resource.h>
+
+// Random 4KiB reads from a MEGABYTES (default 256) file in the page cache, at queue depths 1 to 128.  The
+// synchronous engine gets its depth from that many threads each doing pread; the ring is driven by one thread
+// submitting a depth's worth of reads at a time with a registered file and registered buffers.  CPU is user plus
+// system time for the whole process per read.  Then reads readahead windows of 256KiB to 1MiB the way the core
+// does, as one pread against ReadBatched's pieces submitted together.
+
+typedef std::chrono::steady_clock Clock;
+
+static double CPUSeconds(void)
+{
+	rusage Usage;
+	getrusage(RUSAGE_SELF, &Usage);
+	return Usage.ru_utime.tv_sec + Usage.ru_utime.tv_usec / 1e6 + Usage.ru_stime.tv_sec + Usage.ru_stime.tv_usec / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+	try
+	{
+		uint64_t const Megabytes = (argc >= 2) ? std::stoull(argv[1]) : 256;
+		char const *Path = (argc >= 3) ? argv[2] : "ioenginebench";
+		size_t const ReadSize = 4096;
+		size_t const Reads = 400000;
+		size_t const FileSize = Megabytes * 1024 * 1024;
+
+		int const File = open(Path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		if (File < 0) throw SystemError() << "Could not create " << Path << ": " << strerror(errno);
+		Cleanup CloseFile([&]() { close(File); unlink(Path); });
+		{
+			std::vector<char> Chunk(1024 * 1024, 1);
+			for (size_t Offset = 0; Offset < FileSize; Offset += Chunk.size())
+				if (pwrite(File, Chunk.data(), Chunk.size(), static_cast<off_t>(Offset)) != static_cast<ssize_t>(Chunk.size()))
+					throw SystemError() << "Could not fill " << Path << ": " << strerror(errno);
+		}
+		std::vector<off_t> Offsets(Reads);
+		std::mt19937_64 Random(1);
+		for (auto &Offset : Offsets) Offset = static_cast<off_t>(Random() % (FileSize / ReadSize) * ReadSize);
+
+		std::unique_ptr<IOEngine> Ring;
+		try { Ring.reset(new IOEngine(128)); }
+		catch (SystemError const &Error) { std::cout << "io_uring unavailable: " << Error << std::endl; }
+
+		std::cout << std::setw(8) << "depth" << std::setw(14) << "sync (kIOPS)" << std::setw(16) << "sync (us/op)" <<
+			std::setw(14) << "ring (kIOPS)" << std::setw(16) << "ring (us/op)" << std::endl;
+		for (unsigned int Depth = 1; Depth <= 128; Depth *= 2)
+		{
+			IOEngine Sync;
+			double CPUStart = CPUSeconds();
+			auto Start = Clock::now();
+			std::vector<std::thread> Threads;
+			for (unsigned int Thread = 0; Thread < Depth; ++Thread)
+				Threads.emplace_back([&, Thread]()
+				{
+					char Buffer[ReadSize];
+					for (size_t Index = Thread; Index < Reads; Index += Depth)
+						Assert(Sync.Read(File, -1, Buffer, ReadSize, Offsets[Index]), static_cast<ssize_t>(ReadSize));
+				});
+			for (auto &Thread : Threads) Thread.join();
+			double const SyncSeconds = std::chrono::duration<double>(Clock::now() - Start).count();
+			double const SyncCPU = CPUSeconds() - CPUStart;
+
+			std::cout << std::setw(8) << Depth << std::fixed << std::setprecision(1) <<
+				std::setw(14) << Reads / SyncSeconds / 1e3 << std::setprecision(2) << std::setw(16) << SyncCPU / Reads * 1e6;
+			if (!Ring)
+			{
+				std::cout << std::endl;
+				continue;
+			}
+
+			int const Slot = Ring->Register(File);
+			std::vector<int> Buffers;
+			for (unsigned int Index = 0; Index < Depth; ++Index) Buffers.push_back(Ring->AcquireBuffer());
+			std::vector<IOOperation> Batch;
+			CPUStart = CPUSeconds();
+			Start = Clock::now();
+			for (size_t Index = 0; Index < Reads; Index += Depth)
+			{
+				Batch.clear();
+				for (size_t Queued = 0; (Queued < Depth) && (Index + Queued < Reads); ++Queued)
+				{
+					int const Buffer = Buffers[Queued];
+					Batch.emplace_back(false, File, Ring->GetBuffer(Buffer), ReadSize, Offsets[Index + Queued], Slot, Buffer);
+				}
+				Ring->Run(Batch.data(), Batch.size());
+				for (auto const &Operation : Batch) Assert(Operation.Result, static_cast<ssize_t>(ReadSize));
+			}
+			double const RingSeconds = std::chrono::duration<double>(Clock::now() - Start).count();
+			double const RingCPU = CPUSeconds() - CPUStart;
+			for (auto Buffer : Buffers) Ring->ReleaseBuffer(Buffer);
+			Ring->Unregister(Slot);
+
+			std::cout << std::setprecision(1) << std::setw(14) << Reads / RingSeconds / 1e3 <<
+				std::setprecision(2) << std::setw(16) << RingCPU / Reads * 1e6 << std::endl;
+		}
+
+		if (!Ring) return 0;
+		std::cout << std::setw(8) << "window" << std::setw(14) << "pread (MB/s)" << std::setw(16) << "batched (MB/s)" << std::endl;
+		int const Slot = Ring->Register(File);
+		for (size_t Window = 256 * 1024; Window <= 1024 * 1024; Window *= 2)
+		{
+			std::vector<char> Buffer(Window);
+			size_t const Windows = std::min<size_t>(20000, FileSize / Window * 8);
+			std::vector<off_t> Starts(Windows);
+			for (auto &Start : Starts) Start = static_cast<off_t>(Random() % (FileSize / Window) * Window);
+			auto const Time = [&](bool Batched)
+			{
+				auto const Start = Clock::now();
+				for (auto const At : Starts)
+					Assert(Batched ? Ring->ReadBatched(File, Slot, Buffer.data(), Window, At) : Ring->Read(File, Slot, Buffer.data(), Window, At),
+						static_cast<ssize_t>(Window));
+				return static_cast<double>(Windows * Window) / 1e6 / std::chrono::duration<double>(Clock::now() - Start).count();
+			};
+			std::cout << std::setw(7) << Window / 1024 << "K" << std::setprecision(1) << std::setw(14) << Time(false) <<
+				std::setw(16) << Time(true) << std::endl;
+		}
+		Ring->Unregister(Slot);
+	}
+	catch (SystemError const &Error) { std::cerr << Error << std::endl; return 1; }
+	return 0;
+}
@@ -0,0 +1,78 @@
+#include "../app/core.h"
+
+#include <chrono>
+#include <iomanip>
+#include <random>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Creates COUNT empty backing files under each layout, reporting create latency as the directories fill, then
+// the latency of opening randomly chosen existing files.  Default COUNT is 10 million; needs that many free inodes
+// in DIRECTORY.
+
+typedef std::chrono::steady_clock Clock;
+
+static double Microseconds(Clock::duration const &Duration)
+	{ return std::chrono::duration_cast<std::chrono::nanoseconds>(Duration).count() / 1000.0; }
+
+static std::string Filename(uint64_t Index) { return String() << "0-" << Index << "-0-0"; }
+
+int main(int argc, char **argv)
+{
+	try
+	{
+		uint64_t const Count = (argc >= 2) ? std::stoull(argv[1]) : 10000000ull;
+		bfs::path const Base = (argc >= 3) ? bfs::path(argv[2]) : bfs::path("layoutbench");
+		uint64_t const Windows = 10;
+		uint64_t const Opens = std::min<uint64_t>(Count, 100000);
+
+		for (auto const &Layout : {FileLayout(0, 0), FileLayout(1, 2), FileLayout(2, 2), FileLayout(2, 3)})
+		{
+			bfs::remove_all(Base);
+			bfs::create_directories(Base);
+			std::cout << "layout " << Layout.Levels << "x" << Layout.Width << std::endl;
+			std::cout << std::setw(14) << "files" << std::setw(20) << "create (us)" << std::endl;
+
+			Clock::duration Window{};
+			for (uint64_t Index = 0; Index < Count; ++Index)
+			{
+				auto const Path = Layout.Locate(Base, Filename(Index)).string();
+				auto const Start = Clock::now();
+				int File = open(Path.c_str(), O_CREAT | O_WRONLY | O_CLOEXEC, 0600);
+				if ((File < 0) && (errno == ENOENT))
+				{
+					bfs::create_directories(bfs::path(Path).parent_path());
+					File = open(Path.c_str(), O_CREAT | O_WRONLY | O_CLOEXEC, 0600);
+				}
+				if (File < 0) throw SystemError() << "Could not create " << Path << ": " << strerror(errno);
+				close(File);
+				Window += Clock::now() - Start;
+				if ((Index + 1) % (Count / Windows) == 0)
+				{
+					std::cout << std::setw(14) << (Index + 1) << std::setw(20) << std::fixed << std::setprecision(2) <<
+						Microseconds(Window) / (Count / Windows) << std::endl;
+					Window = {};
+				}
+			}
+
+			std::mt19937_64 Random(4);
+			std::vector<double> Latencies;
+			Latencies.reserve(Opens);
+			for (uint64_t Open = 0; Open < Opens; ++Open)
+			{
+				auto const Path = Layout.Locate(Base, Filename(Random() % Count)).string();
+				auto const Start = Clock::now();
+				int const File = open(Path.c_str(), O_RDONLY | O_CLOEXEC);
+				if (File < 0) throw SystemError() << "Could not open " << Path << ": " << strerror(errno);
+				close(File);
+				Latencies.push_back(Microseconds(Clock::now() - Start));
+			}
+			std::sort(Latencies.begin(), Latencies.end());
+			std::cout << "open p50 " << Latencies[Latencies.size() / 2] << " us, p99 " << Latencies[Latencies.size() * 99 / 100] << " us" << std::endl << std::endl;
+		}
+		bfs::remove_all(Base);
+	}
+	catch (SystemError const &Error) { std::cerr << Error << std::endl; return 1; }
+	catch (bfs::filesystem_error const &Error) { std::cerr << Error.what() << std::endl; return 1; }
+	return 0;
+}
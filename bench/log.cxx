@@ -0,0 +1,76 @@
+#include "../app/core.h"
+
+#include <chrono>
+#include <iomanip>
+
+// Measures what a log line costs its caller when its level is off at runtime, both through Logged (which skips the
+// arguments) and through a direct Debug() (which still evaluates them), against a line that's written.  Then creates
+// DIRECTORIES (default 2000) directories through the core with debug lines on and off, which is where the core logs
+// most.  Build with -DLOG_LEVEL=1 to see debug lines compiled out entirely.
+
+typedef std::chrono::steady_clock Clock;
+
+static double Nanoseconds(Clock::duration const &Duration)
+	{ return std::chrono::duration_cast<std::chrono::nanoseconds>(Duration).count(); }
+
+// Stands in for the Describe-style formatting callers do for their arguments
+static std::string Describe(unsigned int Index) { return String() << "file " << Index << " / " << (Index * 7); }
+
+template <typename LineType> static double TimeLines(FileLog &Log, unsigned int Count, LineType const &Line)
+{
+	Log.Flush();
+	auto const Start = Clock::now();
+	for (unsigned int Index = 0; Index < Count; ++Index) Line(Index);
+	auto const End = Clock::now();
+	Log.Flush();
+	return Nanoseconds(End - Start) / Count;
+}
+
+static double TimeDirectories(bfs::path const &Root, LogLevel Level, unsigned int Directories)
+{
+	bfs::remove_all(Root);
+	ShareCore Core(Root, "bench");
+	Core->SetLogLevel(Level);
+	auto const Start = Clock::now();
+	for (unsigned int Index = 0; Index < Directories; ++Index)
+	{
+		std::string const Path = String() << "/" << Index;
+		Assert(Core->CreateDirectory(Path.c_str(), true, true), ActionError::OK);
+	}
+	return Nanoseconds(Clock::now() - Start) / Directories;
+}
+
+int main(int argc, char **argv)
+{
+	try
+	{
+		unsigned int const Directories = (argc >= 2) ? static_cast<unsigned int>(std::stoul(argv[1])) : 2000;
+		unsigned int const Lines = 1000000;
+		bfs::path const Root("logbench");
+		bfs::remove_all(Root);
+		bfs::create_directory(Root);
+		Cleanup Cleanup([&]() { bfs::remove_all(Root); });
+
+		std::cout << "Compiled log level " << static_cast<unsigned int>(CompiledLogLevel) << std::endl;
+		std::cout << std::fixed << std::setprecision(1);
+		{
+			FileLog Log(Root / "log.txt");
+			Log.SetLevel(LogWarn);
+			std::cout << "Disabled, Logged: " << TimeLines(Log, Lines, [&Log](unsigned int Index)
+				{ Logged(Log, Note) << "Created " << Describe(Index); }) << "ns per line" << std::endl;
+			std::cout << "Disabled, direct: " << TimeLines(Log, Lines, [&Log](unsigned int Index)
+				{ Log.Note() << "Created " << Describe(Index); }) << "ns per line" << std::endl;
+			Log.SetLevel(LogNote);
+			std::cout << "Enabled: " << TimeLines(Log, Lines / 10, [&Log](unsigned int Index)
+				{ Logged(Log, Note) << "Created " << Describe(Index); }) << "ns per line" << std::endl;
+		}
+
+		bfs::path const ShareRoot = Root / "share";
+		std::cout << "CreateDirectory, debug on: " << TimeDirectories(ShareRoot, LogDebug, Directories) << "ns" << std::endl;
+		std::cout << "CreateDirectory, debug off: " << TimeDirectories(ShareRoot, LogNote, Directories) << "ns" << std::endl;
+	}
+	catch (SystemError const &Error) { std::cerr << Error << std::endl; return 1; }
+	catch (UserError const &Error) { std::cerr << Error << std::endl; return 1; }
+	catch (...) { std::cerr << "Encountered unexpected error." << std::endl; throw; }
+	return 0;
+}
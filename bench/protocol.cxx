@@ -0,0 +1,184 @@
+#include "../app/protocol.h"
+#include "../app/log.h"
+
+#include <chrono>
+#include <iomanip>
+#include <random>
+
+// Encodes MESSAGES (default 1000000) messages shaped like the transaction log's into one batch, with a new vector
+// per message copied into the batch, with each appended straight to a reused batch, and with each encoded into a
+// stack buffer.  Then decodes the batch, once with the Reader pulling from an in-memory stream and once with the
+// ViewReader reading in place.  Reports throughput and heap allocations per message.  Decoding callbacks only touch
+// each field so the decoding is what's measured.
+
+typedef std::chrono::steady_clock Clock;
+
+static size_t Allocations = 0;
+void *operator new(size_t Size)
+{
+	++Allocations;
+	if (void *Out = malloc(Size)) return Out;
+	throw std::bad_alloc();
+}
+void operator delete(void *Pointer) noexcept { free(Pointer); }
+
+DefineProtocol(BenchProtocol)
+DefineProtocolVersion(BenchVersion1, BenchProtocol)
+DefineProtocolMessage(BV1Create, BenchVersion1, void(uint64_t ID, uint64_t Parent, std::string Name, bool IsFile, uint8_t Permissions))
+DefineProtocolMessage(BV1Move, BenchVersion1, void(uint64_t ID, uint64_t Parent, std::string Name))
+DefineProtocolMessage(BV1Write, BenchVersion1, void(uint64_t ID, uint64_t Offset, std::vector<uint8_t> Data))
+DefineProtocolMessage(BV1Delete, BenchVersion1, void(uint64_t ID))
+
+struct BufferStream
+{
+	BufferStream(Protocol::BufferType const &Buffer) : Buffer(Buffer), Offset(0), Dead(false) {}
+	BufferStream &read(char *Out, size_t Length)
+	{
+		if (Offset + Length > Buffer.size()) { Dead = true; return *this; }
+		memcpy(Out, &Buffer[Offset], Length);
+		Offset += Length;
+		return *this;
+	}
+	bool operator !(void) const { return Dead; }
+	bool AtEnd(void) const { return Offset >= Buffer.size(); }
+
+	private:
+		Protocol::BufferType const &Buffer;
+		size_t Offset;
+		bool Dead;
+};
+
+int main(int argc, char **argv)
+{
+	size_t const Messages = (argc >= 2) ? std::stoull(argv[1]) : 1000000;
+	unsigned int const Rounds = 5;
+	NullLog Log;
+
+	struct Arguments
+	{
+		unsigned int Type;
+		uint64_t ID, Parent;
+		std::string Name;
+		std::vector<uint8_t> Data;
+	};
+	std::vector<Arguments> Inputs(Messages);
+	std::mt19937_64 Random(1);
+	for (size_t Index = 0; Index < Messages; ++Index)
+	{
+		auto &Input = Inputs[Index];
+		Input.Type = static_cast<unsigned int>(Random() % 4);
+		Input.ID = Index;
+		Input.Parent = Random() % 1000;
+		Input.Name.assign(8 + Random() % 32, static_cast<char>('a' + Index % 26));
+		if (Input.Type == 2) Input.Data.assign(Random() % 256, 7);
+	}
+
+	Protocol::BufferType Buffer;
+	uint64_t Sum = 0;
+	auto const Run = [&](char const *Name, std::function<void(void)> const &Body)
+	{
+		double Best = 0;
+		size_t Allocated = 0;
+		for (unsigned int Round = 0; Round < Rounds; ++Round)
+		{
+			size_t const AllocationsBefore = Allocations;
+			auto const Start = Clock::now();
+			Body();
+			double const Seconds = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - Start).count() / 1e9;
+			Allocated = Allocations - AllocationsBefore;
+			if ((Best == 0) || (Seconds < Best)) Best = Seconds;
+		}
+		std::cout << std::setw(8) << Name << std::fixed << std::setprecision(1) <<
+			std::setw(12) << Buffer.size() / 1e6 / Best <<
+			std::setw(14) << Messages / 1e6 / Best <<
+			std::setw(14) << std::setprecision(2) << static_cast<double>(Allocated) / Messages << std::endl;
+	};
+
+	std::cout << std::setw(8) << "" << std::setw(12) << "MB/s" << std::setw(14) << "M msgs/s" << std::setw(14) << "allocs/msg" << std::endl;
+
+	// Sizes the batch for the first round
+	for (auto const &Input : Inputs)
+	{
+		switch (Input.Type)
+		{
+			case 0: BV1Create::Append(Buffer, Input.ID, Input.Parent, Input.Name, Input.ID % 2, 6); break;
+			case 1: BV1Move::Append(Buffer, Input.ID, Input.Parent, Input.Name); break;
+			case 2: BV1Write::Append(Buffer, Input.ID, Input.Parent, Input.Data); break;
+			default: BV1Delete::Append(Buffer, Input.ID); break;
+		}
+	}
+	Protocol::BufferType const Expected = Buffer;
+
+	Run("write", [&](void)
+	{
+		Buffer.clear();
+		for (auto const &Input : Inputs)
+		{
+			Protocol::BufferType Message;
+			switch (Input.Type)
+			{
+				case 0: Message = BV1Create::Write(Input.ID, Input.Parent, Input.Name, Input.ID % 2, 6); break;
+				case 1: Message = BV1Move::Write(Input.ID, Input.Parent, Input.Name); break;
+				case 2: Message = BV1Write::Write(Input.ID, Input.Parent, Input.Data); break;
+				default: Message = BV1Delete::Write(Input.ID); break;
+			}
+			Buffer.insert(Buffer.end(), Message.begin(), Message.end());
+		}
+	});
+	Assert(Buffer == Expected);
+
+	Run("append", [&](void)
+	{
+		Buffer.clear();
+		for (auto const &Input : Inputs)
+		{
+			switch (Input.Type)
+			{
+				case 0: BV1Create::Append(Buffer, Input.ID, Input.Parent, Input.Name, Input.ID % 2, 6); break;
+				case 1: BV1Move::Append(Buffer, Input.ID, Input.Parent, Input.Name); break;
+				case 2: BV1Write::Append(Buffer, Input.ID, Input.Parent, Input.Data); break;
+				default: BV1Delete::Append(Buffer, Input.ID); break;
+			}
+		}
+	});
+	Assert(Buffer == Expected);
+
+	Run("encode", [&](void)
+	{
+		uint8_t Stack[512];
+		for (auto const &Input : Inputs)
+		{
+			switch (Input.Type)
+			{
+				case 0: Sum += BV1Create::Encode(Stack, sizeof(Stack), Input.ID, Input.Parent, Input.Name, Input.ID % 2, 6); break;
+				case 1: Sum += BV1Move::Encode(Stack, sizeof(Stack), Input.ID, Input.Parent, Input.Name); break;
+				case 2: Sum += BV1Write::Encode(Stack, sizeof(Stack), Input.ID, Input.Parent, Input.Data); break;
+				default: Sum += BV1Delete::Encode(Stack, sizeof(Stack), Input.ID); break;
+			}
+			Sum += Stack[Sum % 8];
+		}
+	});
+
+	Protocol::Reader<NullLog, BV1Create, BV1Move, BV1Write, BV1Delete> Reader(Log,
+		[&](uint64_t const &ID, uint64_t const &Parent, std::string const &Name, bool const &IsFile, uint8_t const &Permissions)
+			{ Sum += ID + Parent + Name.size() + IsFile + Permissions; },
+		[&](uint64_t const &ID, uint64_t const &Parent, std::string const &Name) { Sum += ID + Parent + Name.size(); },
+		[&](uint64_t const &ID, uint64_t const &Offset, std::vector<uint8_t> const &Data) { Sum += ID + Offset + Data.size(); },
+		[&](uint64_t const &ID) { Sum += ID; });
+	Run("stream", [&](void)
+	{
+		BufferStream Stream(Buffer);
+		while (!Stream.AtEnd()) Assert(Reader.Read(Stream));
+	});
+
+	Protocol::ViewReader<NullLog, BV1Create, BV1Move, BV1Write, BV1Delete> Viewer(Log,
+		[&](uint64_t const &ID, uint64_t const &Parent, StringView const &Name, bool const &IsFile, uint8_t const &Permissions)
+			{ Sum += ID + Parent + Name.Length + IsFile + Permissions; },
+		[&](uint64_t const &ID, uint64_t const &Parent, StringView const &Name) { Sum += ID + Parent + Name.Length; },
+		[&](uint64_t const &ID, uint64_t const &Offset, Protocol::Span<uint8_t> const &Data) { Sum += ID + Offset + Data.size(); },
+		[&](uint64_t const &ID) { Sum += ID; });
+	Run("view", [&](void) { Assert(Viewer.Read(&Buffer[0], Buffer.size())); });
+
+	std::cout << "(checksum " << Sum << ")" << std::endl;
+	return 0;
+}
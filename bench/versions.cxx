@@ -0,0 +1,64 @@
+#include "../app/core.h"
+
+#include <chrono>
+#include <iomanip>
+
+// Compares answering "is change A an ancestor of change B" by walking the Ancestry table against comparing the
+// nodes' version vectors, for increasingly long change histories.
+
+int main(int, char **)
+{
+	try
+	{
+		std::vector<unsigned int> const Depths{10, 100, 1000, 10000, 100000};
+		unsigned int const Repeats = 10;
+
+		std::cout << std::setw(10) << "depth" << std::setw(20) << "chain walk (us)" << std::setw(20) << "vector (ns)" << std::endl;
+		for (auto const Depth : Depths)
+		{
+			CoreDatabase Database(bfs::path(), true, "bench", UUID::Type(1));
+			Database.Begin();
+			for (UUID::Type Index = 1; Index <= Depth; ++Index)
+				Database.CreateChange({Counter::Type(0), Index}, {Counter::Type(0), Index - 1}, Timestamp::Type(0));
+			Database.End();
+
+			NodeID const Oldest(Counter::Type(0), UUID::Type(1));
+			NodeID const Newest(Counter::Type(0), UUID::Type(Depth));
+
+			auto WalkStart = std::chrono::steady_clock::now();
+			for (unsigned int Repeat = 0; Repeat < Repeats; ++Repeat)
+			{
+				NodeID Change = Newest;
+				while (Change.Index != Oldest.Index)
+				{
+					auto Preceding = Database.GetChange(Change);
+					if (!Preceding) throw SystemError() << "Broken chain at " << *Change.Index;
+					Change = *Preceding;
+				}
+			}
+			auto const WalkTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - WalkStart).count() / Repeats;
+
+			// Vectors as a node would carry them after a history shared between a few instances
+			VersionVector OldestVersions, NewestVersions;
+			for (Counter::Type Instance = 0; Instance < 4; ++Instance)
+			{
+				OldestVersions.Advance({Instance, *Oldest.Index});
+				NewestVersions.Advance({Instance, *Newest.Index});
+			}
+			unsigned int const VectorRepeats = 1000000;
+			unsigned int Before = 0;
+			auto VectorStart = std::chrono::steady_clock::now();
+			for (unsigned int Repeat = 0; Repeat < VectorRepeats; ++Repeat)
+			{
+				if (OldestVersions.Compare(NewestVersions) == VersionOrder::Before) ++Before;
+				asm volatile("" : : "r"(&OldestVersions) : "memory");
+			}
+			auto const VectorTime = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - VectorStart).count() / VectorRepeats;
+			Assert(Before, VectorRepeats);
+
+			std::cout << std::setw(10) << Depth << std::setw(20) << WalkTime << std::setw(20) << VectorTime << std::endl;
+		}
+	}
+	catch (SystemError const &Error) { std::cerr << Error << std::endl; return 1; }
+	return 0;
+}
@@ -4,7 +4,7 @@ ProtocolTest = Define.Executable
 {
 	Name = 'protocol',
 	Sources = Item 'protocol.cxx',
-	LinkFlags = '-lboost_system -lboost_filesystem'
+	LinkFlags = '-lboost_system -lboost_filesystem -lz'
 }
 Define.Test { Executable = ProtocolTest }
 
@@ -12,7 +12,7 @@ DatabaseTest = Define.Executable
 {
 	Name = 'database',
 	Sources = Item 'database.cxx',
-	LinkFlags = '-lboost_system -lboost_filesystem -lsqlite3'
+	LinkFlags = '-lboost_system -lboost_filesystem -lsqlite3 -lz'
 }
 Define.Test { Executable = DatabaseTest }
 
@@ -20,7 +20,7 @@ TransactionTest = Define.Executable
 {
 	Name = 'transaction',
 	Sources = Item 'transaction.cxx',
-	LinkFlags = '-lboost_system -lboost_filesystem'
+	LinkFlags = '-lboost_system -lboost_filesystem -lz'
 }
 Define.Test { Executable = TransactionTest }
 
@@ -29,10 +29,117 @@ Core1Test = Define.Executable
 	Name = 'core1',
 	Sources = Item 'core1.cxx',
 	Objects = CoreObject,
-	LinkFlags = '-lboost_system -lboost_filesystem -lsqlite3'
+	LinkFlags = '-lboost_system -lboost_filesystem -lsqlite3 -lz'
 }
 Define.Test { Executable = Core1Test }
 
+NotifyTest = Define.Executable
+{
+	Name = 'notify',
+	Sources = Item 'notify.cxx',
+	Objects = CoreObject,
+	LinkFlags = '-lboost_system -lboost_filesystem -lsqlite3 -lz -lpthread'
+}
+Define.Test { Executable = NotifyTest }
+
+SplitsTest = Define.Executable
+{
+	Name = 'splits',
+	Sources = Item 'splits.cxx',
+	Objects = CoreObject,
+	LinkFlags = '-lboost_system -lboost_filesystem -lsqlite3 -lz -lpthread'
+}
+Define.Test { Executable = SplitsTest }
+
+LayoutTest = Define.Executable
+{
+	Name = 'layout',
+	Sources = Item 'layout.cxx',
+	Objects = CoreObject,
+	LinkFlags = '-lboost_system -lboost_filesystem -lsqlite3 -lz -lpthread'
+}
+Define.Test { Executable = LayoutTest }
+
+BlocksTest = Define.Executable
+{
+	Name = 'blocks',
+	Sources = Item 'blocks.cxx',
+	Objects = CoreObject,
+	LinkFlags = '-lboost_system -lboost_filesystem -lsqlite3 -lz -lpthread'
+}
+Define.Test { Executable = BlocksTest }
+
+ExtentsTest = Define.Executable
+{
+	Name = 'extents',
+	Sources = Item 'extents.cxx',
+	Objects = CoreObject,
+	LinkFlags = '-lboost_system -lboost_filesystem -lsqlite3 -lz -lpthread'
+}
+Define.Test { Executable = ExtentsTest }
+
+CopyTest = Define.Executable
+{
+	Name = 'copy',
+	Sources = Item 'copy.cxx',
+	Objects = CoreObject,
+	LinkFlags = '-lboost_system -lboost_filesystem -lsqlite3 -lz -lpthread'
+}
+Define.Test { Executable = CopyTest }
+
+IOEngineTest = Define.Executable
+{
+	Name = 'ioengine',
+	Sources = Item 'ioengine.cxx',
+	Objects = CoreObject,
+	LinkFlags = '-lboost_system -lboost_filesystem -lsqlite3 -lz -lpthread'
+}
+Define.Test { Executable = IOEngineTest }
+
+FileCacheTest = Define.Executable
+{
+	Name = 'filecache',
+	Sources = Item 'filecache.cxx',
+	Objects = CoreObject,
+	LinkFlags = '-lboost_system -lboost_filesystem -lsqlite3 -lz -lpthread'
+}
+Define.Test { Executable = FileCacheTest }
+
+SparseTest = Define.Executable
+{
+	Name = 'sparse',
+	Sources = Item 'sparse.cxx',
+	Objects = CoreObject,
+	LinkFlags = '-lboost_system -lboost_filesystem -lsqlite3 -lz -lpthread'
+}
+Define.Test { Executable = SparseTest }
+
+CompressTest = Define.Executable
+{
+	Name = 'compress',
+	Sources = Item 'compress.cxx',
+	Objects = CoreObject,
+	LinkFlags = '-lboost_system -lboost_filesystem -lsqlite3 -lz -lpthread'
+}
+Define.Test { Executable = CompressTest }
+
+LogTest = Define.Executable
+{
+	Name = 'log',
+	Sources = Item 'log.cxx',
+	LinkFlags = '-lboost_system -lboost_filesystem -lpthread'
+}
+Define.Test { Executable = LogTest }
+
+LatencyTest = Define.Executable
+{
+	Name = 'latency',
+	Sources = Item 'latency.cxx',
+	Objects = CoreObject,
+	LinkFlags = '-lboost_system -lboost_filesystem -lsqlite3 -lz -lpthread'
+}
+Define.Test { Executable = LatencyTest }
+
 --[[FSBasicsTest = Define.Executable
 {
 	Name = 'fsbasics',
@@ -0,0 +1,204 @@
+#include "../app/core.h"
+
+#include <chrono>
+#include <random>
+#include <thread>
+
+int main(int, char **)
+{
+	try
+	{
+		bfs::path ExternalRootPath("blocksroot");
+		Cleanup Cleanup([&]() { boost::filesystem::remove_all(ExternalRootPath); });
+
+		std::mt19937 Random(7);
+		std::string Data(BlockSize * 2 + BlockSize / 2, 0);
+		for (auto &Byte : Data) Byte = static_cast<char>(Random());
+		std::string Variant = Data;
+		Variant[BlockSize * 2 + 1] ^= 1;
+
+		auto const Write = [](ShareCore &Core, char const *Path, std::string const &Contents)
+		{
+			Assert(Core->CreateFile(Path, true, false), ActionError::OK);
+			auto File = Core->Open(Path, true, false);
+			Assert(File);
+			Assert((*File)->Write(Contents.data(), Contents.size(), 0), static_cast<ssize_t>(Contents.size()));
+			Core->Release(std::move(*File));
+			Core->IngestReleased(100);
+		};
+		auto const ReadAll = [](OpenFile &File)
+		{
+			// Odd sized reads so they straddle blocks
+			std::string Out;
+			char Buffer[9001];
+			while (true)
+			{
+				ssize_t const Got = File.Read(Buffer, sizeof(Buffer), static_cast<off_t>(Out.size()));
+				Assert(Got >= 0);
+				if (Got == 0) break;
+				Out.append(Buffer, static_cast<size_t>(Got));
+			}
+			return Out;
+		};
+		auto const IsPlain = [](ShareCore &Core, char const *Path)
+		{
+			auto const File = Core->Get(Path);
+			return bfs::exists(Core->GetRealPath(*File));
+		};
+		auto const Read = [&ReadAll](ShareCore &Core, char const *Path)
+		{
+			auto File = Core->Open(Path, false, false);
+			Assert(File);
+			std::string const Out = ReadAll(**File);
+			Core->Release(std::move(*File));
+			return Out;
+		};
+
+		{
+			ShareCore Core(ExternalRootPath, "blocksinstance1");
+			Assert(!Core->IsDeduplicating());
+
+			// Without deduplication data stays in plain backing files
+			Write(Core, "/plain", Data);
+			Assert(IsPlain(Core, "/plain"));
+			Assert(Core->GetBlockStats().Blocks, 0u);
+
+			// Opening a read only file to truncate it is refused before anything is lost
+			{
+				Assert(Core->CreateFile("/readonly", false, false), ActionError::OK);
+				auto File = Core->Open("/readonly", true, false);
+				Assert(File);
+				Assert((*File)->Write(Data.data(), Data.size(), 0), static_cast<ssize_t>(Data.size()));
+				Core->Release(std::move(*File));
+				Assert(Core->Open("/readonly", true, true).Code, ActionError::Restricted);
+				Assert(Read(Core, "/readonly") == Data);
+				Assert(Core->Delete("/readonly"), ActionError::OK);
+			}
+
+			Core->SetDeduplication(true);
+			Write(Core, "/a", Data);
+			Write(Core, "/b", Data);
+			Write(Core, "/c", Variant);
+			Assert(!IsPlain(Core, "/a"));
+			auto Stats = Core->GetBlockStats();
+			Assert(Stats.Blocks, 4u);
+			Assert(Stats.LogicalBytes, static_cast<uint64_t>(Data.size() * 3));
+			Assert(Stats.StoredBytes, static_cast<uint64_t>(Data.size() + BlockSize / 2));
+			Assert(Read(Core, "/a") == Data);
+			Assert(Read(Core, "/c") == Variant);
+
+			struct stat Status;
+			auto const B = Core->Get("/b");
+			Assert(Core->StatBacking(*B, &Status), 0);
+			Assert(Status.st_size, static_cast<off_t>(Data.size()));
+
+			// Opening for writing without writing leaves the blocks in place
+			{
+				auto File = Core->Open("/a", true, false);
+				Assert(File);
+				Core->Release(std::move(*File));
+				Assert(!IsPlain(Core, "/a"));
+				Assert(Core->GetBlockStats().Blocks, 4u);
+			}
+
+			// Handles on one file share its data, so a reader sees a concurrent writer's changes
+			{
+				auto Reader = Core->Open("/a", false, false);
+				auto Writer = Core->Open("/a", true, false);
+				Assert(Reader);
+				Assert(Writer);
+				Assert((*Writer)->Write("x", 1, 0), 1);
+				Data[0] = 'x';
+				Assert(ReadAll(**Reader) == Data);
+				Core->Release(std::move(*Writer));
+				Core->Release(std::move(*Reader));
+				Assert(!IsPlain(Core, "/a"));
+			}
+			Assert(Core->GetBlockStats().Blocks, 5u);
+			Assert(Core->CollectBlocks(100), 0u);
+
+			// The version the write replaced goes with its change
+			Timestamp const Later = static_cast<Timestamp::Type>(std::time(nullptr) + 60);
+			Core->CompactHistory(Later, 100);
+
+			// Unreferenced blocks stay until collected
+			Assert(Core->Delete("/b"), ActionError::OK);
+			Assert(Core->Delete("/c"), ActionError::OK);
+			Assert(Core->GetBlockStats().Blocks, 5u);
+			Assert(Core->CollectBlocks(1), 1u);
+			Assert(Core->CollectBlocks(100), 1u);
+			Stats = Core->GetBlockStats();
+			Assert(Stats.Blocks, 3u);
+			Assert(Stats.LogicalBytes, static_cast<uint64_t>(Data.size()));
+			Assert(Read(Core, "/a") == Data);
+
+			// A file deleted while open stays readable until closed
+			{
+				auto File = Core->Open("/a", false, false);
+				Assert(File);
+				Assert(Core->Delete("/a"), ActionError::OK);
+				Assert(Core->CollectBlocks(100), 0u);
+				Assert(ReadAll(**File) == Data);
+				Core->Release(std::move(*File));
+				Assert(Core->CollectBlocks(100), 3u);
+				Assert(Core->GetBlockStats().Blocks, 0u);
+			}
+
+			// Emptied files go back to plain
+			Write(Core, "/d", Variant);
+			{
+				auto File = Core->Open("/d", true, true);
+				Assert(File);
+				Core->Release(std::move(*File));
+			}
+			Assert(IsPlain(Core, "/d"));
+			Assert(Read(Core, "/d").empty());
+			Core->CompactHistory(Later, 100);
+			Assert(Core->CollectBlocks(100), 3u);
+
+			Write(Core, "/e", Variant);
+
+			// The ingestion thread stores a released file without holding up other operations, and a write that lands
+			// meanwhile isn't lost
+			{
+				std::string Big(BlockSize * 256, 0);
+				for (auto &Byte : Big) Byte = static_cast<char>(Random());
+				Assert(Core->CreateFile("/big", true, false), ActionError::OK);
+				auto File = Core->Open("/big", true, false);
+				Assert(File);
+				Assert((*File)->Write(Big.data(), Big.size(), 0), static_cast<ssize_t>(Big.size()));
+				auto const CountBlockFiles = [&]()
+				{
+					size_t Count = 0;
+					for (bfs::recursive_directory_iterator Entry(ExternalRootPath / "." App / "blocks"), End; Entry != End; ++Entry)
+						if (bfs::is_regular_file(Entry->status())) ++Count;
+					return Count;
+				};
+				size_t const Before = CountBlockFiles();
+				Core->StartIngestion();
+				Core->Release(std::move(*File));
+				// Once blocks are being written the core is free, well before the rest are
+				while (CountBlockFiles() <= Before) std::this_thread::yield();
+				Assert(Core->Get("/e"));
+				Assert(CountBlockFiles() < Before + 256);
+				auto Rewriter = Core->Open("/big", true, false);
+				Assert(Rewriter);
+				Assert((*Rewriter)->Write("y", 1, 0), 1);
+				Core->Release(std::move(*Rewriter));
+				while (IsPlain(Core, "/big")) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+				Big[0] = 'y';
+				Assert(Read(Core, "/big") == Big);
+			}
+		}
+
+		// Both the setting and the data survive a restart
+		ShareCore Core(ExternalRootPath);
+		Assert(Core->IsDeduplicating());
+		Assert(Read(Core, "/e") == Variant);
+		Assert(Read(Core, "/plain").size(), Data.size());
+	}
+	catch (SystemError const &Error) { std::cerr << Error << std::endl; return 1; }
+	catch (UserError const &Error) { std::cerr << Error << std::endl; return 1; }
+	catch (...) { std::cerr << "Encountered unexpected error." << std::endl; throw; }
+	return 0;
+}
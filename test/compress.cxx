@@ -0,0 +1,143 @@
+#include "../app/core.h"
+
+#include <random>
+#include <ctime>
+
+int main(int, char **)
+{
+	try
+	{
+		bfs::path ExternalRootPath("compressroot");
+		Cleanup Cleanup([&]() { boost::filesystem::remove_all(ExternalRootPath); });
+		bfs::create_directory(ExternalRootPath);
+
+		// Blocks on their own
+		{
+			BlockCompressor Compressor;
+			std::vector<char> Out;
+			std::string const Text(BlockSize, 'a');
+			size_t const Size = Compressor.Compress(Text.data(), Text.size(), Out);
+			Assert(Size > 0);
+			Assert(Size < Text.size() / 8);
+			std::vector<char> Inflated(BlockSize);
+			Assert(DecompressBlock(Out.data(), Size, Inflated.data(), Inflated.size()), static_cast<ssize_t>(Text.size()));
+			Assert(memcmp(Inflated.data(), Text.data(), Text.size()), 0);
+			Assert(DecompressBlock(Out.data(), Size / 2, Inflated.data(), Inflated.size()), -EIO);
+
+			std::mt19937 Random(1);
+			std::string Noise(BlockSize, 0);
+			for (auto &Byte : Noise) Byte = static_cast<char>(Random());
+			Assert(Compressor.Compress(Noise.data(), Noise.size(), Out), 0u);
+
+			// Gives up after a run of failures, checking back now and then
+			CompressionBypass Bypass;
+			for (unsigned int Count = 0; Count < CompressionBypass::Patience; ++Count)
+			{
+				Assert(Bypass.ShouldTry());
+				Bypass.Record(false);
+			}
+			unsigned int Tries = 0;
+			for (unsigned int Count = 0; Count < CompressionBypass::Interval * 2; ++Count)
+				if (Bypass.ShouldTry()) ++Tries;
+			Assert(Tries, 2u);
+			Bypass.Record(true);
+			Assert(Bypass.ShouldTry());
+		}
+
+		// Log-like text, incompressible noise, and a mix of the two a block at a time
+		std::string Text;
+		std::mt19937 Random(2);
+		for (unsigned int Line = 0; Text.size() < BlockSize * 10; ++Line)
+			Text += "2024-01-01 12:00:" + std::to_string(Line % 60) + " worker " + std::to_string(Random() % 8) + " handled request " + std::to_string(Line) + "\n";
+		std::string Noise(BlockSize * 10 + 1234, 0);
+		for (auto &Byte : Noise) Byte = static_cast<char>(Random());
+		std::string Mixed;
+		for (unsigned int Block = 0; Block < 10; ++Block)
+			Mixed += ((Block % 2) ? Noise : Text).substr(Block * BlockSize, BlockSize);
+
+		auto const Write = [](ShareCore &Core, char const *Path, std::string const &Contents)
+		{
+			Assert(Core->CreateFile(Path, true, false), ActionError::OK);
+			auto File = Core->Open(Path, true, false);
+			Assert(File);
+			Assert((*File)->Write(Contents.data(), Contents.size(), 0), static_cast<ssize_t>(Contents.size()));
+			Core->Release(std::move(*File));
+			Core->IngestReleased(100);
+		};
+		auto const Read = [](ShareCore &Core, char const *Path, off_t Offset, size_t Length)
+		{
+			auto File = Core->Open(Path, false, false);
+			Assert(File);
+			std::string Out(Length, 0);
+			ssize_t const Got = (*File)->Read(&Out[0], Out.size(), Offset);
+			Assert(Got >= 0);
+			Out.resize(static_cast<size_t>(Got));
+			Core->Release(std::move(*File));
+			return Out;
+		};
+
+		bfs::path const SharePath = ExternalRootPath / "share";
+		{
+			ShareCore Core(SharePath, "compressinstance1");
+			Assert(!Core->IsCompressing());
+			Core->SetCompression(true);
+
+			// Files go to the block store without deduplication, and only compressible blocks shrink
+			Write(Core, "/text", Text);
+			auto Stats = Core->GetBlockStats();
+			Assert(Stats.LogicalBytes, static_cast<uint64_t>(Text.size()));
+			Assert(Stats.StoredBytes * 3 < Stats.LogicalBytes);
+			Write(Core, "/noise", Noise);
+			auto const NoiseStats = Core->GetBlockStats();
+			Assert(NoiseStats.StoredBytes - Stats.StoredBytes, static_cast<uint64_t>(Noise.size()));
+			Write(Core, "/mixed", Mixed);
+
+			// Any range reads back without the rest of the file
+			for (auto const &File : {std::make_pair("/text", &Text), std::make_pair("/noise", &Noise), std::make_pair("/mixed", &Mixed)})
+			{
+				Assert(Read(Core, File.first, 0, File.second->size() + 10) == *File.second);
+				for (unsigned int Count = 0; Count < 20; ++Count)
+				{
+					auto const Offset = static_cast<size_t>(Random() % File.second->size());
+					auto const Length = static_cast<size_t>(Random() % (BlockSize * 2));
+					Assert(Read(Core, File.first, static_cast<off_t>(Offset), Length) == File.second->substr(Offset, Length));
+				}
+			}
+
+			// Writes into compressed extents
+			{
+				auto File = Core->Open("/text", true, false);
+				Assert(File);
+				Assert((*File)->Write("edit", 4, BlockSize + 10), 4);
+				Core->Release(std::move(*File));
+			}
+			Text.replace(BlockSize + 10, 4, "edit");
+			Assert(Read(Core, "/text", 0, Text.size()) == Text);
+
+			// Compressed blocks are collected like any other
+			Timestamp const Later = static_cast<Timestamp::Type>(std::time(nullptr) + 60);
+			Core->CompactHistory(Later, 100);
+			Assert(Core->Delete("/mixed"), ActionError::OK);
+			Assert(Core->Delete("/text"), ActionError::OK);
+			Assert(Core->Delete("/noise"), ActionError::OK);
+			Core->CompactHistory(Later, 100);
+			while (Core->CollectBlocks(100) > 0) {}
+			Assert(Core->GetBlockStats().Blocks, 0u);
+			for (bfs::recursive_directory_iterator Entry(SharePath / ".sonch" / "blocks"), End; Entry != End; ++Entry)
+				Assert(!bfs::is_regular_file(Entry->path()));
+
+			Write(Core, "/kept", Text);
+		}
+
+		// The setting and the blocks survive reopening
+		{
+			ShareCore Core(SharePath, "compressinstance1");
+			Assert(Core->IsCompressing());
+			Assert(Read(Core, "/kept", 0, Text.size()) == Text);
+		}
+	}
+	catch (SystemError const &Error) { std::cerr << Error << std::endl; return 1; }
+	catch (UserError const &Error) { std::cerr << Error << std::endl; return 1; }
+	catch (...) { std::cerr << "Encountered unexpected error." << std::endl; throw; }
+	return 0;
+}
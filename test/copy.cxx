@@ -0,0 +1,98 @@
+#include "../app/core.h"
+#include "../app/copy.h"
+
+#include <random>
+
+int main(int, char **)
+{
+	try
+	{
+		bfs::path ExternalRootPath("copyroot");
+		Cleanup Cleanup([&]() { boost::filesystem::remove_all(ExternalRootPath); });
+		bfs::create_directory(ExternalRootPath);
+
+		std::mt19937 Random(5);
+		std::string Data(BlockSize * 3 + 1234, 0);
+		for (auto &Byte : Data) Byte = static_cast<char>(Random());
+
+		// Raw ranges, whichever way the host ends up copying them
+		{
+			int const From = open((ExternalRootPath / "from").string().c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+			int const To = open((ExternalRootPath / "to").string().c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+			Assert(From >= 0);
+			Assert(To >= 0);
+			::Cleanup CloseFiles([&]() { close(From); close(To); });
+			Assert(pwrite(From, Data.data(), Data.size(), 0), static_cast<ssize_t>(Data.size()));
+
+			Assert(CopyRange(From, 0, To, 0, Data.size()), static_cast<ssize_t>(Data.size()));
+			std::string Copied(Data.size(), 0);
+			Assert(pread(To, &Copied[0], Copied.size(), 0), static_cast<ssize_t>(Data.size()));
+			Assert(Copied == Data);
+
+			// Unaligned offsets, and a range running past the end of the source comes up short
+			Assert(CopyRange(From, 17, To, 5, 100), 100);
+			Assert(pread(To, &Copied[0], 100, 5), 100);
+			Assert(memcmp(Copied.data(), Data.data() + 17, 100), 0);
+			Assert(CopyRange(From, static_cast<off_t>(Data.size() - 10), To, 0, 100), 10);
+			Assert(CopyRange(From, static_cast<off_t>(Data.size()), To, 0, 100), 0);
+		}
+
+		ShareCore Core(ExternalRootPath / "share", "copyinstance1");
+		auto const Write = [](ShareCore &Core, char const *Path, std::string const &Contents)
+		{
+			Assert(Core->CreateFile(Path, true, false), ActionError::OK);
+			auto File = Core->Open(Path, true, false);
+			Assert(File);
+			Assert((*File)->Write(Contents.data(), Contents.size(), 0), static_cast<ssize_t>(Contents.size()));
+			Core->Release(std::move(*File));
+			Core->IngestReleased(100);
+		};
+		auto const Read = [&Data](ShareCore &Core, char const *Path)
+		{
+			auto File = Core->Open(Path, false, false);
+			Assert(File);
+			std::string Out(Data.size() * 2, 0);
+			ssize_t const Got = (*File)->Read(&Out[0], Out.size(), 0);
+			Assert(Got >= 0);
+			Out.resize(static_cast<size_t>(Got));
+			Core->Release(std::move(*File));
+			return Out;
+		};
+
+		// Plain files
+		Write(Core, "/plain", Data);
+		Assert(Core->Copy("/plain", "/plaincopy"), ActionError::OK);
+		Assert(Read(Core, "/plaincopy") == Data);
+		Assert(Core->Copy("/plain", "/plaincopy"), ActionError::Exists);
+		Assert(Core->Copy("/missing", "/other"), ActionError::Missing);
+		Assert(Core->CreateDirectory("/dir", true, true), ActionError::OK);
+		Assert(Core->Copy("/dir", "/other"), ActionError::Invalid);
+
+		// Files in the block store share their blocks with the copy
+		Core->SetDeduplication(true);
+		Write(Core, "/stored", Data);
+		auto const Stats = Core->GetBlockStats();
+		Assert(Stats.Blocks > 0);
+		Assert(Core->Copy("/stored", "/storedcopy"), ActionError::OK);
+		Assert(Core->GetBlockStats().Blocks, Stats.Blocks);
+		Assert(Core->GetBlockStats().LogicalBytes, Stats.LogicalBytes * 2);
+		Assert(Read(Core, "/storedcopy") == Data);
+
+		// Staged writes are copied as they stand
+		{
+			auto File = Core->Open("/stored", true, false);
+			Assert(File);
+			Assert((*File)->Write("staged", 6, BlockSize), 6);
+			Assert(Core->Copy("/stored", "/stagedcopy"), ActionError::OK);
+			Core->Release(std::move(*File));
+		}
+		std::string Staged = Data;
+		Staged.replace(BlockSize, 6, "staged");
+		Assert(Read(Core, "/stagedcopy") == Staged);
+		Assert(Read(Core, "/storedcopy") == Data);
+	}
+	catch (SystemError const &Error) { std::cerr << Error << std::endl; return 1; }
+	catch (UserError const &Error) { std::cerr << Error << std::endl; return 1; }
+	catch (...) { std::cerr << "Encountered unexpected error." << std::endl; throw; }
+	return 0;
+}
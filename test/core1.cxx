@@ -21,7 +21,7 @@ int main(int, char **)
 		/// Base stuff, get
 		// Get root, (fail) special directories, check permissions
 		bfs::path const RootPath = "/";
-		auto Root = Core.Get("/");
+		auto Root = Core->Get("/");
 		Assert(Root);
 		Assert(!Root->ID());
 		Assert(!Root->Parent());
@@ -31,12 +31,12 @@ int main(int, char **)
 		Assert(!Root->IsSplit());
 
 		// Make sure root can't be deleted, renamed
-		Assert(Core.Move(RootPath, "/bad"), ActionError::Illegal);
-		Assert(Core.Delete(RootPath), ActionError::Illegal);
+		Assert(Core->Move(RootPath, "/bad"), ActionError::Illegal);
+		Assert(Core->Delete(RootPath), ActionError::Illegal);
 
 		// Check /splits
 		auto const SplitsPath = RootPath / "splits";
-		auto Splits = Core.Get(SplitsPath);
+		auto Splits = Core->Get(SplitsPath);
 		Assert(Splits);
 		Assert(!Splits->ID());
 		Assert(!Splits->Parent());
@@ -46,24 +46,24 @@ int main(int, char **)
 		Assert(!Splits->IsSplit());
 
 		// Make sure splits can't be deleted, renamed
-		Assert(Core.Move(SplitsPath, RootPath / "bad"), ActionError::Illegal);
-		Assert(Core.Delete(SplitsPath), ActionError::Illegal);
+		Assert(Core->Move(SplitsPath, RootPath / "bad"), ActionError::Illegal);
+		Assert(Core->Delete(SplitsPath), ActionError::Illegal);
 
 		// Fail instance get
-		auto Instance = Core.Get(RootPath / "splits" / "core1instance1");
+		auto Instance = Core->Get(RootPath / "splits" / "core1instance1");
 		Assert(!Instance);
 
 		/// Create dir tests
 		// Create splits
-		Assert(Core.CreateDirectory(RootPath / "splits" / "dir", true, true), ActionError::Illegal);
+		Assert(Core->CreateDirectory(RootPath / "splits" / "dir", true, true), ActionError::Illegal);
 
 		// Create splits 2
-		Assert(Core.CreateDirectory(RootPath / "splits", true, true), ActionError::Illegal);
+		Assert(Core->CreateDirectory(RootPath / "splits", true, true), ActionError::Illegal);
 
 		// Create dir
 		bfs::path DirPath(RootPath / "dir");
-		Assert(Core.CreateDirectory(DirPath, true, true), ActionError::OK);
-		auto Dir = Core.Get(DirPath);
+		Assert(Core->CreateDirectory(DirPath, true, true), ActionError::OK);
+		auto Dir = Core->Get(DirPath);
 		Assert(Dir);
 		Assert(Dir->ID().Instance, Counter::Type(0));
 		Assert(Dir->ID().Index, UUID::Type(1));
@@ -73,12 +73,12 @@ int main(int, char **)
 		Assert(Dir->Parent().Index, Root->ID().Index);
 
 		// Create already exists
-		Assert(Core.CreateDirectory(RootPath / "dir", true, true), ActionError::Exists);
+		Assert(Core->CreateDirectory(RootPath / "dir", true, true), ActionError::Exists);
 
 		// Create subdir
 		bfs::path SubdirPath(DirPath / "subdir");
-		Assert(Core.CreateDirectory(SubdirPath, true, true), ActionError::OK);
-		auto Subdir = Core.Get(SubdirPath);
+		Assert(Core->CreateDirectory(SubdirPath, true, true), ActionError::OK);
+		auto Subdir = Core->Get(SubdirPath);
 		Assert(Subdir.Code, ActionError::OK);
 		Assert(Subdir->ID().Instance, Counter::Type(0));
 		Assert(Subdir->ID().Index, UUID::Type(2));
@@ -89,16 +89,16 @@ int main(int, char **)
 
 		/// Delete tests
 		// Delete subdir
-		Assert(Core.Delete(SubdirPath), ActionError::OK);
+		Assert(Core->Delete(SubdirPath), ActionError::OK);
 
 		/// Rename tests
 		// Move into splits
-		Assert(Core.Move(DirPath, SplitsPath), ActionError::Illegal);
+		Assert(Core->Move(DirPath, SplitsPath), ActionError::Illegal);
 
 		// Rename dir
-		Assert(Core.Move(DirPath, RootPath / "dir1b"), ActionError::OK);
-		Assert(Core.Move(RootPath / "dir1b", DirPath), ActionError::OK);
-		Dir = Core.Get(DirPath);
+		Assert(Core->Move(DirPath, RootPath / "dir1b"), ActionError::OK);
+		Assert(Core->Move(RootPath / "dir1b", DirPath), ActionError::OK);
+		Dir = Core->Get(DirPath);
 		Assert(Dir);
 		Assert(Dir->ID().Instance, Counter::Type(0));
 		Assert(Dir->ID().Index, UUID::Type(1));
@@ -107,10 +107,24 @@ int main(int, char **)
 		Assert(Dir->Parent().Instance, Root->ID().Instance);
 		Assert(Dir->Parent().Index, Root->ID().Index);
 
+		/// Version tests
+		auto DirVersions = Core->GetVersions(DirPath);
+		Assert(DirVersions);
+		Assert(DirVersions->Get(Counter::Type(0)), UUID::Type(2));
+		Assert(DirVersions->Get(Counter::Type(1)), UUID::Type(0));
+		VersionVector Earlier;
+		Earlier.Advance(NodeID(Counter::Type(0), UUID::Type(1)));
+		Assert(Earlier.Compare(*DirVersions) == VersionOrder::Before);
+		Assert(DirVersions->Compare(Earlier) == VersionOrder::After);
+		Assert(DirVersions->Compare(*DirVersions) == VersionOrder::Equal);
+		Earlier.Advance(NodeID(Counter::Type(1), UUID::Type(1)));
+		Assert(Earlier.Compare(*DirVersions) == VersionOrder::Concurrent);
+		Assert(Core->GetVersions(RootPath / "missing").Code, ActionError::Missing);
+
 		// Move to subdir
 		bfs::path Subdir2Path(RootPath / "subdir");
-		Assert(Core.CreateDirectory(Subdir2Path, true, true), ActionError::OK);
-		auto Subdir2 = Core.Get(Subdir2Path);
+		Assert(Core->CreateDirectory(Subdir2Path, true, true), ActionError::OK);
+		auto Subdir2 = Core->Get(Subdir2Path);
 		Assert(Subdir2);
 		Assert(Subdir2->ID().Instance, Counter::Type(0));
 		Assert(Subdir2->ID().Index, UUID::Type(3));
@@ -118,31 +132,52 @@ int main(int, char **)
 		Assert(Subdir2->Change().Index, UUID::Type(0));
 		Assert(Subdir2->Parent().Instance, Root->ID().Instance);
 		Assert(Subdir2->Parent().Index, Root->ID().Index);
-		Assert(Core.Move(Subdir2Path, DirPath / "subdir"), ActionError::OK);
+		Assert(Core->Move(Subdir2Path, DirPath / "subdir"), ActionError::OK);
+		Subdir2Path = DirPath / "subdir";
+		Subdir2 = Core->Get(Subdir2Path);
+		Assert(Subdir2);
+		Assert(Subdir2->Change().Index, UUID::Type(3));
+		Assert(Subdir2->Parent().Instance, Dir->ID().Instance);
+		Assert(Subdir2->Parent().Index, Dir->ID().Index);
+
+		/// History compaction tests
+		// Only dir's intermediate change (0 1) is neither current nor recent enough to keep
+		Timestamp const Future = static_cast<Timestamp::Type>(std::time(nullptr) + 1000);
+		auto Compacted = Core->CompactHistory(static_cast<Timestamp::Type>(0), 10);
+		Assert(Compacted.Reclaimed, 0u);
+		Compacted = Core->CompactHistory(Future, 1);
+		Assert(Compacted.Scanned, 1u);
+		Assert(Compacted.Reclaimed, 1u);
+		Compacted = Core->CompactHistory(Future, 10);
+		Assert(Compacted.Reclaimed, 0u);
+		Assert(Core->GetCompactedCount(), 1u);
+		Dir = Core->Get(DirPath);
+		Assert(Dir);
+		Assert(Dir->Change().Index, UUID::Type(2));
 
 		/// Dir list tests
 		// Bad path
-		Assert(Core.OpenDirectory(RootPath / "missing").Code, ActionError::Missing);
+		Assert(Core->OpenDirectory(RootPath / "missing").Code, ActionError::Missing);
 
 		// Splits
-		auto SplitListHandle = Core.OpenDirectory(SplitsPath);
+		auto SplitListHandle = Core->OpenDirectory(SplitsPath);
 		Assert(SplitListHandle);
 		Assert(*SplitListHandle);
-		auto SplitList = Core.GetDirectory(**SplitListHandle, 0, 100);
+		auto SplitList = Core->GetDirectory(**SplitListHandle, 0, 100);
 		Assert(SplitList.size(), 0u);
 
 		// 0 subdirs
-		auto Subdir2ListHandle = Core.OpenDirectory(Subdir2Path);
+		auto Subdir2ListHandle = Core->OpenDirectory(Subdir2Path);
 		Assert(Subdir2ListHandle);
 		Assert(*Subdir2ListHandle);
-		auto Subdir2List = Core.GetDirectory(**Subdir2ListHandle, 0, 100);
+		auto Subdir2List = Core->GetDirectory(**Subdir2ListHandle, 0, 100);
 		Assert(Subdir2List.size(), 0u);
 
 		// 1 subdir
-		auto OpenDir = Core.OpenDirectory(DirPath);
+		auto OpenDir = Core->OpenDirectory(DirPath);
 		Assert(OpenDir);
 		Assert(*OpenDir);
-		auto Children = Core.GetDirectory(**OpenDir, 0, 100);
+		auto Children = Core->GetDirectory(**OpenDir, 0, 100);
 		Assert(Children.size(), 1u);
 		Assert(Children[0].ID().Instance, Subdir2->ID().Instance);
 		Assert(Children[0].ID().Index, Subdir2->ID().Index);
@@ -150,6 +185,33 @@ int main(int, char **)
 		Assert(Children[0].Change().Index, Subdir2->Change().Index);
 		Assert(Children[0].Parent().Instance, Subdir2->Parent().Instance);
 		Assert(Children[0].Parent().Index, Subdir2->Parent().Index);
+
+		/// Journal replay
+		// A move journaled before a crash is applied when the share is next opened
+		{
+			bfs::path const ReplayPath = ExternalRootPath / "replay";
+			ShareFile Moved;
+			NodeID Target;
+			{
+				ShareCore Replay(ReplayPath, "core1instance2");
+				Assert(Replay->CreateFile("/a long enough name to live on the heap", false, false), ActionError::OK);
+				Assert(Replay->CreateDirectory("/b", true, true), ActionError::OK);
+				Assert(Replay->SetTimestamp("/a long enough name to live on the heap", static_cast<Timestamp::Type>(1500000000)), ActionError::OK);
+				Moved = *Replay->Get("/a long enough name to live on the heap");
+				Target = Replay->Get("/b")->ID();
+			}
+			auto const Journal = CTV2Move::Write(Moved, UUID::Type(100), Target, "c");
+			bfs::ofstream(ReplayPath / "." App / "transactions" / "crashed", std::ofstream::binary).write(reinterpret_cast<char const *>(Journal.data()), Journal.size());
+			ShareCore Replay(ReplayPath, "core1instance2");
+			Assert(Replay->Get("/a long enough name to live on the heap").Code, ActionError::Missing);
+			auto Found = Replay->Get("/b/c");
+			Assert(Found);
+			Assert(Found->ID().Index, Moved.ID().Index);
+			Assert(Found->Change().Index, UUID::Type(100));
+			Assert(Found->Parent().Index, Target.Index);
+			Assert(Found->ModifiedTime(), Timestamp::Type(1500000000));
+			Assert(!bfs::exists(ReplayPath / "." App / "transactions" / "crashed"));
+		}
 	}
 	catch (SystemError const &Error) { std::cerr << Error << std::endl; return 1; }
 	catch (UserError const &Error) { std::cerr << Error << std::endl; return 1; }
@@ -0,0 +1,136 @@
+#include "../app/core.h"
+
+#include <random>
+
+int main(int, char **)
+{
+	try
+	{
+		bfs::path ExternalRootPath("extentsroot");
+		Cleanup Cleanup([&]() { boost::filesystem::remove_all(ExternalRootPath); });
+
+		std::mt19937 Random(11);
+		std::string Data(BlockSize * 4 + 100, 0);
+		for (auto &Byte : Data) Byte = static_cast<char>(Random());
+		Timestamp const Later = static_cast<Timestamp::Type>(std::time(nullptr) + 60);
+
+		auto const ReadAll = [](OpenFile &File)
+		{
+			std::string Out;
+			char Buffer[9001];
+			while (true)
+			{
+				ssize_t const Got = File.Read(Buffer, sizeof(Buffer), static_cast<off_t>(Out.size()));
+				Assert(Got >= 0);
+				if (Got == 0) break;
+				Out.append(Buffer, static_cast<size_t>(Got));
+			}
+			return Out;
+		};
+		auto const Read = [&ReadAll](ShareCore &Core, char const *Path)
+		{
+			auto File = Core->Open(Path, false, false);
+			Assert(File);
+			std::string const Out = ReadAll(**File);
+			Core->Release(std::move(*File));
+			return Out;
+		};
+		auto const IsPlain = [](ShareCore &Core, char const *Path)
+		{
+			auto const File = Core->Get(Path);
+			return bfs::exists(Core->GetRealPath(*File));
+		};
+
+		{
+			ShareCore Core(ExternalRootPath, "extentsinstance1");
+			Core->SetDeduplication(true);
+			Assert(Core->CreateFile("/a", true, false), ActionError::OK);
+			{
+				auto File = Core->Open("/a", true, false);
+				Assert((*File)->Write(Data.data(), Data.size(), 0), static_cast<ssize_t>(Data.size()));
+				Core->Release(std::move(*File));
+			}
+			Assert(Core->IngestReleased(100), 1u);
+			Assert(Core->GetBlockStats().Blocks, 5u);
+
+			// A small write stores only the extent it touches, and readers see it before it's committed
+			{
+				auto Reader = Core->Open("/a", false, false);
+				auto Writer = Core->Open("/a", true, false);
+				Assert(Reader);
+				Assert(Writer);
+				Assert((*Writer)->Write("small", 5, BlockSize + 10), 5);
+				Data.replace(BlockSize + 10, 5, "small");
+				Assert(!IsPlain(Core, "/a"));
+				Assert(ReadAll(**Reader) == Data);
+				Core->Release(std::move(*Writer));
+				Core->Release(std::move(*Reader));
+			}
+			auto Stats = Core->GetBlockStats();
+			Assert(Stats.Blocks, 6u);
+			Assert(Stats.LogicalBytes, static_cast<uint64_t>(Data.size() * 2));
+			Assert(Read(Core, "/a") == Data);
+
+			// The previous version stays until the change that replaced it is compacted
+			Core->CompactHistory(Later, 100);
+			Assert(Core->GetBlockStats().LogicalBytes, static_cast<uint64_t>(Data.size()));
+			Assert(Core->CollectBlocks(100), 1u);
+
+			// Writing past the end leaves a hole of zeros, and the new size shows before committing
+			{
+				auto File = Core->Open("/a", true, false);
+				Assert(File);
+				uint64_t const End = BlockSize * 6 + 7;
+				Assert((*File)->Write("tail", 4, static_cast<off_t>(End)), 4);
+				Data.resize(End, 0);
+				Data += "tail";
+				struct stat Status;
+				Assert((*File)->Stat(&Status), 0);
+				Assert(Status.st_size, static_cast<off_t>(Data.size()));
+				auto const A = Core->Get("/a");
+				Assert(Core->StatBacking(*A, &Status), 0);
+				Assert(Status.st_size, static_cast<off_t>(Data.size()));
+				Assert(ReadAll(**File) == Data);
+
+				// Committing mid-session, later writes start another version
+				Assert((*File)->HasStagedExtents());
+				Core->Commit(**File);
+				Assert(!(*File)->HasStagedExtents());
+				Assert(Read(Core, "/a") == Data);
+				Assert((*File)->Write("again", 5, 0), 5);
+				Data.replace(0, 5, "again");
+				Assert((*File)->HasStagedExtents());
+				Assert(ReadAll(**File) == Data);
+				Core->Release(std::move(*File));
+			}
+			Assert(!IsPlain(Core, "/a"));
+			Assert(Read(Core, "/a") == Data);
+
+			// Shrinking into an extent then growing again brings back zeros, not the cut bytes
+			{
+				auto File = Core->Open("/a", true, false);
+				Assert(File);
+				Assert((*File)->Truncate(BlockSize + 3), 0);
+				Assert((*File)->Truncate(BlockSize * 2), 0);
+				Data.resize(BlockSize + 3);
+				Data.resize(BlockSize * 2, 0);
+				Assert(ReadAll(**File) == Data);
+				Core->Release(std::move(*File));
+			}
+			Assert(Read(Core, "/a") == Data);
+		}
+
+		// Versions survive a restart, and are still released by compaction afterwards
+		ShareCore Core(ExternalRootPath);
+		Assert(Read(Core, "/a") == Data);
+		Assert(Core->GetBlockStats().LogicalBytes > Data.size());
+		Core->CompactHistory(Later, 100);
+		Assert(Core->GetBlockStats().LogicalBytes, static_cast<uint64_t>(Data.size()));
+		Assert(Core->CollectBlocks(100) > 0);
+		Assert(Read(Core, "/a") == Data);
+	}
+	catch (SystemError const &Error) { std::cerr << Error << std::endl; return 1; }
+	catch (UserError const &Error) { std::cerr << Error << std::endl; return 1; }
+	catch (...) { std::cerr << "Encountered unexpected error." << std::endl; throw; }
+	return 0;
+}
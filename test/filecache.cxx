@@ -0,0 +1,199 @@
+#include "../app/core.h"
+
+#include <random>
+
+int main(int, char **)
+{
+	try
+	{
+		bfs::path ExternalRootPath("filecacheroot");
+		Cleanup Cleanup([&]() { boost::filesystem::remove_all(ExternalRootPath); });
+		bfs::create_directory(ExternalRootPath);
+
+		// The pool on its own
+		{
+			FileCache Cache(4);
+			size_t const PageSize = FileCache::PageSize;
+			int Owner;
+			std::atomic<uint64_t> Generation(0);
+			std::string Data(PageSize * 2 + 100, 0);
+			for (size_t Index = 0; Index < Data.size(); ++Index) Data[Index] = static_cast<char>(Index % 251);
+			Cache.Insert(&Owner, Generation, 0, 0, Data.data(), Data.size(), true);
+
+			std::string Out(Data.size() + 50, 0);
+			bool End;
+			Assert(Cache.Read(&Owner, &Out[0], Out.size(), 0, End), Data.size());
+			Assert(End);
+			Assert(memcmp(Out.data(), Data.data(), Data.size()), 0);
+			Assert(Cache.Read(&Owner, &Out[0], 10, 5, End), 10u);
+			Assert(!End);
+			Assert(Cache.Read(&Owner, &Out[0], 10, Data.size() + 5, End), 0u);
+			Assert(End);
+			Assert(Cache.Read(&Cache, &Out[0], 10, 0, End), 0u);
+			Assert(!End);
+
+			// Invalidation leaves the pages around it, and refuses data read before it
+			uint64_t const Snapshot = Generation;
+			Cache.Invalidate(&Owner, Generation, PageSize + 1, PageSize + 2);
+			Assert(Cache.Read(&Owner, &Out[0], Out.size(), 0, End), PageSize);
+			Assert(!End);
+			Cache.Insert(&Owner, Generation, Snapshot, PageSize, Data.data(), PageSize, false);
+			Assert(Cache.Read(&Owner, &Out[0], Out.size(), PageSize, End), 0u);
+
+			// Invalidating past the end of the file drops the page saying where the end was, since the file grew
+			int Growing;
+			Cache.Insert(&Growing, Generation, Generation, 0, Data.data(), PageSize + 100, true);
+			Cache.Invalidate(&Growing, Generation, PageSize + 50, PageSize + 100);
+			Assert(Cache.Read(&Growing, &Out[0], Out.size(), 0, End), PageSize);
+			Assert(!End);
+			Cache.Insert(&Growing, Generation, Generation, 0, Data.data(), PageSize + 100, true);
+			Cache.Invalidate(&Growing, Generation, PageSize * 3, PageSize * 3 + 1);
+			Assert(Cache.Read(&Growing, &Out[0], Out.size(), 0, End), PageSize);
+			Assert(!End);
+			Cache.Drop(&Growing);
+
+			// Least recently used pages are evicted past capacity
+			int Other;
+			Cache.Read(&Owner, &Out[0], 1, 0, End);
+			Cache.Insert(&Other, Generation, Generation, 0, Data.data(), PageSize * 2 + 100, false);
+			Assert(Cache.Read(&Owner, &Out[0], 1, 0, End), 1u);
+			Assert(Cache.Read(&Owner, &Out[0], 1, PageSize * 2, End), 0u);
+			Assert(Cache.Read(&Other, &Out[0], Out.size(), 0, End), Data.size());
+			Assert(End);
+			Cache.Drop(&Other);
+			Assert(Cache.Read(&Other, &Out[0], 1, 0, End), 0u);
+		}
+
+		std::mt19937 Random(9);
+		std::string Data(1024 * 1024 + 777, 0);
+		for (auto &Byte : Data) Byte = static_cast<char>(Random());
+
+		for (bool Deduplicate : {false, true})
+		{
+			ShareCore Core(ExternalRootPath / (Deduplicate ? "stored" : "plain"), "filecacheinstance1");
+			Core->SetDeduplication(Deduplicate);
+			if (Deduplicate)
+			{
+				// Start from an extent-mapped file
+				Assert(Core->CreateFile("/a", true, false), ActionError::OK);
+				auto File = Core->Open("/a", true, false);
+				Assert(File);
+				Assert((*File)->Write(Data.data(), Data.size(), 0), static_cast<ssize_t>(Data.size()));
+				Core->Release(std::move(*File));
+				Assert(Core->IngestReleased(100), 1u);
+			}
+			else Assert(Core->CreateFile("/a", true, false), ActionError::OK);
+
+			// Small appends are coalesced, and visible to other handles and stat before being written out
+			auto const Before = Core->GetFileCacheStats();
+			auto Writer = Core->Open("/a", true, false);
+			auto Reader = Core->Open("/a", false, false);
+			Assert(Writer);
+			Assert(Reader);
+			for (size_t Offset = 0; Offset < Data.size(); Offset += 4096)
+			{
+				size_t const Length = std::min<size_t>(4096, Data.size() - Offset);
+				Assert((*Writer)->Write(Data.data() + Offset, Length, static_cast<off_t>(Offset)), static_cast<ssize_t>(Length));
+			}
+			auto After = Core->GetFileCacheStats();
+			Assert(After.BufferedWrites - Before.BufferedWrites, (Data.size() + 4095) / 4096);
+			Assert(After.FlushedWrites - Before.FlushedWrites <= Data.size() / WriteBufferSize);
+			auto Found = Core->Get("/a");
+			Assert(Found);
+			struct stat Status;
+			Assert(Core->StatBacking(*Found, &Status), 0);
+			Assert(Status.st_size, static_cast<off_t>(Data.size()));
+
+			// Sequential small reads are mostly served from read ahead pages
+			std::string Out(Data.size(), 0);
+			for (size_t Offset = 0; Offset < Data.size(); Offset += 4096)
+			{
+				size_t const Length = std::min<size_t>(4096, Data.size() - Offset);
+				Assert((*Reader)->Read(&Out[Offset], Length, static_cast<off_t>(Offset)), static_cast<ssize_t>(Length));
+			}
+			Assert(Out == Data);
+			Assert((*Reader)->Read(&Out[0], 4096, static_cast<off_t>(Data.size())), 0);
+			After = Core->GetFileCacheStats();
+			Assert(After.ReadHits - Before.ReadHits > (After.ReadMisses - Before.ReadMisses) * 10);
+
+			// Writes replace pages read ahead, whether held back or not
+			std::string Small("small"), Large(SmallWrite * 2, 'L');
+			Assert((*Writer)->Write(Small.data(), Small.size(), 70000), static_cast<ssize_t>(Small.size()));
+			Assert((*Writer)->Write(Large.data(), Large.size(), 200000), static_cast<ssize_t>(Large.size()));
+			Data.replace(70000, Small.size(), Small);
+			Data.replace(200000, Large.size(), Large);
+			for (size_t Offset = 0; Offset < Data.size(); Offset += 4096)
+				Assert((*Reader)->Read(&Out[Offset], std::min<size_t>(4096, Data.size() - Offset), static_cast<off_t>(Offset)) >= 0);
+			Assert(Out == Data);
+
+			// So does truncating
+			Assert((*Writer)->Truncate(100000), 0);
+			Assert((*Reader)->Read(&Out[0], 200000, 0), 100000);
+			Assert(memcmp(Out.data(), Data.data(), 100000), 0);
+			Assert((*Writer)->Truncate(static_cast<off_t>(Data.size())), 0);
+			std::fill(Data.begin() + 100000, Data.end(), 0);
+			Core->Release(std::move(*Writer));
+			Core->Release(std::move(*Reader));
+
+			auto File = Core->Open("/a", false, false);
+			Assert(File);
+			Out.assign(Data.size(), 1);
+			for (size_t Offset = 0; Offset < Data.size(); Offset += 65536)
+				Assert((*File)->Read(&Out[Offset], std::min<size_t>(65536, Data.size() - Offset), static_cast<off_t>(Offset)) >= 0);
+			Assert(Out == Data);
+			Core->Release(std::move(*File));
+
+			// A read ahead page holding the end of the file goes when the file grows past it, however it grows
+			{
+				std::string const Head(100, 'h'), Grown(20000, 'g');
+				Assert(Core->CreateFile("/grow", true, false), ActionError::OK);
+				auto Grower = Core->Open("/grow", true, false);
+				Assert(Grower);
+				Assert((*Grower)->Write(Head.data(), Head.size(), 0), 100);
+				Assert((*Grower)->Flush(), 0);
+				Core->Release(std::move(*Grower));
+				Core->IngestReleased(100);
+
+				auto GrowReader = Core->Open("/grow", false, false);
+				Assert(GrowReader);
+				char Buffer[200];
+				Assert((*GrowReader)->Read(Buffer, 10, 0), 10);
+				Grower = Core->Open("/grow", true, false);
+				Assert(Grower);
+				Assert((*Grower)->Write(Grown.data(), Grown.size(), 70000), 20000);
+				Assert((*Grower)->Stat(&Status), 0);
+				Assert(Status.st_size, 90000);
+				Assert((*GrowReader)->Read(Buffer, 200, 0), 200);
+				Assert(memcmp(Buffer, Head.data(), 100), 0);
+
+				// Reading twice in a row reads ahead to the end again
+				auto const ReadAhead = [&](off_t At)
+				{
+					Assert((*GrowReader)->Read(Buffer, 10, At), 10);
+					Assert((*GrowReader)->Read(Buffer, 10, At + 10), 10);
+				};
+				ReadAhead(80000);
+				Assert((*Grower)->Allocate(0, 140000, 5000), 0);
+				Assert((*GrowReader)->Read(Buffer, 200, 89900), 200);
+
+				ReadAhead(144000);
+				Assert((*GrowReader)->CopyTo(**Grower, 0, 200000, 100), 100);
+				Assert((*GrowReader)->Read(Buffer, 200, 144900), 200);
+				Assert((*GrowReader)->Read(Buffer, 200, 199900), 200);
+				Assert(memcmp(Buffer + 100, Head.data(), 100), 0);
+
+				ReadAhead(199000);
+				Assert((*Grower)->Write("x", 1, 270000), 1);
+				Assert((*GrowReader)->Read(Buffer, 200, 200000), 200);
+				Assert((*GrowReader)->Read(Buffer, 200, 269999), 2);
+				Assert(Buffer[1], 'x');
+				Core->Release(std::move(*Grower));
+				Core->Release(std::move(*GrowReader));
+			}
+		}
+	}
+	catch (SystemError const &Error) { std::cerr << Error << std::endl; return 1; }
+	catch (UserError const &Error) { std::cerr << Error << std::endl; return 1; }
+	catch (...) { std::cerr << "Encountered unexpected error." << std::endl; throw; }
+	return 0;
+}
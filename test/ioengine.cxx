@@ -0,0 +1,127 @@
+#include "../app/core.h"
+
+#include <random>
+#include <thread>
+
+// Runs the same checks on the synchronous engine and, where the kernel allows it, the io_uring one
+static void Exercise(IOEngine &Engine, bfs::path const &Path)
+{
+	int const File = open(Path.string().c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	Assert(File >= 0);
+	Cleanup CloseFile([File]() { close(File); });
+	int const Slot = Engine.Register(File);
+	Assert(Engine.IsRing() == (Slot >= 0));
+	Cleanup Unregister([&]() { Engine.Unregister(Slot); });
+
+	std::mt19937 Random(3);
+	std::string Data(300 * 1024, 0);
+	for (auto &Byte : Data) Byte = static_cast<char>(Random());
+	Assert(Engine.Write(File, Slot, Data.data(), Data.size(), 0), static_cast<ssize_t>(Data.size()));
+	std::string Out(Data.size() + 100, 0);
+	Assert(Engine.Read(File, Slot, &Out[0], Out.size(), 0), static_cast<ssize_t>(Data.size()));
+	Assert(memcmp(Out.data(), Data.data(), Data.size()), 0);
+	Assert(Engine.Read(File, -1, &Out[0], 10, static_cast<off_t>(Data.size() - 4)), 4);
+
+	// Batched reads come back whole, short only at the end, with or without registered buffers to spare
+	std::fill(Out.begin(), Out.end(), 0);
+	Assert(Engine.ReadBatched(File, Slot, &Out[0], Out.size(), 0), static_cast<ssize_t>(Data.size()));
+	Assert(memcmp(Out.data(), Data.data(), Data.size()), 0);
+	Assert(Engine.ReadBatched(File, Slot, &Out[0], Out.size(), 1000), static_cast<ssize_t>(Data.size() - 1000));
+	Assert(memcmp(Out.data(), Data.data() + 1000, Data.size() - 1000), 0);
+	Assert(Engine.ReadBatched(File, Slot, &Out[0], Out.size(), static_cast<off_t>(Data.size())), 0);
+	if (Engine.IsRing())
+	{
+		std::vector<int> Held;
+		for (int Buffer; (Buffer = Engine.AcquireBuffer()) >= 0;) Held.push_back(Buffer);
+		Engine.ReleaseBuffer(Held.back());
+		Held.pop_back();
+		std::fill(Out.begin(), Out.end(), 0);
+		Assert(Engine.ReadBatched(File, Slot, &Out[0], Out.size(), 0), static_cast<ssize_t>(Data.size()));
+		Assert(memcmp(Out.data(), Data.data(), Data.size()), 0);
+		Held.push_back(Engine.AcquireBuffer());
+		Assert(Held.back() >= 0);
+		Assert(Engine.AcquireBuffer(), -1);
+		std::fill(Out.begin(), Out.end(), 0);
+		Assert(Engine.ReadBatched(File, Slot, &Out[0], Out.size(), 0), static_cast<ssize_t>(Data.size()));
+		Assert(memcmp(Out.data(), Data.data(), Data.size()), 0);
+		for (auto Buffer : Held) Engine.ReleaseBuffer(Buffer);
+	}
+
+	// Batches into registered buffers, more than the queue holds
+	if (Engine.IsRing())
+	{
+		std::vector<int> Buffers;
+		for (int Buffer; (Buffer = Engine.AcquireBuffer()) >= 0;) Buffers.push_back(Buffer);
+		Assert(Buffers.size(), static_cast<size_t>(Engine.GetDepth()));
+		std::vector<IOOperation> Operations;
+		for (size_t Index = 0; Index < Engine.GetDepth() * 3; ++Index)
+		{
+			int const Buffer = Buffers[Index % Buffers.size()];
+			Operations.emplace_back(false, File, Engine.GetBuffer(Buffer), 4096, static_cast<off_t>(Index * 4096 % Data.size()), Slot, Buffer);
+		}
+		Engine.Run(Operations.data(), Operations.size());
+		for (size_t Index = 0; Index < Operations.size(); ++Index) Assert(Operations[Index].Result, 4096);
+		for (auto Buffer : Buffers) Engine.ReleaseBuffer(Buffer);
+	}
+
+	// Concurrent callers share the ring and its buffers
+	std::vector<std::thread> Threads;
+	for (unsigned int Thread = 0; Thread < 8; ++Thread)
+		Threads.emplace_back([&, Thread]()
+		{
+			std::vector<char> Buffer(IOEngine::BufferSize * 3 / 2);
+			for (unsigned int Repeat = 0; Repeat < 500; ++Repeat)
+			{
+				size_t const Offset = (Thread * 7919 + Repeat * 4099) % (Data.size() - Buffer.size());
+				Assert(Engine.ReadBatched(File, Slot, Buffer.data(), Buffer.size(), static_cast<off_t>(Offset)), static_cast<ssize_t>(Buffer.size()));
+				Assert(memcmp(Buffer.data(), Data.data() + Offset, Buffer.size()), 0);
+			}
+		});
+	for (auto &Thread : Threads) Thread.join();
+}
+
+int main(int, char **)
+{
+	try
+	{
+		bfs::path ExternalRootPath("ioengineroot");
+		Cleanup Cleanup([&]() { boost::filesystem::remove_all(ExternalRootPath); });
+		bfs::create_directory(ExternalRootPath);
+
+		{
+			IOEngine Engine;
+			Exercise(Engine, ExternalRootPath / "sync");
+		}
+
+		bool Ring = true;
+		try
+		{
+			IOEngine Engine(16);
+			Exercise(Engine, ExternalRootPath / "ring");
+		}
+		catch (SystemError const &Error)
+		{
+			std::cout << "Skipping io_uring checks: " << Error << std::endl;
+			Ring = false;
+		}
+
+		// Through the core
+		ShareCore Core(ExternalRootPath / "share", "ioengineinstance1");
+		Assert(Core->UseRingIO(16), Ring);
+		std::string const Data(200 * 1024, 'x');
+		Assert(Core->CreateFile("/a", true, false), ActionError::OK);
+		{
+			auto File = Core->Open("/a", true, false);
+			Assert(File);
+			Assert((*File)->Write(Data.data(), Data.size(), 0), static_cast<ssize_t>(Data.size()));
+			std::string Out(Data.size(), 0);
+			Assert((*File)->Read(&Out[0], Out.size(), 0), static_cast<ssize_t>(Data.size()));
+			Assert(Out == Data);
+			Core->Release(std::move(*File));
+		}
+	}
+	catch (SystemError const &Error) { std::cerr << Error << std::endl; return 1; }
+	catch (UserError const &Error) { std::cerr << Error << std::endl; return 1; }
+	catch (...) { std::cerr << "Encountered unexpected error." << std::endl; throw; }
+	return 0;
+}
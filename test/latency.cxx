@@ -0,0 +1,101 @@
+#include "../app/core.h"
+
+#include <thread>
+
+int main(int, char **)
+{
+	try
+	{
+		// Buckets cover every value, in order, and each value is within an eighth of its bucket's top
+		{
+			size_t Last = 0;
+			for (uint64_t Value = 0; Value < 100000; ++Value)
+			{
+				size_t const Index = LatencyStats::Bucket(Value);
+				Assert(Index >= Last);
+				Assert(Index <= Last + 1);
+				Last = Index;
+				Assert(Value <= LatencyStats::BucketTop(Index));
+				Assert(LatencyStats::BucketTop(Index) - Value <= Value / 8);
+				if (Index > 0) Assert(Value > LatencyStats::BucketTop(Index - 1));
+			}
+			Assert(LatencyStats::Bucket(~uint64_t(0)), LatencyStats::Buckets - 1);
+			Assert(LatencyStats::Bucket(uint64_t(1) << 41), LatencyStats::Buckets - 1);
+			Assert(LatencyStats::Bucket((uint64_t(1) << 41) - 1), LatencyStats::Buckets - 2);
+		}
+
+		// Percentiles
+		{
+			LatencyStats Stats({"first", "second"});
+			Assert(Stats.Summarize(0).Count, 0u);
+			for (uint64_t Value = 1; Value <= 1000; ++Value) Stats.Record(0, Value * 1000);
+			auto const Summary = Stats.Summarize(0);
+			Assert(Summary.Count, 1000u);
+			Assert(Summary.P50 >= 500000u && Summary.P50 <= 500000u + 500000u / 8);
+			Assert(Summary.P99 >= 990000u && Summary.P99 <= 990000u + 990000u / 8);
+			Assert(Summary.P999 >= 999000u && Summary.P999 <= 999000u + 999000u / 8);
+			Assert(Summary.Max >= 1000000u && Summary.Max <= 1000000u + 1000000u / 8);
+			Assert(Stats.Summarize(1).Count, 0u);
+			Assert(Stats.Report("x.").substr(0, 13), std::string("x.first 1000 "));
+		}
+
+		// Threads count separately and nothing is lost, including from threads that have exited; reset starts over
+		{
+			LatencyStats Stats({"only"});
+			std::vector<std::thread> Threads;
+			for (unsigned int Thread = 0; Thread < 4; ++Thread)
+				Threads.emplace_back([&Stats, Thread]()
+				{
+					for (unsigned int Count = 0; Count < 10000; ++Count) Stats.Record(0, 100 * (Thread + 1));
+				});
+			for (auto &Thread : Threads) Thread.join();
+			auto const Summary = Stats.Summarize(0);
+			Assert(Summary.Count, 40000u);
+			Assert(Summary.P50 >= 200u && Summary.P50 < 250u);
+			Assert(Summary.Max >= 400u && Summary.Max < 450u);
+			Stats.Reset();
+			Assert(Stats.Summarize(0).Count, 0u);
+			Stats.Record(0, 7);
+			Assert(Stats.Summarize(0).Count, 1u);
+			Assert(Stats.Summarize(0).Max, 7u);
+		}
+
+		// A thread alternating between stats counts into each
+		{
+			LatencyStats First({"a"}), Second({"b"});
+			for (unsigned int Count = 0; Count < 10; ++Count)
+			{
+				First.Record(0, 1);
+				Second.Record(0, 2);
+				Second.Record(0, 2);
+			}
+			Assert(First.Summarize(0).Count, 10u);
+			Assert(Second.Summarize(0).Count, 20u);
+		}
+
+		// The core times its operations
+		{
+			bfs::path const Root("latencyroot");
+			bfs::remove_all(Root);
+			Cleanup Cleanup([&]() { bfs::remove_all(Root); });
+			ShareCore Core(Root, "test");
+			LatencyStats &Latency = Core->GetLatency();
+			Assert(Core->CreateDirectory("/a", true, true), ActionError::OK);
+			Assert(Core->CreateDirectory("/b", true, true), ActionError::OK);
+			Assert(Core->Get("/a"));
+			Assert(Latency.GetName(static_cast<size_t>(CoreOperation::CreateDirectory)), std::string("CreateDirectory"));
+			Assert(Latency.GetName(static_cast<size_t>(CoreOperation::IngestReleased)), std::string("IngestReleased"));
+			Assert(Latency.GetCount(), static_cast<size_t>(CoreOperation::IngestReleased) + 1);
+			auto const Created = Latency.Summarize(static_cast<size_t>(CoreOperation::CreateDirectory));
+			Assert(Created.Count, 2u);
+			Assert(Created.P50 > 0u);
+			Assert(Latency.Summarize(static_cast<size_t>(CoreOperation::Get)).Count, 1u);
+			Latency.Reset();
+			Assert(Latency.Summarize(static_cast<size_t>(CoreOperation::CreateDirectory)).Count, 0u);
+		}
+	}
+	catch (SystemError const &Error) { std::cerr << Error << std::endl; return 1; }
+	catch (UserError const &Error) { std::cerr << Error << std::endl; return 1; }
+	catch (...) { std::cerr << "Encountered unexpected error." << std::endl; throw; }
+	return 0;
+}
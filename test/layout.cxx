@@ -0,0 +1,62 @@
+#include "../app/core.h"
+
+int main(int, char **)
+{
+	try
+	{
+		bfs::path ExternalRootPath("layoutroot");
+		Cleanup Cleanup([&]() { boost::filesystem::remove_all(ExternalRootPath); });
+		bfs::path const FilePath = ExternalRootPath / ".sonch" / "files";
+
+		{
+			ShareCore Core(ExternalRootPath, "layoutinstance1");
+			Assert(Core->GetFileLayout() == FileLayout());
+			Assert(!Core->IsMigratingLayout());
+		}
+
+		// Turn the share into a flat one holding two files, as older versions left it
+		{
+			SQLDatabase<> Database(ExternalRootPath / ".sonch" / "database");
+			Database.Execute("UPDATE \"Stats\" SET \"Layout\" = 0, \"TargetLayout\" = 0");
+			Database.Execute("INSERT INTO \"Files\" VALUES (0, 50, 0, 7, 0, 0, 'a', 1, 0, X'03000000', 0, X'', 0, 7)");
+			Database.Execute("INSERT INTO \"Files\" VALUES (0, 51, 0, 8, 0, 0, 'b', 1, 0, X'03000000', 0, X'', 0, 8)");
+			bfs::ofstream(FilePath / "0-50-0-7") << "a";
+			bfs::ofstream(FilePath / "0-51-0-8") << "b";
+		}
+
+		ShareCore Core(ExternalRootPath, "layoutinstance1");
+		Assert(Core->GetFileLayout() == FileLayout(0, 0));
+		auto A = Core->Get("/a");
+		auto B = Core->Get("/b");
+		Assert(A);
+		Assert(B);
+		Assert(Core->GetRealPath(*A) == FilePath / "0-50-0-7");
+
+		Assert(Core->SetFileLayout(FileLayout(3, 6)), ActionError::Invalid);
+		Assert(Core->SetFileLayout(FileLayout(1, 0)), ActionError::Invalid);
+		Assert(Core->SetFileLayout(FileLayout(2, 3)), ActionError::OK);
+		Assert(Core->IsMigratingLayout());
+		Assert(Core->SetFileLayout(FileLayout(1, 1)), ActionError::Illegal);
+
+		// Files resolve wherever they are during the migration
+		Assert(Core->MigrateLayout(1), 1u);
+		Assert(Core->IsMigratingLayout());
+		Assert(bfs::exists(Core->GetRealPath(*A)));
+		Assert(bfs::exists(Core->GetRealPath(*B)));
+		Assert(Core->MigrateLayout(10), 1u);
+		Assert(!Core->IsMigratingLayout());
+		Assert(Core->GetFileLayout() == FileLayout(2, 3));
+		Assert(!bfs::exists(FilePath / "0-50-0-7"));
+		auto const MovedA = Core->GetRealPath(*A);
+		Assert(MovedA == FileLayout(2, 3).Locate(FilePath, "0-50-0-7"));
+		Assert(bfs::exists(MovedA));
+		Assert(MovedA.parent_path().filename().string().size(), 3u);
+
+		Assert(Core->Delete("/a"), ActionError::OK);
+		Assert(!bfs::exists(MovedA));
+	}
+	catch (SystemError const &Error) { std::cerr << Error << std::endl; return 1; }
+	catch (UserError const &Error) { std::cerr << Error << std::endl; return 1; }
+	catch (...) { std::cerr << "Encountered unexpected error." << std::endl; throw; }
+	return 0;
+}
@@ -0,0 +1,130 @@
+#include "../app/log.h"
+#include <cstdio>
+
+#include <thread>
+#include <vector>
+
+static std::vector<std::string> ReadLines(bfs::path const &Path)
+{
+	std::vector<std::string> Out;
+	bfs::ifstream In(Path);
+	std::string Line;
+	while (std::getline(In, Line)) Out.push_back(Line);
+	return Out;
+}
+
+int main(int, char **)
+{
+	try
+	{
+		bfs::path ExternalRootPath("logroot");
+		Cleanup Cleanup([&]() { boost::filesystem::remove_all(ExternalRootPath); });
+		bfs::create_directory(ExternalRootPath);
+		bfs::path const LogPath = ExternalRootPath / "log.txt";
+
+		// Lines read back as an ostream would have written them
+		{
+			FileLog Log(LogPath);
+			std::string const Name("name");
+			char Buffer[] = "buffer";
+			Log.Note() << "text " << Name << " " << Buffer << " " << 'c' << static_cast<uint8_t>('u') << " " << -12 << " " <<
+				static_cast<uint64_t>(18446744073709551615ull) << " " << true << " " << 2.5 << " " << (SystemError() << "error " << 7);
+			Log.Warn() << "warn";
+			Log.Flush();
+			auto const Lines = ReadLines(LogPath);
+			Assert(Lines.size(), 2u);
+			Assert(Lines[0], std::string("Note: text name buffer cu -12 18446744073709551615 1 2.5 error 7"));
+			Assert(Lines[1], std::string("Warn: warn"));
+
+			// Errors are written before the call returns
+			Log.Error() << "failed";
+			Assert(ReadLines(LogPath).back(), std::string("Error: failed"));
+
+			// Lines too long for a record are cut short
+			Log.Note() << std::string(AsyncLogStream::MaxRecord * 2, 'x') << 5;
+			Log.Flush();
+			std::string const Long = ReadLines(LogPath).back();
+			Assert(Long.size() < AsyncLogStream::MaxRecord);
+			Assert(Long.substr(0, 8), std::string("Note: xx"));
+			Assert(Long.substr(Long.size() - 4), std::string("x..."));
+		}
+
+		// Many threads, more than a ring holds, every line in order per thread and nothing lost
+		{
+			unsigned int const Threads = 4;
+			unsigned int const Lines = 20000;
+			{
+				FileLog Log(LogPath);
+				std::vector<std::thread> Workers;
+				for (unsigned int Thread = 0; Thread < Threads; ++Thread)
+					Workers.emplace_back([&Log, Thread, Lines]()
+					{
+						for (unsigned int Line = 0; Line < Lines; ++Line)
+							Log.Note() << "thread " << Thread << " line " << Line;
+					});
+				for (auto &Worker : Workers) Worker.join();
+				// Destroying the log writes what's left
+			}
+			std::vector<unsigned int> Next(Threads, 0);
+			for (auto const &Line : ReadLines(LogPath))
+			{
+				unsigned int Thread, Number;
+				Assert(sscanf(Line.c_str(), "Note: thread %u line %u", &Thread, &Number), 2);
+				Assert(Thread < Threads);
+				Assert(Number, Next[Thread]);
+				++Next[Thread];
+			}
+			for (auto const Count : Next) Assert(Count, Lines);
+		}
+
+		// Levels turned off at runtime write nothing, and Logged doesn't evaluate the arguments
+		{
+			FileLog Log(LogPath);
+			unsigned int Evaluated = 0;
+			auto const Count = [&Evaluated]() { return ++Evaluated; };
+			Log.SetLevel(LogWarn);
+			Assert(Log.GetLevel(), LogWarn);
+			Assert(!Log.Enabled(LogNote));
+			Assert(Log.Enabled(LogError));
+			Logged(Log, Note) << "skipped " << Count();
+			Log.Note() << "dropped " << Count();
+			Logged(Log, Warn) << "kept " << Count();
+			Assert(Evaluated, 2u);
+			Log.SetLevel(LogDebug);
+			Assert(Log.GetLevel(), CompiledLogLevel);
+			Logged(Log, Note) << "note";
+			Log.Flush();
+			auto const Lines = ReadLines(LogPath);
+			Assert(Lines.size(), 2u);
+			Assert(Lines[0], std::string("Warn: kept 2"));
+			Assert(Lines[1], std::string("Note: note"));
+
+			LogLevel Parsed;
+			Assert(ParseLogLevel("warn", Parsed));
+			Assert(Parsed, LogWarn);
+			Assert(!ParseLogLevel("loud", Parsed));
+		}
+
+		// Two logs used from one thread keep their lines apart
+		{
+			bfs::path const OtherPath = ExternalRootPath / "other.txt";
+			FileLog First(LogPath), Second(OtherPath);
+			for (unsigned int Line = 0; Line < 10; ++Line)
+			{
+				First.Note() << "first " << Line;
+				Second.Note() << "second " << Line;
+			}
+			First.Flush();
+			Second.Flush();
+			auto const FirstLines = ReadLines(LogPath), SecondLines = ReadLines(OtherPath);
+			Assert(FirstLines.size(), 10u);
+			Assert(SecondLines.size(), 10u);
+			Assert(FirstLines[9], std::string("Note: first 9"));
+			Assert(SecondLines[9], std::string("Note: second 9"));
+		}
+	}
+	catch (SystemError const &Error) { std::cerr << Error << std::endl; return 1; }
+	catch (UserError const &Error) { std::cerr << Error << std::endl; return 1; }
+	catch (...) { std::cerr << "Encountered unexpected error." << std::endl; throw; }
+	return 0;
+}
@@ -0,0 +1,299 @@
+#include "../app/notify.h"
+
+#include <condition_variable>
+#include <chrono>
+#include <future>
+#include <thread>
+
+// False if Action is still running after a while.  It's left running detached rather than hanging the test.
+template <typename ActionType> static bool Finishes(ActionType const &Action)
+{
+	std::shared_ptr<std::promise<void>> Done(new std::promise<void>);
+	auto Finished = Done->get_future();
+	std::thread([Action, Done]() { Action(); Done->set_value(); }).detach();
+	return Finished.wait_for(std::chrono::seconds(10)) == std::future_status::ready;
+}
+
+// Hands batches from the delivery thread to the test, holding the delivery thread until the test has looked
+struct BatchGate
+{
+	bool Wait(std::vector<ChangeEvent> &Events, bool &Overflowed)
+	{
+		std::unique_lock<std::mutex> Lock(Mutex);
+		if (!Changed.wait_for(Lock, std::chrono::seconds(10), [this]() { return Arrived; })) return false;
+		Events = Batch;
+		Overflowed = BatchOverflowed;
+		return true;
+	}
+
+	void Release(void)
+	{
+		std::lock_guard<std::mutex> Guard(Mutex);
+		Arrived = false;
+		Released = true;
+		Changed.notify_all();
+	}
+
+	bool operator()(std::vector<ChangeEvent> const &Events, bool Overflowed)
+	{
+		std::unique_lock<std::mutex> Lock(Mutex);
+		Batch = Events;
+		BatchOverflowed = Overflowed;
+		Arrived = true;
+		Released = false;
+		Changed.notify_all();
+		Changed.wait(Lock, [this]() { return Released; });
+		return true;
+	}
+
+	std::mutex Mutex;
+	std::condition_variable Changed;
+	std::vector<ChangeEvent> Batch;
+	bool BatchOverflowed = false;
+	bool Arrived = false;
+	bool Released = false;
+};
+
+struct SocketStream
+{
+	int Socket;
+	bool Dead;
+	SocketStream(int Socket) : Socket(Socket), Dead(false) {}
+	SocketStream &read(char *Out, size_t Length)
+	{
+		while (Length > 0)
+		{
+			ssize_t const Got = recv(Socket, Out, Length, 0);
+			if (Got <= 0) { Dead = true; return *this; }
+			Out += Got;
+			Length -= static_cast<size_t>(Got);
+		}
+		return *this;
+	}
+	bool operator!(void) { return Dead; }
+};
+
+int main(int, char **)
+{
+	try
+	{
+		bfs::path ExternalRootPath("notifyroot");
+		Cleanup Cleanup([&]() { boost::filesystem::remove_all(ExternalRootPath); });
+
+		// Coalescing and overflow
+		{
+			ChangeNotifier Notifier(2);
+			BatchGate Gate;
+			Notifier.Subscribe(std::ref(Gate));
+			auto const Event = [](unsigned int Types, UUID::Type Index, char const *Name, bool CanWrite)
+				{ return ChangeEvent{Types, {(Counter::Type)0, Index}, {}, Name, false, SharePermissions{CanWrite, 1}, (Timestamp::Type)0}; };
+
+			std::vector<ChangeEvent> Events;
+			bool Overflowed = false;
+			Notifier.Publish(Event(ChangeCreate, 1, "a", true));
+			Assert(Gate.Wait(Events, Overflowed));
+			Assert(Events.size(), 1u);
+			Assert(Events[0].Types, (unsigned int)ChangeCreate);
+			Assert(!Overflowed);
+
+			// Delivery is blocked, so these all land in one batch
+			Notifier.Publish(Event(ChangePermissions, 1, "a", false));
+			Notifier.Publish(Event(ChangePermissions, 1, "a", true));
+			Notifier.Publish(Event(ChangeMove, 1, "b", true));
+			Notifier.Publish(Event(ChangeCreate, 2, "c", true));
+			Notifier.Publish(Event(ChangeDelete, 2, "c", true));
+			Gate.Release();
+			Assert(Gate.Wait(Events, Overflowed));
+			Assert(!Overflowed);
+			Assert(Events.size(), 1u);
+			Assert(Events[0].Types, (unsigned int)(ChangePermissions | ChangeMove));
+			Assert(Events[0].Name == "b");
+			Assert(Events[0].Permissions.CanWrite, 1u);
+
+			// More distinct nodes than the limit collapses to an overflow notice
+			Notifier.Publish(Event(ChangePermissions, 3, "d", true));
+			Notifier.Publish(Event(ChangePermissions, 4, "e", true));
+			Notifier.Publish(Event(ChangePermissions, 5, "f", true));
+			Gate.Release();
+			Assert(Gate.Wait(Events, Overflowed));
+			Assert(Overflowed);
+			Assert(Events.empty());
+			Gate.Release();
+		}
+
+		ShareCore Core(ExternalRootPath, "notifyinstance1");
+
+		// In-process subscription
+		{
+			BatchGate Gate;
+			auto const Subscription = Core->Subscribe(std::ref(Gate));
+			std::vector<ChangeEvent> Events;
+			bool Overflowed = false;
+			Assert(Core->CreateDirectory("/dir", true, true), ActionError::OK);
+			Assert(Gate.Wait(Events, Overflowed));
+			Assert(Events.size(), 1u);
+			Assert(Events[0].Types, (unsigned int)ChangeCreate);
+			Assert(Events[0].Name == "dir");
+			Assert(!Events[0].IsFile);
+
+			Assert(Core->SetPermissions("/dir", false, true), ActionError::OK);
+			Assert(Core->SetPermissions("/dir", true, false), ActionError::OK);
+			Assert(Core->SetTimestamp("/dir", (Timestamp::Type)44), ActionError::OK);
+			Gate.Release();
+			Assert(Gate.Wait(Events, Overflowed));
+			Assert(Events.size(), 1u);
+			Assert(Events[0].Types, (unsigned int)(ChangePermissions | ChangeTimestamp));
+			Assert(Events[0].Permissions.CanWrite, 1u);
+			Assert(Events[0].Permissions.CanExecute, 0u);
+			Assert(Events[0].Modified, (Timestamp::Type)44);
+			Gate.Release();
+			Core->Unsubscribe(Subscription);
+		}
+
+		// Unsubscribing doesn't wait for a callback that's waiting for the core
+		{
+			std::promise<void> Entered;
+			std::atomic<bool> Called(false);
+			auto const Subscription = Core->Subscribe([&](std::vector<ChangeEvent> const &, bool)
+			{
+				if (Called.exchange(true)) return true;
+				Entered.set_value();
+				// Long enough for the unsubscribe to take the core lock first
+				std::this_thread::sleep_for(std::chrono::milliseconds(200));
+				Assert(Core->Get("/dir"));
+				return true;
+			});
+			Assert(Core->SetTimestamp("/dir", (Timestamp::Type)45), ActionError::OK);
+			Entered.get_future().wait();
+			Assert(Finishes([&Core, Subscription]() { Core->Unsubscribe(Subscription); }));
+		}
+
+		// Socket subscription
+		{
+			int const Socket = socket(AF_UNIX, SOCK_STREAM, 0);
+			Assert(Socket >= 0);
+			::Cleanup CloseSocket([Socket]() { close(Socket); });
+			sockaddr_un Address{};
+			Address.sun_family = AF_UNIX;
+			strcpy(Address.sun_path, (ExternalRootPath / ".sonch" / "notify").string().c_str());
+			Assert(connect(Socket, reinterpret_cast<sockaddr *>(&Address), sizeof(Address)), 0);
+
+			// The subscription is registered asynchronously after accept
+			bool Seen = false;
+			StandardOutLog Log("notify test");
+			Protocol::Reader<StandardOutLog, NV1Create, NV1Move, NV1Delete, NV1SetPermissions, NV1SetTimestamp, NV1Overflow> Reader(Log,
+				[&](NodeID const &, NodeID const &, std::string const &Name, bool const &IsFile) { if (Name == "dir2") Seen = true; },
+				[&](NodeID const &, NodeID const &, std::string const &) {},
+				[&](NodeID const &) {},
+				[&](NodeID const &, bool const &, bool const &) {},
+				[&](NodeID const &, Timestamp const &) {},
+				[&]() {});
+			for (unsigned int Attempt = 0; !Seen && (Attempt < 100); ++Attempt)
+			{
+				std::string const Name = String() << "/probe" << Attempt;
+				Assert(Core->CreateDirectory(Name, true, true), ActionError::OK);
+				timeval Timeout{0, 100000};
+				setsockopt(Socket, SOL_SOCKET, SO_RCVTIMEO, &Timeout, sizeof(Timeout));
+				SocketStream Stream(Socket);
+				if (Reader.Read(Stream) && !Stream.Dead) break;
+			}
+			timeval Timeout{10, 0};
+			setsockopt(Socket, SOL_SOCKET, SO_RCVTIMEO, &Timeout, sizeof(Timeout));
+			Assert(Core->CreateDirectory("/dir2", true, true), ActionError::OK);
+			for (unsigned int Message = 0; !Seen && (Message < 200); ++Message)
+			{
+				SocketStream Stream(Socket);
+				Assert(Reader.Read(Stream));
+				Assert(!Stream.Dead);
+			}
+			Assert(Seen);
+		}
+
+		// A subscriber that accepts a codec gets batches worth compressing in frames
+		{
+			int const Socket = socket(AF_UNIX, SOCK_STREAM, 0);
+			Assert(Socket >= 0);
+			::Cleanup CloseSocket([Socket]() { close(Socket); });
+			sockaddr_un Address{};
+			Address.sun_family = AF_UNIX;
+			strcpy(Address.sun_path, (ExternalRootPath / ".sonch" / "notify").string().c_str());
+			Assert(connect(Socket, reinterpret_cast<sockaddr *>(&Address), sizeof(Address)), 0);
+			auto const Accept = NV1AcceptCodecs::Write(Protocol::SupportedCodecs);
+			Assert(send(Socket, Accept.data(), Accept.size(), MSG_NOSIGNAL), static_cast<ssize_t>(Accept.size()));
+
+			std::string const LongName(1000, 'x');
+			bool Seen = false;
+			StandardOutLog Log("notify test");
+			Protocol::StreamReader<StandardOutLog, NV1Create, NV1Move, NV1Delete, NV1SetPermissions, NV1SetTimestamp, NV1Overflow> Reader(Log,
+				[&](NodeID const &, NodeID const &, StringView const &Name, bool const &) { if (std::string(Name) == LongName) Seen = true; },
+				[&](NodeID const &, NodeID const &, StringView const &) {},
+				[&](NodeID const &) {},
+				[&](NodeID const &, bool const &, bool const &) {},
+				[&](NodeID const &, Timestamp const &) {},
+				[&]() {});
+			size_t Received = 0;
+			auto const Receive = [&]()
+			{
+				uint8_t Piece[4096];
+				ssize_t const Got = recv(Socket, Piece, sizeof(Piece), 0);
+				if (Got <= 0) return false;
+				Received += static_cast<size_t>(Got);
+				Assert(Reader.Read(Piece, static_cast<size_t>(Got)));
+				return true;
+			};
+
+			// The subscription is registered asynchronously after accept
+			timeval Timeout{0, 100000};
+			setsockopt(Socket, SOL_SOCKET, SO_RCVTIMEO, &Timeout, sizeof(Timeout));
+			for (unsigned int Attempt = 0; Attempt < 100; ++Attempt)
+			{
+				std::string const Name = String() << "/compressedprobe" << Attempt;
+				Assert(Core->CreateDirectory(Name, true, true), ActionError::OK);
+				if (Receive()) break;
+			}
+			Received = 0;
+			Assert(Core->CreateDirectory("/" + LongName, true, true), ActionError::OK);
+			while (!Seen) Assert(Receive());
+			Assert(Reader.Idle());
+			// Even with stragglers from the probes, far less than the name alone
+			Assert(Received < LongName.size() / 2);
+		}
+
+		// A socket subscriber that stops reading doesn't hold up closing the core
+		{
+			bfs::path const StalledRootPath("notifystalledroot");
+			::Cleanup CleanupStalled([&]() { boost::filesystem::remove_all(StalledRootPath); });
+			std::unique_ptr<ShareCore> Stalled(new ShareCore(StalledRootPath, "notifyinstance2"));
+			int const Socket = socket(AF_UNIX, SOCK_STREAM, 0);
+			Assert(Socket >= 0);
+			::Cleanup CloseSocket([Socket]() { close(Socket); });
+			sockaddr_un Address{};
+			Address.sun_family = AF_UNIX;
+			strcpy(Address.sun_path, (StalledRootPath / ".sonch" / "notify").string().c_str());
+			Assert(connect(Socket, reinterpret_cast<sockaddr *>(&Address), sizeof(Address)), 0);
+
+			// The subscription is registered asynchronously after accept
+			timeval Timeout{0, 100000};
+			setsockopt(Socket, SOL_SOCKET, SO_RCVTIMEO, &Timeout, sizeof(Timeout));
+			uint8_t Piece[4096];
+			bool Subscribed = false;
+			for (unsigned int Attempt = 0; !Subscribed && (Attempt < 100); ++Attempt)
+			{
+				std::string const Name = String() << "/stalledprobe" << Attempt;
+				Assert((*Stalled)->CreateDirectory(Name, true, true), ActionError::OK);
+				Subscribed = recv(Socket, Piece, sizeof(Piece), 0) > 0;
+			}
+			Assert(Subscribed);
+
+			// Far more than the socket buffers hold, so delivery blocks sending
+			std::string const LongName(1000, 'x');
+			for (unsigned int Index = 0; Index < 1000; ++Index)
+				Assert((*Stalled)->CreateDirectory("/" + std::to_string(Index) + LongName, true, true), ActionError::OK);
+			Assert(Finishes([&Stalled]() { Stalled.reset(); }));
+		}
+	}
+	catch (SystemError const &Error) { std::cerr << Error << std::endl; return 1; }
+	catch (UserError const &Error) { std::cerr << Error << std::endl; return 1; }
+	catch (...) { std::cerr << "Encountered unexpected error." << std::endl; throw; }
+	return 0;
+}
@@ -1,6 +1,7 @@
 #include <cstdint>
 #include <iomanip>
 #include <limits>
+#include <random>
 #include "../app/protocol.h"
 #include "../app/log.h"
 
@@ -72,6 +73,15 @@ DefineProtocol(Proto2)
 DefineProtocolVersion(Proto2_1, Proto2)
 DefineProtocolMessage(Proto2_1_1, Proto2_1, void(int Val))
 
+DefineProtocol(Proto3)
+DefineProtocolLongVersion(Proto3_1, Proto3)
+DefineProtocolMessage(Proto3_1_1, Proto3_1, void(std::string Val))
+DefineProtocolMessage(Proto3_1_2, Proto3_1, void(std::vector<uint32_t> Val))
+DefineProtocolMessage(Proto3_1_3, Proto3_1, void(uint64_t Tag, Protocol::Blob Val))
+typedef StrictType(uint64_t) TestCounter;
+typedef StrictType(int32_t) TestOffset;
+DefineProtocolMessage(Proto3_1_4, Proto3_1, void(Protocol::Compact<TestCounter> Count, Protocol::Compact<TestOffset> Offset))
+
 template<size_t Value> struct Overflow : std::integral_constant<size_t, Value + std::numeric_limits<unsigned char>::max() + 1> {};
 static_assert(Proto1_1::ID == (Protocol::VersionIDType::Type)0, "ID calculation failed");
 static_assert(Proto1_1_1::ID == (Protocol::MessageIDType::Type)0, "ID calculation failed");
@@ -87,6 +97,13 @@ static_assert(Proto1_2_3::ID == (Protocol::MessageIDType::Type)2, "ID calculatio
 static_assert(Proto1_2_4::ID == (Protocol::MessageIDType::Type)3, "ID calculation failed");
 static_assert(Proto1_2_5::ID == (Protocol::MessageIDType::Type)4, "ID calculation failed");
 static_assert(Proto1_2_6::ID == (Protocol::MessageIDType::Type)5, "ID calculation failed");
+static_assert(Proto1_1_3::FixedSize == 4 + 8, "Fixed size calculation failed");
+static_assert(Proto1_2_1::FixedSize == 4 + 1 + 4, "Fixed size calculation failed");
+static_assert(Proto1_2_5::FixedSize == 0, "Fixed size calculation failed");
+static_assert(Proto3_1::ID == (Protocol::VersionIDType::Type)0x80, "ID calculation failed");
+static_assert(Proto3_1_3::BlobPrefix == 8 + 10, "Blob prefix calculation failed");
+static_assert(Proto3_1_2::BlobPrefix == 0, "Blob prefix calculation failed");
+static_assert(Proto3_1_4::FixedSize == 0, "Fixed size calculation failed");
 
 int main(int argc, char **argv)
 {
@@ -230,6 +247,336 @@ int main(int argc, char **argv)
 	assert(Reader3.Read(BufferStream{Buffer}));
 	assert(Mutate == 45);
 
+	// Messages can be listed in any order
+	{
+		int Got = 0;
+		Protocol::Reader<StandardOutLog, Proto1_2_1, Proto1_1_1> Reader5(Log,
+			[&](bool const &, int const &Val) { Got = 2000 + Val; },
+			[&](int const &Val) { Got = 1000 + Val; });
+		Buffer = Proto1_1_1::Write(7);
+		assert(Reader5.Read(BufferStream{Buffer}));
+		assert(Got == 1007);
+		Buffer = Proto1_2_1::Write(true, 8);
+		assert(Reader5.Read(BufferStream{Buffer}));
+		assert(Got == 2008);
+		Reader5.Call<Proto1_1_1>(9);
+		assert(Got == 1009);
+	}
+
+	// Writing into caller buffers
+	{
+		std::vector<uint8_t> Small(Proto1_1_1::Size(11));
+		assert(Proto1_2_5::Size(true, "dog") == 10);
+		assert(Proto1_2_5::Encode(Small.data(), Small.size(), true, "dog") == 0);
+		assert(Proto1_2_1::Encode(Small.data(), Small.size(), true, 11) == 0);
+		assert(Proto1_1_1::Encode(Small.data(), Small.size(), 11) == 8);
+		AssertEquals(Small, Proto1_1_1::Write(11));
+
+		std::vector<uint8_t> Batch, Expected;
+		for (auto const &Message : {Proto1_1_5::Write("dog"), Proto1_2_6::Write(true, std::vector<uint8_t>()), Proto1_1_4::Write(true)})
+			Expected.insert(Expected.end(), Message.begin(), Message.end());
+		assert(Proto1_1_5::Append(Batch, "dog") == 9);
+		assert(Proto1_2_6::Append(Batch, true, std::vector<uint8_t>()) == 7);
+		assert(Proto1_1_4::Append(Batch, true) == 5);
+		AssertEquals(Batch, Expected);
+	}
+
+	// Reading in place from one buffer holding several messages
+	Buffer.clear();
+	for (auto const &Message : {
+		Proto1_1_5::Write("dog"),
+		Proto1_1_6::Write(std::vector<uint8_t>{0x00, 0x01, 0x02}),
+		Proto1_2_5::Write(true, "dog"),
+		Proto1_2_3::Write(true, 11),
+		Proto1_1_6::Write(std::vector<uint8_t>())})
+		Buffer.insert(Buffer.end(), Message.begin(), Message.end());
+	auto const Inside = [&Buffer](void const *Pointer)
+		{ return (Pointer >= &Buffer[0]) && (Pointer < &Buffer[0] + Buffer.size()); };
+	int Calls = 0;
+	Protocol::ViewReader
+	<
+		StandardOutLog,
+		Proto1_1_5, Proto1_1_6, Proto1_2_3, Proto1_2_5
+	>
+	Reader4
+	(
+		Log,
+		[&](StringView const &Val) { assert(Val == "dog"); assert(Inside(Val.Data)); ++Calls; },
+		[&](Protocol::Span<uint8_t> const &Val)
+		{
+			if (Val.empty()) { ++Calls; return; }
+			assert(Val.size() == 3);
+			assert(Inside(Val.Data));
+			assert(Val.Copy() == std::vector<uint8_t>({0x00, 0x01, 0x02}));
+			++Calls;
+		},
+		[&](bool const &Space, uint64_t const &Val) { assert(Space == true); assert(Val == 11); ++Calls; },
+		[&](bool const &Space, StringView const &Val) { assert(Space == true); assert(std::string(Val) == "dog"); ++Calls; }
+	);
+	uint8_t const *Cursor = &Buffer[0];
+	assert(Reader4.Read(Cursor, &Buffer[0] + Buffer.size()));
+	assert(Calls == 1);
+	assert(Cursor == &Buffer[0] + Proto1_1_5::Write("dog").size());
+	assert(Reader4.Read(Cursor, static_cast<size_t>(&Buffer[0] + Buffer.size() - Cursor)));
+	assert(Calls == 5);
+
+	// Reading pieces of a stream, split anywhere, checked against the encoder
+	for (unsigned int Seed = 0; Seed < 20; ++Seed)
+	{
+		std::mt19937 Random(Seed);
+		std::vector<std::string> Expected, Got;
+		Buffer.clear();
+		for (unsigned int Count = 0; Count < 500; ++Count)
+		{
+			std::string Text(Random() % 300, 0);
+			for (auto &Character : Text) Character = static_cast<char>('a' + Random() % 26);
+			std::vector<uint8_t> Bytes(Random() % 1000);
+			for (auto &Byte : Bytes) Byte = static_cast<uint8_t>(Random());
+			int const Number = static_cast<int>(Random());
+			switch (Random() % 5)
+			{
+				case 0: Proto1_1_1::Append(Buffer, Number); Expected.push_back("int " + std::to_string(Number)); break;
+				case 1: Proto1_1_5::Append(Buffer, Text); Expected.push_back("string " + Text); break;
+				case 2: Proto1_1_6::Append(Buffer, Bytes); Expected.push_back("bytes " + std::string(Bytes.begin(), Bytes.end())); break;
+				case 3: Proto1_2_3::Append(Buffer, Number % 2 == 0, static_cast<uint64_t>(Number) << 20); Expected.push_back("pair " + std::to_string(Number % 2 == 0) + " " + std::to_string(static_cast<uint64_t>(Number) << 20)); break;
+				default: Proto1_2_6::Append(Buffer, true, Bytes); Expected.push_back("bytes2 " + std::string(Bytes.begin(), Bytes.end())); break;
+			}
+		}
+
+		Protocol::StreamReader<StandardOutLog, Proto1_1_1, Proto1_1_5, Proto1_1_6, Proto1_2_3, Proto1_2_6> Stream(Log,
+			[&](int const &Val) { Got.push_back("int " + std::to_string(Val)); },
+			[&](StringView const &Val) { Got.push_back("string " + std::string(Val)); },
+			[&](Protocol::Span<uint8_t> const &Val) { auto const Copy = Val.Copy(); Got.push_back("bytes " + std::string(Copy.begin(), Copy.end())); },
+			[&](bool const &Space, uint64_t const &Val) { Got.push_back("pair " + std::to_string(Space) + " " + std::to_string(Val)); },
+			[&](bool const &, Protocol::Span<uint8_t> const &Val) { auto const Copy = Val.Copy(); Got.push_back("bytes2 " + std::string(Copy.begin(), Copy.end())); });
+		for (size_t Offset = 0; Offset < Buffer.size(); )
+		{
+			size_t Length;
+			switch (Random() % 4)
+			{
+				case 0: Length = 1; break;
+				case 1: Length = 1 + Random() % 16; break;
+				case 2: Length = 1 + Random() % 4096; break;
+				default: Length = 1 + Random() % 65536; break;
+			}
+			Length = std::min(Length, Buffer.size() - Offset);
+			// Pieces are copied out so nothing can be read from past their end
+			std::vector<uint8_t> const Piece(&Buffer[Offset], &Buffer[Offset] + Length);
+			assert(Stream.Read(Piece.data(), Piece.size()));
+			Offset += Length;
+		}
+		assert(Stream.Idle());
+		assert(Got == Expected);
+
+		// A stream ending mid-message is left waiting for the rest
+		Got.clear();
+		assert(Stream.Read(&Buffer[0], Buffer.size() - 1));
+		assert(!Stream.Idle());
+		assert(Got.size() == Expected.size() - 1);
+	}
+
+	// Versions without long lengths read all ones as a length, and refuse anything longer
+	{
+		std::vector<uint8_t> const Bytes(Protocol::LongLength - 2, 9);
+		Buffer = Proto1_1_6::Write(Bytes);
+		assert(Buffer.size() == 4 + 2 + Bytes.size());
+		assert(Buffer[2] == 0xFF && Buffer[3] == 0xFF);
+		int Calls = 0;
+		Protocol::ViewReader<StandardOutLog, Proto1_1_6> Reader12(Log,
+			[&](Protocol::Span<uint8_t> const &Val) { assert(Val.Copy() == Bytes); ++Calls; });
+		assert(Reader12.Read(Buffer.data(), Buffer.size()));
+		assert(Calls == 1);
+		std::vector<uint8_t> const TooLong(Protocol::LongLength - 1, 9);
+		assert(Proto1_1_6::Size(TooLong) == 0);
+		assert(Proto1_1_6::Encode(Buffer.data(), Buffer.size(), TooLong) == 0);
+	}
+
+	// Lengths past what two bytes hold, around the point they switch to the long form
+	for (size_t Length : {65532, 65533, 65534, 65535, 65536, 200000})
+	{
+		std::string const Text(Length, 't');
+		std::vector<uint32_t> const Numbers(Length, 7);
+		Buffer.clear();
+		Proto3_1_1::Append(Buffer, Text);
+		Proto3_1_2::Append(Buffer, Numbers);
+		assert(Buffer.size() == Proto3_1_1::Size(Text) + Proto3_1_2::Size(Numbers));
+		assert(Proto3_1_1::Size(Text) == 2 + Protocol::LengthSize(Protocol::LengthSize(Length) + Length) + Protocol::LengthSize(Length) + Length);
+
+		int Calls = 0;
+		Protocol::Reader<StandardOutLog, Proto3_1_1, Proto3_1_2> Reader6(Log,
+			[&](std::string const &Val) { assert(Val == Text); ++Calls; },
+			[&](std::vector<uint32_t> const &Val) { assert(Val == Numbers); ++Calls; });
+		BufferStream Stream(Buffer);
+		assert(Reader6.Read(Stream));
+		assert(Reader6.Read(Stream));
+		assert(Calls == 2);
+
+		Protocol::StreamReader<StandardOutLog, Proto3_1_1, Proto3_1_2> Reader7(Log,
+			[&](StringView const &Val) { assert(std::string(Val) == Text); ++Calls; },
+			[&](Protocol::Span<uint32_t> const &Val) { assert(Val.Copy() == Numbers); ++Calls; });
+		for (size_t Offset = 0; Offset < Buffer.size(); Offset += 1000)
+			assert(Reader7.Read(&Buffer[Offset], std::min<size_t>(1000, Buffer.size() - Offset)));
+		assert(Reader7.Idle());
+		assert(Calls == 4);
+	}
+
+	// Compact fields take a byte for every seven bits they use
+	Buffer = Proto3_1_4::Write(TestCounter::Type(300), TestOffset::Type(-2));
+	AssertEquals(Buffer, std::vector<uint8_t>({0x80, 0x03, 0x03, 0x00, 0xAC, 0x02, 0x03}));
+	{
+		std::vector<std::pair<uint64_t, int32_t>> const Values{{0, 0}, {127, 63}, {128, -64}, {1ull << 63, std::numeric_limits<int32_t>::min()},
+			{std::numeric_limits<uint64_t>::max(), std::numeric_limits<int32_t>::max()}};
+		Buffer.clear();
+		for (auto const &Value : Values)
+		{
+			size_t const Size = Proto3_1_4::Append(Buffer, TestCounter::Type(Value.first), TestOffset::Type(Value.second));
+			assert(Size == 4 + Protocol::VarintSize(Value.first) + Protocol::VarintSize(Protocol::ZigZag(Value.second)));
+		}
+		assert(Protocol::VarintSize(std::numeric_limits<uint64_t>::max()) == Protocol::MaxVarintSize);
+		size_t Index = 0;
+		Protocol::Reader<StandardOutLog, Proto3_1_4> Reader10(Log,
+			[&](TestCounter const &Count, TestOffset const &Offset)
+				{ assert(*Count == Values[Index].first); assert(*Offset == Values[Index].second); ++Index; });
+		BufferStream Stream(Buffer);
+		for (size_t Count = 0; Count < Values.size(); ++Count) assert(Reader10.Read(Stream));
+		assert(Index == Values.size());
+		Index = 0;
+		Protocol::ViewReader<StandardOutLog, Proto3_1_4> Reader11(Log,
+			[&](TestCounter const &Count, TestOffset const &Offset)
+				{ assert(*Count == Values[Index].first); assert(*Offset == Values[Index].second); ++Index; });
+		assert(Reader11.Read(Buffer.data(), Buffer.size()));
+		assert(Index == Values.size());
+	}
+
+	// Blobs are sent and received in bounded pieces
+	{
+		uint64_t const Length = 3 * 1024 * 1024 + 7;
+		auto const Expected = [](uint64_t Offset) { return static_cast<uint8_t>(Offset * 31 + Offset / 251); };
+		uint64_t Produced = 0;
+		Protocol::Blob Data{Length, [&](uint8_t *Out, size_t Count)
+		{
+			assert(Count <= 64 * 1024);
+			for (size_t Index = 0; Index < Count; ++Index) Out[Index] = Expected(Produced++);
+			return true;
+		}};
+		Buffer.clear();
+		Proto1_1_1::Append(Buffer, 5);
+		size_t Sends = 0;
+		assert(Proto3_1_3::Send([&](uint8_t const *Out, size_t Count) { Buffer.insert(Buffer.end(), Out, Out + Count); ++Sends; return true; }, 77, Data));
+		assert(Produced == Length);
+		assert(Sends > 1);
+		assert(Buffer.size() == Proto1_1_1::FixedSize + Proto3_1_3::Size(77, Data));
+		Proto1_1_1::Append(Buffer, 6);
+
+		// Whole, in place
+		int Calls = 0;
+		uint64_t Checked = 0;
+		Protocol::ViewReader<StandardOutLog, Proto3_1_3> Reader8(Log,
+			[&](uint64_t const &Tag, Protocol::BlobPiece const &Val)
+			{
+				assert(Tag == 77);
+				assert((Val.Offset == 0) && (Val.Length == Length) && (Val.Data.size() == Length) && Val.Last());
+				for (size_t Index = 0; Index < Val.Data.size(); Index += 4099) assert(Val.Data[Index] == Expected(Index));
+				++Calls;
+			});
+		assert(Reader8.Read(&Buffer[Proto1_1_1::FixedSize], Buffer.size() - 2 * Proto1_1_1::FixedSize));
+		assert(Calls == 1);
+
+		// In pieces as they arrive, holding only the header and the fields before the blob
+		std::vector<int> Numbers;
+		Calls = 0;
+		uint8_t const *PieceStart = nullptr, *PieceEnd = nullptr;
+		Protocol::StreamReader<StandardOutLog, Proto1_1_1, Proto3_1_3> Reader9(Log,
+			[&](int const &Val) { Numbers.push_back(Val); },
+			[&](uint64_t const &Tag, Protocol::BlobPiece const &Val)
+			{
+				assert(Tag == 77);
+				assert(Val.Length == Length);
+				assert(Val.Offset == Checked);
+				assert((Val.Data.Data >= PieceStart) && (Val.Data.Data + Val.Data.size() <= PieceEnd));
+				for (size_t Index = 0; Index < Val.Data.size(); ++Index) assert(Val.Data[Index] == Expected(Checked + Index));
+				Checked += Val.Data.size();
+				assert(Val.Last() == (Checked == Length));
+				++Calls;
+			});
+		std::mt19937 Random(1);
+		for (size_t Offset = 0; Offset < Buffer.size(); )
+		{
+			size_t const Count = std::min<size_t>(1 + Random() % 20000, Buffer.size() - Offset);
+			std::vector<uint8_t> const Piece(&Buffer[Offset], &Buffer[Offset] + Count);
+			PieceStart = Piece.data();
+			PieceEnd = Piece.data() + Piece.size();
+			assert(Reader9.Read(Piece.data(), Piece.size()));
+			Offset += Count;
+		}
+		assert(Reader9.Idle());
+		assert(Checked == Length);
+		assert(Calls > 100);
+		assert(Numbers == std::vector<int>({5, 6}));
+	}
+
+	// Compressed frames are unwrapped by every reader, mixed in with plain messages
+	{
+		std::vector<std::string> Expected;
+		Protocol::BufferType Batch;
+		for (int Count = 0; Count < 200; ++Count)
+		{
+			std::string const Name = String() << "directory listing entry " << Count;
+			Proto1_1_5::Append(Batch, Name);
+			Proto1_1_1::Append(Batch, Count);
+			Expected.push_back("string " + Name);
+			Expected.push_back("int " + std::to_string(Count));
+		}
+		Protocol::FrameCompressor Framer;
+		assert(Framer.GetCodec() == Protocol::CodecNone);
+		Buffer.clear();
+		assert(Framer.Append(Buffer, Batch.data(), Batch.size()) == Batch.size());
+		assert(Buffer == Batch);
+
+		Framer.SetCodec(Protocol::ChooseCodec(Protocol::SupportedCodecs));
+		assert(Framer.GetCodec() == Protocol::CodecDeflate);
+		assert(Protocol::ChooseCodec(0) == Protocol::CodecNone);
+		Buffer.clear();
+		Proto1_1_1::Append(Buffer, -1);
+		size_t const Framed = Framer.Append(Buffer, Batch.data(), Batch.size());
+		assert(Framed * 4 < Batch.size());
+		assert(Buffer[Proto1_1_1::FixedSize] == Protocol::FrameVersionID);
+		assert(Buffer[Proto1_1_1::FixedSize + 1] == Protocol::CodecDeflate);
+		// Too small to be worth it
+		Protocol::BufferType Small;
+		Proto1_1_1::Append(Small, -2);
+		assert(Framer.Append(Buffer, Small.data(), Small.size()) == Small.size());
+		Framer.Append(Buffer, Batch.data(), Batch.size());
+		Expected.insert(Expected.begin(), "int -1");
+		Expected.push_back("int -2");
+		size_t const Half = Expected.size() - 1;
+		for (size_t Index = 1; Index < Half; ++Index) Expected.push_back(Expected[Index]);
+
+		std::vector<std::string> Got;
+		Protocol::Reader<StandardOutLog, Proto1_1_1, Proto1_1_5> Reader12(Log,
+			[&](int const &Val) { Got.push_back("int " + std::to_string(Val)); },
+			[&](std::string const &Val) { Got.push_back("string " + Val); });
+		BufferStream Stream(Buffer);
+		for (int Count = 0; Count < 4; ++Count) assert(Reader12.Read(Stream));
+		assert(Got == Expected);
+
+		Got.clear();
+		Protocol::ViewReader<StandardOutLog, Proto1_1_1, Proto1_1_5> Reader13(Log,
+			[&](int const &Val) { Got.push_back("int " + std::to_string(Val)); },
+			[&](StringView const &Val) { Got.push_back("string " + std::string(Val)); });
+		assert(Reader13.Read(Buffer.data(), Buffer.size()));
+		assert(Got == Expected);
+
+		Got.clear();
+		Protocol::StreamReader<StandardOutLog, Proto1_1_1, Proto1_1_5> Reader14(Log,
+			[&](int const &Val) { Got.push_back("int " + std::to_string(Val)); },
+			[&](StringView const &Val) { Got.push_back("string " + std::string(Val)); });
+		for (size_t Offset = 0; Offset < Buffer.size(); Offset += 17)
+			assert(Reader14.Read(&Buffer[Offset], std::min<size_t>(17, Buffer.size() - Offset)));
+		assert(Reader14.Idle());
+		assert(Got == Expected);
+	}
+
 	return 0;
 }
 
@@ -0,0 +1,105 @@
+#include "../app/core.h"
+
+#include <linux/falloc.h>
+
+int main(int, char **)
+{
+	try
+	{
+		bfs::path ExternalRootPath("sparseroot");
+		Cleanup Cleanup([&]() { boost::filesystem::remove_all(ExternalRootPath); });
+		bfs::create_directory(ExternalRootPath);
+
+		std::string Data(1024 * 1024, 'd');
+		auto const Check = [&Data](OpenFile &File)
+		{
+			std::string Out(Data.size() + 10, 1);
+			Assert(File.Read(&Out[0], Out.size(), 0), static_cast<ssize_t>(Data.size()));
+			Out.resize(Data.size());
+			Assert(Out == Data);
+		};
+
+		for (bool Deduplicate : {false, true})
+		{
+			ShareCore Core(ExternalRootPath / (Deduplicate ? "stored" : "plain"), "sparseinstance1");
+			Core->SetDeduplication(Deduplicate);
+			Assert(Core->CreateFile("/a", true, false), ActionError::OK);
+			{
+				auto File = Core->Open("/a", true, false);
+				Assert(File);
+				Assert((*File)->Write(Data.data(), Data.size(), 0), static_cast<ssize_t>(Data.size()));
+				Core->Release(std::move(*File));
+			}
+			Core->IngestReleased(100);
+
+			auto File = Core->Open("/a", true, false);
+			Assert(File);
+			struct stat Status;
+			int const Punched = (*File)->Allocate(FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 100000, 200000);
+			if (Punched == -EOPNOTSUPP)
+			{
+				std::cout << "Skipping, the host can't punch holes" << std::endl;
+				Core->Release(std::move(*File));
+				continue;
+			}
+			Assert(Punched, 0);
+			std::fill(Data.begin() + 100000, Data.begin() + 300000, 0);
+			Check(**File);
+			Assert((*File)->Stat(&Status), 0);
+			Assert(Status.st_size, static_cast<off_t>(Data.size()));
+
+			// Zeroing or allocating past the end grows the file unless asked not to
+			Assert((*File)->Allocate(FALLOC_FL_KEEP_SIZE, static_cast<off_t>(Data.size()), 4096), 0);
+			Assert((*File)->Allocate(FALLOC_FL_PUNCH_HOLE, 0, 10), -EOPNOTSUPP);
+			Check(**File);
+			Assert((*File)->Allocate(0, static_cast<off_t>(Data.size()) - 10, 5000), 0);
+			Data.resize(Data.size() + 4990, 0);
+			Check(**File);
+			Assert((*File)->Allocate(FALLOC_FL_ZERO_RANGE, 50, 10), 0);
+			std::fill(Data.begin() + 50, Data.begin() + 60, 0);
+			Check(**File);
+
+			// Holes are found in plain files, extent-mapped ones are all data
+			off_t const Size = static_cast<off_t>(Data.size());
+			Assert((*File)->Seek(10, SEEK_DATA), 10);
+			off_t const Hole = (*File)->Seek(10, SEEK_HOLE);
+			if (Deduplicate) Assert(Hole, Size);
+			else Assert((Hole == Size) || ((Hole >= 100000) && (Hole < 300000)));
+			Assert((*File)->Seek(Size, SEEK_DATA), -ENXIO);
+			Assert((*File)->Seek(Size + 5, SEEK_HOLE), -ENXIO);
+			Core->Release(std::move(*File));
+
+			File = Core->Open("/a", false, false);
+			Assert(File);
+			Check(**File);
+			Core->Release(std::move(*File));
+		}
+
+		// Sequential writers get space reserved ahead of them, which goes back when they finish
+		{
+			ShareCore Core(ExternalRootPath / "appending", "sparseinstance1");
+			Assert(Core->CreateFile("/big", true, false), ActionError::OK);
+			auto Found = Core->Get("/big");
+			Assert(Found);
+			std::string const Chunk(128 * 1024, 'c');
+			size_t const Size = MinPreallocation * 8;
+			auto File = Core->Open("/big", true, false);
+			Assert(File);
+			for (size_t Offset = 0; Offset < Size; Offset += Chunk.size())
+				Assert((*File)->Write(Chunk.data(), Chunk.size(), static_cast<off_t>(Offset)), static_cast<ssize_t>(Chunk.size()));
+			struct stat Status;
+			Assert((*File)->Stat(&Status), 0);
+			Assert(Status.st_size, static_cast<off_t>(Size));
+			bool const Reserved = static_cast<size_t>(Status.st_blocks) * 512 > Size;
+			Core->Release(std::move(*File));
+			Assert(Core->StatBacking(*Found, &Status), 0);
+			Assert(Status.st_size, static_cast<off_t>(Size));
+			if (Reserved) Assert(static_cast<size_t>(Status.st_blocks) * 512 < Size + MinPreallocation);
+			else std::cout << "The host didn't reserve space ahead of the writer" << std::endl;
+		}
+	}
+	catch (SystemError const &Error) { std::cerr << Error << std::endl; return 1; }
+	catch (UserError const &Error) { std::cerr << Error << std::endl; return 1; }
+	catch (...) { std::cerr << "Encountered unexpected error." << std::endl; throw; }
+	return 0;
+}
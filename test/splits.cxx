@@ -0,0 +1,139 @@
+#include "../app/core.h"
+
+#include <algorithm>
+
+int main(int, char **)
+{
+	try
+	{
+		bfs::path ExternalRootPath("splitsroot");
+		Cleanup Cleanup([&]() { boost::filesystem::remove_all(ExternalRootPath); });
+
+		bfs::path const RootPath = "/";
+		bfs::path const SplitsPath = RootPath / "splits";
+		{
+			ShareCore Core(ExternalRootPath, "splitsinstance1");
+			Assert(Core->CreateDirectory("/dir", true, true), ActionError::OK);
+			Assert(Core->CreateDirectory("/dir/subdir", true, true), ActionError::OK);
+			Assert(Core->CreateDirectory("/other", true, true), ActionError::OK);
+
+			// No splits, nothing in the split view
+			auto Splits = Core->OpenDirectory(SplitsPath);
+			Assert(Splits);
+			Assert(Core->GetDirectory(**Splits, 0, 10).empty());
+			Assert(!Core->Get(SplitsPath / "splitsinstance1"));
+		}
+
+		// Conflicting versions arrive from another instance; /dir/a and /dir/subdir/b
+		{
+			SQLDatabase<> Database(ExternalRootPath / ".sonch" / "database");
+			Database.Execute("INSERT INTO \"Instances\" (\"ID\", \"Name\", \"Filename\") VALUES (77, 'remote', 'remote')");
+			Database.Execute("INSERT INTO \"Files\" VALUES (2, 1, 2, 1, 0, 1, 'a', 1, 0, X'03000000', 1, X'', 2, 1)");
+			Database.Execute("INSERT INTO \"Files\" VALUES (2, 2, 2, 2, 0, 2, 'b', 1, 0, X'03000000', 1, X'', 2, 2)");
+		}
+
+		ShareCore Core(ExternalRootPath, "splitsinstance1");
+
+		// Ordinary view is unchanged
+		Assert(!Core->Get("/dir/a"));
+		Assert(Core->Get("/dir/subdir"));
+
+		// Instance listing
+		auto Splits = Core->OpenDirectory(SplitsPath);
+		Assert(Splits);
+		auto Instances = Core->GetDirectory(**Splits, 0, 10);
+		Assert(Instances.size(), 1u);
+		Assert(Instances[0].Name() == "remote");
+		Assert(!Instances[0].IsFile());
+		Assert(!Core->Get(SplitsPath / "splitsinstance1"));
+		Assert(!Core->Get(SplitsPath / "missing"));
+
+		// Lookups through the split view
+		auto const RemotePath = SplitsPath / "remote";
+		auto A = Core->Get(RemotePath / "dir" / "a");
+		Assert(A);
+		Assert(A->IsSplit());
+		Assert(A->ID().Instance, Counter::Type(2));
+		Assert(A->ID().Index, UUID::Type(1));
+		Assert(Core->GetRealPath(*A) == FileLayout().Locate(ExternalRootPath / ".sonch" / "files", "2-1-2-1"));
+		auto B = Core->Get(RemotePath / "dir" / "subdir" / "b");
+		Assert(B);
+		Assert(B->IsSplit());
+		Assert(Core->Get(RemotePath / "dir" / "subdir"));
+		Assert(!Core->Get(RemotePath / "other"));
+		Assert(!Core->Get(RemotePath / "dir" / "b"));
+
+		// Listings through the split view
+		auto Remote = Core->OpenDirectory(RemotePath);
+		Assert(Remote);
+		auto RemoteChildren = Core->GetDirectory(**Remote, 0, 10);
+		Assert(RemoteChildren.size(), 1u);
+		Assert(RemoteChildren[0].Name() == "dir");
+		auto Dir = Core->OpenDirectory(RemotePath / "dir");
+		Assert(Dir);
+		auto DirChildren = Core->GetDirectory(**Dir, 0, 10);
+		Assert(DirChildren.size(), 2u);
+		std::vector<std::string> Names;
+		for (auto const &Child : DirChildren) Names.push_back(Child.Name());
+		std::sort(Names.begin(), Names.end());
+		Assert(Names[0] == "a");
+		Assert(Names[1] == "subdir");
+		Assert(Core->GetDirectory(**Dir, 1, 10).size(), 1u);
+		Assert(Core->GetDirectory(**Dir, 2, 10).empty());
+
+		// Resolving a split removes it from the view
+		Assert(Core->Delete(RemotePath), ActionError::Illegal);
+		Assert(Core->Delete(RemotePath / "dir"), ActionError::Illegal);
+		Assert(Core->Delete(RemotePath / "dir" / "subdir" / "b"), ActionError::OK);
+		Assert(!Core->Get(RemotePath / "dir" / "subdir"));
+		Assert(Core->Get(RemotePath / "dir" / "a"));
+		Assert(Core->Delete(RemotePath / "dir" / "a"), ActionError::OK);
+		Assert(Core->GetDirectory(**Splits, 0, 10).empty());
+		Assert(!Core->Get(RemotePath));
+
+		// Listing a large split directory a page at a time, with the directory leading to deeper splits after the rows
+		{
+			bfs::path const PagedRootPath("splitspagedroot");
+			::Cleanup PagedCleanup([&]() { boost::filesystem::remove_all(PagedRootPath); });
+			{
+				ShareCore Core(PagedRootPath, "splitsinstance1");
+				Assert(Core->CreateDirectory("/dir", true, true), ActionError::OK);
+				Assert(Core->CreateDirectory("/dir/subdir", true, true), ActionError::OK);
+			}
+			unsigned int const Rows = 250;
+			{
+				SQLDatabase<> Database(PagedRootPath / ".sonch" / "database");
+				Database.Execute("INSERT INTO \"Instances\" (\"ID\", \"Name\", \"Filename\") VALUES (77, 'remote', 'remote')");
+				for (unsigned int Row = 0; Row < Rows; ++Row)
+				{
+					std::string const Insert = String() << "INSERT INTO \"Files\" VALUES (2, " << (10 + Row) << ", 2, " << (10 + Row) <<
+						", 0, 1, 'f" << Row << "', 1, 0, X'03000000', 1, X'', 2, " << (10 + Row) << ")";
+					Database.Execute(Insert.c_str());
+				}
+				Database.Execute("INSERT INTO \"Files\" VALUES (2, 2, 2, 2, 0, 2, 'b', 1, 0, X'03000000', 1, X'', 2, 2)");
+			}
+			ShareCore Core(PagedRootPath, "splitsinstance1");
+			auto Dir = Core->OpenDirectory(SplitsPath / "remote" / "dir");
+			Assert(Dir);
+			std::vector<std::string> Names;
+			for (unsigned int From = 0; ; From += 100)
+			{
+				auto const Page = Core->GetDirectory(**Dir, From, 100);
+				Assert(Page.size() <= 100u);
+				for (auto const &Child : Page) Names.push_back(Child.Name());
+				if (Page.size() < 100) break;
+			}
+			Assert(Names.size(), Rows + 1);
+			Assert(Names.back() == "subdir");
+			std::sort(Names.begin(), Names.end());
+			Assert(std::unique(Names.begin(), Names.end()) == Names.end());
+			Assert(Core->GetDirectory(**Dir, Rows, 10).size(), 1u);
+			Assert(Core->GetDirectory(**Dir, Rows + 1, 10).empty());
+			Assert(Core->GetDirectory(**Dir, Rows - 1, 2).size(), 2u);
+		}
+	}
+	catch (SystemError const &Error) { std::cerr << Error << std::endl; return 1; }
+	catch (UserError const &Error) { std::cerr << Error << std::endl; return 1; }
+	catch (...) { std::cerr << "Encountered unexpected error." << std::endl; throw; }
+	return 0;
+}
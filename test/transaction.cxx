@@ -11,17 +11,17 @@ inline void ProtocolWrite(uint8_t *&Out, E const &Argument)
 	memcpy(Out, &Argument, sizeof(Argument));
 	Out += sizeof(Argument);
 }
-template <typename LogType> bool ProtocolRead(LogType &Log, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, Protocol::BufferType const &Buffer, Protocol::SizeType &Offset, E &Data)
+template <typename LogType> bool ProtocolRead(LogType &Log, Protocol::VersionIDType const &VersionID, Protocol::MessageIDType const &MessageID, Protocol::BufferType const &Buffer, size_t &Offset, E &Data)
 {
-	if (Buffer.size() < StrictCast(Offset, size_t) + sizeof(Data))
+	if (Buffer.size() < Offset + sizeof(Data))
 	{
 		Log.Debug() << "End of file reached prematurely reading message body E size " << sizeof(Data) << ", message length doesn't match contents (version " << *VersionID << ", type " << *MessageID << ")";
 		assert(false);
 		return false;
 	}
 
-	Data = *reinterpret_cast<E const *>(&Buffer[*Offset]);
-	Offset += (Protocol::SizeType::Type)sizeof(E);
+	memcpy(static_cast<void *>(&Data), &Buffer[Offset], sizeof(Data));
+	Offset += sizeof(E);
 	return true;
 }
 
@@ -87,6 +87,19 @@ int main(int argc, char **argv)
 			assert(Counter == 0);
 		}
 
+		// Replay failing leaks no descriptors, and leaves the journal to try again
+		{
+			int const Before = dup(0);
+			close(Before);
+			bool Threw = false;
+			try { Transactor<Event1Type, Event2Type> Transact(TransactionPath, Event1, Event2); }
+			catch (unsigned int const &Error) { Threw = true; }
+			Assert(Threw);
+			int const After = dup(0);
+			close(After);
+			Assert(After, Before);
+		}
+
 		{
 			Fail = false;
 			Transactor<Event1Type, Event2Type> Transact(TransactionPath, Event1, Event2);